@@ -0,0 +1,164 @@
+#ifndef LIZY_ASYNC_LOGGER_H_
+#define LIZY_ASYNC_LOGGER_H_
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "logging.h"
+
+namespace base {
+
+// 后台线程等待新日志的方式
+enum AsyncWaitStrategy {
+  ASYNC_WAIT_BLOCKING,   // 直接睡眠(futex), 适合与其他程序共享 CPU 的机器
+  ASYNC_WAIT_ADAPTIVE,   // 先自旋, 再 sched_yield, 最后睡眠; 自旋次数随最近是否在自旋或 sched_yield 期间等到日志调整, 至少自旋一次
+  ASYNC_WAIT_BUSY_SPIN,  // 一直自旋不睡眠, 独占一个 CPU, 适合有空闲 CPU 的低延迟机器
+};
+
+// 异步日志记录器的选项
+struct AsyncLoggerOptions {
+  size_t block_bytes = 4 << 20;  // 每个内存块的大小, 超过一块的单条日志单独占一块
+  size_t memory_blocks = 4;      // 最多占用的内存块数, 超过后整块溢出到暂存文件
+  int flush_interval_ms = 1000;  // 不满一块时, 最多间隔多久交给后台线程写出
+  std::string scratch_dir;       // 暂存文件所在的目录(本地快速磁盘), 为空时使用临时目录
+  // 每个 NUMA 节点(在线的节点, 不超过 memory_blocks 个)一个前台块和空闲块池, 块的内存分配在该节点上
+  // 线程写到它第一次写入时所在节点的块, 同一个线程的日志保持顺序, 不同节点之间只按块的顺序写出
+  bool numa_aware = false;
+  std::vector<int> writer_cpus;   // 后台线程绑定的 CPU, 为空时不绑定
+  int writer_sched_policy = -1;   // 后台线程的调度策略(SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO, SCHED_RR), -1 表示不修改
+  int writer_sched_priority = 0;  // SCHED_FIFO, SCHED_RR 的优先级
+  // 后台线程睡眠时前台线程才需要唤醒它(一次 futex 系统调用), 自旋可以减少唤醒, 但占用 CPU
+  AsyncWaitStrategy wait_strategy = ASYNC_WAIT_BLOCKING;
+  int spin_iterations = 4000;     // ASYNC_WAIT_ADAPTIVE 最多自旋的次数
+  int yield_iterations = 16;      // ASYNC_WAIT_ADAPTIVE 自旋之后 sched_yield 的次数
+};
+
+// 异步日志记录器(双缓冲): 前台线程把日志追加到内存块, 后台线程取走写满的块, 整块批量写到 target
+// 后台线程跟不上时, 把最新的内存块整块溢出到暂存文件(匿名文件), 既不阻塞前台线程等待后台线程, 也不丢日志
+// target 通常是安装前 GetBatchLogger(severity) 返回的默认文件日志记录器, 不拥有它的所有权
+// 通过 SetLogger(severity, ...) 或 SetBatchLogger(severity, ...) 安装, 每个等级使用单独的对象
+// fork 后子进程丢弃父进程中还没有写出的日志
+class AsyncLogger : public Logger, public BatchLogger {
+ public:
+  // severity 是通过旧接口(Write/WriteSegments)写入的日志的等级
+  AsyncLogger(LogSeverity severity, BatchLogger* target, const AsyncLoggerOptions& options = AsyncLoggerOptions());
+  // 写出所有日志后退出
+  ~AsyncLogger() override;
+
+  // force_flush 时立即唤醒后台线程, 不等待写出
+  void Write(bool force_flush, time_t timestamp, const char* message, size_t message_len) override;
+  void WriteSegments(bool force_flush, time_t timestamp, const LogSegment* segments, size_t segment_count) override;
+  void WriteBatch(const LogRecordView* records, size_t count) override;
+
+  // 等待调用之前写入的日志都写到 target, 然后刷新 target
+  void Flush() override;
+  // 同 Flush(), 最多等待到 deadline_nanos, 超时返回 false(后台线程继续写出)
+  bool FlushFor(int64 deadline_nanos) override;
+
+  // target 的大小加上还没有写出的字节数
+  uint32 LogSize() override;
+  uint64 LogSize64() override;
+
+  // 溢出到暂存文件的块数
+  uint64 spilled_blocks();
+
+  // fork 前后的处理, 由 logging.cc 中的 pthread_atfork 处理函数调用
+  static void AtForkPrepareAll();
+  static void AtForkParentAll();
+  static void AtForkChildAll();
+
+ private:
+  struct Record {
+    size_t offset;
+    size_t length;
+    time_t timestamp;
+    int32 usecs;
+    LogSeverity severity;
+    bool force_flush;
+  };
+
+  // 块的内存通过 mmap 分配, 可以绑定到 NUMA 节点
+  struct BlockMemoryDeleter {
+    size_t size;
+    void operator()(char* data) const;
+  };
+  typedef std::unique_ptr<char, BlockMemoryDeleter> BlockMemory;
+
+  struct Block {
+    BlockMemory data{nullptr, BlockMemoryDeleter{0}}; // 溢出后为空, 数据在暂存文件的 [spill_offset, spill_offset + used)
+    size_t capacity{0};
+    size_t used{0};
+    uint64 spill_offset{0};
+    bool spilling{false};        // 正在写到暂存文件(不持有 mutex_), 后台线程需要等待
+    size_t node{0};              // 所属的 Node, 写出后回到该节点的空闲块
+    std::vector<Record> records;
+  };
+
+  // 一个 NUMA 节点的前台块和空闲块, 前台线程只需要获取所在节点的锁
+  struct alignas(64) Node {
+    std::mutex mutex;                           // 保护 front, 加锁顺序: Node::mutex -> mutex_
+    std::unique_ptr<Block> front;               // 前台线程正在写的块
+    std::vector<std::unique_ptr<Block>> free;   // 空闲块, 受 mutex_ 保护
+  };
+
+  // 当前线程使用的 Node
+  size_t CurrentNode() const;
+  // 追加一条日志, 要求: 必须持有 nodes_[node].mutex
+  void AppendLocked(size_t node, const LogRecordView& record);
+  // 当前块交给后台线程, 换一个空块, 要求: 必须持有 nodes_[node].mutex 和 lk(mutex_), 溢出时会暂时释放 lk
+  void SwapFrontLocked(size_t node, size_t min_capacity, std::unique_lock<std::mutex>* lk);
+  // 取一个空块: 空闲块, 新分配, 或者溢出最新的内存块后复用它的内存, 要求: 必须持有 lk(mutex_), 溢出时会暂时释放 lk
+  std::unique_ptr<Block> TakeFreeBlockLocked(size_t node, size_t min_capacity, std::unique_lock<std::mutex>* lk);
+  // 分配块的内存, 开启 numa_aware 时绑定到节点
+  BlockMemory AllocateBlockMemory(size_t node, size_t size) const;
+  // 把块写到暂存文件, 成功后返回块的内存, 失败时块保持不变并返回空
+  // 要求: 必须持有 lk(mutex_); 写文件期间释放 lk, 不阻塞其他节点的前台线程和后台线程
+  BlockMemory Spill(Block* block, std::unique_lock<std::mutex>* lk);
+  // 把不满的前台块交给后台线程, force 为 false 时只在有空闲块时交出, 返回所有前台块是否都为空
+  // 要求: 不持有 mutex_
+  bool StealFronts(bool force);
+  // 唤醒后台线程: 只有后台线程睡眠时才需要系统调用
+  void Signal();
+  // 后台线程等待 Signal(), 或者等待 flush_interval_ms 超时; seen 是检查是否有工作之前读到的 signal_seq_
+  void WaitForSignal(uint32 seen);
+  void StartWriterLocked();
+  void Run();
+
+  const LogSeverity severity_;
+  BatchLogger* const target_;
+  const AsyncLoggerOptions options_;
+
+  size_t node_count_{1};
+  std::unique_ptr<Node[]> nodes_;
+
+  std::mutex mutex_;
+  // 条件变量和线程句柄放在堆上: fork 后子进程放弃父进程的对象(不析构), 重新创建
+  std::unique_ptr<std::condition_variable> flushed_cv_{new std::condition_variable()}; // Flush() 等待后台线程
+  std::unique_ptr<std::condition_variable> spill_cv_{new std::condition_variable()};   // 后台线程等待正在溢出的块
+  std::deque<std::unique_ptr<Block>> pending_;   // 等待写出的块(按顺序), 可能已经溢出
+  size_t memory_blocks_{0};   // 已经分配内存的块数
+  size_t spilled_pending_{0}; // pending_ 中已经溢出的块数
+  uint64 spilled_blocks_{0};
+  std::atomic<uint64> buffered_bytes_{0};  // 还没有写出的字节数
+  uint64 flush_requested_{0};
+  uint64 flushed_{0};
+  std::atomic<uint32> signal_seq_{0};  // 每次 Signal() 加一, 后台线程在它上面 futex 等待
+  std::atomic<bool> sleeping_{false};  // 后台线程是否睡眠(或即将睡眠)
+  int spin_limit_{0};                  // ASYNC_WAIT_ADAPTIVE 当前的自旋次数, 只由后台线程使用
+  std::atomic<bool> wake_{false};      // 有需要立即写出的日志(force_flush)
+  bool stop_{false};
+  int scratch_fd_{-1};
+  uint64 scratch_end_{0};
+  std::atomic<bool> writer_started_{false}; // 后台线程是否已经启动, fork 后子进程中为 false
+  std::unique_ptr<std::thread> thread_{new std::thread()};
+};
+
+} // end of namespace base
+
+#endif
@@ -2,57 +2,170 @@
 #define LIZY_FLAG_H_
 #pragma once
 
+#include <atomic>
+#include <mutex>
 #include <string>
 #include "type.h"
 using std::string;
 
-// TODO: read option from Json
-
-// 日志直接输出到 stderr
-bool FLAGS_logtostderr = false;
-// 日志直接输出到 stdout
-bool FLAGS_logtostdout = false;
-// 特定程度的日志输出到文件的同时是否也输出到 stderr
-bool FLAGS_alsologtostderr = false;
-// 输出到 stderr 是否带颜色
-bool FLAGS_colorlogtostderr = true;
-// 输出到 stdout 是否带颜色
-bool FLAGS_colorlogtostdout = true;
-// 在磁盘满时是否继续写
-bool FLAGS_stop_logging_if_full_disk = false;
-// 是否记录标准时间
-bool FLAGS_log_utc_time = false;
-// 是否在 logfile 的名字中记录时间和pid
-bool FLAGS_timestamp_in_logfile_name = true;
-// 是否记录头部
-bool FLAGS_log_file_header = true;
-// 是否在日志前缀记录年
-bool FLAGS_log_year_in_prefix = true;
-// 是否定时清理一些日志文件在内存中的缓存
-bool FLAGS_drop_log_memory = true;
-
-// 写到 stderr 的日志程度阈值
-int32 FLAGS_stderrthreshold = LOG_ERROR;
-// 日志记录的最小等级
-int32 FLAGS_minloglevel = LOG_INFO;
-// 日志可以异步刷盘的最高等级
-int32 FLAGS_logbuflevel = LOG_INFO;
-// 日志刷盘的最长时间间隔(单位: s)
-int32 FLAGS_logbufsecs = 30;
-// 日志文件的权限
-int32 FLAGS_logfile_mode = 0664;
-// 检查是否有需要过期的日志需要清理的时间间隔
-int32 FLAGS_logcleansecs = 60 * 5; // 5 min
+namespace log_internal_namespace_ {
+
+// 可以在运行时被其他线程修改的选项
+// 读写都是 relaxed 原子操作, 热路径上每条消息读取时不引入额外的内存屏障
+template <class T>
+class RelaxedFlag {
+ public:
+  constexpr explicit RelaxedFlag(T value) : value_(value) {}
+
+  operator T() const { return value_.load(std::memory_order_relaxed); }
+  T get() const { return value_.load(std::memory_order_relaxed); }
+
+  RelaxedFlag& operator=(T value) {
+    value_.store(value, std::memory_order_relaxed);
+    return *this;
+  }
+
+ private:
+  RelaxedFlag(const RelaxedFlag&) = delete;
+  RelaxedFlag& operator=(const RelaxedFlag&) = delete;
+  std::atomic<T> value_;
+};
+
+// 字符串选项不能原子读写, 使用互斥锁保护
+// 只在创建日志文件等冷路径读取
+class GuardedStringFlag {
+ public:
+  explicit GuardedStringFlag(const char* value) : value_(value) {}
+
+  std::string get() const {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return value_;
+  }
+  bool empty() const {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return value_.empty();
+  }
+
+  GuardedStringFlag& operator=(const std::string& value) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    value_ = value;
+    return *this;
+  }
+
+ private:
+  GuardedStringFlag(const GuardedStringFlag&) = delete;
+  GuardedStringFlag& operator=(const GuardedStringFlag&) = delete;
+  mutable std::mutex mutex_;
+  std::string value_;
+};
+
+// 所有数值选项放在一个按 cache line 对齐的块中, 每条消息都会读取的选项放在最前面
+struct alignas(64) LogFlags {
+  // 日志记录的最小等级
+  RelaxedFlag<int32> minloglevel{LOG_INFO};
+  // 日志直接输出到 stderr
+  RelaxedFlag<bool> logtostderr{false};
+  // 日志直接输出到 stdout
+  RelaxedFlag<bool> logtostdout{false};
+  // 特定程度的日志输出到文件的同时是否也输出到 stderr
+  RelaxedFlag<bool> alsologtostderr{false};
+  // 是否记录标准时间
+  RelaxedFlag<bool> log_utc_time{false};
+  // 写到 stderr 的日志程度阈值
+  RelaxedFlag<int32> stderrthreshold{LOG_ERROR};
+  // 日志可以异步刷盘的最高等级
+  RelaxedFlag<int32> logbuflevel{LOG_INFO};
+  // 单条日志的最大长度, 超过部分被丢弃并标记截断
+  RelaxedFlag<uint32> max_log_message_len{1U << 20U}; // "B"
+  // 日志文件最大的大小
+  RelaxedFlag<uint32> max_log_size{1000}; // "MB"
+  // 日志刷盘的最长时间间隔(单位: s)
+  RelaxedFlag<int32> logbufsecs{30};
+  // 检查是否有需要过期的日志需要清理的时间间隔
+  RelaxedFlag<int32> logcleansecs{60 * 5}; // 5 min
+
+  // 输出到 stderr 是否带颜色
+  RelaxedFlag<bool> colorlogtostderr{true};
+  // 输出到 stdout 是否带颜色
+  RelaxedFlag<bool> colorlogtostdout{true};
+  // 在磁盘满时是否继续写
+  RelaxedFlag<bool> stop_logging_if_full_disk{false};
+  // 是否在 logfile 的名字中记录时间和pid
+  RelaxedFlag<bool> timestamp_in_logfile_name{true};
+  // 是否记录头部
+  RelaxedFlag<bool> log_file_header{true};
+  // 是否在日志前缀记录年
+  RelaxedFlag<bool> log_year_in_prefix{true};
+  // 是否定时清理一些日志文件在内存中的缓存
+  RelaxedFlag<bool> drop_log_memory{true};
+  // 后台回写的块大小(单位: KB)
+  RelaxedFlag<uint32> log_writeback_kb{1024};
+  // 后台回写的限速(单位: MB/s), 0 表示不限速
+  RelaxedFlag<uint32> log_writeback_mb_per_sec{128};
+  // 日志文件的权限
+  RelaxedFlag<int32> logfile_mode{0664};
+  // 新建日志文件使用的持久化模式(LogDurabilityMode)
+  RelaxedFlag<int32> durability_mode{DURABILITY_BUFFERED};
+  // 组提交的时间窗口(单位: us)
+  RelaxedFlag<int32> group_commit_usecs{1000};
+  // 日志时间戳使用的时钟(LogClockSource)
+  RelaxedFlag<int32> clock_source{CLOCK_SOURCE_GETTIMEOFDAY};
+  // 分片日志文件的数量, 0 表示不分片(默认, 见 SetLogShards)
+  RelaxedFlag<int32> log_shards{0};
+  // 稀疏索引块的大小(单位: KB), 0 表示不生成索引
+  RelaxedFlag<uint32> log_index_kb{0};
+  // 日志文件的滚动策略(LogRollPolicy 按位组合)
+  RelaxedFlag<int32> log_roll_policy{ROLL_BY_SIZE};
+  // 重复日志合并的时间窗口(单位: ms), 0 表示不合并
+  RelaxedFlag<int32> log_dedup_ms{0};
+};
+
+extern LogFlags g_log_flags;
 
 // 日志文件的目的文件夹
-string FLAGS_log_dir = "./";
+extern GuardedStringFlag g_log_dir;
 // 日志文件软链接的文件夹
-string FLAGS_log_link = "";
+extern GuardedStringFlag g_log_link;
+
+// 从 JSON 文本读取选项, 键名为 FLAGS_ 去掉前缀后的名字
+// 只支持一层的对象, 未知的键会被忽略并输出警告
+// 所有选项检查通过后才通过 Set* 接口应用, 任何一个值不合法(类型, 范围)时返回 false, 不修改任何选项
+bool ParseLogFlagsFromJson(const std::string& json, std::string* error);
+
+} // end of namespace log_internal_namespace_
+
+#define FLAGS_logtostderr log_internal_namespace_::g_log_flags.logtostderr
+#define FLAGS_logtostdout log_internal_namespace_::g_log_flags.logtostdout
+#define FLAGS_alsologtostderr log_internal_namespace_::g_log_flags.alsologtostderr
+#define FLAGS_colorlogtostderr log_internal_namespace_::g_log_flags.colorlogtostderr
+#define FLAGS_colorlogtostdout log_internal_namespace_::g_log_flags.colorlogtostdout
+#define FLAGS_stop_logging_if_full_disk log_internal_namespace_::g_log_flags.stop_logging_if_full_disk
+#define FLAGS_log_utc_time log_internal_namespace_::g_log_flags.log_utc_time
+#define FLAGS_timestamp_in_logfile_name log_internal_namespace_::g_log_flags.timestamp_in_logfile_name
+#define FLAGS_log_file_header log_internal_namespace_::g_log_flags.log_file_header
+#define FLAGS_log_year_in_prefix log_internal_namespace_::g_log_flags.log_year_in_prefix
+#define FLAGS_drop_log_memory log_internal_namespace_::g_log_flags.drop_log_memory
+#define FLAGS_log_writeback_kb log_internal_namespace_::g_log_flags.log_writeback_kb
+#define FLAGS_log_writeback_mb_per_sec log_internal_namespace_::g_log_flags.log_writeback_mb_per_sec
 
-// 日志文件最大的大小
-uint32 FLAGS_max_log_size = 1000; // "MB"
+#define FLAGS_stderrthreshold log_internal_namespace_::g_log_flags.stderrthreshold
+#define FLAGS_minloglevel log_internal_namespace_::g_log_flags.minloglevel
+#define FLAGS_logbuflevel log_internal_namespace_::g_log_flags.logbuflevel
+#define FLAGS_logbufsecs log_internal_namespace_::g_log_flags.logbufsecs
+#define FLAGS_logfile_mode log_internal_namespace_::g_log_flags.logfile_mode
+#define FLAGS_logcleansecs log_internal_namespace_::g_log_flags.logcleansecs
+#define FLAGS_durability_mode log_internal_namespace_::g_log_flags.durability_mode
+#define FLAGS_group_commit_usecs log_internal_namespace_::g_log_flags.group_commit_usecs
+#define FLAGS_clock_source log_internal_namespace_::g_log_flags.clock_source
+#define FLAGS_log_shards log_internal_namespace_::g_log_flags.log_shards
+#define FLAGS_log_index_kb log_internal_namespace_::g_log_flags.log_index_kb
+#define FLAGS_log_roll_policy log_internal_namespace_::g_log_flags.log_roll_policy
+#define FLAGS_log_dedup_ms log_internal_namespace_::g_log_flags.log_dedup_ms
 
+#define FLAGS_log_dir log_internal_namespace_::g_log_dir
+#define FLAGS_log_link log_internal_namespace_::g_log_link
 
-// int32 
+#define FLAGS_max_log_size log_internal_namespace_::g_log_flags.max_log_size
+#define FLAGS_max_log_message_len log_internal_namespace_::g_log_flags.max_log_message_len
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,90 @@
+#ifndef LIZY_LOG_INDEX_H_
+#define LIZY_LOG_INDEX_H_
+#pragma once
+
+#include <ctime>
+#include <string>
+#include <vector>
+#include "type.h"
+
+// 日志文件的稀疏时间索引: <日志文件名>.idx
+// 日志文件被分成若干块, 每块(最多 N KB 或者 1 秒)结束时在索引文件中追加一条定长记录
+// 最后一块之后的部分(正在写的块, 或者进程崩溃时没有写索引的块)当作一个等级未知的块
+// 索引只是加速, 可以随时从日志文件重建(RebuildLogIndex)
+
+struct LogIndexEntry {
+  int64 timestamp;      // 块中第一条日志的时间(秒)
+  uint64 offset;        // 块在日志文件中的起始偏移
+  uint32 length;        // 块的字节数
+  uint32 severity_mask; // 块中出现过的日志等级, 第 i 位表示等级 i
+  uint32 checksum;      // 校验和, 用于丢弃写了一半的记录
+  uint32 reserved;
+};
+
+// 一个需要读取的日志块 [begin, end)
+struct LogIndexBlock {
+  int64 timestamp;
+  uint64 begin;
+  uint64 end;
+  uint32 severity_mask;
+};
+
+// 所有等级
+const uint32 kAllSeverityMask = (1U << NUM_SEVERITIES) - 1;
+
+// 索引文件名
+std::string LogIndexPath(const std::string& log_path);
+
+// 计算索引记录的校验和
+uint32 LogIndexChecksum(const LogIndexEntry& entry);
+
+// 读取索引文件, 校验失败的记录和尾部不完整的记录被丢弃
+bool ReadLogIndex(const std::string& index_path, std::vector<LogIndexEntry>* entries);
+
+// 扫描日志文件重建索引(每 block_kb KB 或每秒一条记录), 写到 <log_path>.idx
+bool RebuildLogIndex(const std::string& log_path, uint32 block_kb);
+
+// 查找可能包含 [from, to] 时间内, 并且包含 severity_mask 中任意等级的日志的块
+// 索引不存在或者与日志文件不一致时, 先扫描日志文件在内存中重建索引
+bool FindLogBlocks(const std::string& log_path, time_t from, time_t to, uint32 severity_mask,
+                   std::vector<LogIndexBlock>* blocks);
+
+// 解析日志前缀中的时间 "YYYY-MM-DD hh:mm:ss", utc 表示日志使用的是标准时间
+bool ParseLogTimestamp(const char* text, bool utc, time_t* out);
+
+// 以下是读取日志文件的公共函数, 索引和查询工具(lizylog_cat, lizylog_index)共用
+
+// 日志前缀中定宽时间戳 "YYYY-MM-DD hh:mm:ss.uuuuuu" 的长度
+const size_t kLogTimestampLen = 26;
+
+// 是否是一条日志的开头(定宽时间戳), 不以时间戳开头的行属于上一条日志
+bool IsLogRecordStart(const char* p, const char* end);
+
+// 时间戳之后的日志前缀 `[file:line][INFO]: ` 中的等级, 找不到时返回 -1
+int ParseLogRecordSeverity(const char* p, const char* end);
+
+// 等级名(INFO, WARNING, ERROR, FATAL, 不区分大小写)对应的等级, 未知的名字返回 -1
+int ParseLogSeverityName(const char* name);
+
+// 只读映射的日志文件(或索引文件)
+class MappedLogFile {
+ public:
+  MappedLogFile() = default;
+  MappedLogFile(const MappedLogFile&) = delete;
+  MappedLogFile& operator=(const MappedLogFile&) = delete;
+  ~MappedLogFile();
+
+  // 失败时返回 false, errno 是失败的原因; sequential 表示将顺序读取, 让内核预读
+  bool Open(const std::string& path, bool sequential = false);
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  const char* begin() const { return data_; }
+  const char* end() const { return data_ + size_; }
+
+ private:
+  const char* data_{nullptr};
+  size_t size_{0};
+};
+
+#endif
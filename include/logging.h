@@ -1,11 +1,18 @@
 #ifndef LIZY_LOGGING_H_
 #define LIZY_LOGGING_H_
 
+#include <atomic>
 #include <ostream>
 #include <iomanip>
 #include <ctime>
 #include <string>
+#include <string_view>
+#include <memory>
+#include <charconv>
+#include <locale>
+#include <type_traits>
 #include <cstring>
+#include <sstream>
 #include <vector>
 #include <algorithm>
 #include <mutex>
@@ -27,24 +34,61 @@
 #define ERROR ERROR
 #define FATAL FATAL
 
-#define COMPACT_LIZY_LOG_INFO LogMessage(__FILE__, __LINE__)
+// 调用点的静态描述(LogSite), 指针登记在 lizylog_sites 段中, 可以通过 ForEachLogSite 遍历
+// 文件名在编译期计算, LOG() 只传递一个指针
+// 不能直接把 site 放进段中: GCC 不允许 inline 函数(COMDAT)和普通函数中的静态变量使用同一个段,
+// 所以用汇编登记指针, "?" 使登记项和所在函数属于同一个 COMDAT 组, .ifndef 避免同一个文件中内联多次时重复登记
+// 汇编只适用于 x86-64 ELF(@progbits, .quad 和 %p 修饰符); 其他平台只有静态描述, 不登记, ForEachLogSite 不遍历任何调用点
+#if defined(__x86_64__) && defined(__ELF__)
+#define LIZY_LOG_SITE_REGISTERED 1
+#define LIZY_LOG_SITE(severity)                                                          \
+        ([]() noexcept -> const LogSite* {                                               \
+          static constexpr LogSite site = {__FILE__, LogSiteBasename(__FILE__), __LINE__, severity}; \
+          asm(".ifndef %p0.lizylog_site\n"                                               \
+              ".set %p0.lizylog_site, 1\n"                                               \
+              ".pushsection lizylog_sites,\"aw?\",@progbits\n"                          \
+              ".balign 8\n"                                                              \
+              ".quad %p0\n"                                                              \
+              ".popsection\n"                                                            \
+              ".endif" : : "X"(&site));                                                  \
+          return &site;                                                                  \
+        }())
+#else
+#define LIZY_LOG_SITE_REGISTERED 0
+#define LIZY_LOG_SITE(severity)                                                          \
+        ([]() noexcept -> const LogSite* {                                               \
+          static constexpr LogSite site = {__FILE__, LogSiteBasename(__FILE__), __LINE__, severity}; \
+          return &site;                                                                  \
+        }())
+#endif
+
+#define COMPACT_LIZY_LOG_INFO LogMessage(LIZY_LOG_SITE(LOG_INFO))
 #define LOG_TO_STRING_INFO(message) LogMessage(__FILE__, __LINE__, LOG_INFO, message)
 
-#define COMPACT_LIZY_LOG_WARNING LogMessage(__FILE__, __LINE__, LOG_WARNING)
+#define COMPACT_LIZY_LOG_WARNING LogMessage(LIZY_LOG_SITE(LOG_WARNING))
 #define LOG_TO_STRING_WARNING(message) LogMessage(__FILE__, __LINE__, LOG_WARNING, message)
 
-#define COMPACT_LIZY_LOG_ERROR LogMessage(__FILE__, __LINE__, LOG_ERROR)
+#define COMPACT_LIZY_LOG_ERROR LogMessage(LIZY_LOG_SITE(LOG_ERROR))
 #define LOG_TO_STRING_ERROR(message) LogMessage(__FILE__, __LINE__, LOG_ERROR, message)
 
-#define COMPACT_LIZY_LOG_FATAL LogMessage(__FILE__, __LINE__, LOG_FATAL)
+#define COMPACT_LIZY_LOG_FATAL LogMessageFatal(LIZY_LOG_SITE(LOG_FATAL))
 #define LOG_TO_STRING_FATAL(message) LogMessage(__FILE__, __LINE__, LOG_FATAL, message)
 
+// DFATAL: 调试版本是 FATAL(是否结束进程由 SetExitOnDFatal 决定), 定义了 NDEBUG 时是 ERROR
+#ifndef NDEBUG
+#define COMPACT_LIZY_LOG_DFATAL LogMessage(LIZY_LOG_SITE(LOG_FATAL))
+#else
+#define COMPACT_LIZY_LOG_DFATAL LogMessage(LIZY_LOG_SITE(LOG_ERROR))
+#endif
+
 // 标准宏定义
 #define LOG(severity) COMPACT_LIZY_LOG_ ## severity.stream()
 
 // Log to string 相关宏定义
 #define LOG_TO_STRING(severity, message) LOG_TO_STRING_ ## severity(static_cast<std::string*>(message)).stream()
 #define LOG_STRING(severity, outvec) LOG_TO_STRING_ ## severity(static_cast<std::vector<std::string>*>(outvec)).stream()
+// 追加到 LogCapture 中, capture->also_log() 为 false 时不写日志文件
+#define LOG_CAPTURE(severity, capture) LOG_TO_STRING_ ## severity(static_cast<LogCapture*>(capture)).stream()
 
 // LogSink 相关宏定义
 #define LOG_TO_SINK(sink, severity) LogMessage(__FILE__, __LINE__, LOG_ ## severity, \
@@ -64,7 +108,8 @@
 #define LOG_ASSERT(condition) LOG_IF(FATAL, !(condition)) << "Assert failed: " #condition
 
 // CHECK 接口
-#define lizy_PREDICT_BRANCH_NOT_TAKEN(x) x 
+#define lizy_PREDICT_BRANCH_NOT_TAKEN(x) (__builtin_expect(x, 0))
+#define lizy_PREDICT_TRUE(x) (__builtin_expect(!!(x), 1))
 #define CHECK(condition) \
         LOG_IF(FATAL, lizy_PREDICT_BRANCH_NOT_TAKEN(!(condition))) << "Check failed: " #condition " "
 
@@ -97,15 +142,103 @@ inline unsigned long long GetReferenceableValue(unsigned long long t) {
   return t;
 }
 
-#define CHECK_OP(op, val1, val2) CHECK((val1) op (val2))
+// 输出 CHECK_OP 失败时的操作数, char 类型同时输出数值
+template <typename T>
+inline void MakeCheckOpValueString(std::ostream* os, const T& v) {
+  (*os) << v;
+}
+template <> void MakeCheckOpValueString(std::ostream* os, const char& v);
+template <> void MakeCheckOpValueString(std::ostream* os, const signed char& v);
+template <> void MakeCheckOpValueString(std::ostream* os, const unsigned char& v);
+template <> void MakeCheckOpValueString(std::ostream* os, const std::nullptr_t& v);
+
+// 构造 CHECK_OP 失败信息 "a == b (1 vs. 2)", 只在失败时使用
+class CheckOpMessageBuilder {
+ public:
+  explicit CheckOpMessageBuilder(const char* exprtext);
+  ~CheckOpMessageBuilder();
+  // 写第一个操作数的流
+  std::ostream* ForVar1() { return stream_; }
+  // 写第二个操作数的流(先写入 " vs. ")
+  std::ostream* ForVar2();
+  // 返回完整的失败信息, 由调用者负责释放
+  std::string* NewString();
+
+ private:
+  CheckOpMessageBuilder(const CheckOpMessageBuilder&) = delete;
+  CheckOpMessageBuilder& operator=(const CheckOpMessageBuilder&) = delete;
+  std::ostringstream* stream_;
+};
+
+// 标量按值传递, 成功路径不需要把操作数保存到栈上
+template <typename T>
+using CheckOpArg = typename std::conditional<std::is_scalar<T>::value, T, const T&>::type;
+
+// 失败路径: 不内联并标记为冷代码, 成功路径只有一次比较和一个不跳转的分支
+template <typename T1, typename T2>
+__attribute__((noinline, cold, returns_nonnull))
+std::string* MakeCheckOpString(CheckOpArg<T1> v1, CheckOpArg<T2> v2, const char* exprtext) {
+  CheckOpMessageBuilder comb(exprtext);
+  MakeCheckOpValueString(comb.ForVar1(), v1);
+  MakeCheckOpValueString(comb.ForVar2(), v2);
+  return comb.NewString();
+}
+
+// Check_EQImpl 等: 比较成功返回 NULL, 失败返回失败信息
+// 每个操作数只求值一次; int 的重载避免字面量实例化出多份模板
+#define DEFINE_CHECK_OP_IMPL(name, op)                                                     \
+  template <typename T1, typename T2>                                                      \
+  inline std::string* name##Impl(const T1& v1, const T2& v2, const char* exprtext) {      \
+    if (lizy_PREDICT_TRUE(v1 op v2)) {                                                     \
+      return NULL;                                                                         \
+    }                                                                                      \
+    return MakeCheckOpString<T1, T2>(v1, v2, exprtext);                                    \
+  }                                                                                        \
+  inline std::string* name##Impl(int v1, int v2, const char* exprtext) {                  \
+    return name##Impl<int, int>(v1, v2, exprtext);                                         \
+  }
+
+DEFINE_CHECK_OP_IMPL(Check_EQ, ==)
+DEFINE_CHECK_OP_IMPL(Check_NE, !=)
+DEFINE_CHECK_OP_IMPL(Check_LE, <=)
+DEFINE_CHECK_OP_IMPL(Check_LT, < )
+DEFINE_CHECK_OP_IMPL(Check_GE, >=)
+DEFINE_CHECK_OP_IMPL(Check_GT, > )
+#undef DEFINE_CHECK_OP_IMPL
+
+// 失败时输出 "Check failed: a == b (1 vs. 2) ", LogMessage 是 FATAL, 析构时结束进程, 所以 while 不会循环
+#define CHECK_OP(name, op, val1, val2)                                                       \
+        while (std::string* _result =                                                        \
+               Check##name##Impl(GetReferenceableValue(val1), GetReferenceableValue(val2),   \
+                                 #val1 " " #op " " #val2))                                   \
+          LogMessageFatal(__FILE__, __LINE__, CheckOpString(_result)).stream()
 
 // CHECK比较接口
-#define CHECK_EQ(val1, val2) CHECK_OP(==, val1, val2)
-#define CHECK_NE(val1, val2) CHECK_OP(!=, val1, val2)
-#define CHECK_LE(val1, val2) CHECK_OP(<=, val1, val2)
-#define CHECK_LT(val1, val2) CHECK_OP(< , val1, val2)
-#define CHECK_GE(val1, val2) CHECK_OP(>=, val1, val2)
-#define CHECK_GT(val1, val2) CHECK_OP(> , val1, val2)
+#define CHECK_EQ(val1, val2) CHECK_OP(_EQ, ==, val1, val2)
+#define CHECK_NE(val1, val2) CHECK_OP(_NE, !=, val1, val2)
+#define CHECK_LE(val1, val2) CHECK_OP(_LE, <=, val1, val2)
+#define CHECK_LT(val1, val2) CHECK_OP(_LT, < , val1, val2)
+#define CHECK_GE(val1, val2) CHECK_OP(_GE, >=, val1, val2)
+#define CHECK_GT(val1, val2) CHECK_OP(_GT, > , val1, val2)
+
+// DCHECK: 调试版本等同于 CHECK, 定义了 NDEBUG 时不生成代码(表达式仍然参与编译检查, 但不会求值)
+#ifndef NDEBUG
+#define DCHECK(condition) CHECK(condition)
+#define DCHECK_EQ(val1, val2) CHECK_EQ(val1, val2)
+#define DCHECK_NE(val1, val2) CHECK_NE(val1, val2)
+#define DCHECK_LE(val1, val2) CHECK_LE(val1, val2)
+#define DCHECK_LT(val1, val2) CHECK_LT(val1, val2)
+#define DCHECK_GE(val1, val2) CHECK_GE(val1, val2)
+#define DCHECK_GT(val1, val2) CHECK_GT(val1, val2)
+#else
+#define DCHECK(condition) while (false) CHECK(condition)
+#define DCHECK_EQ(val1, val2) while (false) CHECK_EQ(val1, val2)
+#define DCHECK_NE(val1, val2) while (false) CHECK_NE(val1, val2)
+#define DCHECK_LE(val1, val2) while (false) CHECK_LE(val1, val2)
+#define DCHECK_LT(val1, val2) while (false) CHECK_LT(val1, val2)
+#define DCHECK_GE(val1, val2) while (false) CHECK_GE(val1, val2)
+#define DCHECK_GT(val1, val2) while (false) CHECK_GT(val1, val2)
+#endif
 
 // 先声明
 namespace log_internal_namespace_ {
@@ -115,6 +248,64 @@ namespace log_internal_namespace_ {
 typedef void (*logging_fail_func_t)() __attribute__((noreturn));
 void InstallFailureFunction(logging_fail_func_t fail_func);
 
+// 日志消息的一个分段(scatter/gather), 大消息由多个分段组成, 避免再次拷贝
+struct LogSegment {
+  const char* data;
+  size_t size;
+};
+
+// LOG() 调用点的静态描述, 编译期生成, 每个调用点一个
+struct LogSite {
+  const char* fullname; // __FILE__
+  const char* basename; // 编译期计算的文件名
+  int line;
+  LogSeverity severity;
+  // 路由表(SetLogRoutes)为这个调用点编译出的目的地位图, 高位是路由表的版本, 版本不一致时重新匹配
+  mutable std::atomic<uint64> route_cache{0};
+  // 重复日志合并(SetLogDedupWindow)的状态, 由 dedup_seq 保护(顺序锁, 奇数表示正在开始新窗口)
+  mutable std::atomic<uint32> dedup_seq{0};
+  mutable std::atomic<uint32> dedup_start{0}; // 窗口开始的时间(ms)
+  mutable std::atomic<uint64> dedup_hash{0};  // 消息正文的 64 位哈希
+  mutable std::atomic<uint64> dedup_len{0};   // 消息正文的长度
+  mutable std::atomic<uint32> dedup_count{0}; // 当前窗口内被合并的重复日志数
+};
+
+// 编译期计算 __FILE__ 的文件名部分
+constexpr const char* LogSiteBasename(const char* path) {
+  const char* base = path;
+  for (const char* p = path; *p != '\0'; ++p) {
+    if (*p == '/') base = p + 1;
+  }
+  return base;
+}
+
+#if LIZY_LOG_SITE_REGISTERED
+// 链接器生成的 lizylog_sites 段边界, 每个模块(可执行文件或共享库)各有一份
+extern "C" {
+  extern const LogSite* const __start_lizylog_sites[] __attribute__((weak, visibility("hidden")));
+  extern const LogSite* const __stop_lizylog_sites[] __attribute__((weak, visibility("hidden")));
+}
+
+// 遍历调用者所在模块中的所有 LOG() 调用点, 用于工具(例如列出所有日志语句)
+// 内联到多个文件中的调用点会被登记多次, 这里去重
+template <typename F>
+inline void ForEachLogSite(F&& f) {
+  if (__start_lizylog_sites == nullptr) {
+    return;
+  }
+  std::vector<const LogSite*> sites(__start_lizylog_sites, __stop_lizylog_sites);
+  std::sort(sites.begin(), sites.end());
+  sites.erase(std::unique(sites.begin(), sites.end()), sites.end());
+  for (const LogSite* site : sites) {
+    f(*site);
+  }
+}
+#else
+// 调用点没有登记, 不遍历任何调用点
+template <typename F>
+inline void ForEachLogSite(F&&) {}
+#endif
+
 struct LogMessageTime {
   LogMessageTime();
   LogMessageTime(std::tm t);
@@ -145,6 +336,8 @@ struct LogMessageTime {
 };
 
 // sink 扩展类 ( 基类 )
+class LogContext;
+
 class LogSink {
 public:
   virtual ~LogSink();
@@ -158,6 +351,19 @@ public:
   virtual void send(LogSeverity severity, const char* full_filename,
                     const char* base_filename, int line, const std::tm* t,
                     const char* message, size_t message_len);
+  // 分段发送, 大消息由多个分段组成
+  // 默认实现在只有一个分段时直接调用 send(), 否则拼接后再调用
+  virtual void send(LogSeverity severity, const char* full_filename,
+                    const char* base_filename, int line,
+                    const LogMessageTime& logmsgtime,
+                    const LogSegment* segments, size_t segment_count);
+  // 带日志上下文(ScopedLogContext)的分段发送, context 为空表示没有上下文
+  // 可以通过 context->Fields() 得到有类型的字段, 用于结构化输出
+  // 默认实现忽略上下文, 调用上面的分段 send()
+  virtual void send(LogSeverity severity, const char* full_filename,
+                    const char* base_filename, int line,
+                    const LogMessageTime& logmsgtime, const LogContext* context,
+                    const LogSegment* segments, size_t segment_count);
 
   // 这个函数用于实现等待日志输出完成的逻辑. 它会在每次 send() 函数返回后, 且在 LogMessage 退出或崩溃之前执行 被调用.
   // 默认情况下, 这个函数不执行任何操作
@@ -167,6 +373,11 @@ public:
   // WaitTillSent() 的具体实现可以用来等待这个逻辑完成.
   virtual void WaitTillSent();
 
+  // 开启重复日志合并(SetLogDedupWindow)时, 返回 true 的 sink 收到合并之前的每一条日志, 不收到汇总
+  // 默认返回 false: 与日志文件一样只收到合并后的日志和 "last message repeated N times"
+  // 只在 AddLogSink 时调用一次
+  virtual bool WantsRawRecords() const;
+
   // 返回日志消息的字符串
   // 对 send() 的实现很有用
   static std::string ToString(LogSeverity severity, const char* file, int line,
@@ -174,30 +385,170 @@ public:
                               const char* message, size_t message_len);
 };
 
+// 日志捕获缓冲区(LOG_CAPTURE)
+// 每条日志以 定长头部 + 正文(不含前缀和末尾的 '\n') 追加到一块连续的内存中, 不为每条日志分配 std::string
+// Clear() 只重置长度, 保留已经分配的内存, 同一个 LogCapture 可以在多个请求之间复用
+// 不是线程安全的, 同一个 LogCapture 同一时间只能在一个线程中使用
+class LogCapture {
+ public:
+  struct Record {
+    LogSeverity severity;
+    int64 time_usec;       // 日志的时间(微秒)
+    std::string_view text; // 指向 LogCapture 的内存, 追加日志或 Clear() 后失效
+  };
+
+  class Iterator {
+   public:
+    explicit Iterator(const char* p) : p_(p) {}
+    Record operator*() const {
+      Header header;
+      memcpy(&header, p_, sizeof(header));
+      return {header.severity, header.time_usec, std::string_view(p_ + sizeof(header), header.length)};
+    }
+    Iterator& operator++() {
+      uint32 length;
+      memcpy(&length, p_, sizeof(length));
+      p_ += sizeof(Header) + length;
+      return *this;
+    }
+    bool operator==(const Iterator& other) const { return p_ == other.p_; }
+    bool operator!=(const Iterator& other) const { return p_ != other.p_; }
+
+   private:
+    const char* p_;
+  };
+
+  // also_log 为 false 时只捕获, 不写日志文件, 也不获取 log_mutex
+  explicit LogCapture(bool also_log = true) : also_log_(also_log) {}
+
+  bool also_log() const { return also_log_; }
+  void set_also_log(bool also_log) { also_log_ = also_log; }
+
+  Iterator begin() const { return Iterator(arena_.data()); }
+  Iterator end() const { return Iterator(arena_.data() + arena_.size()); }
+  // 日志条数
+  size_t size() const { return count_; }
+  bool empty() const { return count_ == 0; }
+  // 占用的字节数(包括每条日志的头部)
+  size_t bytes() const { return arena_.size(); }
+
+  // 预先分配内存
+  void Reserve(size_t bytes) { arena_.reserve(bytes); }
+  // 清空日志, 保留内存
+  void Clear() {
+    arena_.clear();
+    count_ = 0;
+  }
+
+  // 所有日志的正文, 每条以 '\n' 结尾
+  std::string ToString() const;
+
+ private:
+  friend class LogMessage;
+
+  struct Header {
+    uint32 length;
+    LogSeverity severity;
+    int64 time_usec;
+  };
+
+  void Append(LogSeverity severity, int64 time_usec, const LogSegment* segments, size_t segment_count);
+
+  std::string arena_;
+  size_t count_{0};
+  bool also_log_;
+};
+
 namespace base_logging {
   // LogStreamBuf 继承 std::streambuf
   // std::streambuf 是输入输出操作的基础组件, std::istream 和 std::ostream 都有一个 std::streambuf 指针
-  // LogStreamBuf 忽略溢出且最后两个字符是 '\n' '\0'
+  // LogStreamBuf 先使用一个小的内联缓冲区, 写满后从线程局部的 arena 获取逐级翻倍的 chunk 串联起来,
+  // 总长度达到上限后丢弃后续内容并在末尾显式标记截断.
+  // 每个分段末尾都保留两个字符用于 '\n' '\0'
   class LogStreamBuf : public std::streambuf {
     public:
-      LogStreamBuf(char* buf, int len) {
-        setp(buf, buf + len - 2); // 设置缓冲区的起始位置
-      }
+      // 最多串联的 chunk 数量, 第 i 个 chunk 的大小为 4KB << i
+      static const int kMaxChunks = 15;
+      // 内联段 + chunk + 截断标记段
+      static const int kMaxSegments = kMaxChunks + 2;
+
+      LogStreamBuf(char* buf, int len);
+      ~LogStreamBuf() override;
 
       // 负责将缓冲区中的数据写入到输流中。当缓冲区已满时，或者在需要强制刷新缓冲区时，这个函数会被调用。
-      // 用于输出操作, 缓冲区满时直接输出(即忽略溢出)
+      // 用于输出操作, 缓冲区满时串联新的 chunk, 超过上限时丢弃
       // override: 由 I/O 自动调用
-      int_type overflow(int_type ch) {
-        return ch;
+      int_type overflow(int_type ch) override;
+      // 批量写入, 避免逐字符调用 overflow
+      std::streamsize xsputn(const char* s, std::streamsize n) override;
+      // 当前分段可以直接写入的空间, 写满时串联新的 chunk, 达到上限时返回 0
+      // 写入后调用 Commit() 提交
+      size_t Writable(char** out);
+      void Commit(size_t n) { pbump(static_cast<int>(n)); }
+      // 记录因超过上限而没有写入的字节数
+      void Discard(size_t n) { dropped_ += n; }
+      // 追加 n 个字节, 当前分段放得下时直接拷贝, 不经过虚函数
+      void Append(const char* s, size_t n) {
+        if (static_cast<size_t>(epptr() - pptr()) >= n) {
+          memcpy(pptr(), s, n);
+          pbump(static_cast<int>(n));
+        } else {
+          LogStreamBuf::xsputn(s, static_cast<std::streamsize>(n));
+        }
       }
 
       // 公共 ostream 方法
-      // 返回缓冲区填充的长度
-      size_t pcount() const { return static_cast<size_t>(pptr() - pbase()); }
-      // 返回首地址
+      // 返回缓冲区填充的长度(所有分段)
+      size_t pcount() const { return finished_len_ + static_cast<size_t>(pptr() - pbase()); }
+      // 返回首段的首地址
       char* pbase() const { return std::streambuf::pbase(); }
+
+      // 设置单条消息的长度上限(包括前缀)
+      void set_limit(size_t limit);
+      // 被丢弃的字节数
+      size_t dropped() const { return dropped_; }
+      // 归还所有 chunk 并回到内联缓冲区
+      void Reset();
+
+      // 结束写入: 写入截断标记, 确保末尾是 '\n', 并在末尾写 '\0'
+      // 返回是否追加了 '\n'
+      bool Seal();
+      // 撤销 Seal() 追加的 '\n'
+      void Unseal(bool appended_newline);
+
+      // 获取 [offset, offset + length) 范围对应的分段, 返回分段数量(不超过 kMaxSegments)
+      size_t GetSegments(size_t offset, size_t length, LogSegment* out) const;
+
+    private:
+      // 串联下一个 chunk, 失败(达到上限)时返回 false
+      bool Grow();
+
+      char* inline_buf_;
+      size_t inline_len_;
+      size_t limit_;
+      size_t finished_len_{0};  // 已写满的分段的总长度
+      size_t dropped_{0};       // 因超过上限被丢弃的字节数
+      int num_chunks_{0};
+      LogSegment segments_[kMaxSegments];  // segments_[0] 是内联段
+      char* chunks_[kMaxChunks];
+      char marker_[64];                    // 截断标记段
+      bool sealed_marker_{false};
   };
 
+  // 可以用 std::to_chars 直接格式化的类型(与 std::ostream 的默认格式逐字节相同)
+  template <typename T>
+  constexpr bool kFastLogInteger =
+      std::is_same<T, short>::value || std::is_same<T, unsigned short>::value ||
+      std::is_same<T, int>::value || std::is_same<T, unsigned int>::value || std::is_same<T, long>::value ||
+      std::is_same<T, unsigned long>::value || std::is_same<T, long long>::value ||
+      std::is_same<T, unsigned long long>::value;
+  template <typename T>
+  constexpr bool kFastLogFloat =
+      std::is_same<T, float>::value || std::is_same<T, double>::value || std::is_same<T, long double>::value;
+  template <typename T>
+  constexpr bool kFastLogChar =
+      std::is_same<T, bool>::value || std::is_same<T, char>::value || std::is_same<T, signed char>::value || std::is_same<T, unsigned char>::value;
+
 }
 
 
@@ -216,8 +567,104 @@ class LogMessage {
         : std::ostream(NULL), 
           streambuf_(buf, len), 
           ctr_(ctr), 
-          self_(this) {
+          self_(this),
+          classic_locale_(getloc() == std::locale::classic()) {
         rdbuf(&streambuf_); // 改变底层的缓冲区
+        // imbue() 修改 locale 时更新 classic_locale_
+        register_callback(&LogStream::OnLocaleEvent, 0);
+      }
+
+      // 内置类型的插入不经过 std::ostream 的 sentry 和 num_put, 直接写入 LogStreamBuf
+      // 只在流是默认格式(十进制, 没有 setw, "C" locale)时使用, 否则交给 std::ostream, 输出逐字节相同
+      // 用户自定义类型仍然使用 std::ostream 的 operator<<
+      template <typename T, typename std::enable_if<base_logging::kFastLogInteger<T>, int>::type = 0>
+      friend LogStream& operator<<(LogStream& s, T value) {
+        if (!s.DefaultFormat()) {
+          static_cast<std::ostream&>(s) << value;
+          return s;
+        }
+        char buf[24];
+        const std::to_chars_result r = std::to_chars(buf, buf + sizeof(buf), value);
+        s.streambuf_.Append(buf, static_cast<size_t>(r.ptr - buf));
+        return s;
+      }
+      template <typename T, typename std::enable_if<base_logging::kFastLogFloat<T>, int>::type = 0>
+      friend LogStream& operator<<(LogStream& s, T value) {
+        // std::ostream 对浮点数使用 printf("%.*g"), 与 to_chars(general, precision) 相同
+        const std::streamsize precision = s.precision() < 0 ? 6 : s.precision();
+        if (!s.DefaultFormat() || precision > 17) {
+          static_cast<std::ostream&>(s) << value;
+          return s;
+        }
+        char buf[48];
+        const std::to_chars_result r = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::general,
+                                                     static_cast<int>(precision));
+        s.streambuf_.Append(buf, static_cast<size_t>(r.ptr - buf));
+        return s;
+      }
+      template <typename T, typename std::enable_if<base_logging::kFastLogChar<T>, int>::type = 0>
+      friend LogStream& operator<<(LogStream& s, T value) {
+        if (!s.DefaultFormat()) {
+          static_cast<std::ostream&>(s) << value;
+          return s;
+        }
+        // bool 在没有 boolalpha 时输出 "1" / "0"
+        const char c = std::is_same<T, bool>::value ? (value ? '1' : '0') : static_cast<char>(value);
+        s.streambuf_.Append(&c, 1);
+        return s;
+      }
+      // const char* / char*, 空指针交给 std::ostream(设置 badbit)
+      template <typename T, typename std::enable_if<std::is_same<typename std::remove_const<T>::type, char>::value,
+                                                    int>::type = 0>
+      friend LogStream& operator<<(LogStream& s, T* str) {
+        if (str == nullptr || !s.DefaultFormat()) {
+          static_cast<std::ostream&>(s) << str;
+          return s;
+        }
+        s.streambuf_.Append(str, strlen(str));
+        return s;
+      }
+      // void*: 与 num_put 相同, 空指针输出 "0", 否则输出 "0x" + 十六进制
+      template <typename T, typename std::enable_if<std::is_void<T>::value, int>::type = 0>
+      friend LogStream& operator<<(LogStream& s, T* ptr) {
+        if (!s.DefaultFormat()) {
+          static_cast<std::ostream&>(s) << static_cast<const void*>(ptr);
+          return s;
+        }
+        char buf[24] = {'0', 'x'};
+        const uintptr_t value = reinterpret_cast<uintptr_t>(ptr);
+        char* end = value == 0 ? buf + 1 : std::to_chars(buf + 2, buf + sizeof(buf), value, 16).ptr;
+        s.streambuf_.Append(buf, static_cast<size_t>(end - buf));
+        return s;
+      }
+      template <typename T, typename std::enable_if<std::is_same<T, std::string_view>::value, int>::type = 0>
+      friend LogStream& operator<<(LogStream& s, T str) {
+        if (!s.DefaultFormat()) {
+          static_cast<std::ostream&>(s) << str;
+          return s;
+        }
+        s.streambuf_.Append(str.data(), str.size());
+        return s;
+      }
+      template <typename Alloc>
+      friend LogStream& operator<<(LogStream& s, const std::basic_string<char, std::char_traits<char>, Alloc>& str) {
+        if (!s.DefaultFormat()) {
+          static_cast<std::ostream&>(s) << str;
+          return s;
+        }
+        s.streambuf_.Append(str.data(), str.size());
+        return s;
+      }
+
+      // copyfmt() 同时复制 locale 和回调列表: 重新计算 classic_locale_, rhs 不是 LogStream 时重新注册回调
+      // (通过 std::ios& 调用的 copyfmt() 不经过这里)
+      LogStream& copyfmt(const std::ios& rhs) {
+        std::ostream::copyfmt(rhs);
+        if (dynamic_cast<const LogStream*>(&rhs) == nullptr) {
+          register_callback(&LogStream::OnLocaleEvent, 0);
+        }
+        classic_locale_ = getloc() == std::locale::classic();
+        return *this;
       }
 
       int64 ctr() const { return ctr_; }
@@ -227,20 +674,43 @@ class LogMessage {
       // std::streambuf 的方法
       size_t pcount() const { return streambuf_.pcount(); }
       char* pbase() const { return streambuf_.pbase(); }
-      // 返回缓冲区的字符串首地址
+      // 返回缓冲区首段的字符串首地址
       char* str() const { return pbase(); }
+      // 底层缓冲区
+      base_logging::LogStreamBuf& buf() { return streambuf_; }
+      const base_logging::LogStreamBuf& buf() const { return streambuf_; }
     private:
       LogStream(const LogStream&) = delete;            // delete copy constructor
       LogStream& operator=(const LogStream&) = delete; // delete operator=
+      // copyfmt() 会把回调复制到其他流上, 只处理 LogStream 自己
+      static void OnLocaleEvent(std::ios_base::event event, std::ios_base& ios, int) {
+        if (event != std::ios_base::imbue_event) {
+          return;
+        }
+        LogStream* self = dynamic_cast<LogStream*>(&ios);
+        if (self != nullptr) {
+          self->classic_locale_ = self->getloc() == std::locale::classic();
+        }
+      }
+      // 默认格式: 没有修改过格式标志, 没有 setw, 流状态正常, 使用 "C" locale
+      bool DefaultFormat() const {
+        return classic_locale_ && flags() == (std::ios_base::skipws | std::ios_base::dec) && width() == 0 &&
+               rdstate() == std::ios_base::goodbit;
+      }
+
       base_logging::LogStreamBuf streambuf_;  // 缓冲区
       int64 ctr_;  // TODO: Counter hack (for the LOG_EVERY_X() macro)
       LogStream* self_; // 用于一致性检查
+      bool classic_locale_; // 流的 locale 是否是 "C" locale
     };
 
   public:
     typedef void (LogMessage::*SendMethod)(); // 成员函数指针类型
     
     LogMessage(const char* file, int line, LogSeverity severity, int64 ctr, SendMethod send_method);
+    // 用于 LOG(severity): 调用点只传递一个指向静态 LogSite 的指针, 文件名不需要在运行时计算
+    // 隐含的是: ctr = 0, send_method = &LogMessage::SendToLog
+    explicit LogMessage(const LogSite* site);
     // 两个特殊的构造函数, 在常见情况下 LOG 的调用位置减少生成的代码量
     // 用于 LOG(INFO): 隐含的是: severity = INFO, ctr = 0, send_method = &LogMessage::SendToLog
     // 使用这个构造函数而不上面那个复杂的构造函数可以节省19个字节.
@@ -263,6 +733,10 @@ class LogMessage {
     // 隐含的是: ctr = 0, send_method = &LogMessage::WriteToStringAndLog
     LogMessage(const char* file, int line, LogSeverity severity, std::string* message);
 
+    // 用于把日志追加到 LogCapture 中
+    // 隐含的是: ctr = 0, send_method = &LogMessage::SaveToCapture
+    LogMessage(const char* file, int line, LogSeverity severity, LogCapture* capture);
+
     // 特殊的构造函数 用于 check 失败时
     LogMessage(const char* file, int line, const CheckOpString& result);
 
@@ -271,8 +745,10 @@ class LogMessage {
     // 将所有日志消息刷盘到 sink 对象, 总是在析构函数调用, 也可以在任何地方调用如果有需要同步日志的时候
     void Flush();
 
-    // 单条日志最长长度
+    // 单条日志默认的最长长度(可通过 SetMaxLogMessageLen 修改)
     static const size_t kMaxLogMessageLen;
+    // 内联缓冲区长度, 大部分日志不需要额外分配内存
+    static const size_t kInlineMessageLen;
 
     // 这些函数不应该在其他地方(非logging.*)直接调用, 应该作为参数 SendMethod 传递
     void SendToLog();
@@ -281,11 +757,11 @@ class LogMessage {
     // FATAL 错误结束进程函数
     [[noreturn]] static void Fail();
 
-    std::ostream& stream();
+    LogStream& stream();
 
     int preserved_errno() const;
 
-    // 调用时不能持有锁
+    // 不需要获取锁, 返回值可能略微滞后
     static int64 num_messages(int severity);
 
     const LogMessageTime& getLogMessageTime() const;
@@ -302,14 +778,28 @@ class LogMessage {
 
     void SaveOrSendToLog();
 
+    // capture->also_log() 为 false 时不需要持有 log_mutex
+    void SaveToCapture();
+
+    // FATAL: 刷盘所有日志文件, 有限时间内等待 sink, 然后结束进程
+    [[noreturn]] void FlushFatalAndFail();
+
+    // 重复日志合并: 窗口内与同一个调用点的上一条日志相同时返回 true, 不再写出
+    bool CoalesceRepeat();
+    // 写出窗口已经结束(force 时不等待窗口结束)的调用点的 "last message repeated N times"
+    // unlocked 时不获取任何锁, 直接写入日志文件(用于 FlushLogFilesUnsafe)
+    static void ReportRepeats(bool force, uint32 now_ms, bool unlocked = false);
+
     // 构造函数调用的初始化函数
     void Init(const char* file, int line, LogSeverity severity, void (LogMessage::*send_method)());
+    void Init(const char* file, const char* basename, int line, LogSeverity severity,
+              void (LogMessage::*send_method)());
 
     // 用于记录错误原因当 FATAL 发生时
     void RecordCrashReason(log_internal_namespace_::CrashReason* reason);
 
     // 每个优先级发送的消息计数
-    static int64 num_messages_[NUM_SEVERITIES];
+    static std::atomic<int64> num_messages_[NUM_SEVERITIES];
 
     // 将 data 保存在单独的结构体中是为了每个 LogMessage 实例使用更少的栈空间
     LogMessageData* allocated_; // 内存分配
@@ -317,6 +807,7 @@ class LogMessage {
     LogMessageTime logmsgtime_;
 
     friend class LogDestination;
+    friend class LogMessageFatal;
 
     LogMessage(const LogMessage&) = delete; // delete copy constructor
     LogMessage& operator=(const LogMessage&) = delete; // delete operator=
@@ -325,6 +816,92 @@ class LogMessage {
 // 当前仅当 ostream 是 LogStream 时起作用
 std::ostream& operator<<(std::ostream &os, const PRIVATE_Counter&);
 
+// LogHex / LogBytes 默认最多输出的字节数, 超过的部分以 "...(+N bytes)" 标记
+const size_t kLogDumpMaxBytes = 4096;
+// LogContainer 默认最多输出的元素个数
+const size_t kLogContainerMaxElems = 64;
+
+struct LogHexValue {
+  const unsigned char* data;
+  size_t len;
+  size_t max_bytes;
+};
+
+struct LogBytesValue {
+  const unsigned char* data;
+  size_t len;
+  size_t max_bytes;
+};
+
+template <typename Container>
+struct LogContainerValue {
+  const Container& container;
+  size_t max_elems;
+};
+
+// 以十六进制输出一段内存: LOG(INFO) << LogHex(buf, len);  ->  "0a1bff..."
+// 使用 SIMD(AVX2/SSE2) 直接写入 LogStreamBuf
+inline LogHexValue LogHex(const void* data, size_t len, size_t max_bytes = kLogDumpMaxBytes) {
+  return {static_cast<const unsigned char*>(data), len, max_bytes};
+}
+
+// 输出一段可能包含二进制的内存, 可打印字符原样输出, 其他字节转义为 \n \t \xHH
+inline LogBytesValue LogBytes(const void* data, size_t len, size_t max_bytes = kLogDumpMaxBytes) {
+  return {static_cast<const unsigned char*>(data), len, max_bytes};
+}
+
+// 输出容器中的元素: LOG(INFO) << LogContainer(vec);  ->  "[1, 2, 3]"
+// 超过 max_elems 的部分以 "...(+N)" 标记
+template <typename Container>
+inline LogContainerValue<Container> LogContainer(const Container& container,
+                                                 size_t max_elems = kLogContainerMaxElems) {
+  return {container, max_elems};
+}
+
+LogMessage::LogStream& operator<<(LogMessage::LogStream& s, const LogHexValue& value);
+std::ostream& operator<<(std::ostream& os, const LogHexValue& value);
+LogMessage::LogStream& operator<<(LogMessage::LogStream& s, const LogBytesValue& value);
+std::ostream& operator<<(std::ostream& os, const LogBytesValue& value);
+
+namespace base_logging {
+  template <typename Stream, typename Container>
+  void WriteLogContainer(Stream& s, const LogContainerValue<Container>& value) {
+    s << '[';
+    size_t count = 0;
+    auto it = std::begin(value.container);
+    const auto end = std::end(value.container);
+    for (; it != end && count < value.max_elems; ++it, ++count) {
+      if (count > 0) s << ", ";
+      s << *it;
+    }
+    if (it != end) {
+      s << (count > 0 ? ", " : "") << "...(+" << static_cast<size_t>(std::distance(it, end)) << ')';
+    }
+    s << ']';
+  }
+}
+
+template <typename Container>
+LogMessage::LogStream& operator<<(LogMessage::LogStream& s, const LogContainerValue<Container>& value) {
+  base_logging::WriteLogContainer(s, value);
+  return s;
+}
+
+template <typename Container>
+std::ostream& operator<<(std::ostream& os, const LogContainerValue<Container>& value) {
+  base_logging::WriteLogContainer(os, value);
+  return os;
+}
+
+// FATAL 日志: 析构函数不会返回
+// 编译器知道失败路径不会回到调用点, CHECK 成功路径不需要为失败路径保存寄存器
+class LogMessageFatal : public LogMessage {
+ public:
+  explicit LogMessageFatal(const LogSite* site);
+  LogMessageFatal(const char* file, int line, const CheckOpString& result);
+  [[noreturn]] ~LogMessageFatal();
+};
+
 class LogMessageVoidify {
  public:
   LogMessageVoidify() { }
@@ -350,24 +927,85 @@ class Logger {
   // 子类重写这个函数可以实现异步写
   virtual void Write(bool force_flush, time_t timestamp, const char* message, size_t message_len) = 0;
 
+  // 分段写入, 大消息由多个分段组成
+  // 默认实现把分段拼接后调用 Write(), 子类可以重写以避免拷贝
+  virtual void WriteSegments(bool force_flush, time_t timestamp, const LogSegment* segments, size_t segment_count);
+
   // 刷盘所有的信息
   virtual void Flush() = 0;
 
   // 返回日志文件的大小, 返回的值可能是近似值, 因为一些日志可能还没刷新到磁盘上
+  // 超过 4GB 时返回 UINT32_MAX, 使用 BatchLogger::LogSize64() 获取完整的大小
   virtual uint32 LogSize() = 0;
 
 };
 
+// 一条已经格式化的日志(包含前缀), 只在 WriteBatch() 调用期间有效
+struct LogRecordView {
+  LogSeverity severity;       // 日志本身的等级(写到低等级文件时也不变)
+  bool force_flush;           // 是否需要立即刷新
+  time_t timestamp;           // 日志的时间(秒)
+  int32 usecs;                // 日志的时间(微秒部分)
+  const LogSegment* segments; // 日志内容, 大消息由多个分段组成
+  size_t segment_count;
+};
+
+// 第二版日志记录器接口: 一次调用写入一批日志, 分摊虚函数调用和加锁的开销
+// 通过 SetBatchLogger() 设置, 旧的 Logger 通过 LoggerAdapter 适配
+class BatchLogger {
+ public:
+  virtual ~BatchLogger();
+
+  // 按顺序写入 records[0, count-1]
+  virtual void WriteBatch(const LogRecordView* records, size_t count) = 0;
+
+  // 刷盘所有的信息
+  virtual void Flush() = 0;
+
+  // 同 Flush(), 最多等待到 deadline_nanos(steady_clock 的纳秒数), 超时返回 false; FATAL 时使用
+  // 默认直接调用 Flush(), 可能阻塞的实现(例如等待后台线程)需要重写
+  virtual bool FlushFor(int64 deadline_nanos);
+
+  // 返回日志文件的大小(64 位), 返回的值可能是近似值
+  virtual uint64 LogSize64() = 0;
+};
+
+// 把旧的单条写入接口 Logger 适配为 BatchLogger, 每条日志调用一次 WriteSegments()
+// 拥有 logger 的所有权
+class LoggerAdapter final : public BatchLogger {
+ public:
+  explicit LoggerAdapter(Logger* logger) : logger_(logger) {}
+  ~LoggerAdapter() override;
+
+  void WriteBatch(const LogRecordView* records, size_t count) override;
+  void Flush() override;
+  uint64 LogSize64() override;
+
+  Logger* logger() const { return logger_; }
+
+ private:
+  Logger* logger_;
+};
+
 // 获取指定严重程度级别的日志记录器
 // 日志记录器仍然属于日志模块的所有权, 不应由调用者删除
+// 通过 SetBatchLogger() 设置的 BatchLogger 没有实现 Logger 时, 返回一个适配器: Write() 写入一条日志到该 BatchLogger
 // 线程安全的
 Logger* GetLogger(LogSeverity level);
 
-// 设置指定严重程度级别的日志记录器
+// 设置指定严重程度级别的日志记录器, 内部用 LoggerAdapter 包装
 // 日志记录器将成为日志模块的所有权, 调用者不应该删除它
 // 线程安全的
 void SetLogger(LogSeverity level, Logger* logger);
 
+// 获取指定严重程度级别的日志记录器(BatchLogger 接口), 默认的文件日志记录器也实现了这个接口
+// 日志记录器仍然属于日志模块的所有权, 不应由调用者删除
+BatchLogger* GetBatchLogger(LogSeverity level);
+
+// 设置指定严重程度级别的日志记录器(BatchLogger 接口), nullptr 表示恢复默认的文件日志记录器
+// 日志记录器将成为日志模块的所有权, 调用者不应该删除它
+void SetBatchLogger(LogSeverity level, BatchLogger* logger);
+
 } // end of namespace base
 
 
@@ -410,6 +1048,9 @@ void SetLogFileHeader(bool flag);
 void SetLogYearInPrefix(bool flag);
 // 是否定时清理一些日志文件在内存中的缓存
 void SetDropLogMemory(bool flag);
+// 清理缓存的方式(对新建的日志文件生效): 每写满 chunk_kb KB, 后台线程发起异步回写, 回写完成后释放这部分页缓存
+// mb_per_sec 限制后台回写的速度(MB/s), 0 表示不限速
+void SetLogWriteBehind(uint32 chunk_kb, uint32 mb_per_sec);
 
 // 写到 stderr 的日志程度阈值
 void SetStderrThreshold(int level);
@@ -430,15 +1071,152 @@ void SetLogLink(const std::string& link);
 
 // 日志文件最大的大小
 void SetMaxLogSize(uint32 size);
+// 单条日志的最大长度(字节), 超过部分被丢弃并标记截断; 取值范围 [256, UINT32_MAX], 超出范围时取边界值
+void SetMaxLogMessageLen(size_t len);
+// 新建日志文件使用的持久化模式, 对已经打开的日志文件不生效
+void SetLogDurabilityMode(LogDurabilityMode mode);
+// 组提交(DURABILITY_GROUP_COMMIT)的时间窗口(单位: us): 同步线程被唤醒后再等待这么久才 fdatasync, 收集更多记录, 写入线程的延迟也增加这么多
+void SetLogGroupCommitWindow(int usecs);
+// 日志时间戳使用的时钟, 刷盘和清理的定时器始终使用单调时钟, 不受影响
+void SetLogClockSource(LogClockSource source);
+// 分片模式: shards > 0 时每个线程的日志写到 shards 个分片文件中的一个(按线程轮转分配, 最多 64 个)
+// 文件名为 <base><time>.<pid>.s<shard><ext>, 写文件不再持有全局的 log_mutex
+// 每条日志的前缀带有全局序号 #seq, 合并工具按序号恢复全局顺序; 使用 SetLogger() 时不生效
+// 默认关闭(0): 只有多个 CPU 上的线程同时大量写日志, log_mutex 的等待(LoggingStats::log_mutex_wait_ns)明显时才开启,
+// 分片数不超过同时写日志的 CPU 数; 线程数多于 CPU 数或单线程时分片没有收益, 而且需要合并工具才能按顺序查看
+void SetLogShards(int shards);
+// 新建日志文件时同时生成稀疏时间索引 <日志文件名>.idx, 每 kb KB 或每秒一条记录, 0 表示不生成
+// 通过 log_index.h 中的 FindLogBlocks() 或 lizylog_index 工具按时间和等级定位日志
+void SetLogIndexBlockSize(uint32 kb);
+// 日志文件的滚动策略, policy 是 LogRollPolicy 的按位组合(例如 ROLL_BY_SIZE | ROLL_DAILY), 0 表示不滚动
+// 按时间滚动的边界使用与日志前缀相同的时区(log_utc_time)
+void SetLogRollPolicy(int policy);
+// 重复日志合并的时间窗口(单位: ms), 0 表示不合并(默认)
+// 同一个 LOG() 调用点在窗口内重复输出相同的内容时只写第一条, 窗口结束后写一条 "last message repeated N times"
+// 窗口比刷盘周期(SetLogBufSecs)长时, 到了刷盘周期提前写出汇总; FlushLogFiles 和 ShutdownLogging 也会写出汇总
+void SetLogDedupWindow(int ms);
+
+// 在作用域内, 当前线程产生的所有日志使用同一个时间戳(进入作用域时读取)
+// 用于一次处理一批消息的场景(例如异步写入线程), 每批只读取一次时钟
+// 可以嵌套, 内层的作用域重新读取时钟, 退出时恢复外层的时间戳
+class ScopedLogTimeBatch {
+ public:
+  ScopedLogTimeBatch();
+  ~ScopedLogTimeBatch();
+
+ private:
+  ScopedLogTimeBatch(const ScopedLogTimeBatch&) = delete;
+  ScopedLogTimeBatch& operator=(const ScopedLogTimeBatch&) = delete;
+  WallTime saved_time_;
+};
+
+// 日志上下文字段的类型
+enum LogContextType {
+  CONTEXT_INT,
+  CONTEXT_UINT,
+  CONTEXT_DOUBLE,
+  CONTEXT_BOOL,
+  CONTEXT_STRING,
+};
+
+// 日志上下文中的一个字段
+struct LogContextField {
+  std::string key;
+  LogContextType type;
+  union {
+    int64 int_value;
+    uint64 uint_value;
+    double double_value;
+    bool bool_value;
+  };
+  std::string string_value;
+};
+
+// 日志上下文: 不可变的链表, 每个节点保存一个字段和外层上下文
+// 节点创建时把所有字段渲染成文本前缀 "[req=42 user=7] ", 之后每条日志直接复制这段前缀, 不再格式化
+class LogContext {
+ public:
+  LogContext(std::shared_ptr<const LogContext> parent, LogContextField field);
+
+  const LogContext* parent() const { return parent_.get(); }
+  const LogContextField& field() const { return field_; }
+  const std::string& prefix() const { return prefix_; }
+  // 所有字段, 从外层到内层
+  std::vector<const LogContextField*> Fields() const;
+
+ private:
+  LogContext(const LogContext&) = delete;
+  LogContext& operator=(const LogContext&) = delete;
+
+  std::shared_ptr<const LogContext> parent_;
+  LogContextField field_;
+  std::string prefix_;
+  size_t depth_;
+};
+
+// 日志上下文的句柄, 复制只增加引用计数, 可以传给其他线程
+using LogContextHandle = std::shared_ptr<const LogContext>;
+
+// 当前线程的日志上下文, 没有时返回空
+LogContextHandle CurrentLogContext();
+
+// 在作用域内, 当前线程产生的所有日志都带有 key=value 字段, 可以嵌套:
+//   ScopedLogContext ctx("req", id);
+// 也可以在其他线程恢复一个上下文:
+//   auto handle = CurrentLogContext();
+//   pool.Submit([handle] { ScopedLogContext ctx(handle); LOG(INFO) << "..."; });
+class ScopedLogContext {
+ public:
+  template <typename T, typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, int>::type = 0>
+  ScopedLogContext(const char* key, T value) {
+    LogContextField field{key, CONTEXT_INT, {}, {}};
+    field.int_value = value;
+    Push(std::move(field));
+  }
+  template <typename T, typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value &&
+                                                !std::is_same<T, bool>::value, int>::type = 0>
+  ScopedLogContext(const char* key, T value) {
+    LogContextField field{key, CONTEXT_UINT, {}, {}};
+    field.uint_value = value;
+    Push(std::move(field));
+  }
+  ScopedLogContext(const char* key, double value);
+  ScopedLogContext(const char* key, bool value);
+  ScopedLogContext(const char* key, const char* value);
+  ScopedLogContext(const char* key, std::string_view value);
+  // 把当前线程的上下文替换为 context(例如从其他线程传过来的句柄)
+  explicit ScopedLogContext(LogContextHandle context);
+  ~ScopedLogContext();
+
+ private:
+  ScopedLogContext(const ScopedLogContext&) = delete;
+  ScopedLogContext& operator=(const ScopedLogContext&) = delete;
+  void Push(LogContextField field);
+
+  LogContextHandle saved_;
+};
+
+// 从 JSON 配置文件读取选项, 键名为 FLAGS_ 去掉前缀后的名字, 例如:
+// { "minloglevel": 1, "max_log_size": 100, "log_dir": "/var/log/app/" }
+// 所有选项都可以在运行时修改, 日志线程只做 relaxed 读取
+// 选项通过对应的 Set* 接口应用(相同的截断规则); 任何一个值的类型或范围不合法时整个文件都不生效, 返回 false
+bool LoadLogConfigFile(const std::string& path);
+// 加载配置文件并监听(inotify)它的修改, 修改后自动重新加载
+bool EnableLogConfigHotReload(const std::string& path);
+void DisableLogConfigHotReload();
 
 
 // 设置 FALTAL 时执行的函数
 void InstallFailureFunction(logging_fail_func_t fail_func);
 
+// LOG(DFATAL) 以及 LOG_TO_STRING(FATAL) 是否结束进程, 默认 true; LOG(FATAL) 和 CHECK 总是结束进程
+void SetExitOnDFatal(bool value);
+bool GetExitOnDFatal();
+
 // 获取日志等级对应的名字
 const char* GetLogSeverityName(LogSeverity severity);
 
-// 获取日志文件目录
+// 获取日志文件目录(按当前的 log_dir 计算), 返回的引用在当前线程下一次调用之前有效
 const std::vector<std::string>& GetLoggingDirectories();
 
 // 返回已存在的临时目录, 将会是 GetLoggingDirectories() 的子集
@@ -447,6 +1225,32 @@ void GetExistingTempDirectories(std::vector<std::string>* list);
 // 允许再次打印任意 fatal 信息
 void ReprintFatalMessage();
 
+// 日志库内部的统计信息, 由每个线程的计数器在调用时汇总
+struct LoggingStats {
+  uint64 messages[NUM_SEVERITIES][NUM_STAT_DESTINATIONS]; // 每个等级, 每个目的地的记录数
+  uint64 bytes[NUM_SEVERITIES][NUM_STAT_DESTINATIONS];    // 每个等级, 每个目的地的字节数
+  uint64 log_mutex_wait_ns;    // 等待 log_mutex 的总时间
+  uint64 log_mutex_contended;  // 获取 log_mutex 时需要等待的次数
+  uint64 write_ns;             // fwrite 的总时间(需要 SetLoggingStatsTiming(true))
+  uint64 flush_ns;             // fflush 的总时间
+  uint64 flushes;              // fflush 的次数
+  int64 queue_depth;           // 异步队列中等待写入的记录数
+  uint64 dropped_records;      // 被丢弃的记录数
+  uint64 truncated_records;    // 被截断的记录数
+  uint64 coalesced_records;    // 被合并的重复日志数
+  uint64 rotations;            // 日志文件滚动的次数
+  uint64 cleaner_runs;         // 过期日志清理的次数
+};
+
+// 获取统计信息(线程安全, 不获取 log_mutex)
+LoggingStats GetLoggingStats();
+
+// 是否统计 fwrite 的耗时, 每次写入需要额外两次时钟调用, 默认关闭
+void SetLoggingStatsTiming(bool enable);
+
+// 以 Prometheus 文本格式把统计信息写到文件(先写临时文件再 rename)
+bool DumpLoggingStats(const char* path);
+
 
 // 刷盘所有包含不低于指定等级日志的日志文件(线程安全) 
 void FlushLogFiles(LogSeverity min_severity);
@@ -466,6 +1270,42 @@ void SetLogSymlink(LogSeverity severity, const char* symlink_basename);
 // 增加或者移除 LogSink 作为下沉对象(线程安全)
 void AddLogSink(LogSink* destination);
 void RemoveLogSink(LogSink* destination);
+// 增加命名的 LogSink, 路由规则中通过名字引用(线程安全)
+void AddLogSink(LogSink* destination, const std::string& name);
+
+// 日志路由的目的地, 可以组合
+enum LogRouteDestination : uint32 {
+  LOG_ROUTE_FILE_INFO = 1U << 0,    // 只写到指定等级的文件(不级联)
+  LOG_ROUTE_FILE_WARNING = 1U << 1,
+  LOG_ROUTE_FILE_ERROR = 1U << 2,
+  LOG_ROUTE_FILE_FATAL = 1U << 3,
+  LOG_ROUTE_FILE = 1U << 4,         // 默认的级联规则: 日志等级对应的文件以及所有更低等级的文件
+  LOG_ROUTE_STDERR = 1U << 5,       // 标准错误输出(不受 stderrthreshold 影响)
+  LOG_ROUTE_SINKS = 1U << 6,        // 所有 LogSink
+  LOG_ROUTE_SYNC = 1U << 7,         // 写文件后立即刷新
+};
+
+// 一条路由规则: 匹配的日志只输出到 destinations 和 sinks
+struct LogRoute {
+  LogSeverity min_severity = LOG_INFO;  // 匹配的等级范围 [min_severity, max_severity]
+  LogSeverity max_severity = LOG_FATAL;
+  std::string file_pattern;             // 匹配 __FILE__ 或者它以 '/' 分隔的后缀(fnmatch), 为空时匹配所有文件
+  uint32 destinations = 0;              // LogRouteDestination 的组合, 为 0 且没有 sinks 时丢弃日志
+  std::vector<std::string> sinks;       // 通过 AddLogSink(sink, name) 命名的 sink
+};
+
+// 设置路由表(线程安全): 按顺序匹配, 使用第一条匹配的规则, 不匹配任何规则的日志按默认规则输出
+// 为空时恢复默认规则, 所有规则最多引用 32 个不同的 sink 名字, 超过时返回 false
+// 每个 LOG() 调用点缓存匹配出的目的地位图, 选择目的地只需要一次查表
+// 只影响写日志文件的情况(没有设置 logtostderr/logtostdout)
+bool SetLogRoutes(const std::vector<LogRoute>& routes);
+
+// 解析文本形式的路由表(配置文件中的 "log_routes"), 每行或者每个 ';' 一条规则:
+//   <等级> [文件模式] -> <目的地>[,<目的地>...]
+// 等级: INFO, ERROR+(不低于 ERROR), WARNING-ERROR(范围), *(所有等级)
+// 目的地: file, file:<等级>, stderr, sinks, sink:<名字>, sync, none
+// 例如 "ERROR+ storage/* -> file:ERROR,sink:socket; INFO -> file:INFO; FATAL -> file,stderr,sinks,sync"
+bool ParseLogRoutes(const std::string& text, std::vector<LogRoute>* routes, std::string* error);
 
 // 指定通过 SetLogDestination 增加的文件名的后缀名
 // 这适用于所有严重等级
@@ -0,0 +1,77 @@
+#ifndef LIZY_METRICS_H_
+#define LIZY_METRICS_H_
+#pragma once
+
+#include <atomic>
+#include "type.h"
+
+namespace log_internal_namespace_ {
+
+// 标量计数器
+enum LogStatCounter {
+  STAT_MUTEX_WAIT_NS,       // 等待 log_mutex 的总时间
+  STAT_MUTEX_CONTENDED,     // 获取 log_mutex 时需要等待的次数
+  STAT_WRITE_NS,            // fwrite 的总时间(需要 SetLoggingStatsTiming(true))
+  STAT_FLUSH_NS,            // fflush 的总时间
+  STAT_FLUSHES,             // fflush 的次数
+  STAT_DROPPED_RECORDS,     // 被丢弃的记录数(无法创建文件, 磁盘满)
+  STAT_TRUNCATED_RECORDS,   // 被截断的记录数
+  STAT_ROTATIONS,           // 日志文件滚动的次数
+  STAT_CLEANER_RUNS,        // 过期日志清理的次数
+  STAT_COALESCED_RECORDS,   // 被合并的重复日志数
+  NUM_STAT_COUNTERS
+};
+
+// 每个线程一份的计数器, 只有所属线程写入, 所以写入只需要 relaxed 的 load + store, 不需要原子的读-改-写
+// 线程退出后使用的计数器被多个线程共用(shared), 写入使用 fetch_add
+// 读取时(GetLoggingStats)汇总所有线程的计数器
+struct alignas(64) ThreadLogStats {
+  std::atomic<uint64> messages[NUM_SEVERITIES][NUM_STAT_DESTINATIONS];
+  std::atomic<uint64> bytes[NUM_SEVERITIES][NUM_STAT_DESTINATIONS];
+  std::atomic<uint64> counters[NUM_STAT_COUNTERS];
+  bool shared = false;
+};
+
+// 当前线程的计数器(第一次调用时注册), 线程退出后返回一个共享的计数器
+ThreadLogStats* LocalLogStats();
+
+// 是否记录 fwrite 的耗时(需要额外的时钟调用)
+extern std::atomic<bool> g_stats_timing;
+
+inline void StatAdd(std::atomic<uint64>& counter, uint64 value) {
+  counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+inline void StatAdd(const ThreadLogStats* stats, std::atomic<uint64>& counter, uint64 value) {
+  if (stats->shared) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+  } else {
+    StatAdd(counter, value);
+  }
+}
+
+inline void StatAdd(LogStatCounter counter, uint64 value = 1) {
+  ThreadLogStats* stats = LocalLogStats();
+  StatAdd(stats, stats->counters[counter], value);
+}
+
+inline void StatMessage(LogSeverity severity, LogStatDestination destination, uint64 bytes) {
+  ThreadLogStats* stats = LocalLogStats();
+  StatAdd(stats, stats->messages[severity][destination], 1);
+  StatAdd(stats, stats->bytes[severity][destination], bytes);
+}
+
+// 异步队列深度(可以被多个线程修改的 gauge)
+void StatQueueDepthAdd(int64 delta);
+
+// 单调时钟, 单位 ns, 用于统计耗时
+int64 StatNowNanos();
+
+// fork 前持有计数器注册表的锁, 之后在父子进程中释放
+void StatsAtForkPrepare();
+void StatsAtForkParent();
+void StatsAtForkChild();
+
+} // end of namespace log_internal_namespace_
+
+#endif
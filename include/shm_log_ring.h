@@ -0,0 +1,102 @@
+#ifndef LIZY_SHM_LOG_RING_H_
+#define LIZY_SHM_LOG_RING_H_
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "logging.h"
+
+namespace base {
+
+// 共享内存日志环的选项
+struct SharedLogRingOptions {
+  size_t slot_bytes = 256;       // 每个槽的大小(包括 24 字节的槽头), 一条日志占用一个或多个连续的槽
+  size_t slots = 16384;          // 槽的数量, 向上取整到 2 的幂; 一条日志最多占用 1/4 的槽, 超出的部分被截断
+  int flush_interval_ms = 1000;  // 收集者最多间隔多久刷新 target
+  int stale_record_ms = 100;     // 槽被占用但一直没有提交, 超过该时间后检查占用它的进程是否还存在
+  bool start_collector = true;   // 在创建它的进程中启动收集线程; 为 false 时由调用者在某个进程中调用 RunCollector()
+};
+
+// 多进程共享的日志环(pre-fork 模型): 在 fork 工作进程之前创建并安装, 共享内存(memfd + MAP_SHARED)由子进程继承
+// 所有进程都把日志追加到环中, 只有收集者写 target, 文件的滚动和过期清理也只在收集者所在的进程中进行
+// 写入不加锁: CAS 占用连续的槽, 写完后发布第一个槽的序号; 收集者按顺序读取并释放槽
+// 环满时写入者让出 CPU 等待收集者, 仍然没有空间时丢弃日志并计数, 不会无限阻塞
+// 写入者在占用槽之后崩溃时, 收集者在 stale_record_ms 后确认占用者已经退出, 跳过这些槽, 不会卡住或读到越界的数据
+// 占用者和收集者都记录 pid 和进程的启动时间, pid 被新的进程复用时同样认为原来的进程已经退出
+// 通过 SetLogger(severity, ...) 或 SetBatchLogger(severity, ...) 安装, 每个等级使用单独的对象
+// 一条日志会写到它的等级及所有更低等级的日志记录器, 只安装部分等级时其他等级仍由每个进程各自写文件,
+// 通常使用 InstallSharedLogRings() 为所有等级安装
+// target 通常是安装前 GetBatchLogger(severity) 返回的默认文件日志记录器, 不拥有它的所有权
+class SharedLogRing : public Logger, public BatchLogger {
+ public:
+  // severity 是通过旧接口(Write/WriteSegments)写入的日志的等级
+  SharedLogRing(LogSeverity severity, BatchLogger* target, const SharedLogRingOptions& options = SharedLogRingOptions());
+  // 运行收集线程的进程中: 收集线程写出剩余的日志后退出; 其他进程只解除映射
+  ~SharedLogRing() override;
+
+  // force_flush 时唤醒收集者, 不等待写出
+  void Write(bool force_flush, time_t timestamp, const char* message, size_t message_len) override;
+  void WriteSegments(bool force_flush, time_t timestamp, const LogSegment* segments, size_t segment_count) override;
+  void WriteBatch(const LogRecordView* records, size_t count) override;
+
+  // 等待调用之前写入的日志都被收集者写到 target 并刷新, 没有收集者时最多等待 flush_interval_ms + 1s
+  void Flush() override;
+  // 同 Flush(), 最多等待到 deadline_nanos
+  bool FlushFor(int64 deadline_nanos) override;
+
+  // 当前进程中 target 的大小(只在收集者所在的进程中有意义)
+  uint32 LogSize() override;
+  uint64 LogSize64() override;
+
+  // 在当前线程中运行收集者, 直到 StopCollector(); 同一时间只能有一个收集者(所有进程中),
+  // 已经有收集者(当前进程的其他线程, 或者仍然存在的其他进程)时立即返回 false
+  bool RunCollector();
+  // 通知收集者写出剩余的日志后退出, 可以在任何进程中调用
+  void StopCollector();
+
+  // 因为环满被丢弃的日志数, 跳过的崩溃进程占用的槽数(所有进程共享)
+  uint64 dropped_records() const;
+  uint64 abandoned_slots() const;
+
+  // fork 前后的处理, 由 logging.cc 中的 pthread_atfork 处理函数调用
+  static void AtForkPrepareAll();
+  static void AtForkParentAll();
+  static void AtForkChildAll();
+
+ private:
+  struct Header;
+  struct Slot;
+
+  Slot* SlotAt(uint64 pos) const;
+  // 占用槽并写入一条日志, 环满时返回 false
+  bool Append(const LogRecordView& record);
+  // 收集者睡眠时唤醒它
+  void Signal();
+  // 收集者等待 Signal(), 或者等待 timeout_nanos 超时
+  void WaitForSignal(int64 timeout_nanos);
+  // 按顺序释放 [begin, end) 的槽
+  void ReleaseSlots(uint64 begin, uint64 end);
+
+  const LogSeverity severity_;
+  BatchLogger* const target_;
+  const SharedLogRingOptions options_;
+
+  size_t slot_bytes_{0};
+  uint64 slot_count_{0};
+  size_t map_bytes_{0};
+  Header* header_{nullptr};  // 共享内存的开头, 之后是 slot_count_ 个槽
+  char* slots_{nullptr};
+  int fd_{-1};
+  // 收集线程, 只存在于创建它的进程中; 放在堆上, fork 后子进程放弃父进程的句柄(不析构), 重新创建
+  std::unique_ptr<std::thread> thread_{new std::thread()};
+  std::atomic<bool> collecting_{false}; // 当前进程中是否有线程在运行 RunCollector(), fork 后子进程中为 false
+};
+
+// 为每个等级安装一个 SharedLogRing, target 是安装前该等级的日志记录器, 在 fork 工作进程之前调用一次
+// 每个等级一个收集线程(options.start_collector 为 true 时)
+void InstallSharedLogRings(const SharedLogRingOptions& options = SharedLogRingOptions());
+
+} // end of namespace base
+
+#endif
@@ -19,6 +19,39 @@ enum LogColor {
   COLOR_YELLOW
 };
 
+// 日志文件的持久化模式
+enum LogDurabilityMode {
+  DURABILITY_BUFFERED,      // 默认: stdio 缓冲, 持久化依赖 fflush 的时机
+  DURABILITY_PREALLOCATE,   // stdio 缓冲 + fallocate 随写入逐块(4MB)预分配日志文件
+  DURABILITY_GROUP_COMMIT,  // 每条记录写到内核, 写入线程等待同步完成后返回, 同时等待的记录共用一次 fdatasync
+  DURABILITY_DSYNC,         // O_DSYNC 打开, 每条记录返回时已经落盘
+  DURABILITY_DIRECT         // O_DIRECT | O_DSYNC 按块对齐写入, 绕过页缓存
+};
+
+// 日志时间戳使用的时钟
+enum LogClockSource {
+  CLOCK_SOURCE_GETTIMEOFDAY,    // 默认: gettimeofday, 精度 1us
+  CLOCK_SOURCE_REALTIME_COARSE, // clock_gettime(CLOCK_REALTIME_COARSE), 只读 vDSO 中的变量, 精度为一个 tick(1~4ms)
+  CLOCK_SOURCE_TSC              // rdtsc, 在后台线程中与墙上时间校准, 不支持时退化为 CLOCK_SOURCE_REALTIME_COARSE
+};
+
+// 日志文件的滚动策略, 可以按位组合, 任意一个条件满足即滚动
+enum LogRollPolicy {
+  ROLL_BY_SIZE = 1,   // 默认: 文件达到 max_log_size
+  ROLL_HOURLY  = 2,   // 每个整点
+  ROLL_DAILY   = 4    // 每天零点
+};
+
+// 统计信息(GetLoggingStats)中的日志输出目的地
+enum LogStatDestination {
+  STAT_DEST_FILE,
+  STAT_DEST_STDERR,
+  STAT_DEST_STDOUT,
+  STAT_DEST_SINK,
+  STAT_DEST_STRING,
+  NUM_STAT_DESTINATIONS
+};
+
 enum PRIVATE_Counter {COUNTER};
 
 enum { PATH_SEPARATOR = '/'};
@@ -4,32 +4,45 @@
 #include "type.h"
 #include <sys/time.h>
 #include <unistd.h>
+#include <condition_variable>
+#include <memory>
 #include <string>
+#include <thread>
 #include <cstring>
 
 
 namespace log_internal_namespace_ {
 
-// 返回自起始时间的微秒数(int64)
+// 单调时钟(CLOCK_MONOTONIC_COARSE), 单位 us, 只用于刷盘, 清理等定时器
+// 不受修改系统时间的影响, 与 FLAGS_clock_source 无关
 int64 CycleClock_Now();
-// 返回自起始时间的微秒数(double)
+// 墙上时间(单位: s), 使用 FLAGS_clock_source 选择的时钟
 WallTime WallTime_Now();
+// 日志消息的时间戳: 在 ScopedLogTimeBatch 范围内返回批次的时间戳, 否则同 WallTime_Now()
+WallTime MessageTime_Now();
 
 int64 UsecToCycles(int64 usec);
 
+// 当前线程的批次时间戳, 0 表示没有批次
+extern thread_local WallTime tls_batch_time;
+
 // 获取路径在'/'的最后一个名字
 const char* const_basename(const char* filepath);
 
+// 判断文件名是否是 <base_filename>YYYYMMDD-HHMMSS.pid[.s<shard>]<filename_extension> 格式的日志文件
+// 用于 LogCleaner 和 lizylog_cat 查找日志文件
+bool IsLogFileName(const std::string& filepath,
+                   const std::string& base_filename,
+                   const std::string& filename_extension);
+
 template<class T>
 inline T sync_val_compare_and_swap(T* ptr, T oldval, T newval) {
   // CAS
   // 如果 *ptr 的值等于 oldval, 则将 newval 存储到 *ptr 中, 并返回 *ptr 原来的值
   // 如果 *ptr 的值不等于 oldval, 则什么都不做, 并返回 *ptr 原来的值
-  T ret = *ptr;
-  if (ret == oldval) {
-    *ptr = newval;
-  }
-  return ret;
+  // 失败时 oldval 被更新为 *ptr 的当前值, 所以两种情况都返回 oldval
+  __atomic_compare_exchange_n(ptr, &oldval, newval, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return oldval;
 }
 
 
@@ -53,11 +66,29 @@ void ShutdownLoggingUtilities();
 
 // 获取程序短名称
 const char* ProgramInvocationShortName();
-// 进程号是否改变
-bool PidHasChanged();
-
+// 缓存的进程号, 只在 fork 后的子进程中更新, 不需要系统调用
 int32 GetMainThreadPid();
 
+// 后台线程的句柄和它等待的条件变量, 由 std::unique_ptr 持有, fork 后子进程可以整体替换
+struct WorkerThread {
+  std::thread thread;
+  std::condition_variable cv;
+};
+
+// 子进程中丢弃父进程的对象: 父进程的线程在子进程中不存在, 句柄不能 join 或 detach,
+// 它等待过的条件变量中还记录着这个等待者, 也不能析构; 旧对象不析构(泄漏), 重新创建一个
+template <typename T>
+inline void RenewAfterFork(std::unique_ptr<T>* object) {
+  static_cast<void>(object->release());
+  object->reset(new T());
+}
+
+// fork 前后的处理, 由 logging.cc 中的 pthread_atfork 处理函数调用
+// 持有 TSC 校准线程的锁, 子进程中更新缓存的进程号, 并在下次使用时重新启动校准线程
+void UtilitiesAtForkPrepare();
+void UtilitiesAtForkParent();
+void UtilitiesAtForkChild();
+
 // 获取用户名
 const std::string& MyUserName();
 
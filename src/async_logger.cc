@@ -0,0 +1,614 @@
+#include "async_logger.h"
+#include "utilities.h"
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace base {
+
+namespace {
+  // 所有 AsyncLogger, fork 时需要持有它们的锁
+  std::mutex& async_loggers_mutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  std::vector<AsyncLogger*>& async_loggers() {
+    static std::vector<AsyncLogger*> loggers;
+    return loggers;
+  }
+
+  // 在 dir 中打开一个匿名的暂存文件, 进程退出或崩溃时不会留下文件
+  int OpenScratchFile(const std::string& dir) {
+    const int fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+      return fd;
+    }
+    // 文件系统不支持 O_TMPFILE: 创建后立即删除
+    std::string path = dir + "/lizylog_spill.XXXXXX";
+    const int tmp_fd = mkostemp(&path[0], O_CLOEXEC);
+    if (tmp_fd >= 0) {
+      unlink(path.c_str());
+    }
+    return tmp_fd;
+  }
+
+  bool PwriteAll(int fd, const char* data, size_t len, uint64 offset) {
+    while (len > 0) {
+      const ssize_t n = pwrite(fd, data, len, static_cast<off_t>(offset));
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      data += n;
+      len -= static_cast<size_t>(n);
+      offset += static_cast<uint64>(n);
+    }
+    return true;
+  }
+
+  // 在线的 NUMA 节点数(最大的节点号 + 1), 例如 /sys/devices/system/node/online 为 "0-1" 时是 2
+  // 不使用 possible: 它包括可以热插拔但不存在的节点, 一些机器上是几十个
+  size_t NumaNodeCount() {
+    FILE* file = fopen("/sys/devices/system/node/online", "r");
+    if (file == nullptr) {
+      return 1;
+    }
+    char buf[64] = {0};
+    const bool ok = fgets(buf, sizeof(buf), file) != nullptr;
+    fclose(file);
+    if (!ok) {
+      return 1;
+    }
+    const char* last = buf;
+    for (const char* p = buf; *p != '\0'; ++p) {
+      if (*p == '-' || *p == ',') last = p + 1;
+    }
+    const long max_node = strtol(last, nullptr, 10);
+    return max_node >= 0 && max_node < 1024 ? static_cast<size_t>(max_node) + 1 : 1;
+  }
+
+  // 线程第一次写入时所在的 NUMA 节点, 之后不再改变, 保证同一个线程的日志写到同一个节点的块
+  thread_local int tls_numa_node = -1;
+
+  // 优先从 node 分配内存, 失败时(例如内核不支持)退化为首次访问所在的节点
+  void BindToNumaNode(void* addr, size_t len, size_t node) {
+    const size_t bits = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> mask(node / bits + 1, 0);
+    mask[node / bits] |= 1UL << (node % bits);
+    if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask.data(), mask.size() * bits + 1, 0) != 0) {
+      // Ignore errors.
+    }
+  }
+
+  // 在后台线程中设置 CPU 亲和性和调度策略, 失败时只打印警告(不能在日志记录器中调用 LOG)
+  void ConfigureWriterThread(const AsyncLoggerOptions& options) {
+    if (!options.writer_cpus.empty()) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      for (int cpu : options.writer_cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &cpus);
+      }
+      if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        fprintf(stderr, "lizy_log: could not set async writer cpu affinity\n");
+      }
+    }
+    if (options.writer_sched_policy >= 0) {
+      struct sched_param param;
+      memset(&param, 0, sizeof(param));
+      param.sched_priority = options.writer_sched_priority;
+      if (pthread_setschedparam(pthread_self(), options.writer_sched_policy, &param) != 0) {
+        fprintf(stderr, "lizy_log: could not set async writer scheduling policy %d\n", options.writer_sched_policy);
+      }
+    }
+  }
+
+  inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+  }
+
+  int64 MonotonicNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  // *word 仍然等于 expected 时睡眠, 最多 timeout_nanos
+  void FutexWait(std::atomic<uint32>* word, uint32 expected, int64 timeout_nanos) {
+    struct timespec ts;
+    ts.tv_sec = static_cast<time_t>(timeout_nanos / 1000000000);
+    ts.tv_nsec = static_cast<long>(timeout_nanos % 1000000000);
+    syscall(SYS_futex, reinterpret_cast<uint32*>(word), FUTEX_WAIT_PRIVATE, expected, &ts, nullptr, 0);
+  }
+
+  void FutexWake(std::atomic<uint32>* word) {
+    syscall(SYS_futex, reinterpret_cast<uint32*>(word), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+  }
+
+  bool PreadAll(int fd, char* data, size_t len, uint64 offset) {
+    while (len > 0) {
+      const ssize_t n = pread(fd, data, len, static_cast<off_t>(offset));
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      data += n;
+      len -= static_cast<size_t>(n);
+      offset += static_cast<uint64>(n);
+    }
+    return true;
+  }
+}
+
+void AsyncLogger::BlockMemoryDeleter::operator()(char* data) const {
+  munmap(data, size);
+}
+
+AsyncLogger::AsyncLogger(LogSeverity severity, BatchLogger* target, const AsyncLoggerOptions& options)
+    : severity_(severity), target_(target), options_(options) {
+  spin_limit_ = std::max(options_.spin_iterations, 0);
+  // 每个节点至少占用一个前台块, 节点数不超过内存块数; 超出的节点使用节点 0 的块
+  node_count_ = options_.numa_aware ? std::min(NumaNodeCount(), std::max<size_t>(options_.memory_blocks, 1)) : 1;
+  nodes_.reset(new Node[node_count_]);
+  std::lock_guard<std::mutex> registry_lk(async_loggers_mutex());
+  async_loggers().push_back(this);
+  std::unique_lock<std::mutex> lk(mutex_);
+  for (size_t i = 0; i < node_count_; i++) {
+    nodes_[i].front = TakeFreeBlockLocked(i, 0, &lk);
+  }
+  StartWriterLocked();
+}
+
+AsyncLogger::~AsyncLogger() {
+  {
+    std::lock_guard<std::mutex> registry_lk(async_loggers_mutex());
+    auto& loggers = async_loggers();
+    loggers.erase(std::remove(loggers.begin(), loggers.end(), this), loggers.end());
+  }
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    stop_ = true;
+    StartWriterLocked();
+  }
+  Signal();
+  thread_->join();
+  if (scratch_fd_ >= 0) {
+    close(scratch_fd_);
+  }
+}
+
+void AsyncLogger::Write(bool force_flush, time_t timestamp, const char* message, size_t message_len) {
+  const LogSegment segment = {message, message_len};
+  WriteSegments(force_flush, timestamp, &segment, 1);
+}
+
+void AsyncLogger::WriteSegments(bool force_flush, time_t timestamp, const LogSegment* segments, size_t segment_count) {
+  const LogRecordView record = {severity_, force_flush, timestamp, 0, segments, segment_count};
+  WriteBatch(&record, 1);
+}
+
+void AsyncLogger::WriteBatch(const LogRecordView* records, size_t count) {
+  if (!writer_started_.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    StartWriterLocked();
+  }
+  const size_t node = CurrentNode();
+  bool wake = false;
+  {
+    std::lock_guard<std::mutex> node_lk(nodes_[node].mutex);
+    for (size_t i = 0; i < count; i++) {
+      AppendLocked(node, records[i]);
+      wake = wake || records[i].force_flush;
+    }
+  }
+  if (wake) {
+    wake_.store(true, std::memory_order_relaxed);
+    Signal();
+  }
+}
+
+void AsyncLogger::Flush() {
+  std::unique_lock<std::mutex> lk(mutex_);
+  StartWriterLocked();
+  const uint64 requested = ++flush_requested_;
+  Signal();
+  flushed_cv_->wait(lk, [this, requested] { return flushed_ >= requested; });
+}
+
+bool AsyncLogger::FlushFor(int64 deadline_nanos) {
+  std::unique_lock<std::mutex> lk(mutex_);
+  StartWriterLocked();
+  const uint64 requested = ++flush_requested_;
+  Signal();
+  const int64 remaining = std::max<int64>(deadline_nanos - MonotonicNanos(), 0);
+  return flushed_cv_->wait_for(lk, std::chrono::nanoseconds(remaining),
+                              [this, requested] { return flushed_ >= requested; });
+}
+
+uint32 AsyncLogger::LogSize() {
+  return static_cast<uint32>(std::min<uint64>(LogSize64(), UINT32_MAX));
+}
+
+uint64 AsyncLogger::LogSize64() {
+  return target_->LogSize64() + buffered_bytes_.load(std::memory_order_relaxed);
+}
+
+uint64 AsyncLogger::spilled_blocks() {
+  std::lock_guard<std::mutex> lk(mutex_);
+  return spilled_blocks_;
+}
+
+size_t AsyncLogger::CurrentNode() const {
+  if (node_count_ == 1) {
+    return 0;
+  }
+  if (tls_numa_node < 0) {
+    unsigned cpu = 0;
+    unsigned node = 0;
+    tls_numa_node = syscall(SYS_getcpu, &cpu, &node, nullptr) == 0 ? static_cast<int>(node) : 0;
+  }
+  return static_cast<size_t>(tls_numa_node) < node_count_ ? static_cast<size_t>(tls_numa_node) : 0;
+}
+
+void AsyncLogger::AppendLocked(size_t node, const LogRecordView& record) {
+  size_t len = 0;
+  for (size_t i = 0; i < record.segment_count; i++) {
+    len += record.segments[i].size;
+  }
+  if (nodes_[node].front->capacity - nodes_[node].front->used < len) {
+    std::unique_lock<std::mutex> lk(mutex_);
+    SwapFrontLocked(node, len, &lk);
+  }
+  Block* block = nodes_[node].front.get();
+  const size_t offset = block->used;
+  for (size_t i = 0; i < record.segment_count; i++) {
+    memcpy(block->data.get() + block->used, record.segments[i].data, record.segments[i].size);
+    block->used += record.segments[i].size;
+  }
+  block->records.push_back({offset, len, record.timestamp, record.usecs, record.severity, record.force_flush});
+  buffered_bytes_.fetch_add(len, std::memory_order_relaxed);
+}
+
+void AsyncLogger::SwapFrontLocked(size_t node, size_t min_capacity, std::unique_lock<std::mutex>* lk) {
+  std::unique_ptr<Block>& front = nodes_[node].front;
+  if (front->used > 0) {
+    pending_.push_back(std::move(front));
+    Signal();
+  } else {
+    // 空块放不下超大的日志
+    nodes_[node].free.push_back(std::move(front));
+  }
+  front = TakeFreeBlockLocked(node, min_capacity, lk);
+}
+
+std::unique_ptr<AsyncLogger::Block> AsyncLogger::TakeFreeBlockLocked(size_t node, size_t min_capacity,
+                                                                      std::unique_lock<std::mutex>* lk) {
+  const size_t block_bytes = std::max<size_t>(options_.block_bytes, 1);
+  if (min_capacity <= block_bytes) {
+    std::vector<std::unique_ptr<Block>>& free_blocks = nodes_[node].free;
+    if (!free_blocks.empty()) {
+      std::unique_ptr<Block> block = std::move(free_blocks.back());
+      free_blocks.pop_back();
+      return block;
+    }
+    if (memory_blocks_ >= options_.memory_blocks) {
+      // 后台线程跟不上: 溢出最新的内存块(最后才会被写出), 复用它的内存, 优先选择同一个节点的块
+      Block* victim = nullptr;
+      for (auto it = pending_.rbegin(); it != pending_.rend(); ++it) {
+        Block* candidate = it->get();
+        if (candidate->data && candidate->capacity == block_bytes) {
+          if (victim == nullptr) victim = candidate;
+          if (candidate->node == node) {
+            victim = candidate;
+            break;
+          }
+        }
+      }
+      if (victim != nullptr) {
+        BlockMemory data = Spill(victim, lk);
+        if (data) {
+          std::unique_ptr<Block> block(new Block());
+          block->data = std::move(data);
+          block->capacity = block_bytes;
+          block->node = node;
+          return block;
+        }
+      }
+    }
+  }
+  // 超大的日志, 或者无法溢出(暂存文件写入失败)时分配新的内存
+  std::unique_ptr<Block> block(new Block());
+  block->capacity = std::max(min_capacity, block_bytes);
+  block->data = AllocateBlockMemory(node, block->capacity);
+  block->node = node;
+  memory_blocks_++;
+  return block;
+}
+
+AsyncLogger::BlockMemory AsyncLogger::AllocateBlockMemory(size_t node, size_t size) const {
+  void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  if (options_.numa_aware) {
+    BindToNumaNode(data, size, node);
+  }
+  return BlockMemory(static_cast<char*>(data), BlockMemoryDeleter{size});
+}
+
+AsyncLogger::BlockMemory AsyncLogger::Spill(Block* block, std::unique_lock<std::mutex>* lk) {
+  if (scratch_fd_ < 0) {
+    std::string dir = options_.scratch_dir;
+    if (dir.empty()) {
+      std::vector<std::string> dirs;
+      GetExistingTempDirectories(&dirs);
+      dir = dirs.empty() ? "/tmp" : dirs.front();
+    }
+    scratch_fd_ = OpenScratchFile(dir);
+    if (scratch_fd_ < 0) {
+      return BlockMemory(nullptr, BlockMemoryDeleter{0});
+    }
+  }
+  // 先在暂存文件中占用一段空间并取走块的内存, 其他线程不会再选择它, 后台线程写到它时等待
+  BlockMemory data = std::move(block->data);
+  const uint64 offset = scratch_end_;
+  const int fd = scratch_fd_;
+  scratch_end_ += block->used;
+  spilled_pending_++;
+  block->spilling = true;
+
+  lk->unlock();
+  const bool ok = PwriteAll(fd, data.get(), block->used, offset);
+  lk->lock();
+
+  block->spilling = false;
+  spill_cv_->notify_all();
+  if (!ok) {
+    // 写入失败: 块仍然使用内存, 占用的空间留到暂存文件下次从头开始使用时回收
+    block->data = std::move(data);
+    if (--spilled_pending_ == 0) {
+      scratch_end_ = 0;
+    }
+    return BlockMemory(nullptr, BlockMemoryDeleter{0});
+  }
+  block->spill_offset = offset;
+  spilled_blocks_++;
+  return data;
+}
+
+bool AsyncLogger::StealFronts(bool force) {
+  bool empty = true;
+  for (size_t i = 0; i < node_count_; i++) {
+    Node& node = nodes_[i];
+    std::lock_guard<std::mutex> node_lk(node.mutex);
+    std::unique_lock<std::mutex> lk(mutex_);
+    if (node.front->used > 0 && (force || !node.free.empty() || memory_blocks_ < options_.memory_blocks)) {
+      SwapFrontLocked(i, 0, &lk);
+    }
+    empty = empty && node.front->used == 0;
+  }
+  return empty;
+}
+
+void AsyncLogger::Signal() {
+  // 与 WaitForSignal() 配对: 先修改 signal_seq_ 再读 sleeping_, 后台线程先写 sleeping_ 再读 signal_seq_,
+  // 两边至少有一边看到对方的修改, 不会丢失唤醒
+  signal_seq_.fetch_add(1, std::memory_order_seq_cst);
+  if (sleeping_.load(std::memory_order_seq_cst)) {
+    FutexWake(&signal_seq_);
+  }
+}
+
+void AsyncLogger::WaitForSignal(uint32 seen) {
+  const int64 deadline = MonotonicNanos() + static_cast<int64>(std::max(options_.flush_interval_ms, 1)) * 1000000;
+  if (options_.wait_strategy == ASYNC_WAIT_BUSY_SPIN) {
+    for (uint32 i = 1; signal_seq_.load(std::memory_order_acquire) == seen; i++) {
+      CpuRelax();
+      if (i % 256 == 0 && MonotonicNanos() >= deadline) return;
+    }
+    return;
+  }
+  if (options_.wait_strategy == ASYNC_WAIT_ADAPTIVE) {
+    const int max_spin = std::max(options_.spin_iterations, 0);
+    for (int i = 0; i < spin_limit_; i++) {
+      if (signal_seq_.load(std::memory_order_acquire) != seen) {
+        // 自旋期间等到了日志, 下次多自旋一些
+        spin_limit_ = std::min(spin_limit_ * 2 + 1, max_spin);
+        return;
+      }
+      CpuRelax();
+    }
+    for (int i = 0; i < options_.yield_iterations; i++) {
+      if (signal_seq_.load(std::memory_order_acquire) != seen) {
+        // 让出 CPU 期间等到了日志: 日志间隔比自旋稍长, 同样多自旋一些(自旋次数减到 0 后也能恢复)
+        spin_limit_ = std::min(spin_limit_ * 2 + 1, max_spin);
+        return;
+      }
+      sched_yield();
+    }
+    // 自旋没有等到日志, 下次少自旋一些, 但至少自旋一次
+    spin_limit_ = std::max(spin_limit_ / 2, std::min(max_spin, 1));
+  }
+  sleeping_.store(true, std::memory_order_seq_cst);
+  while (signal_seq_.load(std::memory_order_seq_cst) == seen) {
+    const int64 remaining = deadline - MonotonicNanos();
+    if (remaining <= 0) break;
+    FutexWait(&signal_seq_, seen, remaining);
+  }
+  sleeping_.store(false, std::memory_order_relaxed);
+}
+
+void AsyncLogger::StartWriterLocked() {
+  if (!thread_->joinable()) {
+    *thread_ = std::thread(&AsyncLogger::Run, this);
+    writer_started_.store(true, std::memory_order_release);
+  }
+}
+
+void AsyncLogger::Run() {
+  ConfigureWriterThread(options_);
+  std::vector<LogRecordView> views;
+  std::vector<LogSegment> segments;
+  std::unique_ptr<char[]> read_buffer;
+  size_t read_capacity = 0;
+
+  std::unique_lock<std::mutex> lk(mutex_);
+  while (true) {
+    // 先读 signal_seq_ 再检查是否有工作: 检查之后的 Signal() 会改变 signal_seq_, 等待立即返回
+    const uint32 seen = signal_seq_.load(std::memory_order_seq_cst);
+    if (!(stop_ || wake_.load(std::memory_order_relaxed) || !pending_.empty() || flush_requested_ != flushed_)) {
+      lk.unlock();
+      WaitForSignal(seen);
+      lk.lock();
+    }
+    wake_.store(false, std::memory_order_relaxed);
+    const uint64 requested = flush_requested_;
+    // 超时, 需要立即写出, 或者 Flush(): 不满的块也交给后台线程
+    // 没有空闲块时只在 Flush() 和退出时这样做, 否则换块需要溢出刚交出的块
+    const bool force = stop_ || requested != flushed_;
+    lk.unlock();
+    const bool fronts_empty = StealFronts(force);
+    lk.lock();
+
+    while (!pending_.empty()) {
+      // 前台线程正在把这个块写到暂存文件
+      spill_cv_->wait(lk, [this] { return !pending_.front()->spilling; });
+      std::unique_ptr<Block> block = std::move(pending_.front());
+      pending_.pop_front();
+      const bool spilled = !block->data;
+      lk.unlock();
+
+      const char* data = block->data.get();
+      bool ok = true;
+      if (spilled) {
+        if (read_capacity < block->used) {
+          read_capacity = block->used;
+          read_buffer.reset(new char[read_capacity]);
+        }
+        ok = PreadAll(scratch_fd_, read_buffer.get(), block->used, block->spill_offset);
+        data = read_buffer.get();
+      }
+      if (ok) {
+        views.resize(block->records.size());
+        segments.resize(block->records.size());
+        for (size_t i = 0; i < block->records.size(); i++) {
+          const Record& record = block->records[i];
+          segments[i] = {data + record.offset, record.length};
+          views[i] = {record.severity, record.force_flush, record.timestamp, record.usecs, &segments[i], 1};
+        }
+        target_->WriteBatch(views.data(), views.size());
+      }
+
+      lk.lock();
+      buffered_bytes_.fetch_sub(block->used, std::memory_order_relaxed);
+      if (spilled) {
+        // 没有等待读取的溢出块时, 从头开始使用暂存文件
+        if (--spilled_pending_ == 0) {
+          scratch_end_ = 0;
+          if (ftruncate(scratch_fd_, 0) != 0) {
+            // Ignore errors.
+          }
+        }
+      } else if (block->capacity == std::max<size_t>(options_.block_bytes, 1) &&
+                 memory_blocks_ <= options_.memory_blocks) {
+        block->used = 0;
+        block->records.clear();
+        nodes_[block->node].free.push_back(std::move(block));
+      } else {
+        memory_blocks_--;
+      }
+    }
+
+    if (requested != flushed_) {
+      lk.unlock();
+      target_->Flush();
+      lk.lock();
+      flushed_ = requested;
+      flushed_cv_->notify_all();
+    }
+    if (stop_ && pending_.empty() && fronts_empty) {
+      lk.unlock();
+      target_->Flush();
+      break;
+    }
+  }
+}
+
+void AsyncLogger::AtForkPrepareAll() {
+  async_loggers_mutex().lock();
+  for (AsyncLogger* logger : async_loggers()) {
+    for (size_t i = 0; i < logger->node_count_; i++) {
+      logger->nodes_[i].mutex.lock();
+    }
+    logger->mutex_.lock();
+  }
+}
+
+void AsyncLogger::AtForkParentAll() {
+  for (AsyncLogger* logger : async_loggers()) {
+    logger->mutex_.unlock();
+    for (size_t i = 0; i < logger->node_count_; i++) {
+      logger->nodes_[i].mutex.unlock();
+    }
+  }
+  async_loggers_mutex().unlock();
+}
+
+// 子进程中没有后台线程, 丢弃父进程还没有写出的日志(由父进程写出), 下次写入时重新创建线程
+void AsyncLogger::AtForkChildAll() {
+  for (AsyncLogger* logger : async_loggers()) {
+    log_internal_namespace_::RenewAfterFork(&logger->thread_);
+    log_internal_namespace_::RenewAfterFork(&logger->flushed_cv_);
+    log_internal_namespace_::RenewAfterFork(&logger->spill_cv_);
+    logger->sleeping_.store(false, std::memory_order_relaxed);
+    logger->writer_started_.store(false, std::memory_order_relaxed);
+    const size_t block_bytes = std::max<size_t>(logger->options_.block_bytes, 1);
+    for (size_t i = 0; i < logger->node_count_; i++) {
+      logger->nodes_[i].front->used = 0;
+      logger->nodes_[i].front->records.clear();
+    }
+    for (auto& block : logger->pending_) {
+      if (block->data && block->capacity == block_bytes) {
+        block->used = 0;
+        block->records.clear();
+        logger->nodes_[block->node].free.push_back(std::move(block));
+      }
+    }
+    logger->pending_.clear();
+    // 父进程的后台线程正在写出的块留在父进程中
+    logger->memory_blocks_ = 0;
+    for (size_t i = 0; i < logger->node_count_; i++) {
+      logger->memory_blocks_ += 1 + logger->nodes_[i].free.size();
+    }
+    logger->spilled_pending_ = 0;
+    logger->buffered_bytes_.store(0, std::memory_order_relaxed);
+    logger->flushed_ = logger->flush_requested_;
+    logger->wake_.store(false, std::memory_order_relaxed);
+    // 暂存文件与父进程共享, 子进程需要时重新创建
+    if (logger->scratch_fd_ >= 0) {
+      close(logger->scratch_fd_);
+      logger->scratch_fd_ = -1;
+    }
+    logger->scratch_end_ = 0;
+    logger->mutex_.unlock();
+    for (size_t i = 0; i < logger->node_count_; i++) {
+      logger->nodes_[i].mutex.unlock();
+    }
+  }
+  async_loggers_mutex().unlock();
+}
+
+} // end of namespace base
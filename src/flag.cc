@@ -0,0 +1,445 @@
+#include "flag.h"
+#include "logging.h"
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+namespace log_internal_namespace_ {
+
+LogFlags g_log_flags;
+
+GuardedStringFlag g_log_dir("./");
+GuardedStringFlag g_log_link("");
+
+namespace {
+
+  enum FlagType { FLAG_BOOL, FLAG_INT32, FLAG_UINT32, FLAG_STRING, FLAG_ROUTES };
+
+  struct FlagEntry {
+    const char* name;
+    FlagType type;
+    long long min_value;  // 数值选项允许的范围, 超出范围时整个配置都不生效
+    long long max_value;
+    // 通过 Set* 接口修改, 与代码中调用时的截断和副作用一致
+    void (*set_number)(long long);
+    void (*set_string)(const std::string&);
+  };
+
+  const long long kInt32Max = INT32_MAX;
+  const long long kUint32Max = UINT32_MAX;
+
+  // 所有可以通过配置文件修改的选项
+  const FlagEntry kFlagTable[] = {
+    {"logtostderr", FLAG_BOOL, 0, 1, [](long long v) { SetLogtostderr(v != 0); }, nullptr},
+    {"logtostdout", FLAG_BOOL, 0, 1, [](long long v) { SetLogtostdout(v != 0); }, nullptr},
+    {"alsologtostderr", FLAG_BOOL, 0, 1, [](long long v) { SetAlsologtostderr(v != 0); }, nullptr},
+    {"colorlogtostderr", FLAG_BOOL, 0, 1, [](long long v) { SetColorlogtostderr(v != 0); }, nullptr},
+    {"colorlogtostdout", FLAG_BOOL, 0, 1, [](long long v) { SetColorlogtostdout(v != 0); }, nullptr},
+    {"stop_logging_if_full_disk", FLAG_BOOL, 0, 1, [](long long v) { SetStopLoggingIfFullDisk(v != 0); }, nullptr},
+    {"log_utc_time", FLAG_BOOL, 0, 1, [](long long v) { SetLogUTCtime(v != 0); }, nullptr},
+    {"timestamp_in_logfile_name", FLAG_BOOL, 0, 1, [](long long v) { SetTimestampInLogfileName(v != 0); }, nullptr},
+    {"log_file_header", FLAG_BOOL, 0, 1, [](long long v) { SetLogFileHeader(v != 0); }, nullptr},
+    {"log_year_in_prefix", FLAG_BOOL, 0, 1, [](long long v) { SetLogYearInPrefix(v != 0); }, nullptr},
+    {"drop_log_memory", FLAG_BOOL, 0, 1, [](long long v) { SetDropLogMemory(v != 0); }, nullptr},
+    {"log_writeback_kb", FLAG_UINT32, 0, kUint32Max,
+     [](long long v) { SetLogWriteBehind(static_cast<uint32>(v), FLAGS_log_writeback_mb_per_sec); }, nullptr},
+    {"log_writeback_mb_per_sec", FLAG_UINT32, 0, kUint32Max,
+     [](long long v) { SetLogWriteBehind(FLAGS_log_writeback_kb, static_cast<uint32>(v)); }, nullptr},
+    // 等级: NUM_SEVERITIES 表示任何日志都不满足; logbuflevel 为 -1 表示所有日志都立即刷新
+    {"stderrthreshold", FLAG_INT32, 0, NUM_SEVERITIES, [](long long v) { SetStderrThreshold(static_cast<int>(v)); }, nullptr},
+    {"minloglevel", FLAG_INT32, 0, NUM_SEVERITIES, [](long long v) { SetMinLogLevel(static_cast<int>(v)); }, nullptr},
+    {"logbuflevel", FLAG_INT32, -1, NUM_SEVERITIES, [](long long v) { SetLogBufLevel(static_cast<int>(v)); }, nullptr},
+    {"logbufsecs", FLAG_INT32, 0, kInt32Max, [](long long v) { SetLogBufSecs(static_cast<int>(v)); }, nullptr},
+    {"logfile_mode", FLAG_INT32, 0, 07777, [](long long v) { SetLogfileMode(static_cast<int>(v)); }, nullptr},
+    {"logcleansecs", FLAG_INT32, 0, kInt32Max, [](long long v) { SetLogcleanSecs(static_cast<int>(v)); }, nullptr},
+    {"durability_mode", FLAG_INT32, DURABILITY_BUFFERED, DURABILITY_DIRECT,
+     [](long long v) { SetLogDurabilityMode(static_cast<LogDurabilityMode>(v)); }, nullptr},
+    {"group_commit_usecs", FLAG_INT32, 0, kInt32Max, [](long long v) { SetLogGroupCommitWindow(static_cast<int>(v)); }, nullptr},
+    {"clock_source", FLAG_INT32, CLOCK_SOURCE_GETTIMEOFDAY, CLOCK_SOURCE_TSC,
+     [](long long v) { SetLogClockSource(static_cast<LogClockSource>(v)); }, nullptr},
+    // 超过上限的分片数由 SetLogShards() 截断
+    {"log_shards", FLAG_INT32, 0, kInt32Max, [](long long v) { SetLogShards(static_cast<int>(v)); }, nullptr},
+    {"log_index_kb", FLAG_UINT32, 0, kUint32Max, [](long long v) { SetLogIndexBlockSize(static_cast<uint32>(v)); }, nullptr},
+    {"log_roll_policy", FLAG_INT32, 0, ROLL_BY_SIZE | ROLL_HOURLY | ROLL_DAILY,
+     [](long long v) { SetLogRollPolicy(static_cast<int>(v)); }, nullptr},
+    {"log_dedup_ms", FLAG_INT32, 0, kInt32Max, [](long long v) { SetLogDedupWindow(static_cast<int>(v)); }, nullptr},
+    {"max_log_size", FLAG_UINT32, 0, kUint32Max, [](long long v) { SetMaxLogSize(static_cast<uint32>(v)); }, nullptr},
+    // 小于 256 的长度由 SetMaxLogMessageLen() 截断
+    {"max_log_message_len", FLAG_UINT32, 0, kUint32Max,
+     [](long long v) { SetMaxLogMessageLen(static_cast<size_t>(v)); }, nullptr},
+    {"log_dir", FLAG_STRING, 0, 0, nullptr, [](const std::string& v) { SetLogDir(v); }},
+    {"log_link", FLAG_STRING, 0, 0, nullptr, [](const std::string& v) { SetLogLink(v); }},
+    {"log_routes", FLAG_ROUTES, 0, 0, nullptr, nullptr},  // 文本形式的路由表, 见 ParseLogRoutes()
+  };
+
+  // 解析出的一个值, 数字也允许写成字符串(例如 "0664")
+  struct JsonValue {
+    bool is_string{false};
+    bool is_bool{false};
+    bool boolean{false};
+    std::string text;
+  };
+
+  // 只支持一层对象的 JSON 解析器: { "key": value, ... }
+  // value 可以是字符串, 数字, true/false
+  class FlatJsonParser {
+   public:
+    explicit FlatJsonParser(const std::string& json) : json_(json) {}
+
+    template <class Callback>
+    bool Parse(Callback callback, std::string* error) {
+      SkipSpace();
+      if (!Consume('{')) return Fail("expected '{'", error);
+      SkipSpace();
+      if (Consume('}')) return true;
+      while (true) {
+        std::string key;
+        JsonValue value;
+        SkipSpace();
+        if (!ParseString(&key)) return Fail("expected string key", error);
+        SkipSpace();
+        if (!Consume(':')) return Fail("expected ':'", error);
+        SkipSpace();
+        if (!ParseValue(&value)) return Fail("invalid value", error);
+        callback(key, value);
+        SkipSpace();
+        if (Consume(',')) continue;
+        if (Consume('}')) break;
+        return Fail("expected ',' or '}'", error);
+      }
+      SkipSpace();
+      if (pos_ != json_.size()) return Fail("trailing characters", error);
+      return true;
+    }
+
+   private:
+    bool Fail(const char* what, std::string* error) {
+      if (error != nullptr) {
+        *error = std::string(what) + " at offset " + std::to_string(pos_);
+      }
+      return false;
+    }
+
+    void SkipSpace() {
+      while (pos_ < json_.size() && isspace(static_cast<unsigned char>(json_[pos_]))) ++pos_;
+    }
+
+    bool Consume(char c) {
+      if (pos_ < json_.size() && json_[pos_] == c) {
+        ++pos_;
+        return true;
+      }
+      return false;
+    }
+
+    bool ParseString(std::string* out) {
+      if (!Consume('"')) return false;
+      while (pos_ < json_.size()) {
+        char c = json_[pos_++];
+        if (c == '"') return true;
+        if (c != '\\') {
+          out->push_back(c);
+          continue;
+        }
+        if (pos_ >= json_.size()) return false;
+        c = json_[pos_++];
+        switch (c) {
+          case '"': case '\\': case '/': out->push_back(c); break;
+          case 'b': out->push_back('\b'); break;
+          case 'f': out->push_back('\f'); break;
+          case 'n': out->push_back('\n'); break;
+          case 'r': out->push_back('\r'); break;
+          case 't': out->push_back('\t'); break;
+          case 'u': {
+            // 只支持 ASCII 范围内的 \uXXXX
+            if (pos_ + 4 > json_.size()) return false;
+            const unsigned long code = strtoul(json_.substr(pos_, 4).c_str(), nullptr, 16);
+            if (code > 0x7f) return false;
+            out->push_back(static_cast<char>(code));
+            pos_ += 4;
+            break;
+          }
+          default: return false;
+        }
+      }
+      return false;
+    }
+
+    bool ParseValue(JsonValue* value) {
+      if (pos_ >= json_.size()) return false;
+      if (json_[pos_] == '"') {
+        value->is_string = true;
+        return ParseString(&value->text);
+      }
+      if (json_.compare(pos_, 4, "true") == 0) {
+        pos_ += 4;
+        value->is_bool = value->boolean = true;
+        return true;
+      }
+      if (json_.compare(pos_, 5, "false") == 0) {
+        pos_ += 5;
+        value->is_bool = true;
+        return true;
+      }
+      const size_t start = pos_;
+      while (pos_ < json_.size() && (isdigit(static_cast<unsigned char>(json_[pos_])) || json_[pos_] == '-' ||
+                                     json_[pos_] == '+' || json_[pos_] == 'x' || json_[pos_] == 'X')) {
+        ++pos_;
+      }
+      value->text = json_.substr(start, pos_ - start);
+      return !value->text.empty();
+    }
+
+    const std::string& json_;
+    size_t pos_{0};
+  };
+
+  bool ToInteger(const JsonValue& value, long long* out) {
+    if (value.is_bool) {
+      *out = value.boolean ? 1 : 0;
+      return true;
+    }
+    char* end = nullptr;
+    errno = 0;
+    // base 0: 允许 "0664" 这样的八进制文件权限
+    *out = strtoll(value.text.c_str(), &end, 0);
+    return errno == 0 && end != value.text.c_str() && *end == '\0';
+  }
+
+  // 检查并转换后的一个选项, 所有选项都检查通过后才开始修改
+  struct PendingFlag {
+    const FlagEntry* entry;
+    long long number;
+    std::string text;
+    std::vector<LogRoute> routes;
+  };
+
+  bool ValidateFlag(const FlagEntry& entry, const JsonValue& value, PendingFlag* pending, std::string* error) {
+    pending->entry = &entry;
+    switch (entry.type) {
+      case FLAG_BOOL:
+      case FLAG_INT32:
+      case FLAG_UINT32:
+        if (!ToInteger(value, &pending->number)) {
+          *error = "expected a number";
+          return false;
+        }
+        if (pending->number < entry.min_value || pending->number > entry.max_value) {
+          *error = "out of range [" + std::to_string(entry.min_value) + ", " + std::to_string(entry.max_value) + "]";
+          return false;
+        }
+        return true;
+      case FLAG_STRING:
+        if (!value.is_string) {
+          *error = "expected a string";
+          return false;
+        }
+        pending->text = value.text;
+        return true;
+      case FLAG_ROUTES:
+        if (!value.is_string) {
+          *error = "expected a string";
+          return false;
+        }
+        return ParseLogRoutes(value.text, &pending->routes, error);
+    }
+    return false;
+  }
+
+  // 串行化配置的应用(热更新线程和直接调用 LoadLogConfigFile)
+  std::mutex apply_mutex;
+
+} // end of namespace
+
+bool ParseLogFlagsFromJson(const std::string& json, std::string* error) {
+  // 先完整解析并检查所有选项再应用, 语法错误或者任何一个选项的值不合法时不修改任何选项
+  std::vector<std::pair<std::string, JsonValue>> values;
+  FlatJsonParser parser(json);
+  if (!parser.Parse([&values](const std::string& key, const JsonValue& value) {
+                      values.emplace_back(key, value);
+                    }, error)) {
+    return false;
+  }
+
+  std::vector<PendingFlag> pending;
+  for (const auto& kv : values) {
+    const FlagEntry* entry = nullptr;
+    for (const auto& e : kFlagTable) {
+      if (kv.first == e.name) {
+        entry = &e;
+        break;
+      }
+    }
+    if (entry == nullptr) {
+      fprintf(stderr, "lizy_log: unknown option '%s' in config, ignored\n", kv.first.c_str());
+      continue;
+    }
+    PendingFlag flag;
+    std::string reason;
+    if (!ValidateFlag(*entry, kv.second, &flag, &reason)) {
+      if (error != nullptr) {
+        *error = "invalid value for option '" + kv.first + "': " + reason;
+      }
+      return false;
+    }
+    pending.push_back(std::move(flag));
+  }
+
+  std::lock_guard<std::mutex> lk(apply_mutex);
+  // 路由表是唯一可能在应用时失败的选项(引用的 sink 名字过多), 最先应用
+  for (const PendingFlag& flag : pending) {
+    if (flag.entry->type == FLAG_ROUTES && !SetLogRoutes(flag.routes)) {
+      if (error != nullptr) {
+        *error = "invalid value for option 'log_routes': too many sink names";
+      }
+      return false;
+    }
+  }
+  for (const PendingFlag& flag : pending) {
+    if (flag.entry->set_number != nullptr) {
+      flag.entry->set_number(flag.number);
+    } else if (flag.entry->set_string != nullptr) {
+      flag.entry->set_string(flag.text);
+    }
+  }
+  return true;
+}
+
+} // end of namespace log_internal_namespace_
+
+/* ----------------------------- 配置文件加载与热更新 ---------------------------- */
+
+namespace {
+
+  bool ReadWholeFile(const std::string& path, std::string* content) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == nullptr) {
+      return false;
+    }
+    char buf[4096];
+    size_t n;
+    content->clear();
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+      content->append(buf, n);
+    }
+    fclose(file);
+    return true;
+  }
+
+  // 使用 inotify 监听配置文件所在的目录
+  // 编辑器通常先写临时文件再 rename, 所以同时关注 IN_CLOSE_WRITE 和 IN_MOVED_TO
+  class ConfigWatcher {
+   public:
+    ~ConfigWatcher() { Stop(); }
+
+    bool Start(const std::string& path) {
+      Stop();
+      const size_t slash = path.find_last_of('/');
+      const std::string dir = (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+      filename_ = (slash == std::string::npos) ? path : path.substr(slash + 1);
+      path_ = path;
+
+      inotify_fd_ = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+      if (inotify_fd_ < 0) {
+        return false;
+      }
+      if (inotify_add_watch(inotify_fd_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        close(inotify_fd_);
+        inotify_fd_ = -1;
+        return false;
+      }
+      stop_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      if (stop_fd_ < 0) {
+        close(inotify_fd_);
+        inotify_fd_ = -1;
+        return false;
+      }
+      thread_ = std::thread(&ConfigWatcher::Run, this);
+      return true;
+    }
+
+    void Stop() {
+      if (thread_.joinable()) {
+        uint64 one = 1;
+        if (write(stop_fd_, &one, sizeof(one)) < 0) {
+          // 忽略错误
+        }
+        thread_.join();
+      }
+      if (inotify_fd_ >= 0) close(inotify_fd_);
+      if (stop_fd_ >= 0) close(stop_fd_);
+      inotify_fd_ = stop_fd_ = -1;
+    }
+
+   private:
+    void Run() {
+      alignas(struct inotify_event) char buf[4096];
+      while (true) {
+        struct pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+          if (errno == EINTR) continue;
+          return;
+        }
+        if (fds[1].revents & POLLIN) {
+          return;
+        }
+
+        bool changed = false;
+        ssize_t len;
+        while ((len = read(inotify_fd_, buf, sizeof(buf))) > 0) {
+          for (char* p = buf; p < buf + len; ) {
+            const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+            if (event->len > 0 && filename_ == event->name) {
+              changed = true;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+          }
+        }
+        if (changed) {
+          LoadLogConfigFile(path_);
+        }
+      }
+    }
+
+    std::string path_;
+    std::string filename_;
+    int inotify_fd_{-1};
+    int stop_fd_{-1};
+    std::thread thread_;
+  };
+
+  std::mutex config_watcher_mutex;
+  ConfigWatcher* config_watcher = nullptr;
+}
+
+bool LoadLogConfigFile(const std::string& path) {
+  std::string content;
+  if (!ReadWholeFile(path, &content)) {
+    fprintf(stderr, "lizy_log: could not read config file '%s'\n", path.c_str());
+    return false;
+  }
+  std::string error;
+  if (!log_internal_namespace_::ParseLogFlagsFromJson(content, &error)) {
+    fprintf(stderr, "lizy_log: could not parse config file '%s': %s\n", path.c_str(), error.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool EnableLogConfigHotReload(const std::string& path) {
+  std::lock_guard<std::mutex> lk(config_watcher_mutex);
+  const bool loaded = LoadLogConfigFile(path);
+  if (config_watcher == nullptr) {
+    config_watcher = new ConfigWatcher;
+  }
+  return config_watcher->Start(path) && loaded;
+}
+
+void DisableLogConfigHotReload() {
+  std::lock_guard<std::mutex> lk(config_watcher_mutex);
+  delete config_watcher;
+  config_watcher = nullptr;
+}
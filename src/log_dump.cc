@@ -0,0 +1,206 @@
+#include "logging.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LIZY_LOG_X86 1
+#endif
+
+using base_logging::LogStreamBuf;
+
+namespace {
+  const char kHexDigits[] = "0123456789abcdef";
+
+  typedef void (*HexEncodeFunc)(const unsigned char* in, size_t n, char* out);
+
+  // 每个字节编码为两个十六进制字符, out 至少 2 * n 字节
+  void HexEncodeScalar(const unsigned char* in, size_t n, char* out) {
+    for (size_t i = 0; i < n; i++) {
+      out[2 * i] = kHexDigits[in[i] >> 4U];
+      out[2 * i + 1] = kHexDigits[in[i] & 0x0fU];
+    }
+  }
+
+#ifdef LIZY_LOG_X86
+  // 半字节(0-15)转换为 '0'-'9' 'a'-'f': '0' + x + (x > 9 ? 'a' - '0' - 10 : 0)
+  __attribute__((target("sse2")))
+  inline __m128i HexDigitsSse2(__m128i nibbles) {
+    const __m128i adjust = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+    return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), adjust);
+  }
+
+  __attribute__((target("sse2")))
+  void HexEncodeSse2(const unsigned char* in, size_t n, char* out) {
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+      const __m128i hi = HexDigitsSse2(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+      const __m128i lo = HexDigitsSse2(_mm_and_si128(v, mask));
+      // 高半字节在前: hi0 lo0 hi1 lo1 ...
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i), _mm_unpacklo_epi8(hi, lo));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    HexEncodeScalar(in + i, n - i, out + 2 * i);
+  }
+
+  __attribute__((target("avx2")))
+  inline __m256i HexDigitsAvx2(__m256i nibbles) {
+    const __m256i adjust =
+        _mm256_and_si256(_mm256_cmpgt_epi8(nibbles, _mm256_set1_epi8(9)), _mm256_set1_epi8('a' - '0' - 10));
+    return _mm256_add_epi8(_mm256_add_epi8(nibbles, _mm256_set1_epi8('0')), adjust);
+  }
+
+  __attribute__((target("avx2")))
+  void HexEncodeAvx2(const unsigned char* in, size_t n, char* out) {
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+      const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+      const __m256i hi = HexDigitsAvx2(_mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+      const __m256i lo = HexDigitsAvx2(_mm256_and_si256(v, mask));
+      // unpack 在每个 128 位通道内进行: a = 字节 0-7 | 16-23, b = 字节 8-15 | 24-31
+      const __m256i a = _mm256_unpacklo_epi8(hi, lo);
+      const __m256i b = _mm256_unpackhi_epi8(hi, lo);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 2 * i), _mm256_permute2x128_si256(a, b, 0x20));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 2 * i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    HexEncodeSse2(in + i, n - i, out + 2 * i);
+  }
+#endif
+
+  // 按 CPU 支持的指令集选择实现
+  HexEncodeFunc SelectHexEncode() {
+#ifdef LIZY_LOG_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return &HexEncodeAvx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+      return &HexEncodeSse2;
+    }
+#endif
+    return &HexEncodeScalar;
+  }
+
+  HexEncodeFunc GetHexEncode() {
+    static const HexEncodeFunc hex_encode = SelectHexEncode();
+    return hex_encode;
+  }
+
+  // 超过 max_bytes 的部分
+  std::string TruncatedMarker(size_t len, size_t max_bytes) {
+    return len > max_bytes ? "...(+" + std::to_string(len - max_bytes) + " bytes)" : std::string();
+  }
+
+  // 转义一个字节, 返回写入的字符数(out 至少 4 字节); 可打印字符返回 0
+  size_t EscapeByte(unsigned char c, char* out) {
+    switch (c) {
+      case '\n': out[0] = '\\'; out[1] = 'n'; return 2;
+      case '\r': out[0] = '\\'; out[1] = 'r'; return 2;
+      case '\t': out[0] = '\\'; out[1] = 't'; return 2;
+      case '\\': out[0] = '\\'; out[1] = '\\'; return 2;
+      default:
+        if (c >= 0x20 && c < 0x7f) {
+          return 0;
+        }
+        out[0] = '\\';
+        out[1] = 'x';
+        out[2] = kHexDigits[c >> 4U];
+        out[3] = kHexDigits[c & 0x0fU];
+        return 4;
+    }
+  }
+
+  // 把转义后的内容交给 write(const char*, size_t), 连续的可打印字符一次写入
+  template <typename Write>
+  void EscapeBytes(const unsigned char* data, size_t len, Write&& write) {
+    size_t run = 0;
+    char escaped[4];
+    for (size_t i = 0; i < len; i++) {
+      const size_t n = EscapeByte(data[i], escaped);
+      if (n == 0) {
+        continue;
+      }
+      if (i > run) {
+        write(reinterpret_cast<const char*>(data + run), i - run);
+      }
+      write(escaped, n);
+      run = i + 1;
+    }
+    if (len > run) {
+      write(reinterpret_cast<const char*>(data + run), len - run);
+    }
+  }
+}
+
+size_t LogStreamBuf::Writable(char** out) {
+  if (pptr() == epptr() && !Grow()) {
+    return 0;
+  }
+  *out = pptr();
+  return static_cast<size_t>(epptr() - pptr());
+}
+
+LogMessage::LogStream& operator<<(LogMessage::LogStream& s, const LogHexValue& value) {
+  const HexEncodeFunc hex_encode = GetHexEncode();
+  LogStreamBuf& buf = s.buf();
+  const unsigned char* data = value.data;
+  size_t remaining = std::min(value.len, value.max_bytes);
+  // 直接编码到当前分段, 写满后串联新的 chunk
+  while (remaining > 0) {
+    char* out;
+    const size_t room = buf.Writable(&out);
+    if (room == 0) {
+      // 达到单条日志的上限, 由 LogStreamBuf 写截断标记
+      buf.Discard(2 * remaining);
+      return s;
+    }
+    if (room < 2) {
+      char pair[2];
+      hex_encode(data, 1, pair);
+      buf.Append(pair, sizeof(pair));
+      data++;
+      remaining--;
+      continue;
+    }
+    const size_t n = std::min(room / 2, remaining);
+    hex_encode(data, n, out);
+    buf.Commit(2 * n);
+    data += n;
+    remaining -= n;
+  }
+  if (value.len > value.max_bytes) {
+    const std::string marker = TruncatedMarker(value.len, value.max_bytes);
+    buf.Append(marker.data(), marker.size());
+  }
+  return s;
+}
+
+std::ostream& operator<<(std::ostream& os, const LogHexValue& value) {
+  const HexEncodeFunc hex_encode = GetHexEncode();
+  char out[512];
+  const size_t len = std::min(value.len, value.max_bytes);
+  for (size_t i = 0; i < len; i += sizeof(out) / 2) {
+    const size_t n = std::min(sizeof(out) / 2, len - i);
+    hex_encode(value.data + i, n, out);
+    os.write(out, static_cast<std::streamsize>(2 * n));
+  }
+  return os << TruncatedMarker(value.len, value.max_bytes);
+}
+
+LogMessage::LogStream& operator<<(LogMessage::LogStream& s, const LogBytesValue& value) {
+  LogStreamBuf& buf = s.buf();
+  EscapeBytes(value.data, std::min(value.len, value.max_bytes),
+              [&buf](const char* data, size_t n) { buf.Append(data, n); });
+  if (value.len > value.max_bytes) {
+    const std::string marker = TruncatedMarker(value.len, value.max_bytes);
+    buf.Append(marker.data(), marker.size());
+  }
+  return s;
+}
+
+std::ostream& operator<<(std::ostream& os, const LogBytesValue& value) {
+  EscapeBytes(value.data, std::min(value.len, value.max_bytes),
+              [&os](const char* data, size_t n) { os.write(data, static_cast<std::streamsize>(n)); });
+  return os << TruncatedMarker(value.len, value.max_bytes);
+}
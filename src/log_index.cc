@@ -0,0 +1,281 @@
+#include "log_index.h"
+#include "logging.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+namespace {
+  // 扫描日志文件生成索引
+  void BuildIndex(const MappedLogFile& file, uint32 block_kb, std::vector<LogIndexEntry>* entries) {
+    const char* const begin = file.begin();
+    const char* const end = file.end();
+    // 文件头的第一行以 " UTC" 结尾表示日志使用标准时间
+    const char* first_nl = begin ? static_cast<const char*>(memchr(begin, '\n', file.size())) : nullptr;
+    const bool utc = first_nl != nullptr && first_nl - begin >= 4 && memcmp(first_nl - 4, " UTC", 4) == 0;
+    const uint64 block_bytes = static_cast<uint64>(std::max<uint32>(block_kb, 1)) << 10U;
+
+    bool open_block = false;
+    LogIndexEntry entry = {0, 0, 0, 0, 0, 0};
+    const char* p = begin;
+    while (p < end) {
+      const char* nl = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(end - p)));
+      const char* line_end = nl ? nl + 1 : end;
+      time_t timestamp;
+      if (IsLogRecordStart(p, end) && ParseLogTimestamp(p, utc, &timestamp)) {
+        const uint64 offset = static_cast<uint64>(p - begin);
+        // 与 LogFileObject 相同的分块规则
+        if (open_block && timestamp >= entry.timestamp + 1) {
+          entry.length = static_cast<uint32>(offset - entry.offset);
+          entry.checksum = LogIndexChecksum(entry);
+          entries->push_back(entry);
+          open_block = false;
+        }
+        if (!open_block) {
+          entry = {static_cast<int64>(timestamp), offset, 0, 0, 0, 0};
+          open_block = true;
+        }
+        // 没有等级的日志按 INFO 处理
+        const int severity = ParseLogRecordSeverity(p + kLogTimestampLen, line_end);
+        entry.severity_mask |= 1U << (severity >= 0 ? severity : LOG_INFO);
+      }
+      p = line_end;
+      if (open_block && static_cast<uint64>(p - begin) - entry.offset >= block_bytes) {
+        entry.length = static_cast<uint32>(static_cast<uint64>(p - begin) - entry.offset);
+        entry.checksum = LogIndexChecksum(entry);
+        entries->push_back(entry);
+        open_block = false;
+      }
+    }
+    if (open_block) {
+      entry.length = static_cast<uint32>(file.size() - entry.offset);
+      entry.checksum = LogIndexChecksum(entry);
+      entries->push_back(entry);
+    }
+  }
+}
+
+std::string LogIndexPath(const std::string& log_path) {
+  return log_path + ".idx";
+}
+
+uint32 LogIndexChecksum(const LogIndexEntry& entry) {
+  // FNV-1a
+  uint32 hash = 2166136261U;
+  const uint64 words[3] = {static_cast<uint64>(entry.timestamp), entry.offset,
+                           (static_cast<uint64>(entry.length) << 32U) | entry.severity_mask};
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(words);
+  for (size_t i = 0; i < sizeof(words); i++) {
+    hash = (hash ^ bytes[i]) * 16777619U;
+  }
+  return hash;
+}
+
+bool ReadLogIndex(const std::string& index_path, std::vector<LogIndexEntry>* entries) {
+  MappedLogFile file;
+  if (!file.Open(index_path)) {
+    return false;
+  }
+  const size_t count = file.size() / sizeof(LogIndexEntry);
+  entries->clear();
+  entries->reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    LogIndexEntry entry;
+    memcpy(&entry, file.data() + i * sizeof(LogIndexEntry), sizeof(entry));
+    // 校验失败, 或者块重叠时, 之后的部分都当作没有索引
+    if (entry.checksum != LogIndexChecksum(entry) ||
+        (!entries->empty() && entry.offset < entries->back().offset + entries->back().length)) {
+      break;
+    }
+    entries->push_back(entry);
+  }
+  return true;
+}
+
+bool RebuildLogIndex(const std::string& log_path, uint32 block_kb) {
+  MappedLogFile file;
+  if (!file.Open(log_path)) {
+    return false;
+  }
+  std::vector<LogIndexEntry> entries;
+  BuildIndex(file, block_kb, &entries);
+
+  // 先写临时文件再 rename, 写入过程中崩溃不会留下损坏的索引
+  const std::string index_path = LogIndexPath(log_path);
+  const std::string tmp_path = index_path + ".tmp";
+  FILE* out = fopen(tmp_path.c_str(), "w");
+  if (out == nullptr) {
+    return false;
+  }
+  const bool written = entries.empty() ||
+                       fwrite(entries.data(), sizeof(LogIndexEntry), entries.size(), out) == entries.size();
+  const bool closed = fclose(out) == 0;
+  if (!written || !closed) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return rename(tmp_path.c_str(), index_path.c_str()) == 0;
+}
+
+bool FindLogBlocks(const std::string& log_path, time_t from, time_t to, uint32 severity_mask,
+                   std::vector<LogIndexBlock>* blocks) {
+  struct stat file_stat;
+  if (stat(log_path.c_str(), &file_stat) != 0) {
+    return false;
+  }
+  const uint64 log_size = static_cast<uint64>(file_stat.st_size);
+
+  std::vector<LogIndexEntry> entries;
+  if (!ReadLogIndex(LogIndexPath(log_path), &entries) ||
+      (!entries.empty() && entries.back().offset + entries.back().length > log_size)) {
+    // 索引不存在或者不属于这个日志文件(例如日志被截断), 扫描日志文件
+    MappedLogFile file;
+    if (!file.Open(log_path)) {
+      return false;
+    }
+    entries.clear();
+    BuildIndex(file, 1024, &entries);
+  }
+
+  // 块之间的空隙(文件头, 或者进程崩溃时没有写索引的块)和最后一块之后的部分当作等级未知的块
+  std::vector<LogIndexEntry> filled;
+  filled.reserve(entries.size() + 1);
+  uint64 indexed_end = 0;
+  int64 last_timestamp = 0;
+  for (const auto& entry : entries) {
+    if (entry.offset > indexed_end) {
+      filled.push_back({last_timestamp, indexed_end, static_cast<uint32>(entry.offset - indexed_end),
+                        kAllSeverityMask, 0, 0});
+    }
+    filled.push_back(entry);
+    indexed_end = entry.offset + entry.length;
+    last_timestamp = entry.timestamp;
+  }
+  if (indexed_end < log_size) {
+    filled.push_back({last_timestamp, indexed_end, static_cast<uint32>(log_size - indexed_end),
+                      kAllSeverityMask, 0, 0});
+  }
+  entries.swap(filled);
+
+  // 第 i 块覆盖的时间是 [timestamp_i, timestamp_{i+1}], 找到第一个可能包含 from 的块:
+  // 第一个起始时间不早于 from 的块的前一块
+  auto first = std::lower_bound(entries.begin(), entries.end(), static_cast<int64>(from),
+                                [](const LogIndexEntry& e, int64 t) { return e.timestamp < t; });
+  if (first != entries.begin()) {
+    --first;
+  }
+
+  blocks->clear();
+  for (auto it = first; it != entries.end() && it->timestamp <= static_cast<int64>(to); ++it) {
+    const uint64 end = it->offset + it->length;
+    if ((it->severity_mask & severity_mask) == 0 || it->length == 0) {
+      continue;
+    }
+    if (!blocks->empty() && blocks->back().end == it->offset) {
+      // 合并相邻的块
+      blocks->back().end = end;
+      blocks->back().severity_mask |= it->severity_mask;
+    } else {
+      blocks->push_back({it->timestamp, it->offset, end, it->severity_mask});
+    }
+  }
+  return true;
+}
+
+bool ParseLogTimestamp(const char* text, bool utc, time_t* out) {
+  struct tm tm_time;
+  memset(&tm_time, 0, sizeof(tm_time));
+  int year, month, day, hour, min, sec;
+  if (sscanf(text, "%4d-%2d-%2d %2d:%2d:%2d", &year, &month, &day, &hour, &min, &sec) != 6) {
+    return false;
+  }
+  tm_time.tm_year = year - 1900;
+  tm_time.tm_mon = month - 1;
+  tm_time.tm_mday = day;
+  tm_time.tm_hour = hour;
+  tm_time.tm_min = min;
+  tm_time.tm_sec = sec;
+  tm_time.tm_isdst = -1;
+  *out = utc ? timegm(&tm_time) : mktime(&tm_time);
+  return *out != static_cast<time_t>(-1);
+}
+
+bool IsLogRecordStart(const char* p, const char* end) {
+  static const char kPattern[] = "dddd-dd-dd dd:dd:dd.dddddd";
+  if (static_cast<size_t>(end - p) < kLogTimestampLen) {
+    return false;
+  }
+  for (size_t i = 0; i < kLogTimestampLen; i++) {
+    if (kPattern[i] == 'd') {
+      if (p[i] < '0' || p[i] > '9') return false;
+    } else if (p[i] != kPattern[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int ParseLogRecordSeverity(const char* p, const char* end) {
+  // 第一个 ']' 是 [file:line] 的结尾(之前可能有分片文件的 #seq 序号), 之后紧跟 [INFO]
+  const char* close = static_cast<const char*>(memchr(p, ']', static_cast<size_t>(end - p)));
+  if (close == nullptr || close + 1 >= end || close[1] != '[') {
+    return -1;
+  }
+  const char* sev = close + 2;
+  for (int i = 0; i < NUM_SEVERITIES; i++) {
+    const char* name = GetLogSeverityName(i);
+    const size_t n = strlen(name);
+    if (static_cast<size_t>(end - sev) > n && memcmp(sev, name, n) == 0 && sev[n] == ']') {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int ParseLogSeverityName(const char* name) {
+  for (int i = 0; i < NUM_SEVERITIES; i++) {
+    if (strcasecmp(name, GetLogSeverityName(i)) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+MappedLogFile::~MappedLogFile() {
+  if (data_ != nullptr) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+}
+
+bool MappedLogFile::Open(const std::string& path, bool sequential) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat file_stat;
+  bool ok = fstat(fd, &file_stat) == 0;
+  if (ok) {
+    size_ = static_cast<size_t>(file_stat.st_size);
+    if (size_ > 0) {
+      void* addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      ok = addr != MAP_FAILED;
+      if (ok) {
+        data_ = static_cast<const char*>(addr);
+        if (sequential) {
+          madvise(addr, size_, MADV_SEQUENTIAL);
+        }
+      } else {
+        size_ = 0;
+      }
+    }
+  }
+  // 保留失败的原因
+  const int saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return ok;
+}
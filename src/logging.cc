@@ -1,12 +1,30 @@
 #include "logging.h"
 #include "flag.h"
+#include "metrics.h"
+#include "log_index.h"
+#include "async_logger.h"
+#include "shm_log_ring.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <new>
+#include <thread>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio_ext.h>
+#include <sys/time.h>
 
 using std::setw;
 
-const size_t LogMessage::kMaxLogMessageLen = 30000;
+const size_t LogMessage::kMaxLogMessageLen = 1U << 20U;
+const size_t LogMessage::kInlineMessageLen = 512;
 
 static uint32 MaxLogSize() {
-  return (FLAGS_max_log_size > 0 && FLAGS_max_log_size < 4096 ? FLAGS_max_log_size : 1);
+  const uint32 max_log_size = FLAGS_max_log_size;
+  return (max_log_size > 0 && max_log_size < 4096 ? max_log_size : 1);
 }
 
 static void GetTempDirectories(std::vector<std::string>* list) {
@@ -39,18 +57,19 @@ static void GetTempDirectories(std::vector<std::string>* list) {
 
 }
 
-static std::vector<string>* logging_directories_list;
+// 每次按当前的 log_dir 计算(只在创建日志文件和清理时调用), 运行时修改 log_dir(SetLogDir, 配置文件)对之后的文件生效
+// 返回的引用在当前线程下一次调用之前有效
 const std::vector<std::string>& GetLoggingDirectories() {
-  if (logging_directories_list == nullptr) {
-    logging_directories_list = new std::vector<std::string>;
-    if (!FLAGS_log_dir.empty()) {
-      logging_directories_list->push_back(FLAGS_log_dir);
-    } else {
-      GetTempDirectories(logging_directories_list);
-      logging_directories_list->push_back("./");
-    }
+  static thread_local std::vector<std::string> logging_directories_list;
+  logging_directories_list.clear();
+  const std::string log_dir = FLAGS_log_dir.get();
+  if (!log_dir.empty()) {
+    logging_directories_list.push_back(log_dir);
+  } else {
+    GetTempDirectories(&logging_directories_list);
+    logging_directories_list.push_back("./");
   }
-  return *logging_directories_list;
+  return logging_directories_list;
 }
 
 void GetExistingTempDirectories(std::vector<std::string>* list) {
@@ -73,19 +92,63 @@ void GetExistingTempDirectories(std::vector<std::string>* list) {
 // 请确保任何可能需要锁定它的人都这样做。
 static std::mutex log_mutex;
 
-// 每种优先级被发送的信息的数量(在持有 log_mutex 下更改)
+// 每种优先级被发送的信息的数量(在持有 log_mutex 下更改, 读取不需要锁)
 // 静态成员变量
-int64 LogMessage::num_messages_[NUM_SEVERITIES] = {0, 0, 0, 0};
+std::atomic<int64> LogMessage::num_messages_[NUM_SEVERITIES] = {{0}, {0}, {0}, {0}};
+
+// 禁止继续记录日志的标记 (当磁盘满时), 分片模式下多个线程同时读写
+static std::atomic<bool> stop_writing{false};
+
+// 分片模式下每条日志的全局序号, 写在前缀中, 合并多个分片文件时用于恢复全局顺序
+// 只在分片写入生效时递增, 单独占一个缓存行, 避免和其他全局变量伪共享
+alignas(64) static std::atomic<uint64> log_sequence{0};
 
-// 禁止继续记录日志的标记 (当磁盘满时)
-static bool stop_writing = false;
+// 当前线程的日志上下文(ScopedLogContext)
+static thread_local LogContextHandle current_log_context;
+
+// 最多的分片数
+static const int kMaxLogShards = 64;
+
+// 当前线程的分片: 线程第一次写日志时按轮转分配, 之后固定
+// 分片数不小于线程数时每个线程独占一个文件
+static int CurrentLogShard(int shards) {
+  static std::atomic<uint32> next_shard{0};
+  thread_local int thread_shard = -1;
+  if (thread_shard < 0) {
+    thread_shard = static_cast<int>(next_shard.fetch_add(1, std::memory_order_relaxed) % kMaxLogShards);
+  }
+  return thread_shard % shards;
+}
 
 const char* const LogSeverityNames[NUM_SEVERITIES] = {
   "INFO", "WARNING", "ERROR", "FATAL"
 };
 
-// Has the user called SetExitOnDFatal(true)?
-static bool exit_on_dfatal = true;
+// FATAL 日志是否结束进程(SetExitOnDFatal), LOG(FATAL) 和 CHECK 总是结束进程
+static std::atomic<bool> exit_on_dfatal{true};
+
+// FATAL 路径等待锁和异步 sink 的最长时间: 崩溃可能发生在持有锁的线程中, 不能无限等待
+static const int64 kFatalWaitNanos = 2000000000LL;
+
+// 当前线程是否在 LogMessage::Flush 中持有 log_mutex(sink 中的 FATAL 不能再等待这把锁)
+static thread_local bool tls_holds_log_mutex = false;
+// 当前线程是否正在处理 FATAL(处理过程中再次 FATAL 直接结束进程)
+static thread_local bool tls_in_fatal = false;
+// 当前线程是否在不持有 log_mutex 的分片模式下写日志(不能读取可能正在被替换的 batch_logger_)
+static thread_local bool tls_sharded_write = false;
+
+// 在截止时间之前反复尝试加锁, 超时返回 false
+template <class Lock>
+static bool TryLockUntil(Lock& lock, int64 deadline_nanos) {
+  while (!lock.try_lock()) {
+    if (log_internal_namespace_::StatNowNanos() >= deadline_nanos) {
+      return false;
+    }
+    struct timespec ts = {0, 1000000};
+    nanosleep(&ts, nullptr);
+  }
+  return true;
+}
 
 const char* GetLogSeverityName(LogSeverity severity) {
   return LogSeverityNames[severity];
@@ -97,8 +160,8 @@ struct LogMessage::LogMessageData {
   LogMessageData();
 
   int preserved_errno_;      // preserved errno
-  // 缓冲区空间
-  char message_text_[kMaxLogMessageLen+1];
+  // 内联缓冲区空间, 更长的消息由 LogStreamBuf 串联 chunk
+  alignas(64) char message_text_[kInlineMessageLen];
   LogStream stream_;
   char severity_;
   int line_;
@@ -107,7 +170,9 @@ struct LogMessage::LogMessageData {
     LogSink* sink_;
     std::vector<std::string>* outvec_;
     std::string* message_;
+    LogCapture* capture_;
   };
+  const LogContext* context_; // 当前线程的日志上下文, 日志发送前作用域不会结束
 
   size_t num_prefix_chars_;
   size_t num_chars_to_log_;
@@ -116,16 +181,292 @@ struct LogMessage::LogMessageData {
   const char* fullname_;  // 调用 LOG 的文件全称
   bool has_been_flushed_; // 是否已经刷盘
   bool first_fatal_;      // 是否是第一条 fatal msg
+  bool fatal_exit_;       // 发送后是否结束进程
+  const LogSite* site_;   // LOG() 的调用点, 其他方式创建时为空
+  uint64 route_;          // SendToLog() 选择的目的地位图
 
  private:
   LogMessageData(const LogMessageData&) = delete;
   LogMessageData& operator=(const LogMessageData&) = delete;
 };
 
+/* ------------------------------ LogStreamBuf ------------------------------------------------ */
+
+namespace {
+  // 线程局部 arena 是否已经析构(线程退出时), 析构后直接使用 malloc/free
+  thread_local bool tls_chunk_arena_destroyed = false;
+
+  // 线程局部的 chunk 缓存, 每个大小等级缓存一个 chunk, 避免大消息反复 malloc/free
+  class LogChunkArena {
+   public:
+    // 只缓存不超过 64KB 的 chunk, 更大的 chunk 用完直接释放
+    static const int kMaxCachedClass = 4;
+
+    static size_t ChunkSize(int cls) { return static_cast<size_t>(4096) << cls; }
+
+    ~LogChunkArena() {
+      for (auto& chunk : cache_) {
+        free(chunk);
+        chunk = nullptr;
+      }
+      tls_chunk_arena_destroyed = true;
+    }
+
+    char* Allocate(int cls) {
+      if (cls <= kMaxCachedClass && cache_[cls] != nullptr) {
+        char* chunk = cache_[cls];
+        cache_[cls] = nullptr;
+        return chunk;
+      }
+      return static_cast<char*>(malloc(ChunkSize(cls)));
+    }
+
+    void Release(int cls, char* chunk) {
+      if (cls <= kMaxCachedClass && cache_[cls] == nullptr) {
+        cache_[cls] = chunk;
+      } else {
+        free(chunk);
+      }
+    }
+
+   private:
+    char* cache_[kMaxCachedClass + 1] = {};
+  };
+
+  thread_local LogChunkArena tls_chunk_arena;
+
+  char* AllocateLogChunk(int cls) {
+    if (tls_chunk_arena_destroyed) {
+      return static_cast<char*>(malloc(LogChunkArena::ChunkSize(cls)));
+    }
+    return tls_chunk_arena.Allocate(cls);
+  }
+
+  void ReleaseLogChunk(int cls, char* chunk) {
+    if (tls_chunk_arena_destroyed) {
+      free(chunk);
+      return;
+    }
+    tls_chunk_arena.Release(cls, chunk);
+  }
+}
+
+namespace base_logging {
+
+LogStreamBuf::LogStreamBuf(char* buf, int len)
+  : inline_buf_(buf),
+    inline_len_(static_cast<size_t>(len) - 2),
+    limit_(LogMessage::kMaxLogMessageLen) {
+  segments_[0] = {inline_buf_, 0};
+  setp(inline_buf_, inline_buf_ + inline_len_); // 设置缓冲区的起始位置
+}
+
+LogStreamBuf::~LogStreamBuf() {
+  for (int i = 0; i < num_chunks_; i++) {
+    ReleaseLogChunk(i, chunks_[i]);
+  }
+}
+
+void LogStreamBuf::set_limit(size_t limit) {
+  // 必须在写入之前调用
+  assert(pcount() == 0);
+  limit_ = limit;
+  setp(inline_buf_, inline_buf_ + std::min(inline_len_, limit_));
+}
+
+void LogStreamBuf::Reset() {
+  for (int i = 0; i < num_chunks_; i++) {
+    ReleaseLogChunk(i, chunks_[i]);
+  }
+  num_chunks_ = 0;
+  finished_len_ = 0;
+  dropped_ = 0;
+  sealed_marker_ = false;
+  segments_[0] = {inline_buf_, 0};
+  setp(inline_buf_, inline_buf_ + std::min(inline_len_, limit_));
+}
+
+bool LogStreamBuf::Grow() {
+  // 一旦截断就不再串联, 保证截断标记之前的内容是连续的
+  if (dropped_ > 0 || sealed_marker_ || num_chunks_ >= kMaxChunks) {
+    return false;
+  }
+  const size_t used = pcount();
+  if (used >= limit_) {
+    return false;
+  }
+  const size_t capacity = std::min(LogChunkArena::ChunkSize(num_chunks_) - 2, limit_ - used);
+  char* chunk = AllocateLogChunk(num_chunks_);
+  if (chunk == nullptr) {
+    return false;
+  }
+
+  // 结束当前分段, 保留的位置写 '\0' 便于按 C 字符串读取首段
+  LogSegment& current = segments_[num_chunks_];
+  current.size = static_cast<size_t>(pptr() - pbase());
+  *pptr() = '\0';
+  finished_len_ += current.size;
+
+  chunks_[num_chunks_++] = chunk;
+  segments_[num_chunks_] = {chunk, 0};
+  setp(chunk, chunk + capacity);
+  return true;
+}
+
+LogStreamBuf::int_type LogStreamBuf::overflow(int_type ch) {
+  if (traits_type::eq_int_type(ch, traits_type::eof())) {
+    return traits_type::not_eof(ch);
+  }
+  if (pptr() == epptr() && !Grow()) {
+    ++dropped_;
+    return ch;
+  }
+  *pptr() = traits_type::to_char_type(ch);
+  pbump(1);
+  return ch;
+}
+
+std::streamsize LogStreamBuf::xsputn(const char* s, std::streamsize n) {
+  std::streamsize done = 0;
+  while (done < n) {
+    const std::streamsize avail = epptr() - pptr();
+    if (avail == 0) {
+      if (!Grow()) {
+        dropped_ += static_cast<size_t>(n - done);
+        break;
+      }
+      continue;
+    }
+    const std::streamsize len = std::min(avail, n - done);
+    memcpy(pptr(), s + done, static_cast<size_t>(len));
+    pbump(static_cast<int>(len));
+    done += len;
+  }
+  return n;
+}
+
+bool LogStreamBuf::Seal() {
+  if (dropped_ > 0 && !sealed_marker_) {
+    // 把截断标记作为最后一个分段
+    const int len = snprintf(marker_, sizeof(marker_) - 2, "...[truncated %zu bytes]", dropped_);
+    LogSegment& current = segments_[num_chunks_];
+    current.size = static_cast<size_t>(pptr() - pbase());
+    *pptr() = '\0';
+    finished_len_ += current.size;
+    segments_[num_chunks_ + 1] = {marker_, 0};
+    setp(marker_, marker_ + len);
+    pbump(len);
+    sealed_marker_ = true;
+  }
+
+  const bool append_newline = (pptr() == pbase() || pptr()[-1] != '\n');
+  if (append_newline) {
+    // 使用每个分段末尾保留的位置
+    char* base = pbase();
+    const int used = static_cast<int>(pptr() - base);
+    setp(base, epptr() + 1);
+    pbump(used);
+    *pptr() = '\n';
+    pbump(1);
+  }
+  *pptr() = '\0';
+  return append_newline;
+}
+
+void LogStreamBuf::Unseal(bool appended_newline) {
+  if (appended_newline) {
+    char* base = pbase();
+    const int used = static_cast<int>(pptr() - base) - 1;
+    setp(base, epptr() - 1);
+    pbump(used);
+  }
+}
+
+size_t LogStreamBuf::GetSegments(size_t offset, size_t length, LogSegment* out) const {
+  const int current = num_chunks_ + (sealed_marker_ ? 1 : 0);
+  size_t count = 0;
+  size_t pos = 0;
+  for (int i = 0; i <= current && length > 0; i++) {
+    const size_t size = (i == current) ? static_cast<size_t>(pptr() - pbase()) : segments_[i].size;
+    if (offset >= pos + size) {
+      pos += size;
+      continue;
+    }
+    const size_t skip = offset > pos ? offset - pos : 0;
+    const size_t take = std::min(size - skip, length);
+    out[count++] = {segments_[i].data + skip, take};
+    length -= take;
+    pos += size;
+  }
+  return count;
+}
+
+} // end of namespace base_logging
+
+// 获取消息的分段: 整条消息(含前缀和 '\n') 或 消息体(不含前缀和末尾 '\n')
+static size_t GetMessageSegments(const LogMessage::LogMessageData* data, bool body_only, LogSegment* out);
+
+// 分段的总长度
+static size_t SegmentsLength(const LogSegment* segments, size_t segment_count) {
+  size_t len = 0;
+  for (size_t i = 0; i < segment_count; i++) {
+    len += segments[i].size;
+  }
+  return len;
+}
+
+// 把分段拼接追加到 string
+static void AppendSegments(const LogSegment* segments, size_t segment_count, std::string* out) {
+  for (size_t i = 0; i < segment_count; i++) {
+    out->append(segments[i].data, segments[i].size);
+  }
+}
+
+/* ------------------------------ LogStreamBuf end ------------------------------------------------ */
+
 /* ------------------------------ LogFileObject ------------------------------------------------ */
 
 base::Logger::~Logger() = default;
 
+void base::Logger::WriteSegments(bool force_flush, time_t timestamp, const LogSegment* segments, size_t segment_count) {
+  if (segment_count == 0) {
+    Write(force_flush, timestamp, "", 0);
+    return;
+  }
+  if (segment_count == 1) {
+    Write(force_flush, timestamp, segments[0].data, segments[0].size);
+    return;
+  }
+  std::string message;
+  AppendSegments(segments, segment_count, &message);
+  Write(force_flush, timestamp, message.data(), message.size());
+}
+
+base::BatchLogger::~BatchLogger() = default;
+
+bool base::BatchLogger::FlushFor(int64 /*deadline_nanos*/) {
+  Flush();
+  return true;
+}
+
+base::LoggerAdapter::~LoggerAdapter() {
+  delete logger_;
+}
+
+void base::LoggerAdapter::WriteBatch(const LogRecordView* records, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    logger_->WriteSegments(records[i].force_flush, records[i].timestamp, records[i].segments, records[i].segment_count);
+  }
+}
+
+void base::LoggerAdapter::Flush() {
+  logger_->Flush();
+}
+
+uint64 base::LoggerAdapter::LogSize64() {
+  return logger_->LogSize();
+}
+
 // 获取网络主机名
 static void GetHostName(string* hostname) {
   struct utsname buf;
@@ -148,33 +489,497 @@ namespace {
   } 
 
 
+  // 组提交的同步目标, 持有 dup() 出来的描述符, 使文件关闭(滚动)后仍能完成最后一次同步
+  struct GroupCommitTarget {
+    explicit GroupCommitTarget(int file_fd) : fd(dup(file_fd)) {}
+    ~GroupCommitTarget() {
+      if (fd >= 0) close(fd);
+    }
+    int fd;
+    std::atomic<bool> dirty{false};
+    std::atomic<uint64> written{0};  // 已经写到内核的记录数, 由写线程(持有文件的锁)增加
+    std::atomic<uint64> synced{0};   // 已经同步到磁盘的记录数
+    bool registered{false};          // 是否由同步线程负责同步, 受 GroupCommitSyncer::mutex_ 保护
+  };
+
+  // 组提交线程是否已经退出(静态对象析构之后仍然可能有日志写入), 退出后写线程自己同步
+  std::atomic<bool> group_commit_exited{false};
+
+  // 后台组提交线程: 一个时间窗口(FLAGS_group_commit_usecs)内到达的所有记录共用一次 fdatasync
+  // 写线程把记录写到内核后, 释放文件的锁(和 log_mutex)再等待同步线程同步到它的记录, 返回时记录已经落盘
+  // 等待期间其他线程可以继续写入, 这些记录由同一次(或下一次) fdatasync 一起同步
+  class GroupCommitSyncer {
+   public:
+    ~GroupCommitSyncer() {
+      {
+        std::lock_guard<std::mutex> lk(mutex_);
+        stop_ = true;
+      }
+      worker_->cv.notify_one();
+      synced_cv_->notify_all();
+      if (worker_->thread.joinable()) worker_->thread.join();
+      group_commit_exited = true;
+    }
+
+    void Register(const std::shared_ptr<GroupCommitTarget>& target) {
+      std::lock_guard<std::mutex> lk(mutex_);
+      target->registered = true;
+      targets_.push_back(target);
+      if (!worker_->thread.joinable()) {
+        worker_->thread = std::thread(&GroupCommitSyncer::Run, this);
+      }
+    }
+
+    // fork 时持有 mutex_, 子进程中没有同步线程, 丢弃父进程的目标, 下次 Register 时重新创建线程
+    void AtForkPrepare() { mutex_.lock(); }
+    void AtForkParent() { mutex_.unlock(); }
+    void AtForkChild() {
+      log_internal_namespace_::RenewAfterFork(&worker_);
+      log_internal_namespace_::RenewAfterFork(&synced_cv_);
+      for (auto& target : targets_) {
+        target->registered = false;
+      }
+      targets_.clear();
+      pending_ = false;
+      mutex_.unlock();
+    }
+
+    // 等待 target 的前 seq 条记录同步到磁盘; 同步线程不负责这个目标(fork 后, 退出时)时直接同步
+    // 要求: 不持有文件的锁
+    void WaitSynced(GroupCommitTarget* target, uint64 seq) {
+      std::unique_lock<std::mutex> lk(mutex_);
+      synced_cv_->wait(lk, [this, target, seq] {
+        return target->synced.load(std::memory_order_acquire) >= seq || stop_ || !target->registered;
+      });
+      if (target->synced.load(std::memory_order_acquire) < seq) {
+        lk.unlock();
+        fdatasync(target->fd);
+      }
+    }
+
+    // 调用前数据必须已经写到内核
+    void MarkDirty(GroupCommitTarget* target) {
+      if (target->dirty.exchange(true, std::memory_order_acq_rel)) {
+        return; // 已经在等待下一次同步
+      }
+      if (!pending_.exchange(true, std::memory_order_acq_rel)) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        worker_->cv.notify_one();
+      }
+    }
+
+   private:
+    void Run() {
+      std::unique_lock<std::mutex> lk(mutex_);
+      while (true) {
+        worker_->cv.wait(lk, [this] { return stop_ || pending_.load(std::memory_order_acquire); });
+        if (!stop_) {
+          // 等待一个窗口, 收集这段时间内到达的记录
+          lk.unlock();
+          std::this_thread::sleep_for(std::chrono::microseconds(std::max<int32>(FLAGS_group_commit_usecs, 0)));
+          lk.lock();
+        }
+        pending_.store(false, std::memory_order_release);
+        std::vector<std::shared_ptr<GroupCommitTarget>> targets = targets_;
+        lk.unlock();
+
+        for (auto& target : targets) {
+          if (target->dirty.exchange(false, std::memory_order_acq_rel)) {
+            // 先读取记录数再同步: 计数之前的记录已经写到内核
+            const uint64 written = target->written.load(std::memory_order_acquire);
+            fdatasync(target->fd);
+            target->synced.store(written, std::memory_order_release);
+          }
+        }
+        targets.clear();
+
+        lk.lock();
+        synced_cv_->notify_all();
+        // 文件已经关闭且同步完成的目标可以移除了
+        targets_.erase(std::remove_if(targets_.begin(), targets_.end(),
+                                      [](const std::shared_ptr<GroupCommitTarget>& t) {
+                                        return t.use_count() == 1 && !t->dirty.load(std::memory_order_acquire);
+                                      }),
+                       targets_.end());
+        if (stop_) break;
+      }
+    }
+
+    std::mutex mutex_;
+    std::unique_ptr<log_internal_namespace_::WorkerThread> worker_{new log_internal_namespace_::WorkerThread()};
+    // 每次同步之后通知等待的写线程
+    std::unique_ptr<std::condition_variable> synced_cv_{new std::condition_variable()};
+    std::atomic<bool> pending_{false};
+    bool stop_{false};
+    std::vector<std::shared_ptr<GroupCommitTarget>> targets_;
+  };
+
+  GroupCommitSyncer& group_commit_syncer() {
+    static GroupCommitSyncer syncer;
+    return syncer;
+  }
+
+  // 当前线程写入后需要等待同步的目标和记录序号; 一条日志最多写到 NUM_SEVERITIES 个文件
+  struct GroupCommitWaits {
+    std::shared_ptr<GroupCommitTarget> targets[NUM_SEVERITIES];
+    uint64 seqs[NUM_SEVERITIES];
+    size_t count{0};
+  };
+  thread_local GroupCommitWaits tls_group_commit_waits;
+  // LogMessage::Flush() 中写文件时为 true: 释放 log_mutex 之后再等待同步, 否则在写入函数返回前等待
+  thread_local bool tls_defer_group_commit = false;
+
+  // 记录需要等待的同步, 要求: 持有文件的锁
+  void AddGroupCommitWait(const std::shared_ptr<GroupCommitTarget>& target, uint64 seq) {
+    GroupCommitWaits& waits = tls_group_commit_waits;
+    for (size_t i = 0; i < waits.count; i++) {
+      if (waits.targets[i] == target) {
+        waits.seqs[i] = seq;
+        return;
+      }
+    }
+    if (waits.count == NUM_SEVERITIES) {
+      // 不会发生(每条日志最多写到 NUM_SEVERITIES 个文件), 直接同步
+      fdatasync(target->fd);
+      return;
+    }
+    waits.targets[waits.count] = target;
+    waits.seqs[waits.count] = seq;
+    waits.count++;
+  }
+
+  // 等待当前线程写入的记录同步到磁盘, 要求: 不持有文件的锁和 log_mutex
+  void WaitForGroupCommit() {
+    GroupCommitWaits& waits = tls_group_commit_waits;
+    for (size_t i = 0; i < waits.count; i++) {
+      if (group_commit_exited) {
+        fdatasync(waits.targets[i]->fd);
+      } else {
+        group_commit_syncer().WaitSynced(waits.targets[i].get(), waits.seqs[i]);
+      }
+      waits.targets[i].reset();
+    }
+    waits.count = 0;
+  }
+
+  // 后台回写每一轮的间隔, 限速按这个间隔分配字节数
+  const int kWriteBehindIntervalMs = 100;
+
+  // 后台回写的目标, 与 GroupCommitTarget 一样持有 dup() 出来的描述符, 文件关闭后仍能回写并释放剩余部分
+  struct WriteBehindTarget {
+    WriteBehindTarget(int file_fd, uint64 file_base)
+      : fd(dup(file_fd)), base(file_base), written(file_base), started(file_base), dropped(file_base) {}
+    ~WriteBehindTarget() {
+      if (fd >= 0) close(fd);
+    }
+    int fd;
+    const uint64 base;              // 打开文件时已有的长度, 之前的内容不属于这个进程
+    std::atomic<uint64> written;    // 已经写到内核的文件末尾, 由写线程更新
+    std::atomic<bool> closed{false}; // 文件已经关闭: 末尾不满一块的部分也回写并释放
+    uint64 started;                 // [dropped, started) 已经发起回写, 只由后台线程访问
+    uint64 dropped;                 // 之前的页缓存已经释放, 只由后台线程访问
+  };
+
+  // 后台回写线程是否已经退出(静态对象析构之后仍然可能有日志写入), 退出后不再登记和通知, 剩余的部分交给内核
+  std::atomic<bool> write_behind_exited{false};
+
+  // 后台回写线程(write-behind): 写线程只更新 written, 写满一块(FLAGS_log_writeback_kb)时唤醒后台线程
+  // 后台线程对写满的块发起异步回写(SYNC_FILE_RANGE_WRITE), 下一轮等待回写完成后再 POSIX_FADV_DONTNEED
+  // 脏页写满一块就开始回写, 不会积累到内核的脏页阈值后集中回写, 日志文件占用的页缓存保持在两三块以内
+  // 每轮发起回写的字节数受 FLAGS_log_writeback_mb_per_sec 限制, 超出的部分留到下一轮
+  class WriteBehindManager {
+   public:
+    ~WriteBehindManager() {
+      {
+        std::lock_guard<std::mutex> lk(mutex_);
+        stop_ = true;
+      }
+      worker_->cv.notify_one();
+      if (worker_->thread.joinable()) worker_->thread.join();
+      write_behind_exited = true;
+    }
+
+    void Register(const std::shared_ptr<WriteBehindTarget>& target) {
+      std::lock_guard<std::mutex> lk(mutex_);
+      targets_.push_back(target);
+      if (!worker_->thread.joinable()) {
+        worker_->thread = std::thread(&WriteBehindManager::Run, this);
+      }
+    }
+
+    // fork 时持有 mutex_, 子进程中没有回写线程, 丢弃父进程的目标, 下次 Register 时重新创建线程
+    void AtForkPrepare() { mutex_.lock(); }
+    void AtForkParent() { mutex_.unlock(); }
+    void AtForkChild() {
+      log_internal_namespace_::RenewAfterFork(&worker_);
+      targets_.clear();
+      pending_ = false;
+      mutex_.unlock();
+    }
+
+    // 调用前 end 之前的数据必须已经写到内核, closed 表示文件已经关闭
+    void MarkWritten(WriteBehindTarget* target, uint64 end, bool closed) {
+      const uint64 chunk = ChunkBytes();
+      const uint64 previous = target->written.exchange(end, std::memory_order_acq_rel);
+      if (closed) {
+        target->closed.store(true, std::memory_order_release);
+      } else if (end / chunk == previous / chunk) {
+        return; // 没有写满新的一块
+      }
+      if (!pending_.exchange(true, std::memory_order_acq_rel)) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        worker_->cv.notify_one();
+      }
+    }
+
+   private:
+    static uint64 ChunkBytes() {
+      // 至少一页, 按页对齐
+      return std::max<uint64>(FLAGS_log_writeback_kb / 4, 1) << 12U;
+    }
+
+    void Run() {
+      std::unique_lock<std::mutex> lk(mutex_);
+      while (true) {
+        worker_->cv.wait(lk, [this] { return stop_ || pending_.load(std::memory_order_acquire); });
+        if (stop_) break; // 退出时剩余的部分交给内核
+        pending_.store(false, std::memory_order_release);
+        std::vector<std::shared_ptr<WriteBehindTarget>> targets = targets_;
+        lk.unlock();
+
+        const bool more = RunRound(targets);
+        targets.clear();
+
+        lk.lock();
+        // 文件已经关闭且全部释放的目标可以移除了
+        targets_.erase(std::remove_if(targets_.begin(), targets_.end(),
+                                      [](const std::shared_ptr<WriteBehindTarget>& t) {
+                                        return t.use_count() == 1 && t->closed.load(std::memory_order_acquire) &&
+                                               t->dropped == t->written.load(std::memory_order_acquire);
+                                      }),
+                       targets_.end());
+        if (more) {
+          // 还有等待释放或者被限速的块: 间隔一轮后继续
+          worker_->cv.wait_for(lk, std::chrono::milliseconds(kWriteBehindIntervalMs), [this] { return stop_; });
+          pending_.store(true, std::memory_order_release);
+        }
+      }
+    }
+
+    // 处理一轮, 返回是否还有剩余的工作
+    bool RunRound(const std::vector<std::shared_ptr<WriteBehindTarget>>& targets) {
+      const uint64 chunk = ChunkBytes();
+      const uint32 rate = FLAGS_log_writeback_mb_per_sec;
+      uint64 budget = rate > 0 ? std::max<uint64>((static_cast<uint64>(rate) << 20U) * kWriteBehindIntervalMs / 1000, chunk)
+                               : UINT64_MAX;
+      bool more = false;
+      for (const auto& t : targets) {
+        if (t->fd < 0) {
+          continue;
+        }
+        // 上一轮发起回写的块: 等待回写完成(通常已经完成)后释放页缓存, 还是脏页时 DONTNEED 会被忽略
+        if (t->started > t->dropped) {
+          const off_t offset = static_cast<off_t>(t->dropped);
+          const off_t len = static_cast<off_t>(t->started - t->dropped);
+          sync_file_range(t->fd, offset, len,
+                          SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+          posix_fadvise(t->fd, offset, len, POSIX_FADV_DONTNEED);
+          t->dropped = t->started;
+        }
+        // 写满的块(文件关闭后包括末尾)发起异步回写
+        const bool closed = t->closed.load(std::memory_order_acquire);
+        const uint64 written = t->written.load(std::memory_order_acquire);
+        const uint64 end = closed ? written : written / chunk * chunk;
+        if (end > t->started) {
+          const uint64 len = std::min(end - t->started, budget);
+          if (len > 0) {
+            sync_file_range(t->fd, static_cast<off_t>(t->started), static_cast<off_t>(len), SYNC_FILE_RANGE_WRITE);
+            t->started += len;
+            budget -= len;
+          }
+          more = true;
+        }
+      }
+      return more;
+    }
+
+    std::mutex mutex_;
+    std::unique_ptr<log_internal_namespace_::WorkerThread> worker_{new log_internal_namespace_::WorkerThread()};
+    std::atomic<bool> pending_{false};
+    bool stop_{false};
+    std::vector<std::shared_ptr<WriteBehindTarget>> targets_;
+  };
+
+  WriteBehindManager& write_behind_manager() {
+    static WriteBehindManager manager;
+    return manager;
+  }
+
+  // 后台任务线程是否已经退出(静态对象析构之后仍然可能有日志写入)
+  std::atomic<bool> log_file_worker_exited{false};
+
+  // 日志文件的后台任务线程: 预创建下一个日志文件, 更新软链接
+  // 单线程按提交顺序执行, 同一个软链接的多次更新保持先后顺序
+  class LogFileWorker {
+   public:
+    ~LogFileWorker() {
+      {
+        std::lock_guard<std::mutex> lk(mutex_);
+        stop_ = true;
+      }
+      worker_->cv.notify_one();
+      if (worker_->thread.joinable()) worker_->thread.join();
+      log_file_worker_exited = true;
+    }
+
+    void Post(std::function<void()> task) {
+      {
+        std::lock_guard<std::mutex> lk(mutex_);
+        tasks_.push_back(std::move(task));
+        if (!worker_->thread.joinable()) {
+          worker_->thread = std::thread(&LogFileWorker::Run, this);
+        }
+      }
+      worker_->cv.notify_one();
+    }
+
+    // fork 时持有 mutex_, 子进程中没有后台线程, 丢弃父进程的任务, 下次 Post 时重新创建线程
+    void AtForkPrepare() { mutex_.lock(); }
+    void AtForkParent() { mutex_.unlock(); }
+    void AtForkChild() {
+      log_internal_namespace_::RenewAfterFork(&worker_);
+      tasks_.clear();
+      mutex_.unlock();
+    }
+
+   private:
+    void Run() {
+      std::unique_lock<std::mutex> lk(mutex_);
+      while (true) {
+        worker_->cv.wait(lk, [this] { return stop_ || !tasks_.empty(); });
+        // 退出前执行完剩余的任务(软链接仍然要指向最新的文件)
+        if (tasks_.empty()) break;
+        std::function<void()> task = std::move(tasks_.front());
+        tasks_.pop_front();
+        lk.unlock();
+        task();
+        lk.lock();
+      }
+    }
+
+    std::mutex mutex_;
+    std::unique_ptr<log_internal_namespace_::WorkerThread> worker_{new log_internal_namespace_::WorkerThread()};
+    bool stop_{false};
+    std::deque<std::function<void()>> tasks_;
+  };
+
+  LogFileWorker& log_file_worker() {
+    static LogFileWorker worker;
+    return worker;
+  }
+
+  // 提交后台任务, 后台线程退出后在当前线程执行
+  void PostLogFileTask(std::function<void()> task) {
+    if (log_file_worker_exited) {
+      task();
+      return;
+    }
+    log_file_worker().Post(std::move(task));
+  }
+
+  // 后台预创建的下一个日志文件: 目录中的匿名文件(O_TMPFILE), 滚动时 linkat 到最终的文件名
+  // 匿名文件没有名字, 进程退出或崩溃时不会留下临时文件
+  struct PreparedLogFile {
+    ~PreparedLogFile() {
+      if (fd >= 0) close(fd);
+    }
+
+    // 取出在 want_dir 目录中按持久化模式 want_mode 打开的文件, 没有时返回 -1
+    int Take(const std::string& want_dir, int want_mode) {
+      std::lock_guard<std::mutex> lk(mutex);
+      if (fd < 0 || dir != want_dir || mode != want_mode) {
+        return -1;
+      }
+      const int result = fd;
+      fd = -1;
+      return result;
+    }
+
+    std::mutex mutex;
+    bool pending{false};     // 后台任务还没有完成
+    bool unsupported{false}; // 文件系统不支持 O_TMPFILE, 不再尝试
+    int fd{-1};
+    std::string dir;
+    int mode{DURABILITY_BUFFERED};
+  };
+
+  // 文件打开失败期间暂存日志的上限, 超出的部分丢弃
+  const size_t kMaxRetryBufferBytes = 1 << 20;
+
+  // O_DIRECT 写入要求缓冲区, 偏移和长度都按块对齐
+  const size_t kDirectBlockSize = 4096;
+  const size_t kDirectBufferSize = 64 * 1024;
+  // DURABILITY_PREALLOCATE 每次预分配的大小
+  const uint64 kPreallocChunkBytes = 4 << 20;
+
   // 封装所有文件系统的相关状态
   // 默认的文件方式的日志落地
-  class LogFileObject : public base::Logger {
+  class LogFileObject : public base::Logger, public base::BatchLogger {
    public:
-    LogFileObject(LogSeverity severity, const char* base_filename);
+    // shard >= 0 表示分片文件, 分片号写在文件名中
+    LogFileObject(LogSeverity severity, const char* base_filename, int shard = -1);
     ~LogFileObject() override;
 
     // force_flush 表示是否在这里 Flush
     void Write(bool force_flush, time_t timestamp, const char* message, size_t message_len) override;
+    // 分段写入, 每个分段直接写到文件, 不再拼接
+    void WriteSegments(bool force_flush, time_t timestamp, const LogSegment* segments, size_t segment_count) override;
+    // 写入一条等级为 record_severity 的日志(用于稀疏索引中的等级位图)
+    void WriteRecord(LogSeverity record_severity, bool force_flush, time_t timestamp,
+                     const LogSegment* segments, size_t segment_count);
+    // 批量写入, 整批只加一次锁, 只在最后判断一次是否刷新
+    void WriteBatch(const base::LogRecordView* records, size_t count) override;
 
     // 配置选项
     void SetBasename(const char* basename);
     void SetExtension(const char* ext);
     void SetSymlinkBasename(const char* symlink_basename);
+    // 分片文件使用与主文件相同的文件名, 扩展名和软链接配置
+    void CopySettingsFrom(LogFileObject& other);
 
     // 正常刷盘接口
     void Flush() override;
 
     // 返回系统日志记录器(如 INFO, ERROR Logger )实际的日志文件大小
     uint32 LogSize() override {
+      std::lock_guard<std::mutex> lk(lock_);
+      return static_cast<uint32>(std::min<uint64>(file_length_, UINT32_MAX));
+    }
+    uint64 LogSize64() override {
       std::lock_guard<std::mutex> lk(lock_);
       return file_length_;
     }
 
+    LogSeverity severity() const { return severity_; }
+
+    // fork 前加锁并刷盘, 子进程不会重复写出父进程缓冲区中的数据
+    void AtForkPrepare();
+    void AtForkParent();
+    // 子进程放弃父进程的文件(不写出任何内容), 下一条日志创建带有子进程 pid 的新文件
+    void AtForkChild();
+
     // 内部的刷盘接口, 暴露此接口是为了 FlushLogFilesUnsafe() 可以在不获取锁的情况下调用这个接口
     // 通常 Flush() 在获取锁后才调用这个接口
     void FlushUnlocked();
+    // 同上, FlushLogFilesUnsafe() 不获取锁写出重复日志汇总
+    void WriteRecordUnlocked(LogSeverity record_severity, time_t timestamp, const LogSegment* segments,
+                             size_t segment_count) {
+      WriteRecordLocked(record_severity, false, timestamp, segments, segment_count);
+    }
+
+    // FATAL 时调用: 写出缓冲区并 fsync, 等待 lock_ 不超过 deadline_nanos
+    // 超时说明持有锁的线程可能已经卡住, 此时不碰它的缓冲区
+    void FatalSync(int64 deadline_nanos);
 
    private:
     static const uint32 kRolloverAttemptFrequency = 0x20; // 日志滚动频率(大小)
@@ -184,18 +989,66 @@ namespace {
     std::string base_filename_;
     std::string symlink_basename_;
     std::string filename_extension_;
-    FILE* file_{nullptr};            // 目标文件
+    FILE* file_{nullptr};            // 目标文件(DURABILITY_DIRECT 模式下不使用 stdio)
+    int fd_{-1};                     // 目标文件描述符, -1 表示文件没有打开
+    int durability_mode_{DURABILITY_BUFFERED}; // 当前文件创建时的持久化模式
+    char* direct_buf_{nullptr};      // O_DIRECT 模式的对齐缓冲区
+    size_t direct_fill_{0};          // 对齐缓冲区中的字节数
+    uint64 direct_offset_{0};        // 对齐缓冲区对应的文件偏移
+    std::shared_ptr<GroupCommitTarget> sync_target_; // 组提交的同步目标
+    int index_fd_{-1};               // 稀疏索引文件(<日志文件名>.idx), -1 表示没有索引
+    uint64 index_base_{0};           // 打开日志文件时已有的长度, 索引中的偏移 = index_base_ + file_length_
+    uint64 index_block_bytes_{0};    // 索引块的最大字节数
+    bool index_block_open_{false};   // 是否有还没有写到索引的块
+    LogIndexEntry index_entry_;      // 当前块
     LogSeverity severity_;
+    int shard_;                     // 分片号, -1 表示不是分片文件
     uint32 bytes_since_flush_{0};   // 上一次刷盘到现在的字节数
-    uint32 dropped_mem_length_{0};  // 丢弃文件流中的字节数
-    uint32 file_length_{0};         // 文件字节数
+    std::shared_ptr<WriteBehindTarget> write_behind_; // 后台回写并释放页缓存(drop_log_memory)
+    uint64 file_length_{0};         // 文件字节数
+    uint64 prealloc_base_{0};       // 打开文件时已有的长度
+    uint64 prealloc_end_{0};        // 已经预分配到的文件偏移
     unsigned int rollover_attempt_; // 日志滚动次数(即另外新建一个新的日志文件)
     int64 next_flush_time_{0};      // 经过多少个周期后进行日志刷盘操作
+    time_t next_roll_time_{0};      // 按时间滚动的下一个边界, 0 表示不按时间滚动
+    std::shared_ptr<PreparedLogFile> prepared_; // 后台预创建的下一个日志文件
+    std::string retry_buffer_;      // 日志文件打开失败期间暂存的日志
+    uint32 retry_severity_mask_{0}; // 暂存日志的等级位图
+    time_t retry_timestamp_{0};     // 暂存的第一条日志的时间
     WallTime start_time_;
 
     // 根据文件名和可选参数time_pid_string创建日志文件
     // 要求: 必须持有锁
     bool CreateLogfile(const std::string& time_pid_string);
+    // 在后台为 dir 目录预创建下一个日志文件, 要求: 必须持有锁
+    void PrepareNextLogfile(const std::string& dir, int mode);
+    // 在后台更新指向 filename 的软链接, 要求: 必须持有锁
+    void UpdateSymlinks(const std::string& filename);
+    // 当前文件是否需要滚动, 要求: 必须持有锁
+    bool ShouldRoll(time_t timestamp) const;
+    // 丢弃而不关闭当前文件(fork 后的子进程), 要求: 必须持有锁
+    void AbandonLogfile();
+    // 文件没有打开时把日志暂存到重试缓冲区, 要求: 必须持有锁
+    void BufferRecord(LogSeverity record_severity, time_t timestamp, const LogSegment* segments, size_t segment_count);
+    // 新文件打开后先写入暂存的日志, 要求: 必须持有锁
+    void FlushRetryBuffer();
+    // 关闭当前日志文件, 要求: 必须持有锁
+    void CloseLogfile();
+    // DURABILITY_PREALLOCATE: 写入位置接近预分配的末尾时再预分配 kPreallocChunkBytes, 要求: 必须持有锁
+    void GrowPreallocation();
+    // 释放文件末尾之后预分配但没有使用的空间, 要求: 必须持有锁
+    void ReleasePreallocation();
+    // 按当前的持久化模式写入文件, 要求: 必须持有锁
+    void WriteToFile(const char* data, size_t len);
+    // 写入一条日志, 要求: 必须持有锁
+    void WriteRecordLocked(LogSeverity record_severity, bool force_flush, time_t timestamp,
+                           const LogSegment* segments, size_t segment_count);
+    // 把 O_DIRECT 缓冲区写到文件(尾部不足一块的部分补零后写入, 再截断到实际长度)
+    void FlushDirectBuffer();
+    // 把当前块追加到索引文件, 要求: 必须持有锁
+    void AppendIndexEntry();
+    // 一条日志写入后更新索引, 要求: 必须持有锁
+    void UpdateIndex(uint32 severity_mask, time_t timestamp, uint64 offset, uint64 length);
   };
 
   // 封装所有日志清理相关状态
@@ -213,6 +1066,10 @@ namespace {
 
     bool enabled() const { return enabled_; }
 
+    // fork 时等待正在执行的清理完成
+    void AtForkPrepare() { mutex_.lock(); }
+    void AtForkRelease() { mutex_.unlock(); }
+
    private:
     // 获取过期的日志文件名
     std::vector<std::string> GetOverdueLogNames(std::string log_directory, unsigned int days,
@@ -228,6 +1085,7 @@ namespace {
     bool enabled_{false};
     unsigned int overdue_days_{7};
     int64 next_cleanup_time_{0}; // 清理逾期日志的周期计数
+    std::mutex mutex_;           // 分片模式下多个文件同时调用 Run, 只有一个执行
   };
 
   LogCleaner log_cleaner;
@@ -261,15 +1119,240 @@ static bool TerminalSupportsColor() {
   return term_supports_color;
 }
 
+/* -------------------------------- 日志路由 ---------------------------------------------- */
+
+namespace {
+  // 编译后的目的地位图: 低 8 位是 LogRouteDestination, 其中 LOG_ROUTE_FILE 已经按日志等级展开为每个等级的文件
+  const uint64 kRouteDefault = 1ULL << 8;         // 没有匹配的规则, 按默认规则输出
+  const int kRouteSinkShift = 9;                  // 第 9 + i 位表示路由表中的第 i 个 sink 名字
+  const size_t kMaxRouteSinks = 32;
+  const int kRouteGenerationShift = 41;           // LogSite::route_cache 的高位是路由表的版本
+  const uint64 kRouteMaskBits = (1ULL << kRouteGenerationShift) - 1;
+  const uint64 kMaxRouteGeneration = (1ULL << (64 - kRouteGenerationShift)) - 1;
+  // 只属于一条日志的标记(不缓存在调用点), 与目的地位图一起保存在 LogMessageData::route_ 中
+  const uint64 kRouteRawSinksOnly = 1ULL << 62;  // 被合并的重复日志: 只发送给需要原始日志的 sink
+  const uint64 kRouteSkipRawSinks = 1ULL << 61;  // 汇总: 需要原始日志的 sink 已经收到了每一条
+  const uint64 kRouteMessageFlags = kRouteRawSinksOnly | kRouteSkipRawSinks;
+  // sink_route_bits_ 中表示 sink 需要原始日志(LogSink::WantsRawRecords)
+  const uint64 kSinkRawRecords = 1ULL << 63;
+
+  class LogRouteTable {
+   public:
+    // 引用的 sink 名字过多时返回 false
+    bool Compile(const std::vector<LogRoute>& routes) {
+      for (const auto& route : routes) {
+        uint64 destinations = route.destinations & 0xffU;
+        for (const auto& name : route.sinks) {
+          size_t slot = std::find(sink_names_.begin(), sink_names_.end(), name) - sink_names_.begin();
+          if (slot == sink_names_.size()) {
+            if (slot == kMaxRouteSinks) return false;
+            sink_names_.push_back(name);
+          }
+          destinations |= 1ULL << (kRouteSinkShift + slot);
+        }
+        rules_.push_back({route.min_severity, route.max_severity, route.file_pattern, destinations});
+      }
+      return true;
+    }
+
+    // 第一条匹配的规则的目的地
+    uint64 Match(const char* fullname, LogSeverity severity) const {
+      for (const auto& rule : rules_) {
+        if (severity < rule.min_severity || severity > rule.max_severity || !MatchFile(rule.file_pattern, fullname)) {
+          continue;
+        }
+        uint64 destinations = rule.destinations & ~static_cast<uint64>(LOG_ROUTE_FILE);
+        if (rule.destinations & LOG_ROUTE_FILE) {
+          destinations |= (2ULL << severity) - 1; // 级联: 等级不高于 severity 的所有文件
+        }
+        return destinations;
+      }
+      return kRouteDefault;
+    }
+
+    // 名字对应的位, 没有被任何规则引用时为 0
+    uint64 SinkBit(const std::string& name) const {
+      const size_t slot = std::find(sink_names_.begin(), sink_names_.end(), name) - sink_names_.begin();
+      return slot < sink_names_.size() ? 1ULL << (kRouteSinkShift + slot) : 0;
+    }
+
+   private:
+    // 模式匹配整个路径, 或者路径中任意 '/' 之后的部分: "storage/*" 可以匹配 "src/storage/db.cc"
+    static bool MatchFile(const std::string& pattern, const char* fullname) {
+      if (pattern.empty() || fnmatch(pattern.c_str(), fullname, 0) == 0) {
+        return true;
+      }
+      for (const char* p = strchr(fullname, '/'); p != nullptr; p = strchr(p + 1, '/')) {
+        if (fnmatch(pattern.c_str(), p + 1, 0) == 0) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    struct Rule {
+      LogSeverity min_severity;
+      LogSeverity max_severity;
+      std::string file_pattern;
+      uint64 destinations;
+    };
+    std::vector<Rule> rules_;
+    std::vector<std::string> sink_names_;
+  };
+
+  // 保护 route_table 和 last_route_generation, 加锁顺序: sink_mutex_ -> route_mutex
+  std::mutex route_mutex;
+  std::shared_ptr<const LogRouteTable> route_table;
+  uint64 last_route_generation = 0;
+  // 当前路由表的版本, 0 表示没有路由表(默认规则, 不需要查找)
+  std::atomic<uint64> route_generation{0};
+
+  std::shared_ptr<const LogRouteTable> CurrentRouteTable() {
+    std::lock_guard<std::mutex> lk(route_mutex);
+    return route_table;
+  }
+
+  // 日志的目的地位图, site 不为空时使用并更新调用点的缓存
+  uint64 LogRouteFor(const LogSite* site, const char* fullname, LogSeverity severity) {
+    const uint64 generation = route_generation.load(std::memory_order_acquire);
+    if (generation == 0) {
+      return kRouteDefault;
+    }
+    if (site != nullptr) {
+      const uint64 cached = site->route_cache.load(std::memory_order_relaxed);
+      if ((cached >> kRouteGenerationShift) == generation) {
+        return cached & kRouteMaskBits;
+      }
+    }
+    // 先读版本再读路由表: 读到更新的路由表时缓存会在下次失效, 不会用旧的路由表更新新版本的缓存
+    const std::shared_ptr<const LogRouteTable> table = CurrentRouteTable();
+    const uint64 route = table ? table->Match(fullname, severity) : kRouteDefault;
+    if (site != nullptr) {
+      site->route_cache.store((generation << kRouteGenerationShift) | route, std::memory_order_relaxed);
+    }
+    return route;
+  }
+
+  // 重复日志合并: 窗口内有被合并的日志, 等待写出汇总的调用点
+  std::mutex dedup_mutex;
+  std::vector<const LogSite*> dedup_pending;
+  std::atomic<size_t> dedup_pending_count{0};
+  std::atomic<uint32> dedup_last_check{0}; // 上次检查 dedup_pending 的时间(ms)
+  std::atomic<int64> dedup_report_time{0}; // 到这个时间(CycleClock_Now)时写出所有汇总, 不超过一个刷盘周期
+
+  // 消息正文的 64 位哈希(FNV-1a)
+  uint64 HashSegments(const LogSegment* segments, size_t segment_count) {
+    uint64 hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < segment_count; i++) {
+      const unsigned char* p = reinterpret_cast<const unsigned char*>(segments[i].data);
+      for (size_t j = 0; j < segments[i].size; j++) {
+        hash = (hash ^ p[j]) * 1099511628211ULL;
+      }
+    }
+    return hash;
+  }
+
+  // 32 位的毫秒时间, 只用于计算时间差(回绕不影响)
+  uint32 DedupMillis(time_t timestamp, int32 usecs) {
+    return static_cast<uint32>(static_cast<uint64>(timestamp) * 1000 + static_cast<uint64>(usecs) / 1000);
+  }
+
+  std::string TrimRouteToken(const std::string& s) {
+    const size_t begin = s.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) {
+      return std::string();
+    }
+    const size_t end = s.find_last_not_of(" \t\r");
+    return s.substr(begin, end - begin + 1);
+  }
+
+  bool ParseRouteSeverity(const std::string& name, LogSeverity* severity) {
+    for (int i = 0; i < NUM_SEVERITIES; i++) {
+      if (name == LogSeverityNames[i]) {
+        *severity = i;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // "INFO", "ERROR+", "WARNING-ERROR", "*"
+  bool ParseRouteSeverityRange(const std::string& text, LogRoute* route) {
+    if (text == "*") {
+      route->min_severity = LOG_INFO;
+      route->max_severity = LOG_FATAL;
+      return true;
+    }
+    if (!text.empty() && text.back() == '+') {
+      route->max_severity = LOG_FATAL;
+      return ParseRouteSeverity(text.substr(0, text.size() - 1), &route->min_severity);
+    }
+    const size_t dash = text.find('-');
+    if (dash != std::string::npos) {
+      return ParseRouteSeverity(text.substr(0, dash), &route->min_severity) &&
+             ParseRouteSeverity(text.substr(dash + 1), &route->max_severity) &&
+             route->min_severity <= route->max_severity;
+    }
+    if (!ParseRouteSeverity(text, &route->min_severity)) {
+      return false;
+    }
+    route->max_severity = route->min_severity;
+    return true;
+  }
+
+  bool ParseRouteDestination(const std::string& text, LogRoute* route) {
+    LogSeverity severity;
+    if (text == "file") {
+      route->destinations |= LOG_ROUTE_FILE;
+    } else if (text.compare(0, 5, "file:") == 0 && ParseRouteSeverity(text.substr(5), &severity)) {
+      route->destinations |= 1U << severity;
+    } else if (text == "stderr") {
+      route->destinations |= LOG_ROUTE_STDERR;
+    } else if (text == "sinks") {
+      route->destinations |= LOG_ROUTE_SINKS;
+    } else if (text.compare(0, 5, "sink:") == 0 && text.size() > 5) {
+      route->sinks.push_back(text.substr(5));
+    } else if (text == "sync") {
+      route->destinations |= LOG_ROUTE_SYNC;
+    } else if (text != "none") {
+      return false;
+    }
+    return true;
+  }
+}
+
 /* -------------------------------- LogDestination ---------------------------------------------- */
 
 
+// 把只实现了 BatchLogger 的日志记录器适配为旧接口 Logger, 作为 GetLogger() 的返回值, 不拥有 logger 的所有权
+class BatchLoggerLegacyAdapter final : public base::Logger {
+ public:
+  BatchLoggerLegacyAdapter(LogSeverity severity, base::BatchLogger* logger) : severity_(severity), logger_(logger) {}
+
+  void Write(bool force_flush, time_t timestamp, const char* message, size_t message_len) override {
+    const LogSegment segment = {message, message_len};
+    WriteSegments(force_flush, timestamp, &segment, 1);
+  }
+  void WriteSegments(bool force_flush, time_t timestamp, const LogSegment* segments, size_t segment_count) override {
+    const base::LogRecordView record = {severity_, force_flush, timestamp, 0, segments, segment_count};
+    logger_->WriteBatch(&record, 1);
+  }
+  void Flush() override { logger_->Flush(); }
+  uint32 LogSize() override { return static_cast<uint32>(std::min<uint64>(logger_->LogSize64(), UINT32_MAX)); }
+
+ private:
+  const LogSeverity severity_;
+  base::BatchLogger* const logger_;
+};
+
 class LogDestination {
  public:
   friend class LogMessage;
   friend void ReprintFatalMessage();
   friend base::Logger* base::GetLogger(LogSeverity);
   friend void base::SetLogger(LogSeverity, base::Logger*);
+  friend base::BatchLogger* base::GetBatchLogger(LogSeverity);
+  friend void base::SetBatchLogger(LogSeverity, base::BatchLogger*);
 
   // 以下方法只是将它们的全局版本进行了转发
 
@@ -279,8 +1362,12 @@ class LogDestination {
   static void SetLogSymlink(LogSeverity severity, const char* symlink_filename);
   // 添加日志发送目的地
   static void AddLogSink(LogSink *destination);
+  // 添加命名的日志发送目的地, 名字为空表示没有名字
+  static void AddLogSink(LogSink *destination, const std::string& name);
   // 删除日志发送目的地
   static void RemoveLogSink(LogSink *destination);
+  // 设置路由表
+  static bool SetLogRoutes(const std::vector<LogRoute>& routes);
   // 设置日志文件的扩展名
   static void SetLogFilenameExtension(const char* filename_extension);
   // 设置日志输出到标准错误流
@@ -291,6 +1378,11 @@ class LogDestination {
   // 刷盘所有日志消息
   static void FlushLogFiles(int min_severity);
   static void FlushLogFilesUnsafe(int min_severity);
+  // 不获取任何锁写入日志文件(只写主文件, 跳过用户自定义的 Logger), 只用于 FlushLogFilesUnsafe()
+  static void LogToAllLogfilesUnsafe(LogSeverity severity, time_t timestamp, const LogSegment* segments,
+                                     size_t segment_count);
+  // FATAL 时调用: 刷盘并 fsync 所有日志文件, 等待文件锁不超过 deadline_nanos
+  static void FatalSyncLogFiles(int64 deadline_nanos);
 
   static const string& hostname();
   static const bool& terminal_supports_color() {
@@ -300,19 +1392,42 @@ class LogDestination {
   // 删除写日志对象
   static void DeleteLogDestinations();
 
+  // 分片模式是否可用: 开启了分片且没有用户自定义的 Logger
+  // 可用时写文件不需要持有 log_mutex, 所有 LogDestination 在这里提前创建
+  static bool ShardedWriteEnabled();
+
  private:
   LogDestination(LogSeverity severity, const char* base_filename);
   ~LogDestination();
 
   // 落地特定严重程度的日志消息, 如果它的严重程度足够高，则将其记录到 stderr
-  static void MaybeLogToStderr(LogSeverity severity, const char* message, size_t message_len, size_t prefix_len);
+  static void MaybeLogToStderr(LogSeverity severity, const LogSegment* segments, size_t segment_count, size_t prefix_len);
   // 落地特定严重程度的日志消息, 如果它的 base filename 不是 "", 则记录到文件
-  static void MaybeLogToLogfile(LogSeverity severity, time_t timestamp, const char* message, size_t len);
+  // record_severity 是日志本身的等级(写到 severity 及更低等级的文件中)
+  static void MaybeLogToLogfile(LogSeverity severity, LogSeverity record_severity, time_t timestamp, int32 usecs,
+                                const LogSegment* segments, size_t segment_count, bool force_flush);
   // 落地特定严重程度的日志消息, 并将其记录到与该严重程度相对应的文件以及所有严重程度低于此严重程度的文件中
-  static void LogToAllLogfiles(LogSeverity severity, time_t timestamp, const char* message, size_t len);
-  // 发送日志信息到所有已注册的 sinks
+  static void LogToAllLogfiles(LogSeverity severity, time_t timestamp, int32 usecs,
+                               const LogSegment* segments, size_t segment_count);
+  // 按路由表编译出的目的地位图落地日志: 位图中的每个等级的文件和 stderr
+  static void LogToRoutedLogfiles(LogSeverity severity, uint64 route, time_t timestamp, int32 usecs,
+                                  const LogSegment* segments, size_t segment_count);
+  // 发送日志信息到 route 选中的 sinks(kRouteDefault 表示所有 sinks)
   static void LogToSinks(LogSeverity severity, const char* full_filename, const char* base_filename, int line, 
-                         const LogMessageTime& logmsgtime, const char* message, size_t message_len);
+                         const LogMessageTime& logmsgtime, const LogContext* context,
+                         const LogSegment* segments, size_t segment_count, uint64 route);
+  // route 是否选中第 i 个 sink, 要求: 必须持有 sink_mutex_
+  static bool SinkRouted(size_t i, uint64 route) {
+    const uint64 bits = sink_route_bits_[i];
+    if ((bits & kSinkRawRecords) ? (route & kRouteSkipRawSinks) != 0 : (route & kRouteRawSinksOnly) != 0) {
+      return false;
+    }
+    return (route & (kRouteDefault | LOG_ROUTE_SINKS | (bits & ~kSinkRawRecords))) != 0;
+  }
+  // 是否有需要原始日志的 sink
+  static bool HasRawSinks() { return raw_sinks_.load(std::memory_order_relaxed) > 0; }
+  // 按路由表重新计算每个 sink 的位, 要求: 必须持有 sink_mutex_ 的写锁
+  static void UpdateSinkRouteBits(const LogRouteTable* table);
 
   // 等待所有已注册的输出目标通过 WaitTillSent 完成发送
   // 包括 "data" 中的可选目标
@@ -323,10 +1438,42 @@ class LogDestination {
 
   base::Logger* GetLoggerImpl() const { return logger_; }
   void SetLoggerImpl(base::Logger* logger);
-  void ResetLoggerImpl() { SetLoggerImpl(&fileobject_); }
+  base::BatchLogger* GetBatchLoggerImpl() const { return batch_logger_; }
+  void SetBatchLoggerImpl(base::BatchLogger* logger);
+  void ResetLoggerImpl() { SetBatchLoggerImpl(&fileobject_); }
+  // 是否使用用户设置的日志记录器
+  bool HasCustomLogger() const { return batch_logger_ != &fileobject_; }
+
+  // 返回分片文件, 第一次使用时创建
+  LogFileObject* shard_file(int shard);
+  // 把 fileobject_ 的配置同步到已经创建的分片文件
+  void UpdateShardSettings();
+  // 刷盘所有分片文件
+  void FlushShards(bool unlocked);
+  // 对所有已经创建的日志文件(包括分片文件)执行 fn
+  template <class Fn>
+  static void ForEachLogFile(Fn fn);
+
+ public:
+  // fork 前按正常写日志的加锁顺序持有所有锁, 写线程全部停在锁上, 之后在父子进程中释放
+  static void AtForkPrepare();
+  static void AtForkParent();
+  static void AtForkChild();
+
+ private:
 
   LogFileObject fileobject_;
-  base::Logger* logger_; // 是 &fileobject_ 或 继承了 Logger 的类对象
+  base::BatchLogger* batch_logger_; // 是 &fileobject_, 包装 Logger 的 LoggerAdapter, 或用户的 BatchLogger
+  base::Logger* logger_;            // GetLogger() 返回的旧接口: &fileobject_, 用户的 Logger, 或者 BatchLogger 本身/它的适配器
+  std::unique_ptr<base::Logger> legacy_adapter_; // 只实现了 BatchLogger 的日志记录器的旧接口适配器
+  std::atomic<LogFileObject*> shards_[kMaxLogShards]; // 分片文件, 只增加, 随 LogDestination 一起删除
+
+  // 保护分片文件的创建和配置同步, 加锁顺序: log_mutex -> shard_mutex_ -> LogFileObject::lock_
+  static std::mutex shard_mutex_;
+  // 用户通过 SetLogger()/SetBatchLogger() 设置的日志记录器的数量, 不为 0 时不使用分片模式
+  static std::atomic<int> custom_loggers_;
+  // 所有 LogDestination 是否都已经创建
+  static std::atomic<bool> destinations_ready_;
   static std::string hostname_; // 主机名
 
   // 记录每个日志等级的 LogDestination
@@ -336,8 +1483,15 @@ class LogDestination {
   // 任意的全局日志记录目的地
   static std::vector<LogSink*>* sinks_;
 
-  // 保护 sinks_ , 但不保护 sinks_ 里面的元素所指向的对象
-  static std::shared_mutex sink_mutex_;
+  // 与 sinks_ 一一对应: sink 的名字, 和它在当前路由表中的位
+  static std::vector<std::string> sink_names_;
+  static std::vector<uint64> sink_route_bits_;
+  // 需要原始日志的 sink 的数量
+  static std::atomic<int> raw_sinks_;
+
+  // 保护 sinks_, sink_names_, sink_route_bits_, 但不保护 sinks_ 里面的元素所指向的对象
+  // 放在堆上: fork 后子进程放弃父进程的锁(不析构), 重新创建
+  static std::shared_mutex* sink_mutex_;
 
   // 禁止
   LogDestination(const LogDestination&) = delete;
@@ -348,8 +1502,16 @@ class LogDestination {
 LogDestination* LogDestination::log_destinations_[NUM_SEVERITIES];
 bool LogDestination::terminal_supports_color_ = TerminalSupportsColor();
 std::vector<LogSink*>* LogDestination::sinks_ = nullptr;
-std::shared_mutex LogDestination::sink_mutex_;
+std::vector<std::string> LogDestination::sink_names_;
+std::vector<uint64> LogDestination::sink_route_bits_;
+std::atomic<int> LogDestination::raw_sinks_{0};
+// 指向静态对象(常量初始化), 其他编译单元的静态初始化中也可以使用
+static std::shared_mutex initial_sink_mutex;
+std::shared_mutex* LogDestination::sink_mutex_ = &initial_sink_mutex;
 std::string LogDestination::hostname_; 
+std::mutex LogDestination::shard_mutex_;
+std::atomic<int> LogDestination::custom_loggers_{0};
+std::atomic<bool> LogDestination::destinations_ready_{false};
 
 // 静态函数
 const string& LogDestination::hostname() {
@@ -364,11 +1526,17 @@ const string& LogDestination::hostname() {
 
 // 私有属性的构造函数, 初始化 日志落地类
 LogDestination::LogDestination(LogSeverity severity, const char* base_filename)
-  : fileobject_(severity, base_filename), logger_(&fileobject_) {
+  : fileobject_(severity, base_filename), batch_logger_(&fileobject_), logger_(&fileobject_) {
+  for (auto& shard : shards_) {
+    shard.store(nullptr, std::memory_order_relaxed);
+  }
 }
 // 析构函数
 LogDestination::~LogDestination() {
   ResetLoggerImpl();
+  for (auto& shard : shards_) {
+    delete shard.load(std::memory_order_relaxed);
+  }
 }
 
 void LogDestination::SetLoggerImpl(base::Logger* logger) {
@@ -376,34 +1544,185 @@ void LogDestination::SetLoggerImpl(base::Logger* logger) {
     // 防止在重置时释放当前持有的 sink
     return;
   }
+  if (logger == nullptr || logger == &fileobject_) {
+    SetBatchLoggerImpl(&fileobject_);
+    return;
+  }
+  SetBatchLoggerImpl(new base::LoggerAdapter(logger));
+  logger_ = logger;
+  legacy_adapter_.reset();
+}
+
+void LogDestination::SetBatchLoggerImpl(base::BatchLogger* logger) {
+  if (logger == nullptr) {
+    logger = &fileobject_;
+  }
+  if (logger == batch_logger_) {
+    return;
+  }
+
+  legacy_adapter_.reset();
+  if (HasCustomLogger()) {
+    // 释放用户通过 SetLogger()/SetBatchLogger() 指定的 logger(LoggerAdapter 同时释放它包装的 Logger)
+    delete batch_logger_;
+    custom_loggers_.fetch_sub(1, std::memory_order_relaxed);
+  }
+  if (logger != &fileobject_) {
+    custom_loggers_.fetch_add(1, std::memory_order_relaxed);
+  }
+  batch_logger_ = logger;
+  if (logger == &fileobject_) {
+    logger_ = &fileobject_;
+  } else if ((logger_ = dynamic_cast<base::Logger*>(logger)) == nullptr) {
+    // 只实现了 BatchLogger: GetLogger() 返回一个适配器, 每次 Write() 写入一条日志
+    legacy_adapter_.reset(new BatchLoggerLegacyAdapter(fileobject_.severity(), logger));
+    logger_ = legacy_adapter_.get();
+  }
+}
+
+bool LogDestination::ShardedWriteEnabled() {
+  if (FLAGS_log_shards <= 0 || custom_loggers_.load(std::memory_order_relaxed) != 0) {
+    return false;
+  }
+  if (!destinations_ready_.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lk(log_mutex);
+    for (int i = 0; i < NUM_SEVERITIES; i++) {
+      log_destination(i);
+    }
+    destinations_ready_.store(true, std::memory_order_release);
+  }
+  return true;
+}
+
+LogFileObject* LogDestination::shard_file(int shard) {
+  LogFileObject* file = shards_[shard].load(std::memory_order_acquire);
+  if (file == nullptr) {
+    std::lock_guard<std::mutex> lk(shard_mutex_);
+    file = shards_[shard].load(std::memory_order_relaxed);
+    if (file == nullptr) {
+      file = new LogFileObject(fileobject_.severity(), nullptr, shard);
+      file->CopySettingsFrom(fileobject_);
+      shards_[shard].store(file, std::memory_order_release);
+    }
+  }
+  return file;
+}
+
+void LogDestination::UpdateShardSettings() {
+  std::lock_guard<std::mutex> lk(shard_mutex_);
+  for (auto& shard : shards_) {
+    LogFileObject* file = shard.load(std::memory_order_relaxed);
+    if (file != nullptr) {
+      file->CopySettingsFrom(fileobject_);
+    }
+  }
+}
+
+void LogDestination::FlushShards(bool unlocked) {
+  for (auto& shard : shards_) {
+    LogFileObject* file = shard.load(std::memory_order_acquire);
+    if (file != nullptr) {
+      if (unlocked) {
+        file->FlushUnlocked();
+      } else {
+        file->Flush();
+      }
+    }
+  }
+}
+
+template <class Fn>
+void LogDestination::ForEachLogFile(Fn fn) {
+  for (LogDestination* log : log_destinations_) {
+    if (log == nullptr) {
+      continue;
+    }
+    fn(&log->fileobject_);
+    for (auto& shard : log->shards_) {
+      LogFileObject* file = shard.load(std::memory_order_acquire);
+      if (file != nullptr) {
+        fn(file);
+      }
+    }
+  }
+}
+
+void LogDestination::AtForkPrepare() {
+  // 加锁顺序: log_mutex -> shard_mutex_ -> sink_mutex_ -> route_mutex -> LogFileObject::lock_
+  log_mutex.lock();
+  shard_mutex_.lock();
+  sink_mutex_->lock();
+  route_mutex.lock();
+  ForEachLogFile([](LogFileObject* file) { file->AtForkPrepare(); });
+}
+
+void LogDestination::AtForkParent() {
+  ForEachLogFile([](LogFileObject* file) { file->AtForkParent(); });
+  route_mutex.unlock();
+  sink_mutex_->unlock();
+  shard_mutex_.unlock();
+  log_mutex.unlock();
+}
 
-  if (logger_ && logger_ != &fileobject_) {
-    // 释放用户通过 SetLogger() 指定的 logger 
-    delete logger_;
-  }
-  logger_ = logger;
+void LogDestination::AtForkChild() {
+  ForEachLogFile([](LogFileObject* file) { file->AtForkChild(); });
+  route_mutex.unlock();
+  // pthread_rwlock_unlock 按线程 id 判断是否是写锁, 子进程中线程 id 已经改变, 不能解锁, 换一个新的锁
+  sink_mutex_ = new std::shared_mutex();
+  shard_mutex_.unlock();
+  log_mutex.unlock();
 }
 
 // 刷盘所有至少是指定日志等级的日志消息
 inline void LogDestination::FlushLogFiles(int min_severity) {
+  // 先写出等待中的重复日志汇总
+  if (dedup_pending_count.load(std::memory_order_relaxed) > 0) {
+    LogMessage::ReportRepeats(true, 0);
+  }
   // 获得锁
   std::lock_guard<std::mutex> lk(log_mutex);
   for (int i = min_severity; i < NUM_SEVERITIES; i++) {
     LogDestination* log = log_destination(i);
     if (log != nullptr) {
-      log->logger_->Flush();
+      log->batch_logger_->Flush();
+      log->FlushShards(false);
     }
   }
 }
 inline void LogDestination::FlushLogFilesUnsafe(int min_severity) {
   // 假设我们已经持有了锁, 这里不再关心是否持有锁
+  // 先写出等待中的重复日志汇总(dedup_mutex 被占用时跳过)
+  if (dedup_pending_count.load(std::memory_order_relaxed) > 0) {
+    LogMessage::ReportRepeats(true, 0, true);
+  }
   for (int i = min_severity; i < NUM_SEVERITIES; i++) {
     LogDestination* log = log_destinations_[i];
     if (log != nullptr) {
       // 直接刷新 fileobject_ logger 而经过任何包装以减少死锁的可能性
       log->fileobject_.FlushUnlocked();
+      log->FlushShards(true);
+    }
+  }
+}
+
+void LogDestination::LogToAllLogfilesUnsafe(LogSeverity severity, time_t timestamp, const LogSegment* segments,
+                                            size_t segment_count) {
+  for (int i = severity; i >= 0; --i) {
+    LogDestination* log = log_destinations_[i];
+    if (log != nullptr && !log->HasCustomLogger()) {
+      log->fileobject_.WriteRecordUnlocked(severity, timestamp, segments, segment_count);
+    }
+  }
+}
+
+void LogDestination::FatalSyncLogFiles(int64 deadline_nanos) {
+  for (LogDestination* log : log_destinations_) {
+    if (log != nullptr && log->HasCustomLogger()) {
+      // 用户设置的 Logger, 例如等待后台线程的异步记录器, 超过截止时间后不再等待
+      log->batch_logger_->FlushFor(deadline_nanos);
     }
   }
+  ForEachLogFile([deadline_nanos](LogFileObject* file) { file->FatalSync(deadline_nanos); });
 }
 
 // 设置日志目的文件
@@ -411,32 +1730,89 @@ void LogDestination::SetLogDestination(LogSeverity severity, const char* base_fi
   assert(severity >= 0 && severity < NUM_SEVERITIES);
   std::lock_guard<std::mutex> lk(log_mutex);
   log_destination(severity)->fileobject_.SetBasename(base_filename);
+  log_destination(severity)->UpdateShardSettings();
 }
 // 设置日志文件的符号链接
 void LogDestination::SetLogSymlink(LogSeverity severity, const char* symlink_filename) {
   assert(severity >= 0 && severity < NUM_SEVERITIES);
   std::lock_guard<std::mutex> lk(log_mutex);
   log_destination(severity)->fileobject_.SetSymlinkBasename(symlink_filename);
+  log_destination(severity)->UpdateShardSettings();
 }
 // 添加日志发送目的地
 void LogDestination::AddLogSink(LogSink *destination) {
-  std::lock_guard<std::shared_mutex> lk(sink_mutex_);
+  AddLogSink(destination, std::string());
+}
+// 添加命名的日志发送目的地
+void LogDestination::AddLogSink(LogSink *destination, const std::string& name) {
+  std::lock_guard<std::shared_mutex> lk(*sink_mutex_);
   if (!sinks_) { sinks_ = new std::vector<LogSink*>; }
   sinks_->push_back(destination);
+  sink_names_.push_back(name);
+  const std::shared_ptr<const LogRouteTable> table = CurrentRouteTable();
+  const bool raw = destination->WantsRawRecords();
+  sink_route_bits_.push_back((table && !name.empty() ? table->SinkBit(name) : 0) | (raw ? kSinkRawRecords : 0));
+  if (raw) {
+    raw_sinks_.fetch_add(1, std::memory_order_relaxed);
+  }
 }
 // 删除日志发送目的地
 void LogDestination::RemoveLogSink(LogSink *destination) {
-  std::lock_guard<std::shared_mutex> lk(sink_mutex_);
+  std::lock_guard<std::shared_mutex> lk(*sink_mutex_);
   if (sinks_) {
-    // std::remove() 把指定元素移动到容器末尾, 返回新范围的位置(但会破坏顺序)
-    sinks_->erase(std::remove(sinks_->begin(), sinks_->end(), destination), sinks_->end());
+    // 保持顺序, 同时删除对应的名字和路由位
+    size_t kept = 0;
+    for (size_t i = 0; i < sinks_->size(); i++) {
+      if ((*sinks_)[i] != destination) {
+        (*sinks_)[kept] = (*sinks_)[i];
+        sink_names_[kept] = std::move(sink_names_[i]);
+        sink_route_bits_[kept] = sink_route_bits_[i];
+        kept++;
+      } else if (sink_route_bits_[i] & kSinkRawRecords) {
+        raw_sinks_.fetch_sub(1, std::memory_order_relaxed);
+      }
+    }
+    sinks_->resize(kept);
+    sink_names_.resize(kept);
+    sink_route_bits_.resize(kept);
+  }
+}
+
+void LogDestination::UpdateSinkRouteBits(const LogRouteTable* table) {
+  for (size_t i = 0; i < sink_route_bits_.size(); i++) {
+    sink_route_bits_[i] = (sink_route_bits_[i] & kSinkRawRecords) |
+                          (table && !sink_names_[i].empty() ? table->SinkBit(sink_names_[i]) : 0);
+  }
+}
+
+bool LogDestination::SetLogRoutes(const std::vector<LogRoute>& routes) {
+  std::shared_ptr<LogRouteTable> table;
+  if (!routes.empty()) {
+    table = std::make_shared<LogRouteTable>();
+    if (!table->Compile(routes)) {
+      return false;
+    }
+  }
+  // 切换的瞬间, 正在发送的日志可能按旧的位图和新的 sink 位选择命名 sink
+  std::lock_guard<std::shared_mutex> sink_lk(*sink_mutex_);
+  UpdateSinkRouteBits(table.get());
+  std::lock_guard<std::mutex> lk(route_mutex);
+  route_table = table;
+  if (table) {
+    // 版本号循环使用, 跳过 0
+    last_route_generation = last_route_generation % kMaxRouteGeneration + 1;
+    route_generation.store(last_route_generation, std::memory_order_release);
+  } else {
+    route_generation.store(0, std::memory_order_release);
   }
+  return true;
 }
 // 设置日志文件的扩展名
 void LogDestination::SetLogFilenameExtension(const char* filename_extension) {
   std::lock_guard<std::mutex> lk(log_mutex);
   for (int i = 0; i < NUM_SEVERITIES; i++) {
     log_destination(i)->fileobject_.SetExtension(filename_extension);
+    log_destination(i)->UpdateShardSettings();
   }
 }
 // 设置日志输出到标准错误流
@@ -455,13 +1831,17 @@ void LogDestination::LogToStderr() {
 }
 
 void LogDestination::DeleteLogDestinations() {
+  destinations_ready_.store(false, std::memory_order_release);
   for (auto& log_destination : log_destinations_) {
     delete log_destination;
     log_destination = nullptr;
   }
-  std::lock_guard<std::shared_mutex> lk(sink_mutex_);
+  std::lock_guard<std::shared_mutex> lk(*sink_mutex_);
   delete sinks_;
   sinks_ = nullptr;
+  sink_names_.clear();
+  sink_route_bits_.clear();
+  raw_sinks_.store(0, std::memory_order_relaxed);
 }
 
 inline LogDestination* LogDestination::log_destination(LogSeverity severity) {
@@ -505,8 +1885,15 @@ static const char* GetAnsiColorCode(LogColor color) {
   return nullptr;
 }
 
+// 把分段写到 stdio 流
+static void WriteSegmentsToStream(FILE* output, const LogSegment* segments, size_t segment_count) {
+  for (size_t i = 0; i < segment_count; i++) {
+    fwrite(segments[i].data, segments[i].size, 1, output);
+  }
+}
+
 // 把带颜色的日志写到 stderr or stdout
-static void ColoredWriteToStderrOrStdout(FILE* output, LogSeverity severity, const char* message, size_t len) {
+static void ColoredWriteToStderrOrStdout(FILE* output, LogSeverity severity, const LogSegment* segments, size_t segment_count) {
   bool is_stdout = (output == stdout);
   const LogColor color = (LogDestination::terminal_supports_color() &&
                           ((!is_stdout && FLAGS_colorlogtostderr) ||
@@ -516,27 +1903,27 @@ static void ColoredWriteToStderrOrStdout(FILE* output, LogSeverity severity, con
   if (color == COLOR_DEFAULT) {
     // 避免在此模块中使用 std::cerr，因为这个函数可能会在退出代码期间被调用,
     // 并且那时 std::cerr 可能会部分或完全销毁
-    fwrite(message, len, 1, output);
+    WriteSegmentsToStream(output, segments, segment_count);
     return;
   }
 
   fprintf(output, "\033[0;3%sm", GetAnsiColorCode(color));
-  fwrite(message, len, 1, output);
+  WriteSegmentsToStream(output, segments, segment_count);
   fprintf(output, "\033[m"); // 恢复原来的颜色
 }
 
 // 把带颜色的日志写到 stdout
-static void ColoredWriteToStdout(LogSeverity severity, const char* message, size_t len) {
+static void ColoredWriteToStdout(LogSeverity severity, const LogSegment* segments, size_t segment_count) {
   FILE* output = stdout;
   // 还需要判断是否是 stderr
   if (severity >= FLAGS_stderrthreshold) {
     output = stderr;
   }
-  ColoredWriteToStderrOrStdout(output, severity, message, len);
+  ColoredWriteToStderrOrStdout(output, severity, segments, segment_count);
 }
 // 把带颜色的日志写到 stderr
-static void ColoredWriteToStderr(LogSeverity severity, const char* message, size_t len) {
-  ColoredWriteToStderrOrStdout(stderr, severity, message, len);
+static void ColoredWriteToStderr(LogSeverity severity, const LogSegment* segments, size_t segment_count) {
+  ColoredWriteToStderrOrStdout(stderr, severity, segments, segment_count);
 }
 
 static void WriteToStderr(const char* message, size_t len) {
@@ -546,45 +1933,101 @@ static void WriteToStderr(const char* message, size_t len) {
 }
 
 // 落地特定严重程度的日志消息, 如果它的严重程度足够高，则将其记录到 stderr
-void LogDestination::MaybeLogToStderr(LogSeverity severity, const char* message, size_t message_len, size_t prefix_len) {
+void LogDestination::MaybeLogToStderr(LogSeverity severity, const LogSegment* segments, size_t segment_count, size_t prefix_len) {
   if (severity >= FLAGS_stderrthreshold || FLAGS_alsologtostderr) {
-    ColoredWriteToStderr(severity, message, message_len);
+    ColoredWriteToStderr(severity, segments, segment_count);
+    log_internal_namespace_::StatMessage(severity, STAT_DEST_STDERR, SegmentsLength(segments, segment_count));
     (void) prefix_len; // 空语句, 用于避免编译器发出未使用变量的警告
   }
 }
 
 // 落地特定严重程度的日志消息, 如果它的 base filename 不是 "", 则记录到文件
-void LogDestination::MaybeLogToLogfile(LogSeverity severity, time_t timestamp, const char* message, size_t len) {
-  const bool should_flush = severity > FLAGS_logbuflevel;
+void LogDestination::MaybeLogToLogfile(LogSeverity severity, LogSeverity record_severity, time_t timestamp,
+                                       int32 usecs, const LogSegment* segments, size_t segment_count,
+                                       bool force_flush) {
+  const bool should_flush = force_flush || severity > FLAGS_logbuflevel;
   LogDestination* destination = log_destination(severity);
-  destination->logger_->Write(should_flush, timestamp, message, len); // 日志落地
+  // 分片模式下不持有 log_mutex: batch_logger_ 可能正在被 SetBatchLogger() 替换和释放, 只写分片文件
+  // (安装自定义日志记录器之后的日志不再走分片模式, 见 ShardedWriteEnabled())
+  if (!tls_sharded_write && destination->HasCustomLogger()) {
+    // 用户自定义的 Logger
+    const base::LogRecordView record = {record_severity, should_flush, timestamp, usecs, segments, segment_count};
+    destination->batch_logger_->WriteBatch(&record, 1);
+    return;
+  }
+  LogFileObject* file = &destination->fileobject_;
+  const int shards = std::min<int32>(FLAGS_log_shards, kMaxLogShards);
+  if (shards > 0) {
+    // 分片模式: 写到当前线程的分片文件
+    file = destination->shard_file(CurrentLogShard(shards));
+  }
+  file->WriteRecord(record_severity, should_flush, timestamp, segments, segment_count); // 日志落地
 }
 
 // 落地特定严重程度的日志消息, 并将其记录到与该严重程度相对应的文件以及所有严重程度低于此严重程度的文件中
-void LogDestination::LogToAllLogfiles(LogSeverity severity, time_t timestamp, const char* message, size_t len) {
+void LogDestination::LogToAllLogfiles(LogSeverity severity, time_t timestamp, int32 usecs,
+                                      const LogSegment* segments, size_t segment_count) {
+  const size_t len = SegmentsLength(segments, segment_count);
   if (FLAGS_logtostdout) {
     // 直接写到 stdout
-    ColoredWriteToStdout(severity, message, len);
+    ColoredWriteToStdout(severity, segments, segment_count);
+    log_internal_namespace_::StatMessage(severity, STAT_DEST_STDOUT, len);
   } else if (FLAGS_logtostderr) {
     // 直接写到 stderr
-    ColoredWriteToStderr(severity, message, len);
+    ColoredWriteToStderr(severity, segments, segment_count);
+    log_internal_namespace_::StatMessage(severity, STAT_DEST_STDERR, len);
   } else {
     for (int i = severity; i >= 0; --i) {
-      LogDestination::MaybeLogToLogfile(i, timestamp, message, len);
+      LogDestination::MaybeLogToLogfile(i, severity, timestamp, usecs, segments, segment_count, false);
+    }
+    log_internal_namespace_::StatMessage(severity, STAT_DEST_FILE, len);
+  }
+}
+
+// 按路由表编译出的目的地位图落地日志
+void LogDestination::LogToRoutedLogfiles(LogSeverity severity, uint64 route, time_t timestamp, int32 usecs,
+                                         const LogSegment* segments, size_t segment_count) {
+  const size_t len = SegmentsLength(segments, segment_count);
+  const bool force_flush = (route & LOG_ROUTE_SYNC) != 0;
+  if (route & ((1ULL << NUM_SEVERITIES) - 1)) {
+    // 与级联规则相同的顺序: 从高等级的文件到低等级的文件
+    for (int i = NUM_SEVERITIES - 1; i >= 0; --i) {
+      if (route & (1ULL << i)) {
+        LogDestination::MaybeLogToLogfile(i, severity, timestamp, usecs, segments, segment_count, force_flush);
+      }
     }
+    log_internal_namespace_::StatMessage(severity, STAT_DEST_FILE, len);
+  }
+  if (route & LOG_ROUTE_STDERR) {
+    ColoredWriteToStderr(severity, segments, segment_count);
+    log_internal_namespace_::StatMessage(severity, STAT_DEST_STDERR, len);
   }
 }
 
 // 发送日志信息到所有已注册的 sinks
 void LogDestination::LogToSinks(LogSeverity severity, const char* full_filename, const char* base_filename, int line, 
-                        const LogMessageTime& logmsgtime, const char* message, size_t message_len) {
+                        const LogMessageTime& logmsgtime, const LogContext* context,
+                        const LogSegment* segments, size_t segment_count, uint64 route) {
   // C++ 17
-  std::shared_lock<std::shared_mutex> lk(sink_mutex_);
+  std::shared_lock<std::shared_mutex> lk(*sink_mutex_, std::defer_lock);
+  if (severity == LOG_FATAL) {
+    // 持有写锁的线程可能已经卡住, FATAL 不无限等待
+    if (!TryLockUntil(lk, log_internal_namespace_::StatNowNanos() + kFatalWaitNanos)) {
+      return;
+    }
+  } else {
+    lk.lock();
+  }
   if (sinks_) {
+    const size_t len = SegmentsLength(segments, segment_count);
     for (size_t i = sinks_->size(); i-- > 0; ) {
       // i-- 是因为 size_t 是 unsigned
+      if (!SinkRouted(i, route)) {
+        continue;
+      }
       // 发送日志到已注册的 sink 
-      (*sinks_)[i]->send(severity, full_filename, base_filename, line, logmsgtime, message, message_len);
+      (*sinks_)[i]->send(severity, full_filename, base_filename, line, logmsgtime, context, segments, segment_count);
+      log_internal_namespace_::StatMessage(severity, STAT_DEST_SINK, len);
     }
   }
 }
@@ -592,12 +2035,14 @@ void LogDestination::LogToSinks(LogSeverity severity, const char* full_filename,
 // 等待所有已注册的输出目标通过 WaitTillSent 完成发送
 // 包括 "data" 中的可选目标
 void LogDestination::WaitForSinks(LogMessage::LogMessageData* data) {
-  std::shared_lock<std::shared_mutex> lk(sink_mutex_);
+  std::shared_lock<std::shared_mutex> lk(*sink_mutex_);
   if (sinks_) {
     for (size_t i = sinks_->size(); i-- > 0; ) {
       // i-- 是因为 size_t 是 unsigned
-      // 等待发送日志到已注册的 sink 
-      (*sinks_)[i]->WaitTillSent();
+      // 等待发送日志到已注册的 sink, 没有发送给它的日志不需要等待
+      if (SinkRouted(i, data->route_)) {
+        (*sinks_)[i]->WaitTillSent();
+      }
     }
   }
 
@@ -619,13 +2064,15 @@ namespace {
 // 文件目录分隔符号
 const char possible_dir_delim[] = {'/'};
 
-LogFileObject::LogFileObject(LogSeverity severity, const char* base_filename)
+LogFileObject::LogFileObject(LogSeverity severity, const char* base_filename, int shard)
  : base_filename_selected_(base_filename != nullptr),
    base_filename_((base_filename != nullptr) ? base_filename : ""),
    symlink_basename_(log_internal_namespace_::ProgramInvocationShortName()),
    filename_extension_(),
    severity_(severity),
+   shard_(shard),
    rollover_attempt_(kRolloverAttemptFrequency - 1),
+   prepared_(std::make_shared<PreparedLogFile>()),
    start_time_(log_internal_namespace_::WallTime_Now())
     {
   assert(severity >= 0 && severity < NUM_SEVERITIES);
@@ -633,9 +2080,108 @@ LogFileObject::LogFileObject(LogSeverity severity, const char* base_filename)
 
 LogFileObject::~LogFileObject() {
   std::lock_guard<std::mutex> lk(lock_);
-  if (file_ != nullptr) {
+  CloseLogfile();
+}
+
+void LogFileObject::CloseLogfile() {
+  if (fd_ < 0) {
+    return;
+  }
+  if (durability_mode_ == DURABILITY_DIRECT) {
+    FlushDirectBuffer();
+    close(fd_);
+    free(direct_buf_);
+    direct_buf_ = nullptr;
+    direct_fill_ = 0;
+    direct_offset_ = 0;
+  } else {
+    if (durability_mode_ != DURABILITY_BUFFERED) {
+      fflush(file_);
+    }
+    if (durability_mode_ == DURABILITY_PREALLOCATE) {
+      ReleasePreallocation();
+    }
     fclose(file_);
-    file_ = nullptr;
+  }
+  if (sync_target_) {
+    // 关闭前写到内核的数据由组提交线程完成最后一次同步
+    group_commit_syncer().MarkDirty(sync_target_.get());
+    sync_target_.reset();
+  }
+  if (write_behind_) {
+    // 末尾不满一块的部分也由后台线程回写并释放
+    if (!write_behind_exited) {
+      write_behind_manager().MarkWritten(write_behind_.get(), write_behind_->base + file_length_, true);
+    }
+    write_behind_.reset();
+  }
+  if (index_fd_ >= 0) {
+    AppendIndexEntry();
+    close(index_fd_);
+    index_fd_ = -1;
+  }
+  file_ = nullptr;
+  fd_ = -1;
+}
+
+void LogFileObject::GrowPreallocation() {
+  // 最多预分配到写入位置之后两块, 不超过日志文件的最大大小; 进程崩溃时最多留下两块没有释放的空间
+  const uint64 offset = prealloc_base_ + file_length_;
+  if (offset + kPreallocChunkBytes <= prealloc_end_) {
+    return;
+  }
+  const uint64 limit = prealloc_base_ + (static_cast<uint64>(MaxLogSize()) << 20U);
+  const uint64 end = std::min(offset + 2 * kPreallocChunkBytes, limit);
+  if (end > prealloc_end_) {
+    // FALLOC_FL_KEEP_SIZE 保证读者看到的文件长度仍然是实际写入的长度, 失败时忽略
+    if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(prealloc_end_),
+                  static_cast<off_t>(end - prealloc_end_)) != 0) {
+      // 忽略错误
+    }
+  }
+  // 失败时同样前进, 不在每次写入时重试
+  prealloc_end_ = std::max(end, offset + kPreallocChunkBytes);
+}
+
+void LogFileObject::ReleasePreallocation() {
+  // GrowPreallocation 预分配了写入位置之后的块, 文件关闭时末尾之后的块仍然被占用
+  // 截断到当前长度释放这些块(ext4 不处理文件长度之后的 FALLOC_FL_PUNCH_HOLE), 失败时忽略
+  struct stat file_stat;
+  if (fstat(fd_, &file_stat) != 0) {
+    return;
+  }
+  if (static_cast<off_t>(file_stat.st_blocks) * 512 > file_stat.st_size &&
+      ftruncate(fd_, file_stat.st_size) != 0) {
+    // 忽略错误
+  }
+}
+
+void LogFileObject::AppendIndexEntry() {
+  if (!index_block_open_) {
+    return;
+  }
+  index_block_open_ = false;
+  index_entry_.checksum = LogIndexChecksum(index_entry_);
+  // 一次 write 追加一条定长记录, 崩溃时最多丢失(或写坏)最后一条, 读取时会被丢弃
+  if (write(index_fd_, &index_entry_, sizeof(index_entry_)) != sizeof(index_entry_)) {
+    // 忽略错误, 索引可以从日志文件重建
+  }
+}
+
+void LogFileObject::UpdateIndex(uint32 severity_mask, time_t timestamp, uint64 offset, uint64 length) {
+  // 每秒一块: 新的一秒的日志开始新的块
+  if (index_block_open_ && static_cast<int64>(timestamp) >= index_entry_.timestamp + 1) {
+    AppendIndexEntry();
+  }
+  if (!index_block_open_) {
+    index_entry_ = {static_cast<int64>(timestamp), offset, 0, 0, 0, 0};
+    index_block_open_ = true;
+  }
+  index_entry_.length = static_cast<uint32>(offset + length - index_entry_.offset);
+  index_entry_.severity_mask |= severity_mask;
+  // 块达到大小上限
+  if (index_entry_.length >= index_block_bytes_) {
+    AppendIndexEntry();
   }
 }
 
@@ -644,13 +2190,12 @@ void LogFileObject::SetBasename(const char* basename) {
   base_filename_selected_ = true;
   if (base_filename_ != basename) {
     // 正在改名字, 旧日志关闭
-    if (file_ != nullptr) {
-      fclose(file_);
-      file_ = nullptr;
+    if (fd_ >= 0) {
+      CloseLogfile();
       rollover_attempt_ = kRolloverAttemptFrequency - 1;
     }
     if (!FLAGS_log_dir.empty()) {
-      base_filename_ = FLAGS_log_dir + basename;
+      base_filename_ = FLAGS_log_dir.get() + basename;
     } else {
       base_filename_ = basename;
     }
@@ -661,9 +2206,8 @@ void LogFileObject::SetExtension(const char* ext) {
   std::lock_guard<std::mutex> lk(lock_);
   if (filename_extension_ != ext) {
     // 正在改名字, 旧日志关闭
-    if (file_ != nullptr) {
-      fclose(file_);
-      file_ = nullptr;
+    if (fd_ >= 0) {
+      CloseLogfile();
       rollover_attempt_ = kRolloverAttemptFrequency - 1;
     }
     filename_extension_ = ext;
@@ -675,14 +2219,44 @@ void LogFileObject::SetSymlinkBasename(const char* symlink_basename) {
   symlink_basename_ = symlink_basename;
 }
 
+void LogFileObject::CopySettingsFrom(LogFileObject& other) {
+  std::scoped_lock lk(lock_, other.lock_);
+  const bool changed = base_filename_selected_ != other.base_filename_selected_ ||
+                       (other.base_filename_selected_ && base_filename_ != other.base_filename_) ||
+                       filename_extension_ != other.filename_extension_;
+  if (changed && fd_ >= 0) {
+    // 名字改变, 旧日志关闭
+    CloseLogfile();
+    rollover_attempt_ = kRolloverAttemptFrequency - 1;
+  }
+  base_filename_selected_ = other.base_filename_selected_;
+  if (base_filename_selected_) {
+    base_filename_ = other.base_filename_;
+  }
+  filename_extension_ = other.filename_extension_;
+  symlink_basename_ = other.symlink_basename_;
+}
+
 void LogFileObject::Flush() {
   std::lock_guard<std::mutex> lk(lock_);
   FlushUnlocked();
 }
 
 void LogFileObject::FlushUnlocked() {
-  if (file_ != nullptr) {
-    fflush(file_); // sys func
+  if (fd_ >= 0) {
+    const int64 flush_start = log_internal_namespace_::StatNowNanos();
+    if (durability_mode_ == DURABILITY_DIRECT) {
+      FlushDirectBuffer();
+    } else {
+      fflush(file_); // sys func
+    }
+    if (durability_mode_ == DURABILITY_GROUP_COMMIT) {
+      // 需要立即刷盘的记录(如 ERROR)不等待组提交窗口
+      fdatasync(fd_);
+    }
+    log_internal_namespace_::StatAdd(log_internal_namespace_::STAT_FLUSH_NS, 
+                                     log_internal_namespace_::StatNowNanos() - flush_start);
+    log_internal_namespace_::StatAdd(log_internal_namespace_::STAT_FLUSHES);
     bytes_since_flush_ = 0;
   }
 
@@ -690,6 +2264,62 @@ void LogFileObject::FlushUnlocked() {
   next_flush_time_ = log_internal_namespace_::CycleClock_Now() + log_internal_namespace_::UsecToCycles(next); 
 }
 
+void LogFileObject::FatalSync(int64 deadline_nanos) {
+  std::unique_lock<std::mutex> lk(lock_, std::defer_lock);
+  if (!TryLockUntil(lk, deadline_nanos) || fd_ < 0) {
+    return;
+  }
+  if (durability_mode_ == DURABILITY_DIRECT) {
+    FlushDirectBuffer();
+  } else {
+    fflush(file_);
+  }
+  fsync(fd_);
+  bytes_since_flush_ = 0;
+}
+
+void LogFileObject::WriteToFile(const char* data, size_t len) {
+  if (durability_mode_ != DURABILITY_DIRECT) {
+    fwrite(data, 1, len, file_);
+    return;
+  }
+  while (len > 0) {
+    const size_t n = std::min(len, kDirectBufferSize - direct_fill_);
+    memcpy(direct_buf_ + direct_fill_, data, n);
+    direct_fill_ += n;
+    data += n;
+    len -= n;
+    if (direct_fill_ == kDirectBufferSize) {
+      if (pwrite(fd_, direct_buf_, kDirectBufferSize, static_cast<off_t>(direct_offset_)) < 0) {
+        return; // errno 由调用者检查
+      }
+      direct_offset_ += kDirectBufferSize;
+      direct_fill_ = 0;
+    }
+  }
+}
+
+void LogFileObject::FlushDirectBuffer() {
+  if (direct_fill_ == 0) {
+    return;
+  }
+  // 尾部补零到整块写入, 再截断到实际长度
+  const size_t aligned = (direct_fill_ + kDirectBlockSize - 1) & ~(kDirectBlockSize - 1);
+  memset(direct_buf_ + direct_fill_, 0, aligned - direct_fill_);
+  if (pwrite(fd_, direct_buf_, aligned, static_cast<off_t>(direct_offset_)) < 0) {
+    return;
+  }
+  if (ftruncate(fd_, static_cast<off_t>(direct_offset_ + direct_fill_)) != 0) {
+    // 忽略错误
+  }
+  // 完整的块已经写入, 只保留尾部不足一块的部分, 下次从这个块开始重写
+  const size_t keep = direct_fill_ % kDirectBlockSize;
+  const size_t full = direct_fill_ - keep;
+  memmove(direct_buf_, direct_buf_ + full, keep);
+  direct_offset_ += full;
+  direct_fill_ = keep;
+}
+
 bool LogFileObject::CreateLogfile(const std::string& time_pid_string) {
   std::string string_filename = base_filename_;
   if (FLAGS_timestamp_in_logfile_name) {
@@ -705,73 +2335,363 @@ bool LogFileObject::CreateLogfile(const std::string& time_pid_string) {
     // 如果文件已存在则会失败
     flags = flags | O_EXCL;
   }
+  const int requested_mode = FLAGS_durability_mode;
+  int mode = requested_mode;
+  if (mode == DURABILITY_DSYNC) {
+    flags |= O_DSYNC;
+  } else if (mode == DURABILITY_DIRECT) {
+    flags |= O_DIRECT | O_DSYNC;
+  }
+  const char* slash = strrchr(filename, PATH_SEPARATOR);
+  const std::string dir = slash ? std::string(filename, static_cast<size_t>(slash - filename + 1)) : std::string(".");
+
+  int fd = -1;
+  if (FLAGS_timestamp_in_logfile_name) {
+    // 使用后台预创建的文件, 只需要一次 linkat 给它命名
+    fd = prepared_->Take(dir, requested_mode);
+    if (fd >= 0) {
+      char proc_path[32];
+      snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+      // 文件名已存在时失败, 与 O_EXCL 相同
+      if (linkat(AT_FDCWD, proc_path, AT_FDCWD, filename, AT_SYMLINK_FOLLOW) != 0) {
+        close(fd);
+        fd = -1;
+      }
+    }
+  }
   // 打开文件
-  int fd = open(filename, flags, static_cast<mode_t>(FLAGS_logfile_mode));
+  if (fd == -1) {
+    fd = open(filename, flags, static_cast<mode_t>(FLAGS_logfile_mode));
+  }
+  if (fd == -1 && mode == DURABILITY_DIRECT && errno == EINVAL) {
+    // 文件系统不支持 O_DIRECT(例如 tmpfs), 退化为 O_DSYNC
+    fprintf(stderr, "O_DIRECT is not supported for '%s', falling back to O_DSYNC\n", filename);
+    mode = DURABILITY_DSYNC;
+    fd = open(filename, (flags & ~O_DIRECT), static_cast<mode_t>(FLAGS_logfile_mode));
+  }
   if (fd == -1) return false;
 
-  // fd 与一个 流 关联
-  file_ = fdopen(fd, "a");
-  if (file_ == nullptr) {
-    close(fd);
+  if (mode == DURABILITY_DIRECT) {
+    bool direct_ready = false;
+    if (posix_memalign(reinterpret_cast<void**>(&direct_buf_), kDirectBlockSize, kDirectBufferSize) == 0) {
+      // 追加到已存在的文件时, 先读入尾部不足一块的部分, 之后从块对齐的偏移开始重写
+      struct stat file_stat;
+      direct_fill_ = 0;
+      direct_offset_ = 0;
+      direct_ready = (fstat(fd, &file_stat) == 0);
+      if (direct_ready && file_stat.st_size > 0) {
+        const uint64 size = static_cast<uint64>(file_stat.st_size);
+        direct_offset_ = size & ~static_cast<uint64>(kDirectBlockSize - 1);
+        direct_fill_ = static_cast<size_t>(size - direct_offset_);
+        if (direct_fill_ > 0) {
+          const int rfd = open(filename, O_RDONLY);
+          direct_ready = rfd >= 0 && pread(rfd, direct_buf_, direct_fill_, static_cast<off_t>(direct_offset_)) ==
+                                     static_cast<ssize_t>(direct_fill_);
+          if (rfd >= 0) close(rfd);
+        }
+      }
+    } else {
+      direct_buf_ = nullptr;
+    }
+    if (!direct_ready) {
+      // 退化为 O_DSYNC + stdio
+      free(direct_buf_);
+      direct_buf_ = nullptr;
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+      mode = DURABILITY_DSYNC;
+    }
+  }
+  if (mode != DURABILITY_DIRECT) {
+    // fd 与一个 流 关联
+    file_ = fdopen(fd, "a");
+    if (file_ == nullptr) {
+      close(fd);
+      if (FLAGS_timestamp_in_logfile_name) {
+        unlink(filename); // 删除创建的文件
+      }
+      return false;
+    }
+  }
+  fd_ = fd;
+  durability_mode_ = mode;
+  if (mode == DURABILITY_PREALLOCATE) {
+    // 随写入逐块预分配, 减少写入时的块分配和元数据更新
+    struct stat file_stat;
+    prealloc_base_ = (fstat(fd_, &file_stat) == 0) ? static_cast<uint64>(file_stat.st_size) : 0;
+    prealloc_end_ = prealloc_base_;
+    GrowPreallocation();
+  }
+
+  const uint32 index_kb = FLAGS_log_index_kb;
+  if (index_kb > 0) {
+    // 稀疏索引, 追加到已存在的日志文件时索引也追加
+    struct stat file_stat;
+    index_base_ = (fstat(fd_, &file_stat) == 0) ? static_cast<uint64>(file_stat.st_size) : 0;
+    index_block_bytes_ = static_cast<uint64>(index_kb) << 10U;
+    index_block_open_ = false;
+    int index_flags = O_WRONLY | O_CREAT | O_APPEND;
     if (FLAGS_timestamp_in_logfile_name) {
-      unlink(filename); // 删除创建的文件
+      index_flags |= O_TRUNC; // 新的日志文件, 丢弃同名的旧索引
     }
-    return false;
+    index_fd_ = open(LogIndexPath(string_filename).c_str(), index_flags, static_cast<mode_t>(FLAGS_logfile_mode));
+  }
+
+  if (mode == DURABILITY_GROUP_COMMIT) {
+    sync_target_ = std::make_shared<GroupCommitTarget>(fd_);
+    group_commit_syncer().Register(sync_target_);
+  }
+  if (FLAGS_drop_log_memory && mode != DURABILITY_DIRECT && !write_behind_exited) {
+    // O_DIRECT 不经过页缓存, 不需要回写和释放
+    struct stat file_stat;
+    const uint64 base = (fstat(fd_, &file_stat) == 0) ? static_cast<uint64>(file_stat.st_size) : 0;
+    write_behind_ = std::make_shared<WriteBehindTarget>(fd_, base);
+    write_behind_manager().Register(write_behind_);
+  }
+
+  UpdateSymlinks(string_filename);
+  if (FLAGS_timestamp_in_logfile_name) {
+    PrepareNextLogfile(dir, requested_mode);
+  }
+  return true;
+}
+
+void LogFileObject::PrepareNextLogfile(const std::string& dir, int mode) {
+  std::shared_ptr<PreparedLogFile> prepared = prepared_;
+  {
+    std::lock_guard<std::mutex> lk(prepared->mutex);
+    if (prepared->unsupported || prepared->pending) {
+      return;
+    }
+    if (prepared->fd >= 0) {
+      if (prepared->dir == dir && prepared->mode == mode) {
+        return;
+      }
+      close(prepared->fd);
+      prepared->fd = -1;
+    }
+    prepared->pending = true;
   }
+  const mode_t file_mode = static_cast<mode_t>(FLAGS_logfile_mode);
+  PostLogFileTask([prepared, dir, mode, file_mode] {
+    int flags = O_WRONLY | O_TMPFILE;
+    if (mode == DURABILITY_DSYNC) {
+      flags |= O_DSYNC;
+    } else if (mode == DURABILITY_DIRECT) {
+      flags |= O_DIRECT | O_DSYNC;
+    }
+    const int fd = open(dir.c_str(), flags, file_mode);
+    const bool unsupported = (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR));
+    // 不预分配: 被使用时由 CreateLogfile 按持久化模式预分配
+    std::lock_guard<std::mutex> lk(prepared->mutex);
+    prepared->pending = false;
+    prepared->unsupported = unsupported;
+    prepared->fd = fd;
+    prepared->dir = dir;
+    prepared->mode = mode;
+  });
+}
 
+void LogFileObject::UpdateSymlinks(const std::string& filename) {
   // 创建一个 名为 <program_name>.<severity> 的软链接
   // 每次我们创建一个新的日志文件, 我们都会删除旧的软链接并创建一个新的, 使得它一直指向新的日志文件
-  if (!symlink_basename_.empty()) {
-    const char* slash = strrchr(filename, PATH_SEPARATOR);
-    // 软链接名
-    const std::string linkname = symlink_basename_ + '.' + LogSeverityNames[severity_];
-    std::string linkpath;
-    if (slash) {
-      // 获取目录名
-      linkpath = std::string(filename, static_cast<size_t>(slash - filename + 1));
-    }
-    linkpath += linkname;
-    unlink(linkpath.c_str()); // 删除旧的软链接
+  if (symlink_basename_.empty()) {
+    return;
+  }
+  const size_t slash = filename.rfind(PATH_SEPARATOR);
+  // 软链接名
+  std::string linkname = symlink_basename_ + '.' + LogSeverityNames[severity_];
+  if (shard_ >= 0) {
+    linkname += ".s" + std::to_string(shard_);
+  }
+  std::string linkpath;
+  if (slash != std::string::npos) {
+    // 获取目录名
+    linkpath = filename.substr(0, slash + 1);
+  }
+  linkpath += linkname;
+  // 使符号链接相对于当前目录(在相同目录内)以便与整个日志目录被移动时仍然有效
+  std::string linkdest = (slash != std::string::npos) ? filename.substr(slash + 1) : filename;
+  // 根据 FLAGS 创建一个指定的软链接
+  std::string extra_linkpath;
+  if (!FLAGS_log_link.empty()) {
+    extra_linkpath = FLAGS_log_link.get() + "/" + linkname;
+  }
 
-    // 包含 unistd.h
-    // 使符号链接相对于当前目录(在相同目录内)以便与整个日志目录被移动时仍然有效
-    const char* linkdest = slash ? (slash + 1) : filename;
+  // unlink + symlink 不在写日志的路径上执行
+  PostLogFileTask([filename, linkpath, linkdest, extra_linkpath] {
+    unlink(linkpath.c_str()); // 删除旧的软链接
     // 此时 linkpath --> linkdest
-    if (symlink(linkdest, linkpath.c_str()) != 0) {
+    if (symlink(linkdest.c_str(), linkpath.c_str()) != 0) {
       // 忽略错误
     }
-
-    // 根据 FLAGS 创建一个指定的软链接
-    if (!FLAGS_log_link.empty()) {
-      linkpath = FLAGS_log_link + "/" + linkname;
-      unlink(linkpath.c_str()); // 删除旧的软链接
-      if (symlink(filename, linkpath.c_str()) != 0) {
+    if (!extra_linkpath.empty()) {
+      unlink(extra_linkpath.c_str()); // 删除旧的软链接
+      if (symlink(filename.c_str(), extra_linkpath.c_str()) != 0) {
         // 忽略错误
       }
     }
+  });
+}
+
+bool LogFileObject::ShouldRoll(time_t timestamp) const {
+  // file_length_ >> 20U 相当于把字节数转化从兆 B --> MB
+  // pid 改变(fork)由 AtForkChild 处理, 这里不需要 getpid()
+  if ((FLAGS_log_roll_policy & ROLL_BY_SIZE) && file_length_ >> 20U >= MaxLogSize()) {
+    return true;
   }
-  return true;
+  return next_roll_time_ != 0 && timestamp >= next_roll_time_;
+}
+
+void LogFileObject::AtForkPrepare() {
+  lock_.lock();
+  FlushUnlocked();
+  prepared_->mutex.lock();
+}
+
+void LogFileObject::AtForkParent() {
+  prepared_->mutex.unlock();
+  lock_.unlock();
+}
+
+void LogFileObject::AtForkChild() {
+  // 预创建的文件属于父进程, 父进程中的后台任务不会在子进程中完成
+  if (prepared_->fd >= 0) {
+    close(prepared_->fd);
+    prepared_->fd = -1;
+  }
+  prepared_->pending = false;
+  prepared_->mutex.unlock();
+  AbandonLogfile();
+  lock_.unlock();
+}
+
+void LogFileObject::AbandonLogfile() {
+  // 父进程暂存的日志由父进程写出
+  std::string().swap(retry_buffer_);
+  retry_severity_mask_ = 0;
+  if (fd_ >= 0) {
+    if (durability_mode_ == DURABILITY_DIRECT) {
+      free(direct_buf_);
+      direct_buf_ = nullptr;
+      direct_fill_ = 0;
+      direct_offset_ = 0;
+      close(fd_);
+    } else {
+      __fpurge(file_);
+      fclose(file_);
+    }
+    sync_target_.reset();
+    write_behind_.reset();
+    if (index_fd_ >= 0) {
+      // 当前块属于父进程, 不写到索引
+      close(index_fd_);
+      index_fd_ = -1;
+    }
+    index_block_open_ = false;
+    file_ = nullptr;
+    fd_ = -1;
+  }
+  file_length_ = bytes_since_flush_ = 0;
+  rollover_attempt_ = kRolloverAttemptFrequency - 1;
+  next_roll_time_ = 0;
+}
+
+void LogFileObject::BufferRecord(LogSeverity record_severity, time_t timestamp,
+                                 const LogSegment* segments, size_t segment_count) {
+  size_t len = 0;
+  for (size_t i = 0; i < segment_count; i++) {
+    len += segments[i].size;
+  }
+  if (retry_buffer_.size() + len > kMaxRetryBufferBytes) {
+    log_internal_namespace_::StatAdd(log_internal_namespace_::STAT_DROPPED_RECORDS);
+    return;
+  }
+  if (retry_buffer_.empty()) {
+    retry_timestamp_ = timestamp;
+  }
+  for (size_t i = 0; i < segment_count; i++) {
+    retry_buffer_.append(segments[i].data, segments[i].size);
+  }
+  retry_severity_mask_ |= 1U << record_severity;
+}
+
+void LogFileObject::FlushRetryBuffer() {
+  if (retry_buffer_.empty()) {
+    return;
+  }
+  const size_t len = retry_buffer_.size();
+  WriteToFile(retry_buffer_.data(), len);
+  if (index_fd_ >= 0) {
+    UpdateIndex(retry_severity_mask_, retry_timestamp_, index_base_ + file_length_, len);
+  }
+  file_length_ += len;
+  bytes_since_flush_ += len;
+  std::string().swap(retry_buffer_); // 释放内存
+  retry_severity_mask_ = 0;
 }
 
 void LogFileObject::Write(bool force_flush, time_t timestamp, const char* message, size_t message_len) {
-  std::lock_guard<std::mutex> lk(lock_);
+  const LogSegment segment = {message, message_len};
+  WriteSegments(force_flush, timestamp, &segment, 1);
+}
+
+void LogFileObject::WriteSegments(bool force_flush, time_t timestamp, const LogSegment* segments, size_t segment_count) {
+  WriteRecord(severity_, force_flush, timestamp, segments, segment_count);
+}
+
+void LogFileObject::WriteRecord(LogSeverity record_severity, bool force_flush, time_t timestamp,
+                                const LogSegment* segments, size_t segment_count) {
+  {
+    std::lock_guard<std::mutex> lk(lock_);
+    WriteRecordLocked(record_severity, force_flush, timestamp, segments, segment_count);
+  }
+  if (!tls_defer_group_commit) {
+    WaitForGroupCommit();
+  }
+}
+
+void LogFileObject::WriteBatch(const base::LogRecordView* records, size_t count) {
+  bool force_flush = false;
+  for (size_t i = 0; i < count; i++) {
+    force_flush = force_flush || records[i].force_flush;
+  }
+  {
+    std::lock_guard<std::mutex> lk(lock_);
+    for (size_t i = 0; i < count; i++) {
+      const base::LogRecordView& record = records[i];
+      WriteRecordLocked(record.severity, force_flush && i + 1 == count, record.timestamp,
+                        record.segments, record.segment_count);
+    }
+  }
+  if (!tls_defer_group_commit) {
+    WaitForGroupCommit();
+  }
+}
+
+void LogFileObject::WriteRecordLocked(LogSeverity record_severity, bool force_flush, time_t timestamp,
+                                      const LogSegment* segments, size_t segment_count) {
   // base_filename_ 是空则不用写
   if (base_filename_selected_ && base_filename_.empty()) {
     return;
   }
 
-  // file_length_ >> 20U 相当于把字节数转化从兆 B --> MB
-  if (file_length_ >> 20U >= MaxLogSize() || log_internal_namespace_::PidHasChanged()) {
-    if (file_ != nullptr) fclose(file_);
-    file_ = nullptr;
-    file_length_ = bytes_since_flush_ = dropped_mem_length_ = 0;
+  // 按滚动策略(大小, 整点, 零点)或者 pid 改变时关闭当前文件
+  if (ShouldRoll(timestamp)) {
+    if (fd_ >= 0) {
+      log_internal_namespace_::StatAdd(log_internal_namespace_::STAT_ROTATIONS);
+    }
+    CloseLogfile();
+    file_length_ = bytes_since_flush_ = 0;
     rollover_attempt_ = kRolloverAttemptFrequency - 1;
   }
   // 如果文件还没创建就先创建
-  if (file_ == nullptr) {
+  if (fd_ < 0) {
     // 会在32次后打开文件
-    // 只有在创建文件时出现问题才会执行此处, 会丢失日志!
-    if (++rollover_attempt_ != kRolloverAttemptFrequency) return;
+    // 只有在创建文件时出现问题才会执行此处, 期间的日志暂存在重试缓冲区, 超出上限的部分丢弃
+    if (++rollover_attempt_ != kRolloverAttemptFrequency) {
+      BufferRecord(record_severity, timestamp, segments, segment_count);
+      return;
+    }
     rollover_attempt_ = 0;
 
     struct ::tm tm_time;
@@ -782,24 +2702,22 @@ void LogFileObject::Write(bool force_flush, time_t timestamp, const char* messag
       localtime_r(&timestamp, &tm_time);
     }
 
-    // 文件名包括 日期/时间 pid 
-    std::ostringstream time_pid_stream;
-    time_pid_stream.fill('0');
-    time_pid_stream << 1900+tm_time.tm_year
-                    << setw(2) << 1 + tm_time.tm_mon
-                    << setw(2) << tm_time.tm_mday
-                    << '-'
-                    << setw(2) << tm_time.tm_hour
-                    << setw(2) << tm_time.tm_min
-                    << setw(2) << tm_time.tm_sec
-                    << '.'
-                    << log_internal_namespace_::GetMainThreadPid();
-    const std::string& time_pid_string = time_pid_stream.str();
+    // 文件名包括 日期/时间 pid, 分片文件: <time>.<pid>.s<shard>
+    char time_pid_buf[64];
+    const int time_pid_len = snprintf(time_pid_buf, sizeof(time_pid_buf), "%04d%02d%02d-%02d%02d%02d.%d",
+                                1900 + tm_time.tm_year, 1 + tm_time.tm_mon, tm_time.tm_mday,
+                                tm_time.tm_hour, tm_time.tm_min, tm_time.tm_sec,
+                                static_cast<int>(log_internal_namespace_::GetMainThreadPid()));
+    if (shard_ >= 0) {
+      snprintf(time_pid_buf + time_pid_len, sizeof(time_pid_buf) - static_cast<size_t>(time_pid_len), ".s%d", shard_);
+    }
+    const std::string time_pid_string(time_pid_buf);
 
     if (base_filename_selected_) {
       if (!CreateLogfile(time_pid_string)) {
         perror("Could not create log file");
         fprintf(stderr, "COULD NOT CREATE LOGFILE '%s'!\n", time_pid_string.c_str());
+        BufferRecord(record_severity, timestamp, segments, segment_count);
         return;
       }
     } else {
@@ -830,10 +2748,28 @@ void LogFileObject::Write(bool force_flush, time_t timestamp, const char* messag
       if (success == false) {
         perror("Could not create log file");
         fprintf(stderr, "COULD NOT CREATE LOGFILE '%s'!\n", time_pid_string.c_str());
+        BufferRecord(record_severity, timestamp, segments, segment_count);
         return;
       }
     }
 
+    // 按时间滚动: 下一个整点或零点(与日志前缀使用相同的时区)
+    next_roll_time_ = 0;
+    const int roll_policy = FLAGS_log_roll_policy;
+    if (roll_policy & (ROLL_HOURLY | ROLL_DAILY)) {
+      struct ::tm next_tm = tm_time;
+      next_tm.tm_min = 0;
+      next_tm.tm_sec = 0;
+      next_tm.tm_isdst = -1;
+      if (roll_policy & ROLL_HOURLY) {
+        next_tm.tm_hour += 1;
+      } else {
+        next_tm.tm_hour = 0;
+        next_tm.tm_mday += 1;
+      }
+      next_roll_time_ = FLAGS_log_utc_time ? timegm(&next_tm) : mktime(&next_tm);
+    }
+
     if (FLAGS_log_file_header) {
       std::ostringstream file_header_stream;
       file_header_stream.fill('0');
@@ -851,14 +2787,17 @@ void LogFileObject::Write(bool force_flush, time_t timestamp, const char* messag
       file_header_stream << "Running duration (h:mm:ss): "
                          << PrettyDuration(static_cast<int>(log_internal_namespace_::WallTime_Now() - start_time_)) << '\n'
                          << "Log line format: [IWEF]" << date_time_format << " "
+                         << (shard_ >= 0 ? "#seq " : "")
                          << "[file:line][severity]: msg" << '\n';
       const string& file_header_string = file_header_stream.str();
 
       const size_t header_len = file_header_string.size();
-      fwrite(file_header_string.data(), 1, header_len, file_);
+      WriteToFile(file_header_string.data(), header_len);
       file_length_ += header_len;
       bytes_since_flush_ += header_len;
     }
+    // 打开失败期间暂存的日志比当前这条早
+    FlushRetryBuffer();
   }
 
   // 写到文件
@@ -866,19 +2805,50 @@ void LogFileObject::Write(bool force_flush, time_t timestamp, const char* messag
     // 当磁盘已满时, fwrite() 对于小于 4096 字节的消息不会返回错误。
     // 对于小于 4096 字节的消息, 它会返回消息的长度. 对于大于 4096 字节的消息, fwrite() 会返回 4096,从而表示发生了错误。
     errno = 0;
-    fwrite(message, 1, message_len, file_);
+    size_t message_len = 0;
+    const bool timing = log_internal_namespace_::g_stats_timing.load(std::memory_order_relaxed);
+    const int64 write_start = timing ? log_internal_namespace_::StatNowNanos() : 0;
+    for (size_t i = 0; i < segment_count; i++) {
+      WriteToFile(segments[i].data, segments[i].size);
+      message_len += segments[i].size;
+    }
+    if (timing) {
+      log_internal_namespace_::StatAdd(log_internal_namespace_::STAT_WRITE_NS, 
+                                       log_internal_namespace_::StatNowNanos() - write_start);
+    }
+    if (durability_mode_ == DURABILITY_DSYNC || durability_mode_ == DURABILITY_GROUP_COMMIT) {
+      // 每条记录都写到内核: O_DSYNC 下返回时已经落盘, 组提交下由后台线程统一同步, 释放锁之后等待
+      fflush(file_);
+      if (sync_target_) {
+        const uint64 seq = sync_target_->written.fetch_add(1, std::memory_order_acq_rel) + 1;
+        if (group_commit_exited) {
+          fdatasync(fd_);
+        } else {
+          AddGroupCommitWait(sync_target_, seq);
+          group_commit_syncer().MarkDirty(sync_target_.get());
+        }
+      }
+    }
     if ( FLAGS_stop_logging_if_full_disk && errno == ENOSPC) {
       // 磁盘不足
       stop_writing = true;
+      log_internal_namespace_::StatAdd(log_internal_namespace_::STAT_DROPPED_RECORDS);
       return;
     } else {
+      if (index_fd_ >= 0 && message_len > 0) {
+        UpdateIndex(1U << record_severity, timestamp, index_base_ + file_length_, message_len);
+      }
       file_length_ += message_len;
       bytes_since_flush_ += message_len;
+      if (durability_mode_ == DURABILITY_PREALLOCATE) {
+        GrowPreallocation();
+      }
     }
   } else {
     if (log_internal_namespace_::CycleClock_Now() >= next_flush_time_) {
       stop_writing = false; // 磁盘已满后过一定时间再尝试, 需要刷新了
     }
+    log_internal_namespace_::StatAdd(log_internal_namespace_::STAT_DROPPED_RECORDS);
     return; // 还没超时, 不需要刷盘
   }
 
@@ -886,23 +2856,9 @@ void LogFileObject::Write(bool force_flush, time_t timestamp, const char* messag
       (log_internal_namespace_::CycleClock_Now() >= next_flush_time_)) {
     FlushUnlocked();
     // Linux
-    // 如果文件长度大于 3MB, 则释放一些文件流中的内存
-    if (FLAGS_drop_log_memory && file_length_ >= (3U << 20U)) {
-      // 对file_length_低 20 位清零(即取整比如 4.2M 取整到 4MB) 并且 - 1M
-      // 最后日志文件只保留 1～2M
-      uint32 total_drop_length = (file_length_ & ~((1U << 20U) - 1U)) - (1U << 20U);
-      uint32 this_drop_length = total_drop_length - dropped_mem_length_;
-      if (this_drop_length >= (2U << 20U)) {
-        // 建议系统释放相关数据块的缓存
-        // fileno(file_) 获得描述符
-        // static_cast<off_t>(dropped_mem_length_) 文件偏移量
-        // static_cast<off_t>(this_drop_length) 要释放的内存
-        // POSIX_FADV_DONTNEED: 建议系统释放相关数据块的缓存
-        posix_fadvise(fileno(file_), static_cast<off_t>(dropped_mem_length_), 
-                      static_cast<off_t>(this_drop_length), POSIX_FADV_DONTNEED);
-        
-        dropped_mem_length_ = total_drop_length;
-      }
+    // 已经写到内核的部分交给后台线程回写, 回写完成后释放页缓存
+    if (write_behind_ && !write_behind_exited) {
+      write_behind_manager().MarkWritten(write_behind_.get(), write_behind_->base + file_length_, false);
     }
   }
 
@@ -935,12 +2891,19 @@ void LogCleaner::Run(bool base_filename_selected,
   assert(enabled_);
   assert(!base_filename_selected || !base_filename.empty());
 
+  // 其他分片正在检查时直接返回
+  std::unique_lock<std::mutex> lk(mutex_, std::try_to_lock);
+  if (!lk.owns_lock()) {
+    return;
+  }
+
   // 避免 扫描日志太频繁
   if (log_internal_namespace_::CycleClock_Now() < next_cleanup_time_) {
     return;
   }
 
   UpdateCleanUpTime();
+  log_internal_namespace_::StatAdd(log_internal_namespace_::STAT_CLEANER_RUNS);
 
   std::vector<std::string> dirs;
 
@@ -962,6 +2925,7 @@ void LogCleaner::Run(bool base_filename_selected,
 
     for (auto& log : logs) {
       static_cast<void>(unlink(log.c_str())); // 删除文件
+      static_cast<void>(unlink(LogIndexPath(log).c_str())); // 删除稀疏索引
     }
   }
 
@@ -995,87 +2959,21 @@ std::vector<std::string> LogCleaner::GetOverdueLogNames(std::string log_director
       }
       // 
       if (IsLogFromCurrentProject(filepath, base_filename, filename_extension) && 
-          IsLogLastModifiedOver(filepath, days)) {
-        overdue_log_names.push_back(filepath);
-      }
-    }
-    closedir(dir);
-  }
-
-  return overdue_log_names;
-}
-
-
-bool LogCleaner::IsLogFromCurrentProject(const std::string& filepath,
-                                 const std::string& base_filename,
-                                 const std::string& filename_extension) const {
-
-  // 移除 base_filename 多余的 '/'
-  // 原来 "/tmp//<base_filename>.<create_time>.<pid>"
-  // 移除 "/tmp/<base_filename>.<create_time>.<pid>"
-  std::string cleaned_base_filename;
-
-  const char* const dir_delim_end = possible_dir_delim + sizeof(possible_dir_delim);
-
-  size_t real_filepath_size = filepath.size();
-  for (char c : base_filename) {
-    if (cleaned_base_filename.empty()) {
-      cleaned_base_filename += c;
-    } else if (std::find(possible_dir_delim, dir_delim_end, c) == dir_delim_end || 
-               (!cleaned_base_filename.empty() && c != cleaned_base_filename.back())) {
-      
-      cleaned_base_filename += c;
-    }
-  }
-
-  // 如果 filename 不以 cleaned_base_filename 开头就返回
-  if (filepath.find(cleaned_base_filename) != 0) {
-    return false;
-  }
-
-  // 如果设置了 filename_extension, 则检查 filename_extension 是否在 cleaned_base_filename 的相邻右边
-  if (!filename_extension.empty()) {
-    if (cleaned_base_filename.size() >= real_filepath_size) {
-      return false;
-    }
-    // 对于原始版本, filename_extension 在 filepath 的中间
-    std::string ext = filepath.substr(cleaned_base_filename.size(), filename_extension.size());
-    if (ext == filename_extension) {
-      cleaned_base_filename += filename_extension;
-    } else {
-      // 对于新版本, filename_extension 在 filepath 的尾部
-      if (filename_extension.size() >= real_filepath_size) {
-        return false;
-      }
-      real_filepath_size = filepath.size() - filename_extension.size();
-      if (filepath.substr(real_filepath_size) != filename_extension) {
-        return false;
+          IsLogLastModifiedOver(filepath, days)) {
+        overdue_log_names.push_back(filepath);
       }
     }
+    closedir(dir);
   }
 
-  // YYYYMMDD-HHMMSS.pid
-  for (size_t i = cleaned_base_filename.size(); i < real_filepath_size; i++) {
-    const char& c = filepath[i];
+  return overdue_log_names;
+}
 
-    if (i <= cleaned_base_filename.size() + 7) {
-      // 0~7: YYYYMMDD
-      if (c < '0' || c > '9') {return false;}
-    } else if (i == cleaned_base_filename.size() + 8) {
-      // 8: -
-      if (c != '-') {return false;}
-    } else if (i <= cleaned_base_filename.size() + 14) {
-      // 9~14: HHMMSS
-      if (c < '0' || c > '9') {return false;}
-    } else if (i == cleaned_base_filename.size() + 15) {
-      // 15: .
-      if (c != '.') {return false;}
-    } else if (i >= cleaned_base_filename.size() + 16) {
-      // 16+: pid
-      if (c < '0' || c > '9') {return false;}
-    }
-  }
-  return true;
+
+bool LogCleaner::IsLogFromCurrentProject(const std::string& filepath,
+                                 const std::string& base_filename,
+                                 const std::string& filename_extension) const {
+  return log_internal_namespace_::IsLogFileName(filepath, base_filename, filename_extension);
 }
 
 bool LogCleaner::IsLogLastModifiedOver(const std::string& filepath, unsigned int days) const {
@@ -1099,20 +2997,26 @@ bool LogCleaner::IsLogLastModifiedOver(const std::string& filepath, unsigned int
 
 // 因为多个线程可能同时调用 LOG(FATAL), 我们需要保留第一个 FATAL 信息
 // 申请两个 log data 空间, 一个由第一个线程独享, 一个由所有其他线程共享
-static std::mutex fatal_msg_lock;
 static log_internal_namespace_::CrashReason crash_reason;
-static bool fatal_msg_exclusive = true;
+static std::atomic<bool> fatal_msg_exclusive{true};
 static LogMessage::LogMessageData fatal_msg_data_exclusive;
-static LogMessage::LogMessageData fatal_msg_data_shared;
 
 /* ---------------------------------- LogMessage -------------------------------------------- */
 
 
 LogMessage::LogMessageData::LogMessageData()
-  : stream_(message_text_, LogMessage::kMaxLogMessageLen, 0) { 
+  : stream_(message_text_, LogMessage::kInlineMessageLen, 0) { 
   // 初始化 LogStream
 }
 
+static size_t GetMessageSegments(const LogMessage::LogMessageData* data, bool body_only, LogSegment* out) {
+  if (body_only) {
+    return data->stream_.buf().GetSegments(data->num_prefix_chars_, 
+                                           data->num_chars_to_log_ - data->num_prefix_chars_ - 1, out);
+  }
+  return data->stream_.buf().GetSegments(0, data->num_chars_to_log_, out);
+}
+
 LogMessage::LogMessage(const char* file, int line, LogSeverity severity, int64 ctr, SendMethod send_method)
     : allocated_(nullptr) {
   Init(file, line, severity, send_method);
@@ -1122,7 +3026,12 @@ LogMessage::LogMessage(const char* file, int line, LogSeverity severity, int64 c
 LogMessage::LogMessage(const char* file, int line, const CheckOpString& result)
     : allocated_(nullptr) {
   Init(file, line, LOG_FATAL, &LogMessage::SendToLog);
-  stream() << "check failed: " << (*result.str_) << " ";
+  stream() << "Check failed: " << (*result.str_) << " ";
+}
+
+LogMessage::LogMessage(const LogSite* site) : allocated_(nullptr) {
+  Init(site->fullname, site->basename, site->line, site->severity, &LogMessage::SendToLog);
+  data_->site_ = site;
 }
 
 LogMessage::LogMessage(const char* file, int line) : allocated_(nullptr) {
@@ -1152,24 +3061,30 @@ LogMessage::LogMessage(const char* file, int line, LogSeverity severity, std::st
   data_->message_ = message;
 }
 
+LogMessage::LogMessage(const char* file, int line, LogSeverity severity, LogCapture* capture)
+    : allocated_(nullptr) {
+  Init(file, line, severity, &LogMessage::SaveToCapture);
+  data_->capture_ = capture;
+}
+
 void LogMessage::Init(const char* file, int line, LogSeverity severity, void (LogMessage::*send_method)()) {
+  Init(file, log_internal_namespace_::const_basename(file), line, severity, send_method);
+}
+
+void LogMessage::Init(const char* file, const char* basename, int line, LogSeverity severity,
+                      void (LogMessage::*send_method)()) {
   allocated_ = nullptr;
-  if (severity != LOG_FATAL) {
+  if (severity == LOG_FATAL && fatal_msg_exclusive.exchange(false, std::memory_order_acq_rel)) {
+    // 第一个 FATAL msg 使用静态的 data, 用于保存崩溃原因, 不需要加锁
+    data_ = &fatal_msg_data_exclusive;
+    data_->first_fatal_ = true;
+  } else {
     allocated_ = new LogMessageData();
     data_ = allocated_;
     data_->first_fatal_ = false;
-  } else {
-    std::lock_guard<std::mutex> lk(fatal_msg_lock);
-    if (fatal_msg_exclusive) {
-      // 第一个 FATAL msg
-      fatal_msg_exclusive = false;
-      data_ = &fatal_msg_data_exclusive;
-      data_->first_fatal_ = true;
-    } else {
-      data_ = &fatal_msg_data_shared;
-      data_->first_fatal_ = false;
-    }
   }
+  data_->fatal_exit_ = severity == LOG_FATAL && exit_on_dfatal.load(std::memory_order_relaxed);
+  data_->stream_.buf().set_limit(FLAGS_max_log_message_len);
 
   data_->preserved_errno_ = errno;
   data_->severity_ = severity;
@@ -1178,13 +3093,16 @@ void LogMessage::Init(const char* file, int line, LogSeverity severity, void (Lo
   data_->sink_ = nullptr;
   data_->outvec_ = nullptr;
   data_->message_ = nullptr; // ??: add message_ nullptr
-  WallTime now = log_internal_namespace_::WallTime_Now();
+  data_->context_ = current_log_context.get();
+  data_->site_ = nullptr;
+  data_->route_ = kRouteDefault;
+  WallTime now = log_internal_namespace_::MessageTime_Now();
   time_t timestamp_now = static_cast<time_t>(now);
   logmsgtime_ = LogMessageTime(timestamp_now, now);
 
   data_->num_chars_to_log_ = 0;
   data_->num_chars_to_syslog_ = 0;
-  data_->basename_ = log_internal_namespace_::const_basename(file);
+  data_->basename_ = basename;
   data_->fullname_ = file;
   data_->has_been_flushed_ = false;
 
@@ -1204,11 +3122,21 @@ void LogMessage::Init(const char* file, int line, LogSeverity severity, void (Lo
              << setw(2) << logmsgtime_.hour() << ':'
              << setw(2) << logmsgtime_.min() << ':'
              << setw(2) << logmsgtime_.sec() << "."
-             << setw(6) << logmsgtime_.usec() << " ["
-             << data_->basename_ << ':' << data_->line_ << "]["
+             << setw(6) << logmsgtime_.usec() << " ";
+    if (FLAGS_log_shards > 0 && LogDestination::ShardedWriteEnabled()) {
+      // 分片模式: 全局序号, 用于合并多个分片文件
+      stream() << '#' << log_sequence.fetch_add(1, std::memory_order_relaxed) << ' ';
+    }
+    stream() << '[' << data_->basename_ << ':' << data_->line_ << "]["
              << LogSeverityNames[severity] << "]: ";
+    if (data_->context_ != nullptr) {
+      // 上下文前缀在 ScopedLogContext 创建时已经渲染好
+      const std::string& context_prefix = data_->context_->prefix();
+      stream().write(context_prefix.data(), static_cast<std::streamsize>(context_prefix.size()));
+    }
 
-    stream().copyfmt(saved_fmt); // 替换回原来的流格式
+    // 替换回原来的流格式, locale 和回调列表没有变化, 不需要 LogStream::copyfmt() 重新计算
+    stream().std::ostream::copyfmt(saved_fmt);
   }
 
   data_->num_prefix_chars_ = data_->stream_.pcount();
@@ -1223,11 +3151,25 @@ LogMessage::~LogMessage() {
   delete allocated_;
 }
 
+LogMessageFatal::LogMessageFatal(const LogSite* site) : LogMessage(site) {
+  data_->fatal_exit_ = true;
+}
+
+LogMessageFatal::LogMessageFatal(const char* file, int line, const CheckOpString& result)
+    : LogMessage(file, line, result) {
+  data_->fatal_exit_ = true;
+}
+
+LogMessageFatal::~LogMessageFatal() {
+  Flush();
+  LogMessage::Fail();
+}
+
 int LogMessage::preserved_errno() const {
   return data_->preserved_errno_;
 }
 
-std::ostream& LogMessage::stream() {
+LogMessage::LogStream& LogMessage::stream() {
   return data_->stream_;
 }
 
@@ -1236,30 +3178,116 @@ void LogMessage::Flush() {
     return;
   }
 
+  // 直接修改 stream_ 缓冲区: 写入截断标记并确保以 '\n' 结尾
+  const bool append_newline = data_->stream_.buf().Seal();
   data_->num_chars_to_log_ = data_->stream_.pcount();
-  data_->num_chars_to_syslog_ = data_->num_chars_to_log_ - data_->num_prefix_chars_;
+  data_->num_chars_to_syslog_ = data_->num_chars_to_log_ - data_->num_prefix_chars_ - (append_newline ? 1 : 0);
 
-  bool append_newline = (data_->message_text_[data_->num_chars_to_log_-1] != '\n');
-  char original_final_char = '\0'; // 用来保存原来的最后一个字符
+  if (data_->stream_.buf().dropped() > 0) {
+    log_internal_namespace_::StatAdd(log_internal_namespace_::STAT_TRUNCATED_RECORDS);
+  }
 
-  // 直接修改 stream_ 缓冲区
-  if (append_newline) {
-    original_final_char = data_->message_text_[data_->num_chars_to_log_];
-    data_->message_text_[data_->num_chars_to_log_++] = '\n';
+  if (FLAGS_log_dedup_ms > 0) {
+    const uint32 now_ms = DedupMillis(logmsgtime_.timestamp(), logmsgtime_.usec());
+    // 其他调用点的窗口结束后写出它们的汇总, 每 1/4 个窗口最多检查一次
+    // 到了刷盘周期(FLAGS_logbufsecs)时不等窗口结束, 写出所有汇总, 窗口很长时汇总也不会停留太久
+    if (dedup_pending_count.load(std::memory_order_relaxed) > 0) {
+      const int64 now_cycles = log_internal_namespace_::CycleClock_Now();
+      int64 due = dedup_report_time.load(std::memory_order_relaxed);
+      uint32 last = dedup_last_check.load(std::memory_order_relaxed);
+      if (now_cycles >= due &&
+          dedup_report_time.compare_exchange_strong(
+              due, now_cycles + log_internal_namespace_::UsecToCycles(FLAGS_logbufsecs * static_cast<int64>(1000000)),
+              std::memory_order_relaxed)) {
+        ReportRepeats(true, now_ms);
+      } else if (static_cast<int32>(now_ms - last) >= std::max<int32>(FLAGS_log_dedup_ms / 4, 1) &&
+                 dedup_last_check.compare_exchange_strong(last, now_ms, std::memory_order_relaxed)) {
+        ReportRepeats(false, now_ms);
+      }
+    }
+    if (data_->site_ != nullptr && data_->send_method_ == &LogMessage::SendToLog && !data_->fatal_exit_ &&
+        CoalesceRepeat()) {
+      LogDestination::WaitForSinks(data_);
+      data_->stream_.buf().Unseal(append_newline);
+      if (data_->preserved_errno_ != 0) {
+        errno = data_->preserved_errno_;
+      }
+      data_->has_been_flushed_ = true;
+      return;
+    }
   }
-  data_->message_text_[data_->num_chars_to_log_] = '\0';
 
-  {
-    std::lock_guard<std::mutex> lk(log_mutex);
+  if (data_->send_method_ == &LogMessage::SendToLog && data_->severity_ != LOG_FATAL &&
+      LogDestination::ShardedWriteEnabled()) {
+    // 分片模式: 每个分片文件有自己的锁, 不需要 log_mutex
+    tls_sharded_write = true;
+    tls_defer_group_commit = true;
+    SendToLog();
+    tls_defer_group_commit = false;
+    tls_sharded_write = false;
+    num_messages_[static_cast<int>(data_->severity_)].fetch_add(1, std::memory_order_relaxed);
+    WaitForGroupCommit();
+  } else if (data_->send_method_ == &LogMessage::SaveToCapture && data_->severity_ != LOG_FATAL &&
+             data_->capture_ != nullptr && !data_->capture_->also_log()) {
+    // 只捕获: LogCapture 属于调用者, 不需要 log_mutex
+    SaveToCapture();
+    num_messages_[static_cast<int>(data_->severity_)].fetch_add(1, std::memory_order_relaxed);
+  } else {
+    if (data_->fatal_exit_ && tls_in_fatal) {
+      // 处理 FATAL 的过程中(例如 sink 中)再次 FATAL: 只写 stderr, 直接结束进程
+      LogSegment segments[base_logging::LogStreamBuf::kMaxSegments];
+      const size_t segment_count = GetMessageSegments(data_, false, segments);
+      for (size_t i = 0; i < segment_count; i++) {
+        if (write(STDERR_FILENO, segments[i].data, segments[i].size) < 0) {
+          // Ignore errors.
+        }
+      }
+      Fail();
+    }
+
+    // 先尝试不等待地获取锁, 只有发生竞争时才统计等待时间
+    std::unique_lock<std::mutex> lk(log_mutex, std::defer_lock);
+    if (!(data_->fatal_exit_ && tls_holds_log_mutex) && !lk.try_lock()) {
+      const int64 wait_start = log_internal_namespace_::StatNowNanos();
+      if (data_->fatal_exit_) {
+        // FATAL 不无限等待: 持有锁的线程可能已经卡住, 超时后不加锁继续
+        TryLockUntil(lk, wait_start + kFatalWaitNanos);
+      } else {
+        lk.lock();
+      }
+      log_internal_namespace_::StatAdd(log_internal_namespace_::STAT_MUTEX_WAIT_NS, 
+                                       log_internal_namespace_::StatNowNanos() - wait_start);
+      log_internal_namespace_::StatAdd(log_internal_namespace_::STAT_MUTEX_CONTENDED);
+    }
+    tls_holds_log_mutex = lk.owns_lock();
+    if (data_->fatal_exit_) {
+      tls_in_fatal = true;
+    }
+    // 组提交模式下写文件后在释放 log_mutex 之后等待同步, 等待期间其他线程的日志可以一起同步
+    if (!data_->fatal_exit_) {
+      tls_defer_group_commit = true;
+    }
     (this->*(data_->send_method_))(); // 执行回调函数(日志发送下一步处理)
-    ++num_messages_[static_cast<int>(data_->severity_)];
+    tls_defer_group_commit = false;
+    tls_holds_log_mutex = false;
+    num_messages_[static_cast<int>(data_->severity_)].fetch_add(1, std::memory_order_relaxed);
+    if (tls_group_commit_waits.count > 0) {
+      lk.unlock();
+      WaitForGroupCommit();
+    }
+
+    if (data_->fatal_exit_) {
+      // 进程即将结束, 先释放锁, 让其他线程的日志可以完成
+      if (lk.owns_lock()) {
+        lk.unlock();
+      }
+      FlushFatalAndFail();
+    }
   }
   LogDestination::WaitForSinks(data_);
 
-  if (append_newline) {
-    // 恢复到换行符增加前
-    data_->message_text_[data_->num_chars_to_log_ - 1] = original_final_char;
-  }
+  // 恢复到换行符增加前
+  data_->stream_.buf().Unseal(append_newline);
 
   // 如果在日志调用前 errno 已经被设置了, 那么在日志记录后不能改变 errno, 需要设置回原来的值
   if (data_->preserved_errno_ != 0) {
@@ -1284,7 +3312,123 @@ void ReprintFatalMessage() {
       // 避免重复打印
       WriteToStderr(fatal_message, n);
     }
-    LogDestination::LogToAllLogfiles(LOG_ERROR, fatal_time, fatal_message, n);
+    const LogSegment segment = {fatal_message, n};
+    LogDestination::LogToAllLogfiles(LOG_ERROR, fatal_time, 0, &segment, 1);
+  }
+}
+
+bool LogMessage::CoalesceRepeat() {
+  const LogSite* site = data_->site_;
+  const int32 window = FLAGS_log_dedup_ms;
+  const uint32 now_ms = DedupMillis(logmsgtime_.timestamp(), logmsgtime_.usec());
+  LogSegment body[base_logging::LogStreamBuf::kMaxSegments];
+  const size_t body_count = GetMessageSegments(data_, true, body);
+  const uint64 hash = HashSegments(body, body_count);
+  const uint64 length = SegmentsLength(body, body_count);
+
+  uint32 seq = 0;
+  while (true) {
+    seq = site->dedup_seq.load(std::memory_order_acquire);
+    if (seq & 1U) {
+      // 其他线程正在开始新窗口
+      std::this_thread::yield();
+      continue;
+    }
+    // 长度和 64 位哈希都相同才认为是重复的日志
+    // 多个线程的时间戳可能略有先后, 窗口开始之前的时间也算在窗口内
+    const bool repeated = site->dedup_hash.load(std::memory_order_relaxed) == hash &&
+                          site->dedup_len.load(std::memory_order_relaxed) == length &&
+                          static_cast<int32>(now_ms - site->dedup_start.load(std::memory_order_relaxed)) < window;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (site->dedup_seq.load(std::memory_order_relaxed) != seq) {
+      continue;
+    }
+    if (repeated) {
+      // 并发开始新窗口时计数可能记到新窗口中, 汇总的次数是近似值
+      if (site->dedup_count.fetch_add(1, std::memory_order_relaxed) == 0) {
+        std::lock_guard<std::mutex> lk(dedup_mutex);
+        if (std::find(dedup_pending.begin(), dedup_pending.end(), site) == dedup_pending.end()) {
+          if (dedup_pending.empty()) {
+            dedup_report_time.store(log_internal_namespace_::CycleClock_Now() +
+                                        log_internal_namespace_::UsecToCycles(FLAGS_logbufsecs * static_cast<int64>(1000000)),
+                                    std::memory_order_relaxed);
+          }
+          dedup_pending.push_back(site);
+          dedup_pending_count.store(dedup_pending.size(), std::memory_order_relaxed);
+        }
+      }
+      log_internal_namespace_::StatAdd(log_internal_namespace_::STAT_COALESCED_RECORDS);
+      if (LogDestination::HasRawSinks()) {
+        data_->route_ = kRouteRawSinksOnly | LogRouteFor(site, data_->fullname_, data_->severity_);
+        LogDestination::LogToSinks(data_->severity_, data_->fullname_, data_->basename_, data_->line_,
+                                   logmsgtime_, data_->context_, body, body_count, data_->route_);
+      } else {
+        data_->route_ = kRouteRawSinksOnly;
+      }
+      return true;
+    }
+    if (site->dedup_seq.compare_exchange_weak(seq, seq + 1, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+      break;
+    }
+  }
+  // 开始新窗口: 先写出上一个窗口的汇总
+  std::atomic_thread_fence(std::memory_order_release);
+  site->dedup_hash.store(hash, std::memory_order_relaxed);
+  site->dedup_len.store(length, std::memory_order_relaxed);
+  site->dedup_start.store(now_ms, std::memory_order_relaxed);
+  const uint32 repeated = site->dedup_count.exchange(0, std::memory_order_acq_rel);
+  site->dedup_seq.store(seq + 2, std::memory_order_release);
+  if (repeated > 0) {
+    LogMessage summary(site->fullname, site->line, std::min<LogSeverity>(site->severity, LOG_ERROR));
+    summary.data_->route_ |= kRouteSkipRawSinks;
+    summary.stream() << "last message repeated " << repeated << " times";
+  }
+  // 需要原始日志的 sink 正常收到这一条
+  return false;
+}
+
+void LogMessage::ReportRepeats(bool force, uint32 now_ms, bool unlocked) {
+  std::vector<std::pair<const LogSite*, uint32>> reports;
+  {
+    std::unique_lock<std::mutex> lk(dedup_mutex, std::defer_lock);
+    if (force && !unlocked) {
+      lk.lock();
+    } else if (!lk.try_lock()) {
+      return;
+    }
+    size_t kept = 0;
+    for (const LogSite* site : dedup_pending) {
+      const uint32 start = site->dedup_start.load(std::memory_order_acquire);
+      if (!force && static_cast<int32>(now_ms - start) < FLAGS_log_dedup_ms) {
+        dedup_pending[kept++] = site;
+        continue;
+      }
+      // 窗口已经结束: 下一条日志会开始新窗口, 不会再写一次汇总
+      const uint32 repeated = site->dedup_count.exchange(0, std::memory_order_acq_rel);
+      if (repeated > 0) {
+        reports.emplace_back(site, repeated);
+      }
+    }
+    dedup_pending.resize(kept);
+    dedup_pending_count.store(kept, std::memory_order_relaxed);
+  }
+  // 不持有 dedup_mutex 时写出
+  for (const auto& report : reports) {
+    const LogSite* site = report.first;
+    LogMessage summary(site->fullname, site->line, std::min<LogSeverity>(site->severity, LOG_ERROR));
+    summary.data_->route_ |= kRouteSkipRawSinks;
+    summary.stream() << "last message repeated " << report.second << " times";
+    if (unlocked) {
+      // 不经过 Flush(): 直接写入日志文件, 不获取 log_mutex 和文件锁
+      LogMessageData* data = summary.data_;
+      data->stream_.buf().Seal();
+      data->num_chars_to_log_ = data->stream_.pcount();
+      LogSegment segments[base_logging::LogStreamBuf::kMaxSegments];
+      const size_t segment_count = GetMessageSegments(data, false, segments);
+      LogDestination::LogToAllLogfilesUnsafe(data->severity_, summary.logmsgtime_.timestamp(), segments,
+                                             segment_count);
+      data->has_been_flushed_ = true;
+    }
   }
 }
 
@@ -1293,7 +3437,7 @@ void LogMessage::SendToLog() {
   static bool already_warned_before_initgoolgle = false;
   // 确保持有锁
   
-  assert(data_->num_chars_to_log_ > 0 && data_->message_text_[data_->num_chars_to_log_ - 1] == '\n');
+  assert(data_->num_chars_to_log_ > 0);
 
   if (!already_warned_before_initgoolgle && !IsLoggingInitialized()) {
     const char w[] = "WARNING: Logging before InitLogginging() is written to STDERR\n";
@@ -1301,74 +3445,139 @@ void LogMessage::SendToLog() {
     already_warned_before_initgoolgle = true;
   }
 
+  LogSegment segments[base_logging::LogStreamBuf::kMaxSegments];
+  const size_t segment_count = GetMessageSegments(data_, false, segments);
+  LogSegment body[base_logging::LogStreamBuf::kMaxSegments];
+  const size_t body_count = data_->fatal_exit_ ? 0 : GetMessageSegments(data_, true, body);
+
   if (FLAGS_logtostderr || FLAGS_logtostdout || !IsLoggingInitialized()) {
+    const size_t len = SegmentsLength(segments, segment_count);
     if (FLAGS_logtostdout) {
-      ColoredWriteToStdout(data_->severity_, data_->message_text_, data_->num_chars_to_log_);
+      ColoredWriteToStdout(data_->severity_, segments, segment_count);
+      log_internal_namespace_::StatMessage(data_->severity_, STAT_DEST_STDOUT, len);
     } else {
-      ColoredWriteToStderr(data_->severity_, data_->message_text_, data_->num_chars_to_log_);
+      ColoredWriteToStderr(data_->severity_, segments, segment_count);
+      log_internal_namespace_::StatMessage(data_->severity_, STAT_DEST_STDERR, len);
     }
 
     // 如果有需要这里可以用 FLAG 保护起来
-    // 不发送头部
-    LogDestination::LogToSinks(data_->severity_, data_->fullname_, data_->basename_,
-                              data_->line_, logmsgtime_, data_->message_text_ + data_->num_prefix_chars_,
-                              (data_->num_chars_to_log_ - data_->num_prefix_chars_ - 1) );
+    // 不发送头部, 结束进程的 FATAL 在 FlushFatalAndFail() 中发送
+    if (!data_->fatal_exit_) {
+      LogDestination::LogToSinks(data_->severity_, data_->fullname_, data_->basename_,
+                                data_->line_, logmsgtime_, data_->context_, body, body_count, data_->route_);
+    }
 
   } else {
-    // 把日志文件落地
-    LogDestination::LogToAllLogfiles(data_->severity_, logmsgtime_.timestamp(), 
-                                    data_->message_text_, data_->num_chars_to_log_);
-
-    LogDestination::MaybeLogToStderr(data_->severity_, data_->message_text_, 
-                                    data_->num_chars_to_log_, data_->num_prefix_chars_);
+    // 路由表为空时不需要查找; LOG() 的调用点缓存了匹配结果
+    data_->route_ = (data_->route_ & kRouteMessageFlags) | LogRouteFor(data_->site_, data_->fullname_, data_->severity_);
+    if (data_->route_ & kRouteDefault) {
+      // 把日志文件落地
+      LogDestination::LogToAllLogfiles(data_->severity_, logmsgtime_.timestamp(), logmsgtime_.usec(),
+                                      segments, segment_count);
+
+      LogDestination::MaybeLogToStderr(data_->severity_, segments, 
+                                      segment_count, data_->num_prefix_chars_);
+    } else {
+      LogDestination::LogToRoutedLogfiles(data_->severity_, data_->route_, logmsgtime_.timestamp(),
+                                          logmsgtime_.usec(), segments, segment_count);
+    }
     
-    LogDestination::LogToSinks(data_->severity_, data_->fullname_, data_->basename_,
-                              data_->line_, logmsgtime_, data_->message_text_ + data_->num_prefix_chars_,
-                              (data_->num_chars_to_log_ - data_->num_prefix_chars_ - 1) );
+    if (!data_->fatal_exit_) {
+      LogDestination::LogToSinks(data_->severity_, data_->fullname_, data_->basename_,
+                                data_->line_, logmsgtime_, data_->context_, body, body_count, data_->route_);
+    }
   }
 
   // 如果我们记录了一个致命错误的消息, 将所有的日志输出刷新一遍
   // 然后发送一个信号让其他人来处理. 我们保持日志处于一种状态, 其他人可以使用它们(只要在之后也进行了刷新)
-  if (data_->severity_ == LOG_FATAL && exit_on_dfatal) {
+  if (data_->fatal_exit_) {
     if (data_->first_fatal_) {
       // 保存错误信息
       RecordCrashReason(&crash_reason);
       log_internal_namespace_::SetCrashReason(&crash_reason);
 
       // 保存最短的错误信息
-      const size_t copy = std::min(data_->num_chars_to_log_, sizeof(fatal_message) - 1);
-      memcpy(fatal_message, data_->message_text_, copy);
+      size_t copy = 0;
+      for (size_t i = 0; i < segment_count && copy < sizeof(fatal_message) - 1; i++) {
+        const size_t n = std::min(segments[i].size, sizeof(fatal_message) - 1 - copy);
+        memcpy(fatal_message + copy, segments[i].data, n);
+        copy += n;
+      }
       fatal_message[copy] = '\0';
       fatal_time = logmsgtime_.timestamp();
     }
+    // 刷盘和结束进程在 Flush() 释放 log_mutex 之后进行(FlushFatalAndFail)
+  }
 
-    if (!FLAGS_logtostderr && !FLAGS_logtostdout) {
-      for (auto& log_destination : LogDestination::log_destinations_) {
-        if (log_destination) {
-          log_destination->logger_->Write(true, 0, "", 0);
-        }
-      }
-    }
+}
 
-    // 释放锁, 因为这里是 fatal 信息, 进程会被结束
-    log_mutex.unlock();
-    LogDestination::WaitForSinks(data_);
+// FATAL 路径的看门狗: 刷盘或者 sink 卡住, 超过时间还没有结束进程时由 SIGALRM 结束进程
+// 信号处理函数中只调用异步信号安全的函数(write, abort)
+static void FatalWatchdogHandler(int /*signo*/) {
+  const char message[] = "*** Fatal log flush timed out, aborting ***\n";
+  if (write(STDERR_FILENO, message, sizeof(message) - 1) < 0) {
+    // Ignore errors.
+  }
+  abort();
+}
 
-    const char* message = "*** Check failure stack trace: ***\n";
-    if (write(STDERR_FILENO, message, strlen(message)) < 0) {
-      // Ignore errors.
-    }
+// nanos 之后触发看门狗, nanos 为 0 时取消; 不需要创建线程, 内存不足或者线程数达到上限时也能工作
+static void ArmFatalWatchdog(int64 nanos) {
+  if (nanos > 0) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = FatalWatchdogHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESETHAND;
+    sigaction(SIGALRM, &action, nullptr);
+    // 其他线程可能都屏蔽了 SIGALRM, 当前线程一定能收到
+    sigset_t alarm_set;
+    sigemptyset(&alarm_set);
+    sigaddset(&alarm_set, SIGALRM);
+    pthread_sigmask(SIG_UNBLOCK, &alarm_set, nullptr);
+  }
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  timer.it_value.tv_sec = static_cast<time_t>(nanos / 1000000000);
+  timer.it_value.tv_usec = static_cast<suseconds_t>(nanos % 1000000000 / 1000);
+  setitimer(ITIMER_REAL, &timer, nullptr);
+}
+
+// 在 Flush() 中调用, 不持有 log_mutex
+// 先把日志文件落盘(等待锁有截止时间, 落盘使用 write/fsync), 再发送给 sink
+// sink 是用户代码, 可能阻塞: 不在新线程中等待它(FATAL 时可能无法创建线程), 而是由看门狗限制整个过程的时间
+void LogMessage::FlushFatalAndFail() {
+  // 刷盘和 sink 各 kFatalWaitNanos, 超时后看门狗直接 abort
+  ArmFatalWatchdog(2 * kFatalWaitNanos);
+  const int64 deadline = log_internal_namespace_::StatNowNanos() + kFatalWaitNanos;
+  if (!FLAGS_logtostderr && !FLAGS_logtostdout) {
+    LogDestination::FatalSyncLogFiles(deadline);
+  }
+
+  LogSegment body[base_logging::LogStreamBuf::kMaxSegments];
+  const size_t body_count = GetMessageSegments(data_, true, body);
+  LogDestination::LogToSinks(data_->severity_, data_->fullname_, data_->basename_,
+                             data_->line_, logmsgtime_, data_->context_, body, body_count, data_->route_);
+  LogDestination::WaitForSinks(data_);
 
-    // 结束进程
-    Fail();
+  const char* message = "*** Check failure stack trace: ***\n";
+  if (write(STDERR_FILENO, message, strlen(message)) < 0) {
+    // Ignore errors.
   }
 
+  // 用户设置的 Fail 函数可能不结束进程(例如抛出异常), 先取消看门狗
+  ArmFatalWatchdog(0);
+  // 结束进程
+  Fail();
 }
 
 void LogMessage::RecordCrashReason(log_internal_namespace_::CrashReason* reason) {
   reason->filename = fatal_msg_data_exclusive.fullname_;
   reason->line_number = fatal_msg_data_exclusive.line_;
-  reason->message = fatal_msg_data_exclusive.message_text_ + fatal_msg_data_exclusive.num_prefix_chars_; // 不记录头部
+  // 不记录头部, 每个分段都以 '\0' 结尾, 超长消息只记录首段
+  reason->message = fatal_msg_data_exclusive.message_text_ + 
+                    std::min(fatal_msg_data_exclusive.num_prefix_chars_, 
+                             strlen(fatal_msg_data_exclusive.message_text_));
   reason->depth = 0;
 }
 
@@ -1379,6 +3588,14 @@ void InstallFailureFunction(logging_fail_func_t fail_func) {
   logging_fail_func = fail_func;
 }
 
+void SetExitOnDFatal(bool value) {
+  exit_on_dfatal.store(value, std::memory_order_relaxed);
+}
+
+bool GetExitOnDFatal() {
+  return exit_on_dfatal.load(std::memory_order_relaxed);
+}
+
 void LogMessage::Fail() {
   logging_fail_func();
 }
@@ -1387,10 +3604,13 @@ void LogMessage::Fail() {
 void LogMessage::SendToSink() {
   // 确保持有锁
   if (data_->sink_ != nullptr) {
-    assert(data_->num_chars_to_log_ > 0 && data_->message_text_[data_->num_chars_to_log_ - 1] == '\n');
+    assert(data_->num_chars_to_log_ > 0);
 
+    LogSegment body[base_logging::LogStreamBuf::kMaxSegments];
+    const size_t body_count = GetMessageSegments(data_, true, body);
     data_->sink_->send(data_->severity_, data_->fullname_, data_->basename_, data_->line_,
-                      logmsgtime_, data_->message_text_ + data_->num_prefix_chars_, (data_->num_chars_to_log_ - data_->num_prefix_chars_ - 1));
+                      logmsgtime_, data_->context_, body, body_count);
+    log_internal_namespace_::StatMessage(data_->severity_, STAT_DEST_SINK, SegmentsLength(body, body_count));
 
   }
 }
@@ -1404,12 +3624,13 @@ void LogMessage::SendToSinkAndLog() {
 // 确保持有锁
 void LogMessage::SaveOrSendToLog() {
   if (data_->outvec_ != nullptr) {
-    assert(data_->num_chars_to_log_ > 0 && data_->message_text_[data_->num_chars_to_log_ - 1] == '\n');
+    assert(data_->num_chars_to_log_ > 0);
 
-    // 类型转换
-    const char* start = data_->message_text_ + data_->num_prefix_chars_;
-    size_t len = data_->num_chars_to_log_ - data_->num_prefix_chars_ - 1;
-    data_->outvec_->push_back(std::string(start, len));
+    LogSegment body[base_logging::LogStreamBuf::kMaxSegments];
+    const size_t body_count = GetMessageSegments(data_, true, body);
+    data_->outvec_->emplace_back();
+    AppendSegments(body, body_count, &data_->outvec_->back());
+    log_internal_namespace_::StatMessage(data_->severity_, STAT_DEST_STRING, data_->outvec_->back().size());
   } else {
     SendToLog();
   }
@@ -1418,16 +3639,35 @@ void LogMessage::SaveOrSendToLog() {
 // 确保持有锁
 void LogMessage::WriteToStringAndLog() {
   if (data_->message_ != nullptr) {
-    assert(data_->num_chars_to_log_ > 0 && data_->message_text_[data_->num_chars_to_log_ - 1] == '\n');
+    assert(data_->num_chars_to_log_ > 0);
 
-    // 类型转换
-    const char* start = data_->message_text_ + data_->num_prefix_chars_;
-    size_t len = data_->num_chars_to_log_ - data_->num_prefix_chars_ - 1;
-    data_->message_->assign(start, len);
+    LogSegment body[base_logging::LogStreamBuf::kMaxSegments];
+    const size_t body_count = GetMessageSegments(data_, true, body);
+    data_->message_->clear();
+    AppendSegments(body, body_count, data_->message_);
+    log_internal_namespace_::StatMessage(data_->severity_, STAT_DEST_STRING, data_->message_->size());
   } 
   SendToLog();
 }
 
+// capture_->also_log() 为 true 时需要持有 log_mutex
+void LogMessage::SaveToCapture() {
+  if (data_->capture_ != nullptr) {
+    assert(data_->num_chars_to_log_ > 0);
+
+    LogSegment body[base_logging::LogStreamBuf::kMaxSegments];
+    const size_t body_count = GetMessageSegments(data_, true, body);
+    const int64 time_usec = static_cast<int64>(logmsgtime_.timestamp()) * 1000000 + logmsgtime_.usec();
+    data_->capture_->Append(data_->severity_, time_usec, body, body_count);
+    log_internal_namespace_::StatMessage(data_->severity_, STAT_DEST_STRING, SegmentsLength(body, body_count));
+    // FATAL 总是写日志
+    if (!data_->capture_->also_log() && data_->severity_ != LOG_FATAL) {
+      return;
+    }
+  }
+  SendToLog();
+}
+
 void LogMessage::SendToSyslogAndLog() {
   // TODO: 增加 LOG() 宏接口
   // LOG(ERROR) << "No syslog support: message=" << data_->message_text_;
@@ -1435,8 +3675,7 @@ void LogMessage::SendToSyslogAndLog() {
 
 // 静态成员函数
 int64 LogMessage::num_messages(int severity) {
-  std::lock_guard<std::mutex> lk(log_mutex);
-  return num_messages_[severity];
+  return num_messages_[severity].load(std::memory_order_relaxed);
 }
 
 /* ---------------------------------- LogMessage end -------------------------------------------- */
@@ -1460,6 +3699,16 @@ void base::SetLogger(LogSeverity level, base::Logger* logger) {
   LogDestination::log_destination(level)->SetLoggerImpl(logger);
 }
 
+base::BatchLogger* base::GetBatchLogger(LogSeverity level) {
+  std::lock_guard<std::mutex> lk(log_mutex);
+  return LogDestination::log_destination(level)->GetBatchLoggerImpl();
+}
+
+void base::SetBatchLogger(LogSeverity level, base::BatchLogger* logger) {
+  std::lock_guard<std::mutex> lk(log_mutex);
+  LogDestination::log_destination(level)->SetBatchLoggerImpl(logger);
+}
+
 // 当前仅当 ostream 是 LogStream 时起作用
 std::ostream& operator<<(std::ostream& os, const PRIVATE_Counter&) {
   auto* log = dynamic_cast<LogMessage::LogStream*>(&os);
@@ -1469,6 +3718,76 @@ std::ostream& operator<<(std::ostream& os, const PRIVATE_Counter&) {
 }
 
 /* ----------------------------- LogMessageTime --------------------------------------- */
+namespace {
+  // localtime_r/gmtime_r/mktime 都要获取 glibc 内部的时区锁, fork 时其他线程持有这把锁会使子进程死锁
+  // 每个线程缓存一个 15 分钟区间内的本地时区偏移(时区切换都发生在 15 分钟的边界上), 换算 tm 不需要加锁
+  // 刷新缓存时持有 local_time_mutex, fork 前获取这把锁, fork 时没有日志线程在时区函数中
+  std::mutex local_time_mutex;
+  const int64 kLocalTimeCacheSecs = 15 * 60;
+
+  struct LocalTimeCache {
+    int64 begin{1};
+    int64 end{0};
+    long gmtoff{0};
+    int isdst{0};
+    const char* zone{nullptr};
+  };
+  thread_local LocalTimeCache tls_local_time;
+
+  // 1970-01-01 以来的秒数转换为 tm(civil_from_days 算法), 不访问时区
+  void CivilFromSeconds(int64 secs, std::tm* t) {
+    int64 days = secs / 86400;
+    int64 rem = secs % 86400;
+    if (rem < 0) {
+      rem += 86400;
+      days -= 1;
+    }
+    t->tm_hour = static_cast<int>(rem / 3600);
+    t->tm_min = static_cast<int>(rem % 3600 / 60);
+    t->tm_sec = static_cast<int>(rem % 60);
+    t->tm_wday = static_cast<int>(((days + 4) % 7 + 7) % 7); // 1970-01-01 是星期四
+
+    const int64 z = days + 719468;
+    const int64 era = (z >= 0 ? z : z - 146096) / 146097;
+    const int64 doe = z - era * 146097;
+    const int64 yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const int64 doy = doe - (365 * yoe + yoe / 4 - yoe / 100); // 从 3 月 1 日开始
+    const int64 mp = (5 * doy + 2) / 153;
+    const int64 mday = doy - (153 * mp + 2) / 5 + 1;
+    const int64 mon = mp < 10 ? mp + 3 : mp - 9;
+    const int64 year = yoe + era * 400 + (mon <= 2 ? 1 : 0);
+    t->tm_year = static_cast<int>(year - 1900);
+    t->tm_mon = static_cast<int>(mon - 1);
+    t->tm_mday = static_cast<int>(mday);
+    const bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    static const int kDaysBeforeMonth[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+    t->tm_yday = kDaysBeforeMonth[mon - 1] + static_cast<int>(mday) - 1 + ((leap && mon > 2) ? 1 : 0);
+  }
+
+  // 日志时间戳转换为 tm, gmtoff 是本地时区与 UTC 的偏移(秒)
+  void ConvertLogTime(std::time_t timestamp, bool utc, std::tm* t, long* gmtoff) {
+    LocalTimeCache& cache = tls_local_time;
+    const int64 ts = static_cast<int64>(timestamp);
+    if (ts < cache.begin || ts >= cache.end) {
+      std::tm local;
+      {
+        std::lock_guard<std::mutex> lk(local_time_mutex);
+        localtime_r(&timestamp, &local);
+      }
+      cache.begin = ts - ((ts % kLocalTimeCacheSecs) + kLocalTimeCacheSecs) % kLocalTimeCacheSecs;
+      cache.end = cache.begin + kLocalTimeCacheSecs;
+      cache.gmtoff = local.tm_gmtoff;
+      cache.isdst = local.tm_isdst;
+      cache.zone = local.tm_zone;
+    }
+    *gmtoff = cache.gmtoff;
+    CivilFromSeconds(utc ? ts : ts + cache.gmtoff, t);
+    t->tm_isdst = utc ? 0 : cache.isdst;
+    t->tm_gmtoff = utc ? 0 : cache.gmtoff;
+    t->tm_zone = utc ? "GMT" : cache.zone;
+  }
+}
+
 LogMessageTime::LogMessageTime()
   : time_struct_(), timestamp_(0), usecs_(0), gmtoffset_(0) {}
 
@@ -1478,13 +3797,10 @@ LogMessageTime::LogMessageTime(std::tm t) {
 }
 
 LogMessageTime::LogMessageTime(std::time_t timestamp, WallTime now) {
-  std::tm t;
-  if (FLAGS_log_utc_time) {
-    gmtime_r(&timestamp, &t);
-  } else {
-    localtime_r(&timestamp, &t);
-  }
-  init(t, timestamp, now);
+  // 每条日志都会调用, 不使用 localtime_r(见 ConvertLogTime)
+  ConvertLogTime(timestamp, FLAGS_log_utc_time, &time_struct_, &gmtoffset_);
+  timestamp_ = timestamp;
+  usecs_ = static_cast<int32>((now - timestamp) * 1000000);
 }
 
 void LogMessageTime::init(const std::tm& t, std::time_t timestamp, WallTime now) {
@@ -1515,6 +3831,59 @@ void LogMessageTime::CalcGmtOffset() {
 
 /* ----------------------------- LogMessageTime end --------------------------------------- */
 
+/* ----------------------------- fork ---------------------------------------------------- */
+// fork 处理: 父进程中其他线程持有的锁在子进程中永远不会被释放, 所以 fork 前先拿到所有的锁
+// 叶子锁(后台线程, 清理, 统计, TSC 校准)在日志文件的锁之后获取
+static void LoggingAtForkPrepare() {
+  LogDestination::AtForkPrepare();
+  base::AsyncLogger::AtForkPrepareAll();
+  base::SharedLogRing::AtForkPrepareAll();
+  local_time_mutex.lock();
+  log_file_worker().AtForkPrepare();
+  group_commit_syncer().AtForkPrepare();
+  write_behind_manager().AtForkPrepare();
+  log_cleaner.AtForkPrepare();
+  log_internal_namespace_::StatsAtForkPrepare();
+  log_internal_namespace_::UtilitiesAtForkPrepare();
+}
+
+static void LoggingAtForkParent() {
+  log_internal_namespace_::UtilitiesAtForkParent();
+  log_internal_namespace_::StatsAtForkParent();
+  log_cleaner.AtForkRelease();
+  write_behind_manager().AtForkParent();
+  group_commit_syncer().AtForkParent();
+  log_file_worker().AtForkParent();
+  local_time_mutex.unlock();
+  base::SharedLogRing::AtForkParentAll();
+  base::AsyncLogger::AtForkParentAll();
+  LogDestination::AtForkParent();
+}
+
+static void LoggingAtForkChild() {
+  log_internal_namespace_::UtilitiesAtForkChild();
+  log_internal_namespace_::StatsAtForkChild();
+  log_cleaner.AtForkRelease();
+  write_behind_manager().AtForkChild();
+  group_commit_syncer().AtForkChild();
+  log_file_worker().AtForkChild();
+  local_time_mutex.unlock();
+  base::SharedLogRing::AtForkChildAll();
+  base::AsyncLogger::AtForkChildAll();
+  LogDestination::AtForkChild();
+}
+
+namespace {
+  struct ForkHandlerRegistrar {
+    ForkHandlerRegistrar() {
+      pthread_atfork(LoggingAtForkPrepare, LoggingAtForkParent, LoggingAtForkChild);
+    }
+  };
+  ForkHandlerRegistrar fork_handler_registrar;
+}
+
+/* ----------------------------- fork end ------------------------------------------------ */
+
 
 /* ----------------------------- LogSink ---------------------------- */
 LogSink::~LogSink() = default;
@@ -1542,6 +3911,31 @@ void LogSink::send(LogSeverity severity, const char* full_filename,
   (void)message_len;
 }
 
+void LogSink::send(LogSeverity severity, const char* full_filename,
+                   const char* base_filename, int line,
+                   const LogMessageTime& logmsgtime,
+                   const LogSegment* segments, size_t segment_count) {
+  if (segment_count == 1) {
+    send(severity, full_filename, base_filename, line, logmsgtime, segments[0].data, segments[0].size);
+    return;
+  }
+  std::string message;
+  AppendSegments(segments, segment_count, &message);
+  send(severity, full_filename, base_filename, line, logmsgtime, message.data(), message.size());
+}
+
+void LogSink::send(LogSeverity severity, const char* full_filename,
+                   const char* base_filename, int line,
+                   const LogMessageTime& logmsgtime, const LogContext* context,
+                   const LogSegment* segments, size_t segment_count) {
+  (void)context;
+  send(severity, full_filename, base_filename, line, logmsgtime, segments, segment_count);
+}
+
+bool LogSink::WantsRawRecords() const {
+  return false;
+}
+
 void LogSink::WaitTillSent() {
   // 默认不做操作
 }
@@ -1570,6 +3964,174 @@ std::string LogSink::ToString(LogSeverity severity, const char* file, int line,
 
 /* ----------------------------- LogSink end ---------------------------- */
 
+/* ----------------------------- CHECK_OP ---------------------------- */
+
+template <>
+void MakeCheckOpValueString(std::ostream* os, const char& v) {
+  if (v >= 32 && v <= 126) {
+    (*os) << "'" << v << "'";
+  } else {
+    (*os) << "char value " << static_cast<short>(v);
+  }
+}
+
+template <>
+void MakeCheckOpValueString(std::ostream* os, const signed char& v) {
+  if (v >= 32 && v <= 126) {
+    (*os) << "'" << v << "'";
+  } else {
+    (*os) << "signed char value " << static_cast<short>(v);
+  }
+}
+
+template <>
+void MakeCheckOpValueString(std::ostream* os, const unsigned char& v) {
+  if (v >= 32 && v <= 126) {
+    (*os) << "'" << v << "'";
+  } else {
+    (*os) << "unsigned char value " << static_cast<unsigned short>(v);
+  }
+}
+
+template <>
+void MakeCheckOpValueString(std::ostream* os, const std::nullptr_t& /*v*/) {
+  (*os) << "nullptr";
+}
+
+CheckOpMessageBuilder::CheckOpMessageBuilder(const char* exprtext) : stream_(new std::ostringstream) {
+  *stream_ << exprtext << " (";
+}
+
+CheckOpMessageBuilder::~CheckOpMessageBuilder() {
+  delete stream_;
+}
+
+std::ostream* CheckOpMessageBuilder::ForVar2() {
+  *stream_ << " vs. ";
+  return stream_;
+}
+
+std::string* CheckOpMessageBuilder::NewString() {
+  *stream_ << ")";
+  return new std::string(stream_->str());
+}
+
+/* ----------------------------- CHECK_OP end ---------------------------- */
+
+/* ----------------------------- LogCapture ---------------------------- */
+
+void LogCapture::Append(LogSeverity severity, int64 time_usec, const LogSegment* segments, size_t segment_count) {
+  const Header header = {static_cast<uint32>(SegmentsLength(segments, segment_count)), severity, time_usec};
+  // 头部和正文一次分配, 复用时不会再分配
+  arena_.reserve(arena_.size() + sizeof(header) + header.length);
+  arena_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  AppendSegments(segments, segment_count, &arena_);
+  ++count_;
+}
+
+std::string LogCapture::ToString() const {
+  std::string result;
+  result.reserve(arena_.size());
+  for (const Record& record : *this) {
+    result.append(record.text.data(), record.text.size());
+    result += '\n';
+  }
+  return result;
+}
+
+/* ----------------------------- LogCapture end ---------------------------- */
+
+/* ----------------------------- LogContext ---------------------------- */
+
+namespace {
+  // 渲染一个字段: "key=value"
+  void AppendContextField(const LogContextField& field, std::string* out) {
+    out->append(field.key);
+    out->push_back('=');
+    char buf[32];
+    switch (field.type) {
+      case CONTEXT_INT:
+        out->append(buf, static_cast<size_t>(snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(field.int_value))));
+        break;
+      case CONTEXT_UINT:
+        out->append(buf, static_cast<size_t>(snprintf(buf, sizeof(buf), "%llu",
+                                                      static_cast<unsigned long long>(field.uint_value))));
+        break;
+      case CONTEXT_DOUBLE:
+        out->append(buf, static_cast<size_t>(snprintf(buf, sizeof(buf), "%g", field.double_value)));
+        break;
+      case CONTEXT_BOOL:
+        out->append(field.bool_value ? "true" : "false");
+        break;
+      case CONTEXT_STRING:
+        out->append(field.string_value);
+        break;
+    }
+  }
+}
+
+LogContext::LogContext(std::shared_ptr<const LogContext> parent, LogContextField field)
+    : parent_(std::move(parent)), field_(std::move(field)), depth_(parent_ ? parent_->depth_ + 1 : 1) {
+  // "[req=42] " -> "[req=42 user=7] "
+  if (parent_) {
+    prefix_.reserve(parent_->prefix_.size() + field_.key.size() + 24);
+    prefix_.append(parent_->prefix_, 0, parent_->prefix_.size() - 2);
+    prefix_.push_back(' ');
+  } else {
+    prefix_.push_back('[');
+  }
+  AppendContextField(field_, &prefix_);
+  prefix_.append("] ");
+}
+
+std::vector<const LogContextField*> LogContext::Fields() const {
+  std::vector<const LogContextField*> fields(depth_);
+  const LogContext* context = this;
+  for (size_t i = depth_; i-- > 0; context = context->parent()) {
+    fields[i] = &context->field_;
+  }
+  return fields;
+}
+
+LogContextHandle CurrentLogContext() {
+  return current_log_context;
+}
+
+ScopedLogContext::ScopedLogContext(const char* key, double value) {
+  LogContextField field{key, CONTEXT_DOUBLE, {}, {}};
+  field.double_value = value;
+  Push(std::move(field));
+}
+
+ScopedLogContext::ScopedLogContext(const char* key, bool value) {
+  LogContextField field{key, CONTEXT_BOOL, {}, {}};
+  field.bool_value = value;
+  Push(std::move(field));
+}
+
+ScopedLogContext::ScopedLogContext(const char* key, const char* value)
+    : ScopedLogContext(key, std::string_view(value)) {}
+
+ScopedLogContext::ScopedLogContext(const char* key, std::string_view value) {
+  LogContextField field{key, CONTEXT_STRING, {}, std::string(value)};
+  Push(std::move(field));
+}
+
+ScopedLogContext::ScopedLogContext(LogContextHandle context) : saved_(std::move(current_log_context)) {
+  current_log_context = std::move(context);
+}
+
+ScopedLogContext::~ScopedLogContext() {
+  current_log_context = std::move(saved_);
+}
+
+void ScopedLogContext::Push(LogContextField field) {
+  saved_ = current_log_context;
+  current_log_context = std::make_shared<const LogContext>(saved_, std::move(field));
+}
+
+/* ----------------------------- LogContext end ---------------------------- */
+
 
 
 /* ----------------------------- 公共对外函数接口 ---------------------------- */
@@ -1579,10 +4141,12 @@ void InitLogging(const char* argv0) {
 }
 
 void ShutdownLogging() {
+  // 还在初始化状态时写出等待中的重复日志汇总(FlushLogFiles 会先写出汇总)
+  if (dedup_pending_count.load(std::memory_order_relaxed) > 0) {
+    LogDestination::FlushLogFiles(0);
+  }
   log_internal_namespace_::ShutdownLoggingUtilities();
   LogDestination::DeleteLogDestinations();
-  delete logging_directories_list;
-  logging_directories_list = nullptr;
 }
 
 void EnableLogCleaner(unsigned int overdue_days) {
@@ -1637,6 +4201,11 @@ void SetLogYearInPrefix(bool flag) {
 void SetDropLogMemory(bool flag) {
   FLAGS_drop_log_memory = flag;
 }
+// 后台回写的块大小和限速
+void SetLogWriteBehind(uint32 chunk_kb, uint32 mb_per_sec) {
+  FLAGS_log_writeback_kb = chunk_kb;
+  FLAGS_log_writeback_mb_per_sec = mb_per_sec;
+}
 
 // 写到 stderr 的日志程度阈值
 void SetStderrThreshold(int level) {
@@ -1676,6 +4245,50 @@ void SetMaxLogSize(uint32 size) {
   FLAGS_max_log_size = size;
 }
 
+// 新建日志文件使用的持久化模式
+void SetLogDurabilityMode(LogDurabilityMode mode) {
+  FLAGS_durability_mode = mode;
+}
+// 组提交的时间窗口
+void SetLogGroupCommitWindow(int usecs) {
+  FLAGS_group_commit_usecs = usecs;
+}
+// 日志时间戳使用的时钟
+void SetLogClockSource(LogClockSource source) {
+  FLAGS_clock_source = source;
+}
+// 稀疏索引块的大小
+void SetLogIndexBlockSize(uint32 kb) {
+  FLAGS_log_index_kb = kb;
+}
+// 日志文件的滚动策略
+void SetLogRollPolicy(int policy) {
+  FLAGS_log_roll_policy = policy & (ROLL_BY_SIZE | ROLL_HOURLY | ROLL_DAILY);
+}
+// 重复日志合并的时间窗口
+void SetLogDedupWindow(int ms) {
+  FLAGS_log_dedup_ms = std::max(ms, 0);
+}
+// 分片日志文件的数量
+void SetLogShards(int shards) {
+  FLAGS_log_shards = std::min(std::max(shards, 0), kMaxLogShards);
+}
+
+ScopedLogTimeBatch::ScopedLogTimeBatch()
+  : saved_time_(log_internal_namespace_::tls_batch_time) {
+  log_internal_namespace_::tls_batch_time = log_internal_namespace_::WallTime_Now();
+}
+
+ScopedLogTimeBatch::~ScopedLogTimeBatch() {
+  log_internal_namespace_::tls_batch_time = saved_time_;
+}
+
+// 单条日志的最大长度
+void SetMaxLogMessageLen(size_t len) {
+  // 至少要能放下前缀, 最大 UINT32_MAX(FLAGS_max_log_message_len 是 32 位的)
+  FLAGS_max_log_message_len = static_cast<uint32>(std::min<size_t>(std::max<size_t>(len, 256), UINT32_MAX));
+}
+
 void FlushLogFiles(LogSeverity min_severity) {
   LogDestination::FlushLogFiles(min_severity);
 }
@@ -1700,6 +4313,73 @@ void RemoveLogSink(LogSink* destination) {
   LogDestination::RemoveLogSink(destination);
 }
 
+void AddLogSink(LogSink* destination, const std::string& name) {
+  LogDestination::AddLogSink(destination, name);
+}
+
+bool SetLogRoutes(const std::vector<LogRoute>& routes) {
+  return LogDestination::SetLogRoutes(routes);
+}
+
+bool ParseLogRoutes(const std::string& text, std::vector<LogRoute>* routes, std::string* error) {
+  std::vector<LogRoute> result;
+  int rule_index = 0;
+  size_t start = 0;
+  while (start <= text.size()) {
+    size_t end = text.find_first_of(";\n", start);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    const std::string rule = TrimRouteToken(text.substr(start, end - start));
+    start = end + 1;
+    rule_index++;
+    if (rule.empty() || rule[0] == '#') {
+      continue;
+    }
+    auto fail = [&](const char* what) {
+      if (error != nullptr) {
+        *error = "rule " + std::to_string(rule_index) + ": " + what;
+      }
+      return false;
+    };
+
+    const size_t arrow = rule.find("->");
+    if (arrow == std::string::npos) {
+      return fail("expected '->'");
+    }
+    // 左边: 等级 [文件模式]
+    LogRoute route;
+    std::istringstream match(rule.substr(0, arrow));
+    std::string severity_text, extra;
+    if (!(match >> severity_text)) {
+      return fail("expected severity");
+    }
+    if (!ParseRouteSeverityRange(severity_text, &route)) {
+      return fail("invalid severity");
+    }
+    match >> route.file_pattern;
+    if (match >> extra) {
+      return fail("unexpected text before '->'");
+    }
+    // 右边: 以 ',' 分隔的目的地
+    const std::string destinations = rule.substr(arrow + 2);
+    size_t pos = 0;
+    while (pos <= destinations.size()) {
+      size_t comma = destinations.find(',', pos);
+      if (comma == std::string::npos) {
+        comma = destinations.size();
+      }
+      if (!ParseRouteDestination(TrimRouteToken(destinations.substr(pos, comma - pos)), &route)) {
+        return fail("invalid destination");
+      }
+      pos = comma + 1;
+    }
+    result.push_back(std::move(route));
+  }
+  routes->swap(result);
+  return true;
+}
+
 void SetLogFilenameExtension(const char* filename_extension) {
   LogDestination::SetLogFilenameExtension(filename_extension);
 }
@@ -0,0 +1,198 @@
+#include "metrics.h"
+#include "logging.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+namespace log_internal_namespace_ {
+
+std::atomic<bool> g_stats_timing{false};
+
+namespace {
+  // 保护 stats_registry 和 retired_stats
+  std::mutex stats_registry_mutex;
+  // 存活线程的计数器
+  std::vector<ThreadLogStats*>* stats_registry = nullptr;
+  // 已经退出的线程的计数器之和
+  ThreadLogStats retired_stats;
+  // 线程局部计数器析构之后(线程退出过程中)使用的共享计数器, 可能被多个线程同时写入
+  ThreadLogStats orphan_stats{{}, {}, {}, true};
+  // 异步队列深度
+  std::atomic<int64> queue_depth{0};
+
+  thread_local bool tls_stats_destroyed = false;
+
+  void Accumulate(const ThreadLogStats& from, ThreadLogStats* to) {
+    for (int s = 0; s < NUM_SEVERITIES; s++) {
+      for (int d = 0; d < NUM_STAT_DESTINATIONS; d++) {
+        StatAdd(to->messages[s][d], from.messages[s][d].load(std::memory_order_relaxed));
+        StatAdd(to->bytes[s][d], from.bytes[s][d].load(std::memory_order_relaxed));
+      }
+    }
+    for (int c = 0; c < NUM_STAT_COUNTERS; c++) {
+      StatAdd(to->counters[c], from.counters[c].load(std::memory_order_relaxed));
+    }
+  }
+
+  // 线程第一次记录统计时注册, 线程退出时把计数器合并到 retired_stats
+  struct ThreadStatsHolder {
+    ThreadStatsHolder() : stats() {
+      std::lock_guard<std::mutex> lk(stats_registry_mutex);
+      if (stats_registry == nullptr) {
+        stats_registry = new std::vector<ThreadLogStats*>;
+      }
+      stats_registry->push_back(&stats);
+    }
+
+    ~ThreadStatsHolder() {
+      std::lock_guard<std::mutex> lk(stats_registry_mutex);
+      Accumulate(stats, &retired_stats);
+      stats_registry->erase(std::remove(stats_registry->begin(), stats_registry->end(), &stats),
+                            stats_registry->end());
+      tls_stats_destroyed = true;
+    }
+
+    ThreadLogStats stats;
+  };
+
+  thread_local ThreadStatsHolder tls_stats_holder;
+
+  const char* const kStatDestinationNames[NUM_STAT_DESTINATIONS] = {
+    "file", "stderr", "stdout", "sink", "string"
+  };
+}
+
+ThreadLogStats* LocalLogStats() {
+  if (tls_stats_destroyed) {
+    return &orphan_stats;
+  }
+  return &tls_stats_holder.stats;
+}
+
+void StatQueueDepthAdd(int64 delta) {
+  queue_depth.fetch_add(delta, std::memory_order_relaxed);
+}
+
+int64 StatNowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void StatsAtForkPrepare() {
+  stats_registry_mutex.lock();
+}
+
+void StatsAtForkParent() {
+  stats_registry_mutex.unlock();
+}
+
+void StatsAtForkChild() {
+  // 子进程继承父进程的计数
+  stats_registry_mutex.unlock();
+}
+
+} // end of namespace log_internal_namespace_
+
+using namespace log_internal_namespace_;
+
+LoggingStats GetLoggingStats() {
+  ThreadLogStats total{};
+  {
+    std::lock_guard<std::mutex> lk(stats_registry_mutex);
+    Accumulate(retired_stats, &total);
+    Accumulate(orphan_stats, &total);
+    if (stats_registry != nullptr) {
+      for (const ThreadLogStats* stats : *stats_registry) {
+        Accumulate(*stats, &total);
+      }
+    }
+  }
+
+  LoggingStats result;
+  for (int s = 0; s < NUM_SEVERITIES; s++) {
+    for (int d = 0; d < NUM_STAT_DESTINATIONS; d++) {
+      result.messages[s][d] = total.messages[s][d].load(std::memory_order_relaxed);
+      result.bytes[s][d] = total.bytes[s][d].load(std::memory_order_relaxed);
+    }
+  }
+  result.log_mutex_wait_ns = total.counters[STAT_MUTEX_WAIT_NS].load(std::memory_order_relaxed);
+  result.log_mutex_contended = total.counters[STAT_MUTEX_CONTENDED].load(std::memory_order_relaxed);
+  result.write_ns = total.counters[STAT_WRITE_NS].load(std::memory_order_relaxed);
+  result.flush_ns = total.counters[STAT_FLUSH_NS].load(std::memory_order_relaxed);
+  result.flushes = total.counters[STAT_FLUSHES].load(std::memory_order_relaxed);
+  result.queue_depth = queue_depth.load(std::memory_order_relaxed);
+  result.dropped_records = total.counters[STAT_DROPPED_RECORDS].load(std::memory_order_relaxed);
+  result.truncated_records = total.counters[STAT_TRUNCATED_RECORDS].load(std::memory_order_relaxed);
+  result.rotations = total.counters[STAT_ROTATIONS].load(std::memory_order_relaxed);
+  result.cleaner_runs = total.counters[STAT_CLEANER_RUNS].load(std::memory_order_relaxed);
+  result.coalesced_records = total.counters[STAT_COALESCED_RECORDS].load(std::memory_order_relaxed);
+  return result;
+}
+
+void SetLoggingStatsTiming(bool enable) {
+  g_stats_timing.store(enable, std::memory_order_relaxed);
+}
+
+namespace {
+  void PrintCounter(FILE* file, const char* name, const char* help, const char* type, double value) {
+    fprintf(file, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+  }
+}
+
+bool DumpLoggingStats(const char* path) {
+  const LoggingStats stats = GetLoggingStats();
+
+  // 先写临时文件再 rename, 采集程序不会读到写了一半的文件
+  const std::string tmp_path = std::string(path) + ".tmp";
+  FILE* file = fopen(tmp_path.c_str(), "w");
+  if (file == nullptr) {
+    return false;
+  }
+
+  fprintf(file, "# HELP lizylog_messages_total Log records written per severity and destination.\n"
+                "# TYPE lizylog_messages_total counter\n");
+  for (int s = 0; s < NUM_SEVERITIES; s++) {
+    for (int d = 0; d < NUM_STAT_DESTINATIONS; d++) {
+      fprintf(file, "lizylog_messages_total{severity=\"%s\",destination=\"%s\"} %llu\n",
+              GetLogSeverityName(s), kStatDestinationNames[d],
+              static_cast<unsigned long long>(stats.messages[s][d]));
+    }
+  }
+  fprintf(file, "# HELP lizylog_bytes_total Log bytes written per severity and destination.\n"
+                "# TYPE lizylog_bytes_total counter\n");
+  for (int s = 0; s < NUM_SEVERITIES; s++) {
+    for (int d = 0; d < NUM_STAT_DESTINATIONS; d++) {
+      fprintf(file, "lizylog_bytes_total{severity=\"%s\",destination=\"%s\"} %llu\n",
+              GetLogSeverityName(s), kStatDestinationNames[d],
+              static_cast<unsigned long long>(stats.bytes[s][d]));
+    }
+  }
+
+  PrintCounter(file, "lizylog_log_mutex_wait_seconds_total", "Time spent waiting for the global log mutex.",
+               "counter", stats.log_mutex_wait_ns * 1e-9);
+  PrintCounter(file, "lizylog_log_mutex_contended_total", "Acquisitions of the global log mutex that had to wait.",
+               "counter", static_cast<double>(stats.log_mutex_contended));
+  PrintCounter(file, "lizylog_write_seconds_total", "Time spent in fwrite (only when timing is enabled).",
+               "counter", stats.write_ns * 1e-9);
+  PrintCounter(file, "lizylog_flush_seconds_total", "Time spent in fflush.",
+               "counter", stats.flush_ns * 1e-9);
+  PrintCounter(file, "lizylog_flushes_total", "Number of log file flushes.",
+               "counter", static_cast<double>(stats.flushes));
+  PrintCounter(file, "lizylog_queue_depth", "Records waiting in asynchronous queues.",
+               "gauge", static_cast<double>(stats.queue_depth));
+  PrintCounter(file, "lizylog_dropped_records_total", "Records dropped because they could not be written.",
+               "counter", static_cast<double>(stats.dropped_records));
+  PrintCounter(file, "lizylog_truncated_records_total", "Records truncated at the maximum message length.",
+               "counter", static_cast<double>(stats.truncated_records));
+  PrintCounter(file, "lizylog_rotations_total", "Log file rotations.",
+               "counter", static_cast<double>(stats.rotations));
+  PrintCounter(file, "lizylog_cleaner_runs_total", "Overdue log cleaner runs.",
+               "counter", static_cast<double>(stats.cleaner_runs));
+  PrintCounter(file, "lizylog_coalesced_records_total", "Repeated records folded into a repeat summary.",
+               "counter", static_cast<double>(stats.coalesced_records));
+
+  const bool ok = (fclose(file) == 0);
+  return ok && rename(tmp_path.c_str(), path) == 0;
+}
@@ -0,0 +1,610 @@
+#include "shm_log_ring.h"
+#include "metrics.h"
+#include "utilities.h"
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+namespace base {
+
+// 共享内存开头的控制信息, 各个计数器放在不同的缓存行, 写入者之间只竞争 tail
+struct SharedLogRing::Header {
+  alignas(64) std::atomic<uint64> tail{0};       // 下一个可以占用的槽, 写入者 CAS
+  alignas(64) std::atomic<uint64> head{0};       // 收集者下一个读取的槽
+  std::atomic<uint64> flushed{0};                // target 上一次刷新时的 head
+  alignas(64) std::atomic<uint64> flush_target{0}; // Flush() 等待刷新到的位置(取最大值)
+  std::atomic<uint32> signal_seq{0};             // 每次唤醒加一, 收集者在它上面 futex 等待
+  std::atomic<uint32> sleeping{0};               // 收集者是否睡眠(或即将睡眠)
+  std::atomic<uint32> flush_done{0};             // 每次刷新 target 后加一, Flush() 在它上面 futex 等待
+  std::atomic<uint32> stop{0};
+  std::atomic<uint64> collector{0};              // 正在运行的收集者所在进程的标识(ProcessIdentity), 0 表示没有
+  std::atomic<uint64> dropped{0};
+  std::atomic<uint64> abandoned{0};
+};
+
+// 槽头, 之后是数据; 一条日志的第一个槽的数据以 RecordHeader 开头, 其余的槽只有数据
+struct SharedLogRing::Slot {
+  // 等于槽的位置: 空闲(或者已被占用还没有提交); 位置 + 1: 已提交; 位置 + 槽数: 下一圈空闲
+  std::atomic<uint64> seq;
+  // 占用者的 pid << 32 | 占用的槽数, 只在第一个槽中设置, 用于跳过崩溃进程占用的槽
+  // 写入者先 CAS claim(0 -> 自己)再移动 tail, 只有持有 claim 的写入者可以把 tail 从这个位置移走,
+  // 所以 tail 之前的每条日志的第一个槽都记录了占用者
+  std::atomic<uint64> claim;
+  // 占用者的启动时间(/proc/<pid>/stat 的第 22 个字段), 先于 claim 写入; pid 被复用时据此判断占用者已经退出
+  std::atomic<uint64> claim_start;
+};
+
+namespace {
+  struct RecordHeader {
+    uint32 length;
+    int32 severity;
+    int64 timestamp;
+    int32 usecs;
+    uint32 force_flush;
+  };
+
+  static_assert(std::atomic<uint64>::is_always_lock_free && std::atomic<uint32>::is_always_lock_free,
+                "shared memory atomics must be lock free");
+
+  // 收集者每批最多写出的日志数
+  const size_t kMaxBatchRecords = 256;
+  // 环满时写入者最多让出 CPU 的次数
+  const int kFullRetries = 1000;
+
+  // 所有 SharedLogRing, fork 后子进程中需要丢弃收集线程
+  std::mutex& shared_rings_mutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  std::vector<SharedLogRing*>& shared_rings() {
+    static std::vector<SharedLogRing*> rings;
+    return rings;
+  }
+
+  int64 MonotonicNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  // 共享内存上的 futex 不能使用 FUTEX_PRIVATE_FLAG
+  void SharedFutexWait(std::atomic<uint32>* word, uint32 expected, int64 timeout_nanos) {
+    struct timespec ts;
+    ts.tv_sec = static_cast<time_t>(timeout_nanos / 1000000000);
+    ts.tv_nsec = static_cast<long>(timeout_nanos % 1000000000);
+    syscall(SYS_futex, reinterpret_cast<uint32*>(word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+  }
+
+  void SharedFutexWake(std::atomic<uint32>* word, int count) {
+    syscall(SYS_futex, reinterpret_cast<uint32*>(word), FUTEX_WAKE, count, nullptr, nullptr, 0);
+  }
+
+  // 读取 /proc/<pid>/stat 中的状态和启动时间(第 22 个字段, 开机以来的时钟滴答数), 读取失败时返回 false
+  bool ReadProcessStat(int32 pid, char* state, uint64* start_time) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* file = fopen(path, "r");
+    if (file == nullptr) {
+      return false;
+    }
+    char buf[1024];
+    const size_t n = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    buf[n] = '\0';
+    // 格式: pid (comm) state ppid ..., comm 中可能有括号, 取最后一个 ')'
+    const char* p = strrchr(buf, ')');
+    if (p == nullptr || p[1] == '\0') {
+      return false;
+    }
+    *state = p[2];
+    // state 是第 3 个字段, 向后跳过 19 个字段
+    p += 2;
+    for (int field = 3; field < 22 && p != nullptr; field++) {
+      p = strchr(p, ' ');
+      if (p != nullptr) p++;
+    }
+    *start_time = p != nullptr ? strtoull(p, nullptr, 10) : 0;
+    return true;
+  }
+
+  // 当前进程的启动时间, fork 后在子进程中重新读取
+  std::atomic<uint64> self_start_time{0};
+
+  uint64 SelfStartTime() {
+    uint64 start = self_start_time.load(std::memory_order_relaxed);
+    if (start == 0) {
+      char state = 0;
+      if (ReadProcessStat(log_internal_namespace_::GetMainThreadPid(), &state, &start)) {
+        self_start_time.store(start, std::memory_order_relaxed);
+      }
+    }
+    return start;
+  }
+
+  // 收集者的标识: pid << 32 | 启动时间的低 32 位
+  uint64 ProcessIdentity() {
+    return (static_cast<uint64>(static_cast<uint32>(log_internal_namespace_::GetMainThreadPid())) << 32U) |
+           (SelfStartTime() & 0xffffffffU);
+  }
+
+  // 进程是否还存在, 僵尸进程(已经崩溃, 父进程还没有回收)当作不存在
+  // start_time 不为 0 时还要求启动时间相同(只比较低 32 位), 否则 pid 已经被新的进程复用
+  bool ProcessAlive(int32 pid, uint64 start_time) {
+    if (pid <= 0) {
+      return false;
+    }
+    if (kill(pid, 0) != 0 && errno == ESRCH) {
+      return false;
+    }
+    char state = 0;
+    uint64 current_start = 0;
+    if (!ReadProcessStat(pid, &state, &current_start)) {
+      return true;
+    }
+    if (state == 'Z') {
+      return false;
+    }
+    return start_time == 0 || current_start == 0 || (current_start & 0xffffffffU) == (start_time & 0xffffffffU);
+  }
+
+  // 等待其他写入者占用槽时让出 CPU 的次数, 之后检查它是否已经崩溃
+  const int kClaimRetries = 16;
+
+  size_t RoundUpPowerOfTwo(size_t n) {
+    size_t result = 1;
+    while (result < n) result <<= 1U;
+    return result;
+  }
+}
+
+SharedLogRing::SharedLogRing(LogSeverity severity, BatchLogger* target, const SharedLogRingOptions& options)
+    : severity_(severity), target_(target), options_(options) {
+  // 槽按 16 字节对齐, 至少能放下槽头(24 字节), RecordHeader 和一些数据
+  slot_bytes_ = (std::max<size_t>(options_.slot_bytes, 64) + 15) & ~static_cast<size_t>(15);
+  slot_count_ = RoundUpPowerOfTwo(std::max<size_t>(options_.slots, 16));
+  const size_t header_bytes = (sizeof(Header) + 63) & ~static_cast<size_t>(63);
+  map_bytes_ = header_bytes + slot_bytes_ * slot_count_;
+
+  fd_ = static_cast<int>(syscall(SYS_memfd_create, "lizylog_ring", MFD_CLOEXEC));
+  void* addr = MAP_FAILED;
+  if (fd_ >= 0 && ftruncate(fd_, static_cast<off_t>(map_bytes_)) == 0) {
+    addr = mmap(nullptr, map_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  }
+  if (addr == MAP_FAILED) {
+    // 不支持 memfd: 匿名共享映射同样由 fork 出来的子进程继承
+    addr = mmap(nullptr, map_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+      if (fd_ >= 0) close(fd_);
+      throw std::bad_alloc();
+    }
+  }
+  header_ = new (addr) Header();
+  slots_ = static_cast<char*>(addr) + header_bytes;
+  for (uint64 i = 0; i < slot_count_; i++) {
+    Slot* slot = new (slots_ + i * slot_bytes_) Slot();
+    slot->seq.store(i, std::memory_order_relaxed);
+    slot->claim.store(0, std::memory_order_relaxed);
+    slot->claim_start.store(0, std::memory_order_relaxed);
+  }
+  SelfStartTime();
+
+  {
+    std::lock_guard<std::mutex> registry_lk(shared_rings_mutex());
+    shared_rings().push_back(this);
+  }
+  if (options_.start_collector) {
+    *thread_ = std::thread([this] { RunCollector(); });
+  }
+}
+
+SharedLogRing::~SharedLogRing() {
+  {
+    std::lock_guard<std::mutex> registry_lk(shared_rings_mutex());
+    auto& rings = shared_rings();
+    rings.erase(std::remove(rings.begin(), rings.end(), this), rings.end());
+  }
+  if (thread_->joinable()) {
+    StopCollector();
+    thread_->join();
+  }
+  munmap(header_, map_bytes_);
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+void SharedLogRing::Write(bool force_flush, time_t timestamp, const char* message, size_t message_len) {
+  const LogSegment segment = {message, message_len};
+  WriteSegments(force_flush, timestamp, &segment, 1);
+}
+
+void SharedLogRing::WriteSegments(bool force_flush, time_t timestamp, const LogSegment* segments, size_t segment_count) {
+  const LogRecordView record = {severity_, force_flush, timestamp, 0, segments, segment_count};
+  WriteBatch(&record, 1);
+}
+
+void SharedLogRing::WriteBatch(const LogRecordView* records, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    bool appended = Append(records[i]);
+    for (int retry = 0; !appended && retry < kFullRetries; retry++) {
+      // 环满: 唤醒收集者, 让出 CPU 后重试
+      Signal();
+      sched_yield();
+      appended = Append(records[i]);
+    }
+    if (!appended) {
+      header_->dropped.fetch_add(1, std::memory_order_relaxed);
+      log_internal_namespace_::StatAdd(log_internal_namespace_::STAT_DROPPED_RECORDS);
+    }
+  }
+  Signal();
+}
+
+void SharedLogRing::Flush() {
+  FlushFor(MonotonicNanos() + (static_cast<int64>(std::max(options_.flush_interval_ms, 0)) + 1000) * 1000000);
+}
+
+bool SharedLogRing::FlushFor(int64 deadline_nanos) {
+  const uint64 end = header_->tail.load(std::memory_order_acquire);
+  uint64 target = header_->flush_target.load(std::memory_order_relaxed);
+  while (target < end && !header_->flush_target.compare_exchange_weak(target, end, std::memory_order_relaxed)) {
+  }
+  header_->signal_seq.fetch_add(1, std::memory_order_seq_cst);
+  SharedFutexWake(&header_->signal_seq, 1);
+
+  while (true) {
+    const uint32 done = header_->flush_done.load(std::memory_order_acquire);
+    if (header_->flushed.load(std::memory_order_acquire) >= end) {
+      return true;
+    }
+    const int64 remaining = deadline_nanos - MonotonicNanos();
+    if (remaining <= 0) {
+      return false; // 没有收集者, 或者收集者被崩溃的写入者卡住
+    }
+    SharedFutexWait(&header_->flush_done, done, std::min<int64>(remaining, 10000000));
+  }
+}
+
+uint32 SharedLogRing::LogSize() {
+  return static_cast<uint32>(std::min<uint64>(LogSize64(), UINT32_MAX));
+}
+
+uint64 SharedLogRing::LogSize64() {
+  return target_->LogSize64();
+}
+
+uint64 SharedLogRing::dropped_records() const {
+  return header_->dropped.load(std::memory_order_relaxed);
+}
+
+uint64 SharedLogRing::abandoned_slots() const {
+  return header_->abandoned.load(std::memory_order_relaxed);
+}
+
+SharedLogRing::Slot* SharedLogRing::SlotAt(uint64 pos) const {
+  return reinterpret_cast<Slot*>(slots_ + (pos & (slot_count_ - 1)) * slot_bytes_);
+}
+
+bool SharedLogRing::Append(const LogRecordView& record) {
+  const size_t data_bytes = slot_bytes_ - sizeof(Slot);
+  size_t len = 0;
+  for (size_t i = 0; i < record.segment_count; i++) {
+    len += record.segments[i].size;
+  }
+  len = std::min(len, static_cast<size_t>(slot_count_ / 4) * data_bytes - sizeof(RecordHeader));
+  const uint64 need = (sizeof(RecordHeader) + len + data_bytes - 1) / data_bytes;
+
+  const uint64 my_claim = (static_cast<uint64>(static_cast<uint32>(log_internal_namespace_::GetMainThreadPid())) << 32U) |
+                          need;
+  uint64 pos = header_->tail.load(std::memory_order_acquire);
+  int claim_waits = 0;
+  while (true) {
+    Slot* first = SlotAt(pos);
+    const uint64 seq = first->seq.load(std::memory_order_acquire);
+    const int64 diff = static_cast<int64>(seq - pos);
+    if (diff < 0) {
+      return false; // 上一圈的日志还没有被读取
+    }
+    if (diff > 0) {
+      pos = header_->tail.load(std::memory_order_acquire);
+      continue;
+    }
+    // 收集者按顺序释放槽, 最后一个槽空闲时中间的槽都空闲
+    if (SlotAt(pos + need - 1)->seq.load(std::memory_order_acquire) != pos + need - 1) {
+      const uint64 current = header_->tail.load(std::memory_order_acquire);
+      if (current == pos) {
+        return false; // 没有足够的连续空闲槽
+      }
+      pos = current;
+      continue;
+    }
+    uint64 holder = 0;
+    if (!first->claim.compare_exchange_strong(holder, my_claim, std::memory_order_acq_rel)) {
+      // 其他写入者正在占用这个位置: 让出 CPU 等待它移动 tail, 它在移动 tail 之前崩溃时清除它的 claim
+      if (header_->tail.load(std::memory_order_acquire) == pos && ++claim_waits >= kClaimRetries) {
+        if (ProcessAlive(static_cast<int32>(holder >> 32U), 0)) {
+          return false;
+        }
+        first->claim.compare_exchange_strong(holder, 0, std::memory_order_acq_rel);
+        claim_waits = 0;
+      } else {
+        sched_yield();
+      }
+      pos = header_->tail.load(std::memory_order_acquire);
+      continue;
+    }
+    // 持有 claim 后只有当前写入者可以移动 tail; tail 已经不在这里时槽已经被使用过(可能是下一圈), 放弃 claim
+    uint64 expected = pos;
+    if (first->seq.load(std::memory_order_acquire) == pos &&
+        header_->tail.compare_exchange_strong(expected, pos + need, std::memory_order_release,
+                                              std::memory_order_relaxed)) {
+      break;
+    }
+    first->claim.store(0, std::memory_order_release);
+    pos = expected;
+  }
+
+  Slot* first = SlotAt(pos);
+  first->claim_start.store(SelfStartTime(), std::memory_order_relaxed);
+  const RecordHeader record_header = {static_cast<uint32>(len), static_cast<int32>(record.severity),
+                                      static_cast<int64>(record.timestamp), record.usecs,
+                                      record.force_flush ? 1U : 0U};
+  char* out = reinterpret_cast<char*>(first) + sizeof(Slot);
+  memcpy(out, &record_header, sizeof(record_header));
+  size_t room = data_bytes - sizeof(record_header);
+  out += sizeof(record_header);
+  uint64 slot_pos = pos;
+  size_t remaining = len;
+  for (size_t i = 0; i < record.segment_count && remaining > 0; i++) {
+    const char* data = record.segments[i].data;
+    size_t size = std::min(record.segments[i].size, remaining);
+    remaining -= size;
+    while (size > 0) {
+      if (room == 0) {
+        // 下一个槽的数据区(环的末尾回到开头)
+        out = reinterpret_cast<char*>(SlotAt(++slot_pos)) + sizeof(Slot);
+        room = data_bytes;
+      }
+      const size_t n = std::min(size, room);
+      memcpy(out, data, n);
+      out += n;
+      data += n;
+      size -= n;
+      room -= n;
+    }
+  }
+
+  // 收集者已经跳过这些槽(认为写入者已经崩溃)时提交失败, 这条日志丢弃
+  uint64 expected = pos;
+  return first->seq.compare_exchange_strong(expected, pos + 1, std::memory_order_release, std::memory_order_relaxed);
+}
+
+void SharedLogRing::Signal() {
+  // 与 WaitForSignal() 配对: 写入者先提交再读 sleeping, 收集者先写 sleeping 再检查是否有已提交的日志
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (header_->sleeping.load(std::memory_order_relaxed)) {
+    header_->signal_seq.fetch_add(1, std::memory_order_seq_cst);
+    SharedFutexWake(&header_->signal_seq, 1);
+  }
+}
+
+void SharedLogRing::WaitForSignal(int64 timeout_nanos) {
+  header_->sleeping.store(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const uint32 seen = header_->signal_seq.load(std::memory_order_acquire);
+  const uint64 head = header_->head.load(std::memory_order_relaxed);
+  const uint64 flushed = header_->flushed.load(std::memory_order_relaxed);
+  // 没有已提交的日志, 没有退出请求, 也没有可以刷新的 Flush() 请求时才睡眠
+  if (SlotAt(head)->seq.load(std::memory_order_acquire) != head + 1 &&
+      !header_->stop.load(std::memory_order_acquire) &&
+      (head == flushed || header_->flush_target.load(std::memory_order_relaxed) <= flushed)) {
+    SharedFutexWait(&header_->signal_seq, seen, timeout_nanos);
+  }
+  header_->sleeping.store(0, std::memory_order_relaxed);
+}
+
+void SharedLogRing::ReleaseSlots(uint64 begin, uint64 end) {
+  for (uint64 pos = begin; pos < end; pos++) {
+    Slot* slot = SlotAt(pos);
+    slot->claim.store(0, std::memory_order_relaxed);
+    slot->claim_start.store(0, std::memory_order_relaxed);
+    slot->seq.store(pos + slot_count_, std::memory_order_release);
+  }
+  header_->head.store(end, std::memory_order_release);
+}
+
+bool SharedLogRing::RunCollector() {
+  // 当前进程中已经有收集线程
+  if (collecting_.exchange(true, std::memory_order_acq_rel)) {
+    return false;
+  }
+  const uint64 identity = ProcessIdentity();
+  uint64 current = header_->collector.load(std::memory_order_acquire);
+  // 只从没有收集者, 或者收集者所在的进程已经退出(包括 pid 被新的进程复用)时接替
+  // current == identity 而当前进程中没有收集线程: 是当前进程之前的收集线程没有正常退出留下的
+  while (true) {
+    if (current != 0 && current != identity &&
+        ProcessAlive(static_cast<int32>(current >> 32U), current & 0xffffffffU)) {
+      collecting_.store(false, std::memory_order_release);
+      return false;
+    }
+    if (header_->collector.compare_exchange_weak(current, identity, std::memory_order_acq_rel)) {
+      break;
+    }
+  }
+
+  const size_t data_bytes = slot_bytes_ - sizeof(Slot);
+  const int64 interval = static_cast<int64>(std::max(options_.flush_interval_ms, 1)) * 1000000;
+  const int64 stale = static_cast<int64>(std::max(options_.stale_record_ms, 1)) * 1000000;
+  std::vector<LogRecordView> views;
+  std::vector<LogSegment> segments;
+  std::vector<size_t> first_segment; // 每条日志的第一个分段在 segments 中的下标
+  uint64 head = header_->head.load(std::memory_order_acquire);
+  uint64 flushed = head;
+  int64 next_flush = MonotonicNanos() + interval;
+  int64 stuck_since = 0;
+  // 跳过没有 claim 的槽(损坏的记录之后的数据槽)时, 第一次跳过时的 tail; 之前的槽不再等待, 之后的槽重新等待
+  uint64 skip_until = 0;
+
+  while (true) {
+    views.clear();
+    segments.clear();
+    first_segment.clear();
+    uint64 pos = head;
+    bool blocked = false;
+    while (views.size() < kMaxBatchRecords) {
+      Slot* slot = SlotAt(pos);
+      if (slot->seq.load(std::memory_order_acquire) != pos + 1) {
+        // 空, 或者已被占用还没有提交
+        blocked = header_->tail.load(std::memory_order_acquire) != pos;
+        break;
+      }
+      RecordHeader record_header;
+      memcpy(&record_header, reinterpret_cast<char*>(slot) + sizeof(Slot), sizeof(record_header));
+      const uint64 need = (sizeof(RecordHeader) + record_header.length + data_bytes - 1) / data_bytes;
+      if (need > slot_count_ / 4 || need != (slot->claim.load(std::memory_order_relaxed) & 0xffffffffU)) {
+        // 损坏的记录: 只跳过第一个槽, 之后的槽按未提交处理
+        header_->abandoned.fetch_add(1, std::memory_order_relaxed);
+        pos++;
+        continue;
+      }
+      first_segment.push_back(segments.size());
+      size_t remaining = record_header.length;
+      size_t first_len = std::min(remaining, data_bytes - sizeof(RecordHeader));
+      segments.push_back({reinterpret_cast<char*>(slot) + sizeof(Slot) + sizeof(RecordHeader), first_len});
+      remaining -= first_len;
+      for (uint64 i = 1; remaining > 0; i++) {
+        const size_t n = std::min(remaining, data_bytes);
+        segments.push_back({reinterpret_cast<char*>(SlotAt(pos + i)) + sizeof(Slot), n});
+        remaining -= n;
+      }
+      const LogSeverity severity = (record_header.severity >= 0 && record_header.severity < NUM_SEVERITIES)
+                                   ? static_cast<LogSeverity>(record_header.severity) : severity_;
+      views.push_back({severity, record_header.force_flush != 0, static_cast<time_t>(record_header.timestamp),
+                       record_header.usecs, nullptr, 0});
+      pos += need;
+    }
+
+    if (!views.empty()) {
+      for (size_t i = 0; i < views.size(); i++) {
+        const size_t end = i + 1 < views.size() ? first_segment[i + 1] : segments.size();
+        views[i].segments = &segments[first_segment[i]];
+        views[i].segment_count = end - first_segment[i];
+      }
+      target_->WriteBatch(views.data(), views.size());
+    }
+    if (pos != head) {
+      // 写出后才释放: 分段直接指向槽中的数据
+      ReleaseSlots(head, pos);
+      head = pos;
+      stuck_since = 0;
+    }
+
+    const int64 now = MonotonicNanos();
+    if (blocked) {
+      // 第一个槽被占用但一直没有提交: 确认占用者已经退出后跳过它占用的槽
+      Slot* slot = SlotAt(head);
+      const uint64 claim = slot->claim.load(std::memory_order_acquire);
+      if (stuck_since == 0) stuck_since = now;
+      uint64 count = 0;
+      if (claim == 0) {
+        // 没有记录占用者: 写入者移动 tail 之前已经写了 claim, 这里只能是损坏的记录之后的数据槽
+        // 为了保险等待更久后逐个跳过, 直到第一次跳过时的 tail, 之后的槽重新等待
+        if (head < skip_until || now - stuck_since >= 10 * stale) {
+          count = 1;
+        }
+      } else if (now - stuck_since >= stale &&
+                 !ProcessAlive(static_cast<int32>(claim >> 32U), slot->claim_start.load(std::memory_order_relaxed))) {
+        count = claim & 0xffffffffU;
+      }
+      const uint64 available = header_->tail.load(std::memory_order_acquire) - head;
+      count = std::min(count, available);
+      uint64 expected = head;
+      if (count > 0 && slot->seq.compare_exchange_strong(expected, head + slot_count_, std::memory_order_acq_rel)) {
+        header_->abandoned.fetch_add(count, std::memory_order_relaxed);
+        ReleaseSlots(head + 1, head + count);
+        head += count;
+        header_->head.store(head, std::memory_order_release);
+        stuck_since = 0;
+        if (claim == 0 && head > skip_until) {
+          skip_until = header_->tail.load(std::memory_order_acquire);
+        }
+        continue;
+      }
+    }
+
+    // 已经读完(或者被未提交的槽挡住): 处理 Flush() 和定时刷新
+    if (views.size() < kMaxBatchRecords && head != flushed &&
+        (header_->flush_target.load(std::memory_order_relaxed) > flushed || now >= next_flush)) {
+      target_->Flush();
+      flushed = head;
+      next_flush = now + interval;
+      header_->flushed.store(flushed, std::memory_order_release);
+      header_->flush_done.fetch_add(1, std::memory_order_release);
+      SharedFutexWake(&header_->flush_done, INT32_MAX);
+    }
+
+    if (views.size() == kMaxBatchRecords) {
+      continue;
+    }
+    if (header_->stop.load(std::memory_order_acquire) && (!blocked || now - stuck_since >= stale)) {
+      // 退出: 被仍然存在的写入者挡住时最多等待 stale_record_ms
+      target_->Flush();
+      header_->flushed.store(head, std::memory_order_release);
+      header_->flush_done.fetch_add(1, std::memory_order_release);
+      SharedFutexWake(&header_->flush_done, INT32_MAX);
+      break;
+    }
+    if (views.empty()) {
+      const int64 timeout = blocked ? std::max<int64>(stale / 4, 1000000) : std::max<int64>(next_flush - now, 1000000);
+      WaitForSignal(std::min(timeout, interval));
+    }
+  }
+
+  header_->stop.store(0, std::memory_order_release);
+  header_->collector.store(0, std::memory_order_release);
+  collecting_.store(false, std::memory_order_release);
+  return true;
+}
+
+void InstallSharedLogRings(const SharedLogRingOptions& options) {
+  for (int severity = 0; severity < NUM_SEVERITIES; severity++) {
+    SetBatchLogger(severity, new SharedLogRing(severity, GetBatchLogger(severity), options));
+  }
+}
+
+void SharedLogRing::StopCollector() {
+  header_->stop.store(1, std::memory_order_release);
+  header_->signal_seq.fetch_add(1, std::memory_order_seq_cst);
+  SharedFutexWake(&header_->signal_seq, 1);
+}
+
+void SharedLogRing::AtForkPrepareAll() {
+  shared_rings_mutex().lock();
+}
+
+void SharedLogRing::AtForkParentAll() {
+  shared_rings_mutex().unlock();
+}
+
+// 子进程中没有收集线程, 只作为写入者; 环中的日志由父进程的收集者写出
+void SharedLogRing::AtForkChildAll() {
+  self_start_time.store(0, std::memory_order_relaxed);
+  SelfStartTime();
+  for (SharedLogRing* ring : shared_rings()) {
+    log_internal_namespace_::RenewAfterFork(&ring->thread_);
+    ring->collecting_.store(false, std::memory_order_relaxed);
+  }
+  shared_rings_mutex().unlock();
+}
+
+} // end of namespace base
@@ -1,4 +1,16 @@
 #include "utilities.h"
+#include "flag.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define LIZY_HAVE_RDTSC 1
+#endif
 
 static const char* log_program_invocation_short_name = nullptr;
 
@@ -11,18 +23,312 @@ bool IsLoggingInitialized() {
 namespace log_internal_namespace_ {
 
 int64 CycleClock_Now() {
+  // 定时器的精度是秒级, 粗粒度的单调时钟足够, 并且只读取 vDSO 中的变量
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+int64 UsecToCycles(int64 usec) {
+  return usec;
+}
+
+thread_local WallTime tls_batch_time = 0;
+
+namespace {
+
+WallTime GetTimeOfDay() {
   struct timeval tv;
   gettimeofday(&tv, nullptr);
+  return static_cast<WallTime>(tv.tv_sec) + tv.tv_usec * 0.000001;
+}
+
+WallTime ClockGetTime(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return static_cast<WallTime>(ts.tv_sec) + ts.tv_nsec * 0.000000001;
+}
 
-  return static_cast<int64>(tv.tv_sec) * 1000000 + tv.tv_usec;
+int64 RealtimeNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
 }
 
+#ifdef LIZY_HAVE_RDTSC
+// TSC 时钟: wall_ns = base_ns + (tsc - base_tsc) * mult >> 32
+// 参数由校准线程更新, 读取方使用 seqlock, 不需要加锁
+class TscClock {
+ public:
+  // 返回 false 表示还不能使用(不支持或者尚未校准)
+  bool Now(WallTime* now) {
+    if (!supported_) {
+      return false;
+    }
+    if (!started_.load(std::memory_order_acquire)) {
+      Start();
+    }
+    uint32 seq;
+    int64 base_tsc, base_ns;
+    uint64 mult;
+    do {
+      seq = seq_.load(std::memory_order_acquire);
+      base_tsc = base_tsc_.load(std::memory_order_relaxed);
+      base_ns = base_ns_.load(std::memory_order_relaxed);
+      mult = mult_.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((seq & 1) != 0 || seq != seq_.load(std::memory_order_relaxed));
+    if (mult == 0) {
+      return false;
+    }
+    const int64 ns = Extrapolate(base_tsc, base_ns, mult, static_cast<int64>(__rdtsc()));
+    *now = ns * 0.000000001;
+    return true;
+  }
+
+  ~TscClock() {
+    {
+      std::lock_guard<std::mutex> lk(mutex_);
+      stop_ = true;
+    }
+    worker_->cv.notify_all();
+    if (worker_->thread.joinable()) {
+      worker_->thread.join();
+    }
+  }
+
+  static TscClock& Instance() {
+    static TscClock clock;
+    return clock;
+  }
+
+  // fork 时校准线程可能持有 mutex_, 先等它释放
+  void AtForkPrepare() {
+    mutex_.lock();
+  }
+
+  void AtForkParent() {
+    mutex_.unlock();
+  }
+
+  // 子进程中没有校准线程, 已经发布的参数继续使用, 下次读取时重新启动校准线程
+  void AtForkChild() {
+    RenewAfterFork(&worker_);
+    started_.store(false, std::memory_order_relaxed);
+    mutex_.unlock();
+  }
+
+ private:
+  // 第一次校准前的采样间隔, 和之后重新校准的间隔
+  static constexpr int kFirstCalibrationMs = 10;
+  static constexpr int kCalibrationMs = 1000;
+
+  TscClock() {
+    unsigned int eax, ebx, ecx, edx;
+    // CPUID.80000007H:EDX[8] 不变的 TSC(频率不随 CPU 调频和休眠改变)
+    supported_ = __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1U << 8));
+  }
+
+  void Start() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    if (!started_.load(std::memory_order_relaxed)) {
+      worker_->thread = std::thread(&TscClock::Calibrate, this);
+      started_.store(true, std::memory_order_release);
+    }
+  }
+
+  // 两次读取 TSC 之间读取墙上时间和不受调整影响的单调时钟, 取间隔最短的一次, 减小被抢占带来的误差
+  static void Sample(int64* tsc, int64* ns, int64* raw_ns) {
+    *tsc = 0;
+    *ns = 0;
+    *raw_ns = 0;
+    uint64 best = ~0ULL;
+    for (int i = 0; i < 5; i++) {
+      const uint64 t0 = __rdtsc();
+      const int64 wall = RealtimeNanos();
+      struct timespec raw;
+      clock_gettime(CLOCK_MONOTONIC_RAW, &raw);
+      const uint64 t1 = __rdtsc();
+      if (t1 - t0 < best) {
+        best = t1 - t0;
+        *tsc = static_cast<int64>(t0 + (t1 - t0) / 2);
+        *ns = wall;
+        *raw_ns = static_cast<int64>(raw.tv_sec) * 1000000000 + raw.tv_nsec;
+      }
+    }
+  }
+
+  static int64 Extrapolate(int64 base_tsc, int64 base_ns, uint64 mult, int64 tsc) {
+    return base_ns + static_cast<int64>((static_cast<__int128>(tsc - base_tsc) * mult) >> 32);
+  }
+
+  void Publish(int64 base_tsc, int64 base_ns, uint64 mult) {
+    const uint32 seq = seq_.load(std::memory_order_relaxed);
+    seq_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    base_tsc_.store(base_tsc, std::memory_order_relaxed);
+    base_ns_.store(base_ns, std::memory_order_relaxed);
+    mult_.store(mult, std::memory_order_relaxed);
+    seq_.store(seq + 2, std::memory_order_release);
+  }
+
+  void Calibrate() {
+    // 频率用第一次采样到当前采样的整个区间(单调时钟, 不受系统时间调整影响)计算, 时间越长越准确
+    // 发布的时间保持单调不减: 新的基准点取当前外推的时间, 与墙上时间的误差在下一个校准周期内通过调整 mult 消除;
+    // 墙上时间向前跳变较多时直接跟上, 向后跳变时最多以 1/8 的速率放慢, 不会倒退
+    int64 first_tsc = 0;
+    int64 first_ns = 0;
+    int64 first_raw = 0;
+    Sample(&first_tsc, &first_ns, &first_raw);
+    int wait_ms = kFirstCalibrationMs;
+    std::unique_lock<std::mutex> lk(mutex_);
+    while (!worker_->cv.wait_for(lk, std::chrono::milliseconds(wait_ms), [this] { return stop_; })) {
+      wait_ms = kCalibrationMs;
+      int64 tsc = 0;
+      int64 ns = 0;
+      int64 raw = 0;
+      Sample(&tsc, &ns, &raw);
+      if (tsc <= first_tsc || raw <= first_raw) {
+        continue;
+      }
+      const uint64 freq_mult =
+          static_cast<uint64>((static_cast<__int128>(raw - first_raw) << 32) / (tsc - first_tsc));
+      const uint64 mult = mult_.load(std::memory_order_relaxed); // 只有校准线程修改
+      if (mult == 0) {
+        Publish(tsc, ns, freq_mult);
+        continue;
+      }
+      const int64 now_tsc = static_cast<int64>(__rdtsc());
+      const int64 current = Extrapolate(base_tsc_.load(std::memory_order_relaxed),
+                                        base_ns_.load(std::memory_order_relaxed), mult, now_tsc);
+      const int64 wall = Extrapolate(tsc, ns, freq_mult, now_tsc);
+      const int64 period = static_cast<int64>(kCalibrationMs) * 1000000;
+      const int64 error = wall - current;
+      if (error > period / 8) {
+        Publish(now_tsc, wall, freq_mult);
+      } else {
+        const int64 correction = std::max(error, -period / 8);
+        Publish(now_tsc, current,
+                static_cast<uint64>(static_cast<__int128>(freq_mult) * (period + correction) / period));
+      }
+    }
+  }
+
+  bool supported_{false};
+  std::atomic<bool> started_{false};
+  std::atomic<uint32> seq_{0};
+  std::atomic<int64> base_tsc_{0};
+  std::atomic<int64> base_ns_{0};
+  std::atomic<uint64> mult_{0};
+
+  std::mutex mutex_;
+  bool stop_{false};
+  std::unique_ptr<WorkerThread> worker_{new WorkerThread()};
+};
+#endif
+
+} // end of namespace
+
 WallTime WallTime_Now() {
-  return CycleClock_Now() * 0.000001;
+  switch (FLAGS_clock_source) {
+    case CLOCK_SOURCE_TSC: {
+#ifdef LIZY_HAVE_RDTSC
+      WallTime now;
+      if (TscClock::Instance().Now(&now)) {
+        return now;
+      }
+#endif
+      return ClockGetTime(CLOCK_REALTIME_COARSE);
+    }
+    case CLOCK_SOURCE_REALTIME_COARSE:
+      return ClockGetTime(CLOCK_REALTIME_COARSE);
+    default:
+      return GetTimeOfDay();
+  }
 }
 
-int64 UsecToCycles(int64 usec) {
-  return usec;
+WallTime MessageTime_Now() {
+  if (tls_batch_time != 0) {
+    return tls_batch_time;
+  }
+  return WallTime_Now();
+}
+
+bool IsLogFileName(const std::string& filepath,
+                   const std::string& base_filename,
+                   const std::string& filename_extension) {
+
+  // 移除 base_filename 多余的 '/'
+  // 原来 "/tmp//<base_filename>.<create_time>.<pid>"
+  // 移除 "/tmp/<base_filename>.<create_time>.<pid>"
+  std::string cleaned_base_filename;
+
+  size_t real_filepath_size = filepath.size();
+  for (char c : base_filename) {
+    if (cleaned_base_filename.empty()) {
+      cleaned_base_filename += c;
+    } else if (c != PATH_SEPARATOR || 
+               (!cleaned_base_filename.empty() && c != cleaned_base_filename.back())) {
+      
+      cleaned_base_filename += c;
+    }
+  }
+
+  // 如果 filename 不以 cleaned_base_filename 开头就返回
+  if (filepath.find(cleaned_base_filename) != 0) {
+    return false;
+  }
+
+  // 如果设置了 filename_extension, 则检查 filename_extension 是否在 cleaned_base_filename 的相邻右边
+  if (!filename_extension.empty()) {
+    if (cleaned_base_filename.size() >= real_filepath_size) {
+      return false;
+    }
+    // 对于原始版本, filename_extension 在 filepath 的中间
+    std::string ext = filepath.substr(cleaned_base_filename.size(), filename_extension.size());
+    if (ext == filename_extension) {
+      cleaned_base_filename += filename_extension;
+    } else {
+      // 对于新版本, filename_extension 在 filepath 的尾部
+      if (filename_extension.size() >= real_filepath_size) {
+        return false;
+      }
+      real_filepath_size = filepath.size() - filename_extension.size();
+      if (filepath.substr(real_filepath_size) != filename_extension) {
+        return false;
+      }
+    }
+  }
+
+  // YYYYMMDD-HHMMSS.pid 或者分片文件 YYYYMMDD-HHMMSS.pid.s<shard>
+  bool in_shard = false;
+  for (size_t i = cleaned_base_filename.size(); i < real_filepath_size; i++) {
+    const char& c = filepath[i];
+
+    if (i <= cleaned_base_filename.size() + 7) {
+      // 0~7: YYYYMMDD
+      if (c < '0' || c > '9') {return false;}
+    } else if (i == cleaned_base_filename.size() + 8) {
+      // 8: -
+      if (c != '-') {return false;}
+    } else if (i <= cleaned_base_filename.size() + 14) {
+      // 9~14: HHMMSS
+      if (c < '0' || c > '9') {return false;}
+    } else if (i == cleaned_base_filename.size() + 15) {
+      // 15: .
+      if (c != '.') {return false;}
+    } else if (i >= cleaned_base_filename.size() + 16) {
+      // 16+: pid[.s<shard>]
+      if (c == '.' && !in_shard && i > cleaned_base_filename.size() + 16 && 
+          i + 2 < real_filepath_size && filepath[i + 1] == 's') {
+        in_shard = true;
+        i++; // 跳过 's'
+        continue;
+      }
+      if (c < '0' || c > '9') {return false;}
+    }
+  }
+  return true;
 }
 
 const char* const_basename(const char* filepath) {
@@ -39,18 +345,28 @@ const char* ProgramInvocationShortName() {
 }
 
 
-static int32 g_main_thread_pid = getpid();
+static std::atomic<int32> g_main_thread_pid{getpid()};
 int32 GetMainThreadPid() {
-  return g_main_thread_pid;
+  return g_main_thread_pid.load(std::memory_order_relaxed);
 }
 
-bool PidHasChanged() {
-  int32 pid = getpid();
-  if (g_main_thread_pid == pid) {
-    return false;
-  }
-  g_main_thread_pid = pid;
-  return true;
+void UtilitiesAtForkPrepare() {
+#ifdef LIZY_HAVE_RDTSC
+  TscClock::Instance().AtForkPrepare();
+#endif
+}
+
+void UtilitiesAtForkParent() {
+#ifdef LIZY_HAVE_RDTSC
+  TscClock::Instance().AtForkParent();
+#endif
+}
+
+void UtilitiesAtForkChild() {
+  g_main_thread_pid.store(getpid(), std::memory_order_relaxed);
+#ifdef LIZY_HAVE_RDTSC
+  TscClock::Instance().AtForkChild();
+#endif
 }
 
 static std::string g_my_user_name;
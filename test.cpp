@@ -1,11 +1,157 @@
 #include "logging.h"
+#include "async_logger.h"
+#include "shm_log_ring.h"
+#include <sched.h>
+#include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <thread>
+#include <vector>
+
+// 写 epi 条日志, 返回每条日志的平均耗时(单位: ns)
+static double RunBenchmark(int epi) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < epi; i++) {
+    LOG(INFO) << "hello log" << i;
+  }
+  FlushLogFiles(LOG_INFO);
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(end - start).count() / epi;
+}
+
+// 写 epi 条相同的日志(例如重试循环中的错误), 返回每条日志的平均耗时(单位: ns)
+static double RunRepeatBenchmark(int epi) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < epi; i++) {
+    LOG(INFO) << "connection refused, retrying";
+  }
+  FlushLogFiles(LOG_INFO);
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(end - start).count() / epi;
+}
+
+// 每条日志插入 kInserts 个 value, 返回每次插入的平均耗时(单位: ns), 日志本身的开销被平摊
+// via_ostream 为 true 时通过 std::ostream& 插入(不走 LogStream 的快速路径)
+template <typename T>
+static double RunInsertBenchmark(const T& value, bool via_ostream, int epi) {
+  const int kInserts = 1000;
+  const int messages = std::max(epi / kInserts, 1) * 10;
+  LogCapture capture(false);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < messages; i++) {
+    capture.Clear();
+    LogMessage message(__FILE__, __LINE__, LOG_INFO, &capture);
+    if (via_ostream) {
+      std::ostream& os = message.stream();
+      for (int j = 0; j < kInserts; j++) os << value;
+    } else {
+      LogMessage::LogStream& os = message.stream();
+      for (int j = 0; j < kInserts; j++) os << value;
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(end - start).count() /
+         messages / kInserts;
+}
+
+template <typename T>
+static void ReportInsertBenchmark(const char* name, const T& value, int epi) {
+  const double slow = RunInsertBenchmark(value, true, epi);
+  const double fast = RunInsertBenchmark(value, false, epi);
+  std::cout << "insert " << name << ": ostream " << slow << " ns, LogStream " << fast << " ns (x" << slow / fast << ")"
+            << std::endl;
+}
+
+// 把 bytes 字节的缓冲区以十六进制写入日志, 返回输入的吞吐量(单位: GB/s)
+// use_loop 为 true 时使用 std::hex 逐字节输出
+static double RunHexBenchmark(size_t bytes, bool use_loop, int rounds) {
+  std::vector<unsigned char> data(bytes);
+  for (size_t i = 0; i < bytes; i++) data[i] = static_cast<unsigned char>(i * 131);
+  LogCapture capture(false);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) {
+    capture.Clear();
+    if (use_loop) {
+      LogMessage message(__FILE__, __LINE__, LOG_INFO, &capture);
+      std::ostream& os = message.stream();
+      os << std::hex << std::setfill('0');
+      for (unsigned char c : data) os << std::setw(2) << static_cast<int>(c);
+    } else {
+      LOG_CAPTURE(INFO, &capture) << LogHex(data.data(), bytes, bytes);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  return static_cast<double>(bytes) * rounds /
+         std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(end - start).count();
+}
+
+// threads 个线程各写 epi 条日志, 返回总的 QPS
+static double RunThreads(int threads, int epi) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([epi] {
+      for (int i = 0; i < epi; i++) {
+        LOG(INFO) << "hello log" << i;
+      }
+    });
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+  FlushLogFiles(LOG_INFO);
+  auto end = std::chrono::steady_clock::now();
+  return threads * epi / std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count();
+}
+
+// 直接写 epi 条已格式化的日志到 INFO 日志记录器, batch 为 0 时每条调用一次旧接口, 否则每 batch 条调用一次 WriteBatch
+// 返回每条日志的平均耗时(包括最后的 Flush, 单位: ns)
+static double RunLoggerBenchmark(size_t batch, int epi) {
+  const char message[] = "2024-01-01 00:00:00.000000 [test.cpp:1][INFO]: hello log\n";
+  const LogSegment segment = {message, sizeof(message) - 1};
+  std::vector<base::LogRecordView> records(std::max<size_t>(batch, 1),
+                                           {LOG_INFO, false, time(nullptr), 0, &segment, 1});
+  auto start = std::chrono::steady_clock::now();
+  if (batch == 0) {
+    base::Logger* logger = base::GetLogger(LOG_INFO);
+    for (int i = 0; i < epi; i++) {
+      logger->WriteSegments(false, records[0].timestamp, &segment, 1);
+    }
+    logger->Flush();
+  } else {
+    base::BatchLogger* logger = base::GetBatchLogger(LOG_INFO);
+    for (int i = 0; i < epi; i += static_cast<int>(batch)) {
+      logger->WriteBatch(records.data(), std::min(batch, static_cast<size_t>(epi - i)));
+    }
+    logger->Flush();
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(end - start).count() / epi;
+}
+
+// 直接调用异步日志记录器的 Write, 每条都要求立即写出(需要唤醒后台线程), 输出每次调用耗时的 p50 和 p99
+static void ReportAsyncWaitBenchmark(const char* name, base::AsyncWaitStrategy strategy, int epi) {
+  base::AsyncLoggerOptions options;
+  options.wait_strategy = strategy;
+  base::AsyncLogger logger(LOG_INFO, base::GetBatchLogger(LOG_INFO), options);
+  const char message[] = "2024-01-01 00:00:00.000000 [test.cpp:1][INFO]: hello async\n";
+  std::vector<double> latencies(epi);
+  for (int i = 0; i < epi; i++) {
+    auto start = std::chrono::steady_clock::now();
+    logger.Write(true, time(nullptr), message, sizeof(message) - 1);
+    auto end = std::chrono::steady_clock::now();
+    latencies[i] = std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(end - start).count();
+  }
+  logger.Flush();
+  std::sort(latencies.begin(), latencies.end());
+  std::cout << "async wait " << name << ": p50 " << latencies[epi / 2] << " ns, p99 "
+            << latencies[epi * 99 / 100] << " ns" << std::endl;
+}
 
 int main(int argc, char const *argv[])
 {
   InitLogging(argv[0]);
-  SetLogDir("/home/lizy/lizy_log/");
+  SetLogDir(argc > 1 ? argv[1] : "/home/lizy/lizy_log/");
   SetLogDestination(LOG_INFO, "testI");
   SetLogDestination(LOG_WARNING, "testW");
   SetLogDestination(LOG_ERROR, "testE");
@@ -21,5 +167,140 @@ int main(int argc, char const *argv[])
   auto res = std::chrono::duration_cast<std::chrono::duration<double>>(end - start);
   std::cout << "QPS: " <<  epi / res.count() << "msg/s" << std::endl;
 
+  // 各个持久化模式增加的延迟
+  struct {
+    LogDurabilityMode mode;
+    const char* name;
+    int epi;
+  } modes[] = {
+    {DURABILITY_BUFFERED, "buffered", 50000},
+    {DURABILITY_PREALLOCATE, "preallocate", 50000},
+    {DURABILITY_GROUP_COMMIT, "group_commit", 50000},
+    {DURABILITY_DIRECT, "direct", 2000},
+    {DURABILITY_DSYNC, "dsync", 2000},
+  };
+  double baseline = 0;
+  for (const auto& m : modes) {
+    SetLogDurabilityMode(m.mode);
+    // 改名字会关闭旧文件, 新文件使用新的持久化模式
+    SetLogDestination(LOG_INFO, (std::string("testI_") + m.name).c_str());
+    const double ns = RunBenchmark(m.epi);
+    if (m.mode == DURABILITY_BUFFERED) baseline = ns;
+    std::cout << "durability " << m.name << ": " << ns << " ns/msg (+" << ns - baseline << " ns)" << std::endl;
+  }
+  SetLogDurabilityMode(DURABILITY_BUFFERED);
+  SetLogDestination(LOG_INFO, "testI_clock");
+
+  // 各个时钟的开销
+  struct {
+    LogClockSource source;
+    const char* name;
+  } clocks[] = {
+    {CLOCK_SOURCE_GETTIMEOFDAY, "gettimeofday"},
+    {CLOCK_SOURCE_REALTIME_COARSE, "realtime_coarse"},
+    {CLOCK_SOURCE_TSC, "tsc"},
+  };
+  for (const auto& c : clocks) {
+    SetLogClockSource(c.source);
+    std::cout << "clock " << c.name << ": " << RunBenchmark(epi) << " ns/msg" << std::endl;
+  }
+  {
+    ScopedLogTimeBatch batch;
+    std::cout << "clock batch: " << RunBenchmark(epi) << " ns/msg" << std::endl;
+  }
+  SetLogClockSource(CLOCK_SOURCE_GETTIMEOFDAY);
+
+  // 多线程: 单个文件和分片文件
+  // 分片默认关闭: 分片只在多个 CPU 上同时写日志时减少 log_mutex 的争用, 线程数超过 CPU 数时没有收益
+  const int threads = 16;
+  std::cout << "threads " << threads << " single file: " << RunThreads(threads, epi / threads) << " msg/s" << std::endl;
+  for (int shards : {1, 4, 16}) {
+    SetLogShards(shards);
+    std::cout << "threads " << threads << " shards " << shards << ": " << RunThreads(threads, epi / threads) << " msg/s"
+              << std::endl;
+  }
+  SetLogShards(0);
+
+  // 捕获到内存: LOG_STRING 每条日志分配一个 string, LogCapture 复用同一块内存
+  {
+    std::vector<std::string> outvec;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < epi; i++) {
+      if (i % 100 == 0) outvec.clear();
+      LOG_STRING(INFO, &outvec) << "hello log" << i;
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "capture LOG_STRING: "
+              << std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(end - start).count() / epi
+              << " ns/msg" << std::endl;
+
+    LogCapture capture(false);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < epi; i++) {
+      if (i % 100 == 0) capture.Clear();
+      LOG_CAPTURE(INFO, &capture) << "hello log" << i;
+    }
+    end = std::chrono::steady_clock::now();
+    std::cout << "capture LogCapture: "
+              << std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(end - start).count() / epi
+              << " ns/msg" << std::endl;
+  }
+
+  // 各个类型的插入开销: std::ostream 和 LogStream 快速路径
+  ReportInsertBenchmark("int", 123456789, epi);
+  ReportInsertBenchmark("uint64", 18446744073709551615ULL, epi);
+  ReportInsertBenchmark("double", 3.14159265358979, epi);
+  ReportInsertBenchmark("char", 'x', epi);
+  ReportInsertBenchmark("const char*", "hello", epi);
+  ReportInsertBenchmark("std::string", std::string("hello log"), epi);
+  ReportInsertBenchmark("string_view", std::string_view("hello log"), epi);
+  ReportInsertBenchmark("pointer", static_cast<const void*>(&epi), epi);
+
+  // 十六进制输出: std::hex 逐字节 和 LogHex
+  std::cout << "hex 64KB: std::hex " << RunHexBenchmark(64 << 10, true, 20) << " GB/s, LogHex "
+            << RunHexBenchmark(64 << 10, false, 2000) << " GB/s" << std::endl;
+
+  // 日志记录器: 每条日志一次调用(加一次锁) 和 批量写入
+  std::cout << "logger single: " << RunLoggerBenchmark(0, epi * 4) << " ns/msg, batch 256: "
+            << RunLoggerBenchmark(256, epi * 4) << " ns/msg" << std::endl;
+
+  // 异步日志记录器: 前台只追加到内存块, 后台线程整块写出
+  base::SetLogger(LOG_INFO, new base::AsyncLogger(LOG_INFO, base::GetBatchLogger(LOG_INFO)));
+  std::cout << "async logger single: " << RunLoggerBenchmark(0, epi * 4) << " ns/msg" << std::endl;
+  base::SetLogger(LOG_INFO, nullptr);
+  // 每个 NUMA 节点一组内存块, 后台线程绑定到 CPU 0 并使用 SCHED_BATCH
+  base::AsyncLoggerOptions numa_options;
+  numa_options.numa_aware = true;
+  numa_options.writer_cpus = {0};
+  numa_options.writer_sched_policy = SCHED_BATCH;
+  base::SetLogger(LOG_INFO, new base::AsyncLogger(LOG_INFO, base::GetBatchLogger(LOG_INFO), numa_options));
+  std::cout << "async logger numa: " << RunLoggerBenchmark(0, epi * 4) << " ns/msg" << std::endl;
+  base::SetLogger(LOG_INFO, nullptr);
+
+  // 后台线程的等待方式: 只有后台线程睡眠时前台线程才需要 futex 唤醒
+  ReportAsyncWaitBenchmark("blocking", base::ASYNC_WAIT_BLOCKING, epi);
+  ReportAsyncWaitBenchmark("adaptive", base::ASYNC_WAIT_ADAPTIVE, epi);
+  ReportAsyncWaitBenchmark("busy_spin", base::ASYNC_WAIT_BUSY_SPIN, epi);
+
+  // 多进程共享的日志环: 无锁写入共享内存, 收集线程写文件
+  base::SetLogger(LOG_INFO, new base::SharedLogRing(LOG_INFO, base::GetBatchLogger(LOG_INFO)));
+  std::cout << "shared log ring: " << RunLoggerBenchmark(0, epi * 4) << " ns/msg" << std::endl;
+  base::SetLogger(LOG_INFO, nullptr);
+
+  // 路由表: 与默认规则等价的路由, 调用点缓存匹配结果, 只增加一次查表
+  std::vector<LogRoute> routes;
+  std::string error;
+  ParseLogRoutes("ERROR+ storage/* -> file:ERROR,sinks; INFO -> file:INFO; * -> file,sinks", &routes, &error);
+  std::cout << "routing default: " << RunBenchmark(epi);
+  SetLogRoutes(routes);
+  std::cout << " ns/msg, routed: " << RunBenchmark(epi) << " ns/msg" << std::endl;
+  SetLogRoutes({});
+
+  // 重复日志合并: 窗口内相同的日志只计数, 窗口结束后写一条 "last message repeated N times"
+  std::cout << "repeat default: " << RunRepeatBenchmark(epi);
+  SetLogDedupWindow(1000);
+  std::cout << " ns/msg, coalesced: " << RunRepeatBenchmark(epi) << " ns/msg" << std::endl;
+  SetLogDedupWindow(0);
+
   return 0;
 }
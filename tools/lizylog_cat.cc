@@ -0,0 +1,349 @@
+// lizylog_cat: 按时间合并输出多个(滚动的, 分片的)日志文件
+//
+// 用法: lizylog_cat [选项] <base_filename | 日志文件>...
+//   <base_filename>          与 SetLogDestination() 相同的前缀(包含目录), 例如 /var/log/app/testI
+//                            按照 LogCleaner 相同的规则查找 <base>YYYYMMDD-HHMMSS.pid[.s<shard>]<ext> 文件
+//   --ext=<ext>              日志文件扩展名(SetLogFilenameExtension), 例如 .log
+//   --from=<time>            只输出不早于 time 的日志, 格式 "YYYY-MM-DD hh:mm:ss.uuuuuu", 可以只写前缀
+//   --to=<time>              只输出不晚于 time 的日志(按前缀比较, "2023-10-08 17" 包含 17 点整个小时)
+//   --severity=<name>        只输出不低于该等级的日志: INFO, WARNING, ERROR, FATAL
+//   --where=<file[:line]>    只输出指定源文件(和行号)的日志
+//   --window=<n>             重排窗口的记录数(默认 65536), 0 表示不重排
+//
+// 每行日志以定宽的时间戳 "YYYY-MM-DD hh:mm:ss.uuuuuu" 开头, 所以文件可以按字节偏移二分查找起始时间,
+// 不需要扫描整个文件. 不以时间戳开头的行(多行日志的后续行)属于上一条日志. 分片文件中的 #seq 序号
+// 用于时间戳相同时排序.
+// 多个线程共享一个分片文件时, 文件中的记录只是近似有序(时间戳在格式化之前获取, 写入顺序取决于抢到锁的顺序),
+// 合并结果再经过一个固定大小的重排窗口, 窗口内的乱序会被纠正.
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "log_index.h"
+#include "type.h"
+#include "utilities.h"
+
+namespace {
+
+struct Options {
+  std::string extension;
+  std::string from;
+  std::string to;
+  int min_severity{LOG_INFO};
+  std::string where_file;
+  int where_line{-1};  // -1 表示不过滤行号
+  size_t window{65536};
+};
+
+// 一条日志的各个字段, 都指向 mmap 的文件内容
+struct Record {
+  std::string_view timestamp;
+  uint64 seq{0};
+  std::string_view file;
+  int line{0};
+  int severity{LOG_INFO};
+  std::string_view text;  // 整条日志, 包括后续行和最后的 '\n'
+};
+
+// 一个 mmap 的日志文件
+class LogFile {
+ public:
+  LogFile() = default;
+  LogFile(const LogFile&) = delete;
+  LogFile& operator=(const LogFile&) = delete;
+
+  bool Open(const std::string& path) {
+    // 顺序读取, 让内核预读
+    if (!file_.Open(path, true)) {
+      perror(path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  const char* begin() const { return file_.begin(); }
+  const char* end() const { return file_.end(); }
+
+  // 从 p 开始(包括 p)的第一条日志的开头, p 必须在行首
+  const char* NextRecord(const char* p) const {
+    while (p < end() && !IsLogRecordStart(p, end())) {
+      p = LineEnd(p);
+    }
+    return p;
+  }
+
+  // 从任意偏移开始的第一条日志的开头
+  const char* NextRecordFrom(const char* p) const {
+    if (p > begin() && p[-1] != '\n') {
+      p = LineEnd(p);
+    }
+    return NextRecord(p);
+  }
+
+  // 二分查找第一条时间戳不早于 from 的日志
+  const char* LowerBound(std::string_view from) const {
+    const char* lo = begin();
+    const char* hi = end();
+    while (lo < hi) {
+      const char* mid = lo + (hi - lo) / 2;
+      const char* r = NextRecordFrom(mid);
+      if (r == end() || std::string_view(r, kLogTimestampLen) >= from) {
+        hi = mid;
+      } else {
+        lo = r + 1;
+      }
+    }
+    return NextRecordFrom(lo);
+  }
+
+  // 解析 p 开始的一条日志
+  void Parse(const char* p, Record* record) const {
+    const char* record_end = LineEnd(p);
+    while (record_end < end() && !IsLogRecordStart(record_end, end())) {
+      record_end = LineEnd(record_end);
+    }
+    record->text = std::string_view(p, static_cast<size_t>(record_end - p));
+    record->timestamp = std::string_view(p, kLogTimestampLen);
+
+    // `2023-10-08 17:13:08.888917 [#seq ][webserver.cpp:36][INFO]: `
+    const char* q = p + kLogTimestampLen + 1;
+    record->seq = 0;
+    if (q < record_end && *q == '#') {
+      char* seq_end;
+      record->seq = strtoull(q + 1, &seq_end, 10);
+      q = seq_end + 1;
+    }
+    record->file = std::string_view();
+    record->line = 0;
+    record->severity = LOG_INFO;
+    if (q < record_end && *q == '[') {
+      const char* close = static_cast<const char*>(memchr(q, ']', static_cast<size_t>(record_end - q)));
+      if (close != nullptr) {
+        const char* colon = close;
+        while (colon > q && *colon != ':') colon--;
+        if (colon > q) {
+          record->file = std::string_view(q + 1, static_cast<size_t>(colon - q - 1));
+          record->line = atoi(colon + 1);
+        }
+        const int severity = ParseLogRecordSeverity(q, record_end);
+        if (severity >= 0) {
+          record->severity = severity;
+        }
+      }
+    }
+  }
+
+ private:
+  // p 所在行的下一行的开头
+  const char* LineEnd(const char* p) const {
+    const char* nl = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(end() - p)));
+    return nl ? nl + 1 : end();
+  }
+
+  MappedLogFile file_;
+};
+
+// 合并时每个文件的读取位置
+struct Cursor {
+  LogFile* file;
+  const char* pos;
+  Record record;
+  size_t index;  // 文件序号, 时间戳和序号都相同时保持文件顺序
+};
+
+// 小顶堆的比较: 先比较时间戳, 再比较序号
+struct RecordGreater {
+  bool operator()(const Record& a, const Record& b) const {
+    const int c = a.timestamp.compare(b.timestamp);
+    if (c != 0) return c > 0;
+    return a.seq > b.seq;
+  }
+};
+
+struct CursorGreater {
+  bool operator()(const Cursor* a, const Cursor* b) const {
+    if (RecordGreater()(a->record, b->record)) return true;
+    if (RecordGreater()(b->record, a->record)) return false;
+    return a->index > b->index;
+  }
+};
+
+bool Matches(const Record& record, const Options& options) {
+  if (record.severity < options.min_severity) {
+    return false;
+  }
+  if (!options.where_file.empty()) {
+    if (record.file != options.where_file) return false;
+    if (options.where_line >= 0 && record.line != options.where_line) return false;
+  }
+  return true;
+}
+
+// 晚于 --to 的日志(按前缀比较)
+bool AfterTo(const Record& record, const Options& options) {
+  return !options.to.empty() &&
+         record.timestamp.substr(0, options.to.size()) > std::string_view(options.to);
+}
+
+// 查找 base_filename 对应的所有日志文件
+void FindLogFiles(const std::string& base_filename, const std::string& extension,
+                  std::vector<std::string>* files) {
+  std::string dir = ".";
+  std::string prefix;  // 拼接到文件名前面的目录
+  const size_t slash = base_filename.rfind(PATH_SEPARATOR);
+  if (slash != std::string::npos) {
+    dir = base_filename.substr(0, slash + 1);
+    prefix = dir;
+  }
+
+  DIR* dirp = opendir(dir.c_str());
+  if (dirp == nullptr) {
+    perror(dir.c_str());
+    return;
+  }
+  std::vector<std::string> found;
+  struct dirent* ent;
+  while ((ent = readdir(dirp)) != nullptr) {
+    const std::string filepath = prefix + ent->d_name;
+    struct stat file_stat;
+    // 跳过软链接(<program>.INFO 等), 只读取真正的日志文件
+    if (lstat(filepath.c_str(), &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+      continue;
+    }
+    if (log_internal_namespace_::IsLogFileName(filepath, base_filename, extension)) {
+      found.push_back(filepath);
+    }
+  }
+  closedir(dirp);
+  // 文件名中有创建时间, 排序后输出顺序稳定
+  std::sort(found.begin(), found.end());
+  files->insert(files->end(), found.begin(), found.end());
+}
+
+void Usage(const char* argv0) {
+  fprintf(stderr,
+          "usage: %s [--ext=EXT] [--from=TIME] [--to=TIME] [--severity=NAME] [--where=FILE[:LINE]] [--window=N]\n"
+          "          <base_filename | logfile>...\n", argv0);
+}
+
+} // end of namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  std::vector<std::string> targets;
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strncmp(arg, "--ext=", 6) == 0) {
+      options.extension = arg + 6;
+    } else if (strncmp(arg, "--from=", 7) == 0) {
+      options.from = arg + 7;
+    } else if (strncmp(arg, "--to=", 5) == 0) {
+      options.to = arg + 5;
+    } else if (strncmp(arg, "--severity=", 11) == 0) {
+      options.min_severity = ParseLogSeverityName(arg + 11);
+      if (options.min_severity < 0) {
+        fprintf(stderr, "unknown severity '%s'\n", arg + 11);
+        return 2;
+      }
+    } else if (strncmp(arg, "--where=", 8) == 0) {
+      options.where_file = arg + 8;
+      const size_t colon = options.where_file.rfind(':');
+      if (colon != std::string::npos) {
+        options.where_line = atoi(options.where_file.c_str() + colon + 1);
+        options.where_file.resize(colon);
+      }
+    } else if (strncmp(arg, "--window=", 9) == 0) {
+      options.window = strtoul(arg + 9, nullptr, 10);
+    } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+      Usage(argv[0]);
+      return 0;
+    } else if (arg[0] == '-') {
+      fprintf(stderr, "unknown option '%s'\n", arg);
+      Usage(argv[0]);
+      return 2;
+    } else {
+      targets.emplace_back(arg);
+    }
+  }
+  if (targets.empty()) {
+    Usage(argv[0]);
+    return 2;
+  }
+
+  // 参数是已经存在的普通文件时直接读取, 否则作为 base_filename 查找
+  std::vector<std::string> paths;
+  for (const auto& target : targets) {
+    struct stat file_stat;
+    if (stat(target.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+      paths.push_back(target);
+    } else {
+      FindLogFiles(target, options.extension, &paths);
+    }
+  }
+  if (paths.empty()) {
+    fprintf(stderr, "no log files found\n");
+    return 1;
+  }
+
+  std::vector<LogFile> files(paths.size());
+  std::vector<Cursor> cursors;
+  cursors.reserve(paths.size());
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (!files[i].Open(paths[i])) {
+      continue;
+    }
+    const char* start = options.from.empty() ? files[i].NextRecord(files[i].begin())
+                                             : files[i].LowerBound(options.from);
+    if (start < files[i].end()) {
+      Cursor cursor{&files[i], start, Record(), i};
+      files[i].Parse(start, &cursor.record);
+      cursors.push_back(cursor);
+    }
+  }
+
+  std::priority_queue<Cursor*, std::vector<Cursor*>, CursorGreater> heap;
+  for (auto& cursor : cursors) {
+    if (!AfterTo(cursor.record, options)) {
+      heap.push(&cursor);
+    }
+  }
+
+  static char out_buf[1 << 20];
+  setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+  // 重排窗口
+  std::priority_queue<Record, std::vector<Record>, RecordGreater> pending;
+  while (!heap.empty()) {
+    Cursor* cursor = heap.top();
+    heap.pop();
+    if (Matches(cursor->record, options)) {
+      pending.push(cursor->record);
+      if (pending.size() > options.window) {
+        fwrite(pending.top().text.data(), 1, pending.top().text.size(), stdout);
+        pending.pop();
+      }
+    }
+    // 下一条日志
+    cursor->pos += cursor->record.text.size();
+    if (cursor->pos < cursor->file->end()) {
+      cursor->file->Parse(cursor->pos, &cursor->record);
+      if (!AfterTo(cursor->record, options)) {
+        heap.push(cursor);
+      }
+    }
+  }
+  while (!pending.empty()) {
+    fwrite(pending.top().text.data(), 1, pending.top().text.size(), stdout);
+    pending.pop();
+  }
+  fflush(stdout);
+  return 0;
+}
@@ -0,0 +1,185 @@
+// lizylog_index: 日志稀疏索引(<日志文件名>.idx)的查询和重建工具
+//
+// 用法:
+//   lizylog_index query [--from=TIME] [--to=TIME] [--severity=NAME] [--utc] <日志文件>
+//       通过索引只读取 [from, to] 内, 并且包含不低于 severity 等级日志的块, 输出其中符合条件的日志
+//       TIME 的格式是 "YYYY-MM-DD hh:mm:ss"
+//   lizylog_index dump <日志文件>
+//       输出索引中的所有块
+//   lizylog_index rebuild [--kb=N] <日志文件>...
+//       扫描日志文件重建索引(默认每 1024 KB 或每秒一块)
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "log_index.h"
+#include "logging.h"
+
+namespace {
+
+// 时间前缀 "YYYY-MM-DD hh:mm:ss" 的长度
+const size_t kSecondsLen = 19;
+
+void Usage() {
+  fprintf(stderr,
+          "usage: lizylog_index query [--from=TIME] [--to=TIME] [--severity=NAME] [--utc] <logfile>\n"
+          "       lizylog_index dump <logfile>\n"
+          "       lizylog_index rebuild [--kb=N] <logfile>...\n"
+          "TIME: \"YYYY-MM-DD hh:mm:ss\"\n");
+}
+
+std::string FormatTime(time_t t, bool utc) {
+  struct tm tm_time;
+  if (utc) {
+    gmtime_r(&t, &tm_time);
+  } else {
+    localtime_r(&t, &tm_time);
+  }
+  char buf[32];
+  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm_time);
+  return buf;
+}
+
+std::string MaskToString(uint32 mask) {
+  std::string result;
+  for (int i = 0; i < NUM_SEVERITIES; i++) {
+    if (mask & (1U << i)) {
+      result += GetLogSeverityName(i)[0];
+    }
+  }
+  return result;
+}
+
+int Dump(const std::string& log_path) {
+  std::vector<LogIndexEntry> entries;
+  if (!ReadLogIndex(LogIndexPath(log_path), &entries)) {
+    perror(LogIndexPath(log_path).c_str());
+    return 1;
+  }
+  for (const auto& entry : entries) {
+    printf("%s offset=%llu length=%u severities=%s\n", FormatTime(static_cast<time_t>(entry.timestamp), false).c_str(),
+           static_cast<unsigned long long>(entry.offset), entry.length, MaskToString(entry.severity_mask).c_str());
+  }
+  return 0;
+}
+
+int Query(const std::string& log_path, const std::string& from, const std::string& to, int min_severity, bool utc) {
+  time_t from_time = 0;
+  time_t to_time = static_cast<time_t>(INT64_MAX / 2);
+  if ((!from.empty() && !ParseLogTimestamp(from.c_str(), utc, &from_time)) ||
+      (!to.empty() && !ParseLogTimestamp(to.c_str(), utc, &to_time))) {
+    fprintf(stderr, "bad time, expected \"YYYY-MM-DD hh:mm:ss\"\n");
+    return 2;
+  }
+  // 块内按时间前缀精确过滤
+  const std::string from_text = from.empty() ? std::string() : FormatTime(from_time, utc);
+  const std::string to_text = to.empty() ? std::string() : FormatTime(to_time, utc);
+  const uint32 mask = kAllSeverityMask & ~((1U << min_severity) - 1);
+
+  std::vector<LogIndexBlock> blocks;
+  if (!FindLogBlocks(log_path, from_time, to_time, mask, &blocks)) {
+    perror(log_path.c_str());
+    return 1;
+  }
+  const int fd = open(log_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    perror(log_path.c_str());
+    return 1;
+  }
+
+  std::vector<char> buf;
+  bool keep = false;  // 后续行跟随所属的日志
+  for (const auto& block : blocks) {
+    buf.resize(block.end - block.begin);
+    const ssize_t n = pread(fd, buf.data(), buf.size(), static_cast<off_t>(block.begin));
+    if (n <= 0) {
+      continue;
+    }
+    const char* p = buf.data();
+    const char* end = buf.data() + n;
+    keep = false;
+    while (p < end) {
+      const char* nl = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(end - p)));
+      const char* line_end = nl ? nl + 1 : end;
+      if (IsLogRecordStart(p, end)) {
+        const std::string_view seconds(p, kSecondsLen);
+        const int severity = ParseLogRecordSeverity(p + kLogTimestampLen, line_end);
+        keep = (from_text.empty() || seconds >= from_text) && (to_text.empty() || seconds <= to_text) &&
+               severity >= min_severity;
+      }
+      if (keep) {
+        fwrite(p, 1, static_cast<size_t>(line_end - p), stdout);
+      }
+      p = line_end;
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+} // end of namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    Usage();
+    return 2;
+  }
+  const std::string command = argv[1];
+  std::string from, to;
+  int min_severity = LOG_INFO;
+  bool utc = false;
+  uint32 block_kb = 1024;
+  std::vector<std::string> files;
+  for (int i = 2; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strncmp(arg, "--from=", 7) == 0) {
+      from = arg + 7;
+    } else if (strncmp(arg, "--to=", 5) == 0) {
+      to = arg + 5;
+    } else if (strncmp(arg, "--severity=", 11) == 0) {
+      min_severity = ParseLogSeverityName(arg + 11);
+      if (min_severity < 0) {
+        fprintf(stderr, "unknown severity '%s'\n", arg + 11);
+        return 2;
+      }
+    } else if (strcmp(arg, "--utc") == 0) {
+      utc = true;
+    } else if (strncmp(arg, "--kb=", 5) == 0) {
+      block_kb = static_cast<uint32>(strtoul(arg + 5, nullptr, 10));
+    } else if (arg[0] == '-') {
+      Usage();
+      return 2;
+    } else {
+      files.emplace_back(arg);
+    }
+  }
+  if (files.empty()) {
+    Usage();
+    return 2;
+  }
+
+  if (command == "rebuild") {
+    int rc = 0;
+    for (const auto& file : files) {
+      if (!RebuildLogIndex(file, block_kb)) {
+        perror(file.c_str());
+        rc = 1;
+      }
+    }
+    return rc;
+  } else if (command == "dump" && files.size() == 1) {
+    return Dump(files[0]);
+  } else if (command == "query" && files.size() == 1) {
+    return Query(files[0], from, to, min_severity, utc);
+  }
+  Usage();
+  return 2;
+}
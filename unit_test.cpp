@@ -0,0 +1,348 @@
+#include "logging.h"
+#include "flag.h"
+#include "log_index.h"
+#include <dirent.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// 断言失败时输出位置并计数, 不中止, 一次运行报告所有失败
+static int g_failures = 0;
+
+#define EXPECT(condition)                                                          \
+  do {                                                                             \
+    if (!(condition)) {                                                            \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": EXPECT(" #condition ") failed" \
+                << std::endl;                                                      \
+      g_failures++;                                                                \
+    }                                                                              \
+  } while (0)
+
+// 日志目录(mkdtemp 创建)
+static std::string g_dir;
+
+static std::string ReadFile(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  std::ostringstream out;
+  out << in.rdbuf();
+  return out.str();
+}
+
+// 日志目录中文件名以 prefix 开头, 以 suffix 结尾的日志文件的内容(不含软链接和索引文件)
+static std::string ReadLogFiles(const std::string& prefix, const std::string& suffix = "") {
+  std::string content;
+  DIR* dir = opendir(g_dir.c_str());
+  if (dir == nullptr) {
+    return content;
+  }
+  while (struct dirent* entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    if (entry->d_type == DT_LNK || name.compare(0, prefix.size(), prefix) != 0 || name.size() < suffix.size() ||
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0 ||
+        (name.size() > 4 && name.compare(name.size() - 4, 4, ".idx") == 0)) {
+      continue;
+    }
+    content += ReadFile(g_dir + "/" + name);
+  }
+  closedir(dir);
+  return content;
+}
+
+static size_t CountOccurrences(const std::string& text, const std::string& pattern) {
+  size_t count = 0;
+  for (size_t pos = text.find(pattern); pos != std::string::npos; pos = text.find(pattern, pos + 1)) {
+    count++;
+  }
+  return count;
+}
+
+// JSON 配置: 合法时全部应用, 任何一个值不合法时不修改任何选项
+static void TestJsonConfig() {
+  std::string error;
+  EXPECT(log_internal_namespace_::ParseLogFlagsFromJson("{\"minloglevel\": 1, \"max_log_size\": 100}", &error));
+  EXPECT(FLAGS_minloglevel == 1);
+  EXPECT(FLAGS_max_log_size == 100U);
+
+  // minloglevel 超出范围, 合法的 max_log_size 也不能被应用
+  error.clear();
+  EXPECT(!log_internal_namespace_::ParseLogFlagsFromJson("{\"max_log_size\": 200, \"minloglevel\": 99}", &error));
+  EXPECT(!error.empty());
+  EXPECT(FLAGS_minloglevel == 1);
+  EXPECT(FLAGS_max_log_size == 100U);
+
+  // 类型错误
+  error.clear();
+  EXPECT(!log_internal_namespace_::ParseLogFlagsFromJson("{\"max_log_size\": \"big\"}", &error));
+  EXPECT(!error.empty());
+  EXPECT(FLAGS_max_log_size == 100U);
+
+  // 路由表不合法时同样不应用其它选项
+  error.clear();
+  EXPECT(!log_internal_namespace_::ParseLogFlagsFromJson(
+      "{\"max_log_size\": 300, \"log_routes\": \"BOGUS -> file\"}", &error));
+  EXPECT(FLAGS_max_log_size == 100U);
+
+  // 语法错误
+  error.clear();
+  EXPECT(!log_internal_namespace_::ParseLogFlagsFromJson("{\"minloglevel\": 2,", &error));
+  EXPECT(!error.empty());
+  EXPECT(FLAGS_minloglevel == 1);
+
+  EXPECT(log_internal_namespace_::ParseLogFlagsFromJson("{\"minloglevel\": 0, \"max_log_size\": 1800}", &error));
+  EXPECT(FLAGS_minloglevel == 0);
+  EXPECT(FLAGS_max_log_size == 1800U);
+}
+
+// 文本形式的路由表
+static void TestParseRoutes() {
+  std::vector<LogRoute> routes;
+  std::string error;
+  EXPECT(ParseLogRoutes("ERROR+ storage/* -> file:ERROR,sink:socket; INFO -> file:INFO", &routes, &error));
+  EXPECT(routes.size() == 2);
+  if (routes.size() == 2) {
+    EXPECT(routes[0].min_severity == LOG_ERROR);
+    EXPECT(routes[0].max_severity == LOG_FATAL);
+    EXPECT(routes[0].file_pattern == "storage/*");
+    EXPECT(routes[0].destinations == LOG_ROUTE_FILE_ERROR);
+    EXPECT(routes[0].sinks == std::vector<std::string>{"socket"});
+    EXPECT(routes[1].min_severity == LOG_INFO);
+    EXPECT(routes[1].max_severity == LOG_INFO);
+    EXPECT(routes[1].file_pattern.empty());
+    EXPECT(routes[1].destinations == LOG_ROUTE_FILE_INFO);
+    EXPECT(routes[1].sinks.empty());
+  }
+
+  EXPECT(ParseLogRoutes("WARNING-ERROR -> file,stderr\n* -> none", &routes, &error));
+  EXPECT(routes.size() == 2);
+  if (routes.size() == 2) {
+    EXPECT(routes[0].min_severity == LOG_WARNING);
+    EXPECT(routes[0].max_severity == LOG_ERROR);
+    EXPECT(routes[0].destinations == (LOG_ROUTE_FILE | LOG_ROUTE_STDERR));
+    EXPECT(routes[1].min_severity == LOG_INFO);
+    EXPECT(routes[1].destinations == 0U);
+  }
+
+  error.clear();
+  EXPECT(!ParseLogRoutes("BOGUS -> file", &routes, &error));
+  EXPECT(!error.empty());
+  error.clear();
+  EXPECT(!ParseLogRoutes("INFO -> nowhere", &routes, &error));
+  EXPECT(!error.empty());
+  error.clear();
+  EXPECT(!ParseLogRoutes("INFO file", &routes, &error));
+  EXPECT(!error.empty());
+}
+
+// 稀疏索引: 返回的块覆盖 [from, to] 内的所有日志, 并且跳过 from 之前的块
+static void TestLogIndex() {
+  struct tm base_tm = {};
+  base_tm.tm_year = 2026 - 1900;
+  base_tm.tm_mon = 0;
+  base_tm.tm_mday = 2;
+  base_tm.tm_hour = 3;
+  base_tm.tm_min = 4;
+  base_tm.tm_sec = 5;
+  base_tm.tm_isdst = -1;
+  const time_t base = mktime(&base_tm);
+
+  // 10 秒, 每秒 5 条日志, 第 7 秒有一条 ERROR
+  const int kSeconds = 10;
+  const int kPerSecond = 5;
+  std::string content = "Log file created at: 2026/01/02 03:04:05\n";
+  std::vector<uint64> offsets;  // 每条日志的偏移
+  for (int s = 0; s < kSeconds; s++) {
+    const time_t t = base + s;
+    struct tm tm_time;
+    localtime_r(&t, &tm_time);
+    char timestamp[32];
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm_time);
+    for (int i = 0; i < kPerSecond; i++) {
+      offsets.push_back(content.size());
+      char line[128];
+      snprintf(line, sizeof(line), "%s.%06d [unit.cc:%d][%s]: second %d record %d\n", timestamp, i * 1000,
+               s, s == 7 && i == 2 ? "ERROR" : "INFO", s, i);
+      content += line;
+    }
+  }
+  const std::string path = g_dir + "/index_test.log";
+  std::ofstream(path, std::ios::binary) << content;
+  time_t parsed;
+  EXPECT(ParseLogTimestamp(content.c_str() + offsets[0], false, &parsed));
+  EXPECT(parsed == base);
+
+  // 有索引文件和没有索引文件(扫描日志文件)的结果相同
+  for (int with_index = 0; with_index < 2; with_index++) {
+    if (with_index) {
+      EXPECT(RebuildLogIndex(path, 1));
+      std::vector<LogIndexEntry> entries;
+      EXPECT(ReadLogIndex(LogIndexPath(path), &entries));
+      EXPECT(entries.size() == static_cast<size_t>(kSeconds));
+    }
+    const int from_second = 4;
+    const int to_second = 6;
+    std::vector<LogIndexBlock> blocks;
+    EXPECT(FindLogBlocks(path, base + from_second, base + to_second, kAllSeverityMask, &blocks));
+    EXPECT(!blocks.empty());
+    for (int s = 0; s < kSeconds; s++) {
+      for (int i = 0; i < kPerSecond; i++) {
+        const uint64 offset = offsets[s * kPerSecond + i];
+        bool covered = false;
+        for (const auto& block : blocks) {
+          covered = covered || (offset >= block.begin && offset < block.end);
+        }
+        if (s >= from_second && s <= to_second) {
+          // from 所在的第一秒也要包含在内
+          EXPECT(covered);
+        } else if (s < from_second - 1 || s > to_second) {
+          EXPECT(!covered);
+        }
+      }
+    }
+
+    // 只查找 ERROR, 除了等级未知的文件头, 只返回第 7 秒的块
+    EXPECT(FindLogBlocks(path, base, base + kSeconds, 1U << LOG_ERROR, &blocks));
+    EXPECT(blocks.size() == 2);
+    if (blocks.size() == 2) {
+      EXPECT(blocks[0].begin == 0 && blocks[0].end == offsets[0]);
+      EXPECT(blocks[1].begin == offsets[7 * kPerSecond]);
+      EXPECT(blocks[1].end == offsets[8 * kPerSecond]);
+    }
+  }
+  unlink(LogIndexPath(path).c_str());
+  unlink(path.c_str());
+}
+
+// LOG_CAPTURE 捕获的内容
+static void TestCapture() {
+  LogCapture capture(false);
+  LOG_CAPTURE(INFO, &capture) << "x" << 1;
+  LOG_CAPTURE(WARNING, &capture) << "value=" << 2.5 << ' ' << std::string("end");
+  EXPECT(capture.size() == 2);
+  std::vector<LogCapture::Record> records;
+  for (const LogCapture::Record& record : capture) {
+    records.push_back(record);
+  }
+  EXPECT(records.size() == 2);
+  if (records.size() == 2) {
+    EXPECT(records[0].severity == LOG_INFO);
+    EXPECT(records[0].text == "x1");
+    EXPECT(records[1].severity == LOG_WARNING);
+    EXPECT(records[1].text == "value=2.5 end");
+    EXPECT(records[0].time_usec > 0 && records[0].time_usec <= records[1].time_usec);
+  }
+  // also_log 为 false 时不写日志文件
+  FlushLogFiles(LOG_INFO);
+  EXPECT(ReadLogFiles("unit").find("value=2.5 end") == std::string::npos);
+
+  capture.Clear();
+  EXPECT(capture.size() == 0);
+  EXPECT(capture.begin() == capture.end());
+}
+
+// 重复日志合并: 汇总中的次数, 以及长度相同的不同日志都被写出
+static void TestDedup() {
+  SetLogDedupWindow(60 * 1000);
+  const int kRepeats = 10;
+  for (int i = 0; i <= kRepeats; i++) {
+    // 同一个调用点, 最后一条的内容不同但长度相同
+    LOG(INFO) << "dedup retry " << (i < kRepeats ? 'a' : 'b');
+  }
+  for (int i = 0; i < 4; i++) {
+    LOG(INFO) << "dedup alternate " << i % 2;
+  }
+  FlushLogFiles(LOG_INFO);
+  SetLogDedupWindow(0);
+
+  const std::string content = ReadLogFiles("unit");
+  EXPECT(CountOccurrences(content, "]: dedup retry a\n") == 1);
+  EXPECT(CountOccurrences(content, "]: dedup retry b\n") == 1);
+  EXPECT(CountOccurrences(content, "]: last message repeated " + std::to_string(kRepeats - 1) + " times\n") == 1);
+  EXPECT(content.find("dedup retry a") < content.find("last message repeated"));
+  EXPECT(content.find("last message repeated") < content.find("dedup retry b"));
+  EXPECT(CountOccurrences(content, "]: dedup alternate 0\n") == 2);
+  EXPECT(CountOccurrences(content, "]: dedup alternate 1\n") == 2);
+}
+
+// fork 之后子进程可以写日志(父进程中有线程正在写日志)
+static void TestForkChild() {
+  std::atomic<bool> stop{false};
+  std::thread writer([&stop] {
+    while (!stop.load(std::memory_order_relaxed)) {
+      LOG(INFO) << "parent writer";
+    }
+  });
+  std::vector<pid_t> children;
+  for (int i = 0; i < 3; i++) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+      LOG(INFO) << "child message " << getpid();
+      FlushLogFiles(LOG_INFO);
+      _exit(0);
+    }
+    EXPECT(pid > 0);
+    if (pid > 0) {
+      children.push_back(pid);
+    }
+  }
+  stop.store(true, std::memory_order_relaxed);
+  writer.join();
+
+  for (pid_t pid : children) {
+    int status = 0;
+    EXPECT(waitpid(pid, &status, 0) == pid);
+    EXPECT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    // 子进程写自己的日志文件(文件名以 .<pid> 结尾)
+    const std::string content = ReadLogFiles("unit", "." + std::to_string(pid));
+    EXPECT(content.find("]: child message " + std::to_string(pid) + "\n") != std::string::npos);
+  }
+}
+
+static void RemoveLogDir() {
+  if (DIR* dir = opendir(g_dir.c_str())) {
+    while (struct dirent* entry = readdir(dir)) {
+      if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+        unlink((g_dir + "/" + entry->d_name).c_str());
+      }
+    }
+    closedir(dir);
+  }
+  rmdir(g_dir.c_str());
+}
+
+int main(int argc, char* argv[]) {
+  char dir_template[] = "/tmp/lizylog_unit_XXXXXX";
+  if (mkdtemp(dir_template) == nullptr) {
+    perror("mkdtemp");
+    return 1;
+  }
+  g_dir = dir_template;
+
+  InitLogging(argv[0]);
+  SetLogDir(g_dir + "/");
+  SetLogDestination(LOG_INFO, "unit");
+
+  TestJsonConfig();
+  TestParseRoutes();
+  TestLogIndex();
+  TestCapture();
+  TestDedup();
+  TestForkChild();
+
+  ShutdownLogging();
+  if (g_failures == 0) {
+    RemoveLogDir();
+    std::cout << "all tests passed" << std::endl;
+    return 0;
+  }
+  std::cerr << g_failures << " check(s) failed, logs kept in " << g_dir << std::endl;
+  return 1;
+}